@@ -0,0 +1,326 @@
+#include "trac0r/scene.hpp"
+#include "trac0r/leaf_kernel.hpp"
+#include "trac0r/shape.hpp"
+#include "trac0r/random.hpp"
+#include "trac0r/timer.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <fmt/format.h>
+
+using Scene = trac0r::Scene;
+using Shape = trac0r::Shape;
+using AccelStructType = trac0r::AccelStructType;
+using TriangleTest = trac0r::TriangleTest;
+using LeafKernel = trac0r::LeafKernel;
+using SIMDLevel = trac0r::SIMDLevel;
+using RayPacket = trac0r::RayPacket;
+
+struct AccelStructConfig {
+    AccelStructType m_type;
+    std::string m_name;
+    float m_spatial_split_budget;
+    TriangleTest m_triangle_test;
+};
+
+// Fills a scene with roughly the same room that the viewer renders and returns the indices of
+// shapes that get moved around later on
+std::vector<size_t> setup_scene(Scene &scene) {
+    auto emissive = Scene::add_material(scene, {1, {1.f, 0.93f, 0.85f}, 0.f, 1.f, 15.f});
+    auto diffuse = Scene::add_material(scene, {2, {0.740063, 0.742313, 0.733934}});
+
+    auto wall_left =
+        Shape::make_plane({-0.5f, 0.4f, 0}, {0, 0, -glm::half_pi<float>()}, {1, 1}, diffuse);
+    auto wall_right =
+        Shape::make_plane({0.5f, 0.4f, 0}, {0, 0, glm::half_pi<float>()}, {1, 1}, diffuse);
+    auto wall_back =
+        Shape::make_plane({0, 0.4f, 0.5}, {-glm::half_pi<float>(), 0, 0}, {1, 1}, diffuse);
+    auto wall_bottom = Shape::make_plane({0, -0.1f, 0}, {0, 0, 0}, {1, 1}, diffuse);
+    auto lamp = Shape::make_plane({0, 0.85f, -0.1}, {0, 0, 0}, {0.4, 0.4}, emissive);
+    auto box = Shape::make_box({0.3f, 0.1f, 0.1f}, {0, 0.6f, 0}, {0.2f, 0.5f, 0.2f}, diffuse);
+    auto sphere = Shape::make_icosphere({0.f, 0.1f, -0.3f}, {0, 0, 0}, 0.15f, 3, diffuse);
+    auto sphere_instance =
+        Shape::make_instance(sphere, {0.3f, 0.45f, 0.1f}, {0.3f, 0, 0}, {0.1f, 0.15f, 0.1f});
+
+    Scene::add_shape(scene, wall_left);
+    Scene::add_shape(scene, wall_right);
+    Scene::add_shape(scene, wall_back);
+    Scene::add_shape(scene, wall_bottom);
+    auto lamp_index = Scene::add_shape(scene, lamp);
+    Scene::add_shape(scene, box);
+    auto sphere_index = Scene::add_shape(scene, sphere);
+    Scene::add_shape(scene, sphere_instance);
+
+    return {lamp_index, sphere_index};
+}
+
+void move_shapes(Scene &scene, const std::vector<size_t> &indices, const float offset) {
+    for (auto index : indices) {
+        auto &shape = Scene::edit_shape(scene, index);
+        Shape::set_pos(shape, Shape::pos(shape) + glm::vec3{offset, 0.f, offset});
+        Shape::set_orientation(shape, Shape::orientation(shape) + glm::vec3{0.f, offset, 0.f});
+    }
+}
+
+// Whether a hit lies on the triangle its scene-wide index names. Rays through a shared edge may
+// report either triangle so the index itself can't be compared against the reference.
+bool on_reported_triangle(const std::vector<trac0r::Triangle> &triangles,
+                          const trac0r::IntersectionInfo &hit) {
+    if (hit.m_triangle_id >= triangles.size())
+        return false;
+    const auto &triangle = triangles[hit.m_triangle_id];
+    return triangle.m_material_id == hit.m_material_id &&
+           glm::abs(glm::dot(hit.m_pos - triangle.m_v1, triangle.m_normal)) < 1e-4f;
+}
+
+int count_mismatches(const Scene &reference, const Scene &scene, const std::vector<Ray> &rays) {
+    std::vector<trac0r::Triangle> triangles;
+    for (const auto &shape : Scene::shapes(scene)) {
+        for (const auto &triangle : Shape::world_triangles(shape))
+            triangles.push_back(triangle);
+    }
+
+    int mismatches = 0;
+    for (const auto &ray : rays) {
+        auto expected = Scene::intersect(reference, ray);
+        auto actual = Scene::intersect(scene, ray);
+        if (expected.m_has_intersected != actual.m_has_intersected ||
+            (expected.m_has_intersected && (glm::length(expected.m_pos - actual.m_pos) > 1e-4f ||
+                                            expected.m_material_id != actual.m_material_id ||
+                                            !on_reported_triangle(triangles, actual))))
+            mismatches++;
+    }
+    return mismatches;
+}
+
+// Editing a material has to show up on every triangle using it without rebuilding anything but
+// the list of lights, which must now include the triangles that became emissive
+int count_material_edit_mismatches(Scene &scene, const std::vector<Ray> &rays) {
+    // Second material added by setup_scene()
+    const trac0r::MaterialId diffuse = 1;
+    auto light_count = Scene::light_triangles(scene).size();
+    auto material = Scene::material(scene, diffuse);
+    material.m_type = 1;
+    material.m_emittance = 2.f;
+    Scene::set_material(scene, diffuse, material);
+    Scene::rebuild(scene);
+
+    int mismatches = 0;
+    for (const auto &ray : rays) {
+        auto intersect_info = Scene::intersect(scene, ray);
+        if (intersect_info.m_has_intersected && intersect_info.m_material_id == diffuse &&
+            intersect_info.m_material.m_emittance != material.m_emittance)
+            mismatches++;
+    }
+    if (Scene::light_triangles(scene).size() <= light_count)
+        mismatches++;
+
+    fmt::print("{:<15} {:>8} mismatches in {} rays after editing a material\n", "Materials",
+               mismatches, rays.size());
+    return mismatches;
+}
+
+// Occlusion queries are checked against the closest hit of the reference. Rays whose closest hit
+// lies right at t_max could go either way so they're left out.
+int count_occlusion_mismatches(const Scene &reference, const Scene &scene,
+                               const std::vector<Ray> &rays, const std::vector<float> &t_maxs) {
+    std::vector<bool> occluded;
+    Scene::occluded(scene, rays, t_maxs, occluded);
+
+    int mismatches = 0;
+    for (size_t i = 0; i < rays.size(); i++) {
+        auto expected = Scene::intersect(reference, rays[i]);
+        auto dist = glm::length(expected.m_pos - rays[i].m_origin);
+        if (expected.m_has_intersected && glm::abs(dist - t_maxs[i]) < 1e-4f)
+            continue;
+
+        bool expected_occluded = expected.m_has_intersected && dist < t_maxs[i];
+        if (expected_occluded != occluded[i] ||
+            occluded[i] != Scene::occluded(scene, rays[i], t_maxs[i]))
+            mismatches++;
+    }
+    return mismatches;
+}
+
+// Packets are traced as a whole and have to agree with tracing each of their rays alone
+int count_packet_mismatches(const Scene &reference, const Scene &scene,
+                            const std::vector<RayPacket> &packets) {
+    int mismatches = 0;
+    std::vector<trac0r::IntersectionInfo> results;
+    for (const auto &packet : packets) {
+        Scene::intersect(scene, packet, results);
+        for (size_t i = 0; i < packet.m_rays.size(); i++) {
+            auto expected = Scene::intersect(reference, packet.m_rays[i]);
+            if (expected.m_has_intersected != results[i].m_has_intersected ||
+                (expected.m_has_intersected &&
+                 glm::length(expected.m_pos - results[i].m_pos) > 1e-4f))
+                mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+// Every SIMD leaf kernel the CPU supports has to find the same hits as the scalar one
+int count_kernel_mismatches(const Scene &scene, const std::vector<Ray> &rays) {
+    auto supported_level = LeafKernel::supported_level();
+    LeafKernel::set_level(SIMDLevel::Scalar);
+    std::vector<trac0r::IntersectionInfo> expected;
+    for (const auto &ray : rays)
+        expected.push_back(Scene::intersect(scene, ray));
+
+    int failures = 0;
+    for (auto level : {SIMDLevel::SSE, SIMDLevel::AVX2, SIMDLevel::AVX512}) {
+        if (level > supported_level)
+            continue;
+
+        LeafKernel::set_level(level);
+        int mismatches = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            auto actual = Scene::intersect(scene, rays[i]);
+            if (expected[i].m_has_intersected != actual.m_has_intersected ||
+                (actual.m_has_intersected && glm::length(expected[i].m_pos - actual.m_pos) > 1e-4f))
+                mismatches++;
+        }
+        fmt::print("{:<15} {:>8} mismatches in {} rays against scalar kernel\n",
+                   LeafKernel::name(level), mismatches, rays.size());
+        failures += mismatches;
+    }
+
+    LeafKernel::set_level(supported_level);
+    return failures;
+}
+
+// Builds the room for a configuration and then moves the animated shapes once per frame
+void build_scene(Scene &scene, const AccelStructConfig &config, int frames) {
+    Scene::set_accel_struct_type(scene, config.m_type);
+    Scene::set_spatial_split_budget(scene, config.m_spatial_split_budget);
+    Scene::set_triangle_test(scene, config.m_triangle_test);
+    auto moving_shapes = setup_scene(scene);
+    Scene::rebuild(scene);
+    for (int i = 1; i <= frames; i++) {
+        move_shapes(scene, moving_shapes, 0.05f * i);
+        Scene::rebuild(scene);
+    }
+}
+
+// Returns the milliseconds it took to find the closest hit for all rays
+double time_intersections(const Scene &scene, const std::vector<Ray> &rays, int &hits) {
+    Timer timer;
+    hits = 0;
+    for (const auto &ray : rays)
+        hits += Scene::intersect(scene, ray).m_has_intersected ? 1 : 0;
+    return timer.elapsed();
+}
+
+// Shoots random rays through the room and compares every acceleration structure against the
+// linear scan of the flat structure. Structures using the watertight triangle test are compared
+// against a flat structure using the same test since Möller-Trumbore may disagree on rays that
+// graze an edge.
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    const AccelStructConfig reference_config = {AccelStructType::Flat, "Flat", 0.f,
+                                                TriangleTest::MollerTrumbore};
+    const AccelStructConfig watertight_reference_config = {AccelStructType::Flat, "Flat", 0.f,
+                                                           TriangleTest::Watertight};
+
+    std::vector<AccelStructConfig> accel_structs = {
+        {AccelStructType::BVH, "BVH", 0.f, TriangleTest::MollerTrumbore},
+        {AccelStructType::BVH, "SBVH", 0.5f, TriangleTest::MollerTrumbore},
+        {AccelStructType::TwoLevelBVH, "TwoLevelBVH", 0.f, TriangleTest::MollerTrumbore},
+        {AccelStructType::WideBVH, "WideBVH", 0.f, TriangleTest::MollerTrumbore},
+        {AccelStructType::CompressedWideBVH, "Compressed", 0.f, TriangleTest::MollerTrumbore},
+        {AccelStructType::CompressedWideBVH, "CompressedSBVH", 0.5f, TriangleTest::MollerTrumbore},
+        {AccelStructType::Grid, "Grid", 0.f, TriangleTest::MollerTrumbore},
+        {AccelStructType::BVH, "BVHWatertight", 0.f, TriangleTest::Watertight},
+        {AccelStructType::TwoLevelBVH, "TwoLevelWatert", 0.f, TriangleTest::Watertight},
+        {AccelStructType::WideBVH, "WideWatertight", 0.f, TriangleTest::Watertight},
+        {AccelStructType::Grid, "GridWatertight", 0.f, TriangleTest::Watertight}};
+
+    const int num_rays = 100000;
+    std::vector<Ray> rays;
+    for (int i = 0; i < num_rays; i++) {
+        glm::vec3 origin{trac0r::rand_range(-0.45f, 0.45f), trac0r::rand_range(-0.05f, 0.8f),
+                         trac0r::rand_range(-1.f, 0.45f)};
+        rays.push_back(Ray{origin, trac0r::uniform_sample_sphere()});
+    }
+
+    // Coherent packets look like camera rays of a tile while the incoherent ones just bundle up
+    // random rays
+    const int num_packets = 500;
+    std::vector<RayPacket> packets;
+    for (int i = 0; i < num_packets; i++) {
+        RayPacket coherent;
+        auto origin = rays[i].m_origin;
+        auto dir = rays[i].m_dir;
+        for (uint32_t j = 0; j < trac0r::ray_packet_size; j++) {
+            glm::vec3 jitter{trac0r::rand_range(-0.05f, 0.05f), trac0r::rand_range(-0.05f, 0.05f),
+                             trac0r::rand_range(-0.05f, 0.05f)};
+            RayPacket::add_ray(coherent, Ray{origin, glm::normalize(dir + jitter)});
+        }
+        packets.push_back(coherent);
+
+        RayPacket incoherent;
+        for (uint32_t j = 0; j < trac0r::ray_packet_size; j++)
+            RayPacket::add_ray(incoherent, rays[(i * trac0r::ray_packet_size + j) % num_rays]);
+        packets.push_back(incoherent);
+    }
+
+    std::vector<float> t_maxs;
+    for (int i = 0; i < num_rays; i++)
+        t_maxs.push_back(trac0r::rand_range(0.f, 1.f));
+
+    int failures = 0;
+    for (int frame = 0; frame <= 3; frame++) {
+        Scene reference;
+        build_scene(reference, reference_config, frame);
+        Scene watertight_reference;
+        build_scene(watertight_reference, watertight_reference_config, frame);
+
+        for (const auto &accel_struct : accel_structs) {
+            Scene scene;
+            build_scene(scene, accel_struct, frame);
+            const auto &expected = accel_struct.m_triangle_test == TriangleTest::Watertight
+                                       ? watertight_reference
+                                       : reference;
+
+            int mismatches = count_mismatches(expected, scene, rays);
+            fmt::print("{:<15} {:>8} mismatches in {} rays at frame {}\n", accel_struct.m_name,
+                       mismatches, num_rays, frame);
+            failures += mismatches;
+
+            // Occlusion queries don't depend on refitting so checking them once is enough
+            if (frame > 0)
+                continue;
+            int occlusion_mismatches = count_occlusion_mismatches(expected, scene, rays, t_maxs);
+            fmt::print("{:<15} {:>8} mismatches in {} occlusion queries\n", accel_struct.m_name,
+                       occlusion_mismatches, num_rays);
+            failures += occlusion_mismatches;
+
+            int packet_mismatches = count_packet_mismatches(expected, scene, packets);
+            fmt::print("{:<15} {:>8} mismatches in {} ray packets\n", accel_struct.m_name,
+                       packet_mismatches, packets.size());
+            failures += packet_mismatches;
+        }
+    }
+
+    Scene kernel_scene;
+    build_scene(kernel_scene, {AccelStructType::BVH, "BVH", 0.f, TriangleTest::MollerTrumbore}, 0);
+    failures += count_kernel_mismatches(kernel_scene, rays);
+    failures += count_material_edit_mismatches(kernel_scene, rays);
+
+    // Compare the cost of both triangle tests on the same hierarchy
+    for (auto test : {TriangleTest::MollerTrumbore, TriangleTest::Watertight}) {
+        Scene scene;
+        build_scene(scene, {AccelStructType::BVH, "BVH", 0.f, test}, 0);
+        int hits;
+        auto elapsed = time_intersections(scene, rays, hits);
+        fmt::print("{:<15} {:>8.2f} ms for {} rays with {} hits\n",
+                   test == TriangleTest::Watertight ? "Watertight" : "MollerTrumbore", elapsed,
+                   num_rays, hits);
+    }
+
+    return failures > 0 ? 1 : 0;
+}
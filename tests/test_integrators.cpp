@@ -0,0 +1,335 @@
+#include "trac0r/renderer.hpp"
+#include "trac0r/scene.hpp"
+#include "trac0r/shape.hpp"
+#include "trac0r/task_pool.hpp"
+#include "trac0r/timer.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <fmt/format.h>
+
+#include <functional>
+
+using Scene = trac0r::Scene;
+using Shape = trac0r::Shape;
+using Camera = trac0r::Camera;
+using Renderer = trac0r::Renderer;
+using TaskPool = trac0r::TaskPool;
+
+struct IntegratorConfig {
+    std::string m_name;
+    std::function<void(Renderer &)> m_setup;
+
+    // Samples per pixel taken by every call to render(), frames must be a multiple of it
+    int m_samples_per_pixel = 1;
+
+    // Whether every block of the image has to match the reference and not just the mean. Takes
+    // more frames so that blocks are less noisy.
+    bool m_compare_blocks = false;
+};
+
+const int block_size = 8;
+
+// Mean and standard error of every block of block_size x block_size pixels, estimated from how
+// much the block differs between calls to render()
+struct BlockStats {
+    std::vector<double> m_sum;
+    std::vector<double> m_sum_squared;
+    int m_count = 0;
+};
+
+// The room from the viewer with a glass sphere so that every material type takes part
+void setup_scene(Scene &scene) {
+    auto emissive = Scene::add_material(scene, {1, {1.f, 0.93f, 0.85f}, 0.f, 1.f, 15.f});
+    auto diffuse = Scene::add_material(scene, {2, {0.740063, 0.742313, 0.733934}});
+    auto diffuse_red = Scene::add_material(scene, {2, {0.366046, 0.0371827, 0.0416385}});
+    auto glass = Scene::add_material(scene, {3, {0.5f, 0.5f, 0.9f}, 0.0f, 1.51714f});
+    auto glossy = Scene::add_material(scene, {4, {1.f, 1.f, 1.f}, 0.09f});
+
+    auto wall_left =
+        Shape::make_plane({-0.5f, 0.4f, 0}, {0, 0, -glm::half_pi<float>()}, {1, 1}, diffuse_red);
+    auto wall_right =
+        Shape::make_plane({0.5f, 0.4f, 0}, {0, 0, glm::half_pi<float>()}, {1, 1}, diffuse);
+    auto wall_back =
+        Shape::make_plane({0, 0.4f, 0.5}, {-glm::half_pi<float>(), 0, 0}, {1, 1}, diffuse);
+    auto wall_top = Shape::make_plane({0, 0.9f, 0}, {glm::pi<float>(), 0, 0}, {1, 1}, diffuse);
+    auto wall_bottom = Shape::make_plane({0, -0.1f, 0}, {0, 0, 0}, {1, 1}, diffuse);
+    auto lamp = Shape::make_plane({0, 0.85f, -0.1}, {0, 0, 0}, {0.4, 0.4}, emissive);
+    auto box = Shape::make_box({0.3f, 0.1f, 0.1f}, {0, 0.6f, 0}, {0.2f, 0.5f, 0.2f}, glossy);
+    auto sphere = Shape::make_icosphere({-0.2f, 0.1f, -0.1f}, {0, 0, 0}, 0.15f, 2, glass);
+
+    Scene::add_shape(scene, wall_left);
+    Scene::add_shape(scene, wall_right);
+    Scene::add_shape(scene, wall_back);
+    Scene::add_shape(scene, wall_top);
+    Scene::add_shape(scene, wall_bottom);
+    Scene::add_shape(scene, lamp);
+    Scene::add_shape(scene, box);
+    Scene::add_shape(scene, sphere);
+
+    // A strip of small and dimmer lights on the back wall so that lights differ in power and in
+    // how far they are from what they light
+    auto led = Scene::add_material(scene, {1, {0.3f, 0.5f, 1.f}, 0.f, 1.f, 5.f});
+    for (int i = 0; i < 8; i++) {
+        auto strip = Shape::make_plane({-0.35f + i * 0.1f, 0.05f, 0.49f},
+                                       {-glm::half_pi<float>(), 0, 0}, {0.04f, 0.04f}, led);
+        Scene::add_shape(scene, strip);
+    }
+}
+
+// Mean color over a whole accumulated image
+glm::vec3 mean_color(const std::vector<glm::vec4> &luminance, int frames) {
+    glm::dvec3 sum{0.0};
+    for (const auto &pixel : luminance)
+        sum += glm::dvec3(pixel);
+    return glm::vec3(sum / double(luminance.size() * frames));
+}
+
+// Whether alpha counts every sample that went into each pixel
+bool counts_samples(const std::vector<glm::vec4> &luminance, int frames) {
+    for (const auto &pixel : luminance)
+        if (pixel.a != frames)
+            return false;
+    return true;
+}
+
+// Per pixel luminance summed over every block, row by row
+std::vector<double> block_sums(const std::vector<glm::vec4> &luminance, int width, int height) {
+    const int blocks_x = width / block_size;
+    std::vector<double> sums(blocks_x * (height / block_size), 0.0);
+    for (int y = 0; y < height / block_size * block_size; y++) {
+        for (int x = 0; x < blocks_x * block_size; x++) {
+            const auto &pixel = luminance[y * width + x];
+            auto &sum = sums[y / block_size * blocks_x + x / block_size];
+            sum += (pixel.r + pixel.g + pixel.b) / 3.0;
+        }
+    }
+    return sums;
+}
+
+// Adds how much each block got from the last call to render(), averaged over the samples it took
+void add_block_samples(BlockStats &stats, const std::vector<double> &sums,
+                       const std::vector<double> &previous_sums, int samples) {
+    stats.m_sum.resize(sums.size(), 0.0);
+    stats.m_sum_squared.resize(sums.size(), 0.0);
+    for (size_t i = 0; i < sums.size(); i++) {
+        double mean = (sums[i] - previous_sums[i]) / (samples * block_size * block_size);
+        stats.m_sum[i] += mean;
+        stats.m_sum_squared[i] += mean * mean;
+    }
+    stats.m_count++;
+}
+
+double block_mean(const BlockStats &stats, size_t block) {
+    return stats.m_sum[block] / stats.m_count;
+}
+
+double block_variance_of_mean(const BlockStats &stats, size_t block) {
+    double mean = block_mean(stats, block);
+    double variance = (stats.m_sum_squared[block] / stats.m_count - mean * mean) *
+                      stats.m_count / (stats.m_count - 1);
+    return glm::max(variance, 0.0) / stats.m_count;
+}
+
+// Whether a block is within five standard errors of the reference. A flipped or shifted image moves
+// whole edges between blocks and is off by far more than that.
+bool block_matches(const BlockStats &stats, const BlockStats &reference, size_t block) {
+    double difference = block_mean(stats, block) - block_mean(reference, block);
+    double variance =
+        block_variance_of_mean(stats, block) + block_variance_of_mean(reference, block);
+    return difference * difference <= 25.0 * variance;
+}
+
+int count_block_mismatches(const BlockStats &stats, const BlockStats &reference) {
+    int mismatches = 0;
+    for (size_t block = 0; block < stats.m_sum.size(); block++) {
+        if (!block_matches(stats, reference, block))
+            mismatches++;
+    }
+    return mismatches;
+}
+
+// Follows a camera ray through at most max_depth - 1 hits without Russian Roulette or light
+// sampling. That's what the roulette in trace_camera_ray() has to average out to.
+glm::vec3 trace_every_bounce(const Ray &camera_ray, const unsigned max_depth,
+                             const Scene &scene) {
+    Ray ray = camera_ray;
+    glm::vec3 throughput{1.f};
+    for (unsigned depth = 1; depth < max_depth; depth++) {
+        auto intersect_info = Scene::intersect(scene, ray);
+        if (!intersect_info.m_has_intersected)
+            break;
+        const auto &material = intersect_info.m_material;
+        if (material.m_type == 1)
+            return throughput * material.m_color * material.m_emittance;
+        if (!Renderer::scatter(intersect_info, throughput, ray))
+            break;
+    }
+    return glm::vec3{0.f};
+}
+
+// Russian Roulette that doesn't divide by the probability of reaching a bounce makes longer paths
+// darker, which the other integrators would have to copy to converge to the same image
+int count_roulette_mismatches(const Scene &scene, const Camera &camera) {
+    const int samples_per_pixel = 16;
+    int mismatches = 0;
+    for (unsigned max_depth : {3u, 5u, 10u}) {
+        glm::dvec3 roulette_sum{0.0};
+        glm::dvec3 every_bounce_sum{0.0};
+        for (int y = 0; y < Camera::screen_height(camera); y++) {
+            for (int x = 0; x < Camera::screen_width(camera); x++) {
+                for (int i = 0; i < samples_per_pixel; i++) {
+                    auto ray = Camera::pixel_to_ray(camera, x, y);
+                    roulette_sum += glm::dvec3(
+                        glm::vec3(Renderer::trace_camera_ray(ray, max_depth, scene, false)));
+                    every_bounce_sum += glm::dvec3(trace_every_bounce(ray, max_depth, scene));
+                }
+            }
+        }
+
+        auto error = glm::abs(roulette_sum - every_bounce_sum) / every_bounce_sum;
+        bool matches = glm::all(glm::lessThan(error, glm::dvec3{0.03}));
+        fmt::print("{:<18} {:.4f} times the mean of every path up to {} hits {}\n", "Roulette",
+                   roulette_sum.g / every_bounce_sum.g, max_depth - 1, matches ? "" : "MISMATCH");
+        if (!matches)
+            mismatches++;
+    }
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    const int width = 96;
+    const int height = 96;
+    const int frames = 64;
+    const int block_frames = 256;
+
+    Scene scene;
+    Scene::set_accel_struct_type(scene, trac0r::AccelStructType::BVH);
+    setup_scene(scene);
+    Scene::rebuild(scene);
+    Camera camera({0, 0.31f, -1.2f}, {0, 0, 1}, {0, 1, 0}, 90.f, 0.001f, 100.f, width, height);
+
+    // More threads than most test machines have cores so that work actually gets stolen
+    auto task_pool = std::make_shared<TaskPool>(4);
+
+    // Every integrator has to converge to the same image. Depth-first path tracing one ray at a
+    // time without light sampling comes first and is the reference for the others. All others
+    // sample lights directly.
+    std::vector<IntegratorConfig> integrators = {
+        {"Reference",
+         [](Renderer &renderer) {
+             renderer.set_ray_packets(false);
+             renderer.set_next_event_estimation(false);
+         }},
+        {"NextEvent", [](Renderer &renderer) { renderer.set_ray_packets(false); }},
+        {"Packets", [](Renderer &renderer) { renderer.set_ray_packets(true); }},
+        {"PacketsSmallTiles",
+         [](Renderer &renderer) {
+             // Tiles that don't fit whole packets leave partial packets at their edges
+             renderer.set_ray_packets(true);
+             renderer.set_tile_size(5);
+         }},
+        {"Wavefront", [](Renderer &renderer) { renderer.set_wavefront(true, true); }},
+        {"WavefrontUnsorted", [](Renderer &renderer) { renderer.set_wavefront(true, false); }},
+        {"TaskPool",
+         [&](Renderer &renderer) {
+             renderer.set_ray_packets(true);
+             renderer.set_task_pool(task_pool);
+         }},
+        {"Bidirectional", [](Renderer &renderer) { renderer.set_bidirectional(true); }, 1, true},
+        // Splats land on the pixels worldpoint_to_pixel() gives, so the image has to match and not
+        // just its mean
+        {"LightTracing", [](Renderer &renderer) { renderer.set_light_tracing(true); }, 1, true},
+        {"LightTracingTaskPool",
+         [&](Renderer &renderer) {
+             // Many threads splatting onto the same film at once
+             renderer.set_light_tracing(true);
+             renderer.set_task_pool(task_pool);
+         },
+         1, true},
+        {"WavefrontTaskPool",
+         [&](Renderer &renderer) {
+             renderer.set_wavefront(true, true);
+             renderer.set_task_pool(task_pool);
+         }},
+        // Fewer calls to render() that take the same number of samples in total
+        {"PacketsSamplesPerPixel", [](Renderer &renderer) { renderer.set_ray_packets(true); }, 8},
+        {"WavefrontSamplesPerPixel",
+         [](Renderer &renderer) { renderer.set_wavefront(true, true); }, 8},
+        {"BidirectionalSamplesPerPixel",
+         [](Renderer &renderer) { renderer.set_bidirectional(true); }, 8},
+        {"LightTracingSamplesPerPixel",
+         [](Renderer &renderer) { renderer.set_light_tracing(true); }, 8},
+        // Changes the scene for all following integrators
+        {"LightHierarchy",
+         [&](Renderer &renderer) {
+             Scene::set_light_sampling_type(scene, trac0r::LightSamplingType::Hierarchy);
+             Scene::rebuild(scene);
+         }},
+        {"WavefrontLightHierarchy",
+         [](Renderer &renderer) { renderer.set_wavefront(true, true); }},
+        {"BidirectionalLightHierarchy",
+         [](Renderer &renderer) { renderer.set_bidirectional(true); }, 1, true}};
+
+    int failures = count_roulette_mismatches(scene, camera);
+    glm::vec3 reference_color;
+    BlockStats reference_blocks;
+
+    // Light focused by the glass sphere lands on the floor under it, a bit away from the lamp
+    glm::i32vec2 caustic_pixel;
+    glm::vec3 canvas_pos;
+    Camera::worldpoint_to_pixel(camera, {-0.25f, -0.1f, -0.1f}, caustic_pixel, canvas_pos);
+    const size_t caustic_block =
+        caustic_pixel.y / block_size * (width / block_size) + caustic_pixel.x / block_size;
+
+    for (const auto &integrator : integrators) {
+        Renderer renderer(width, height, camera, scene, false);
+        integrator.m_setup(renderer);
+        Timer timer;
+        std::vector<glm::vec4> luminance;
+        const int samples = integrator.m_samples_per_pixel;
+        const bool is_reference = &integrator == &integrators.front();
+        const int frames_taken =
+            is_reference || integrator.m_compare_blocks ? block_frames : frames;
+        BlockStats blocks;
+        std::vector<double> sums(width / block_size * (height / block_size), 0.0);
+        for (int frame = 0; frame < frames_taken; frame += samples) {
+            luminance = renderer.render(frame == 0, 1, 1, samples);
+            auto previous_sums = sums;
+            sums = block_sums(luminance, width, height);
+            add_block_samples(blocks, sums, previous_sums, samples);
+        }
+        auto elapsed = timer.elapsed();
+        auto color = mean_color(luminance, frames_taken);
+        if (is_reference) {
+            reference_color = color;
+            reference_blocks = blocks;
+        }
+
+        // Allow for noise, the reference is an estimate as well
+        auto error = glm::abs(color - reference_color) / reference_color;
+        bool matches = glm::all(glm::lessThan(error, glm::vec3{0.03f})) &&
+                       counts_samples(luminance, frames_taken);
+        fmt::print("{:<18} mean ({:.4f}, {:.4f}, {:.4f}) in {:>8.2f} ms {}\n", integrator.m_name,
+                   color.r, color.g, color.b, elapsed, matches ? "" : "MISMATCH");
+        if (!matches)
+            failures++;
+
+        // The caustic is mostly made of paths that start at the light, so it's printed on its own
+        if (integrator.m_compare_blocks) {
+            int mismatches = count_block_mismatches(blocks, reference_blocks);
+            fmt::print("{:<18} {:>8} mismatches in {} blocks, caustic {:.4f} of {:.4f} {}\n",
+                       integrator.m_name, mismatches, blocks.m_sum.size(),
+                       block_mean(blocks, caustic_block),
+                       block_mean(reference_blocks, caustic_block),
+                       block_matches(blocks, reference_blocks, caustic_block) ? "" : "MISMATCH");
+            failures += mismatches;
+        }
+    }
+
+    return failures > 0 ? 1 : 0;
+}
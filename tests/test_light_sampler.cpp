@@ -0,0 +1,165 @@
+#include "trac0r/scene.hpp"
+#include "trac0r/shape.hpp"
+#include "trac0r/random.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <vector>
+
+using Scene = trac0r::Scene;
+using Shape = trac0r::Shape;
+using LightSample = trac0r::LightSample;
+using LightSamplingType = trac0r::LightSamplingType;
+
+// A closed room lit by lights of different sizes, colors and emittances. Walls come first so that
+// light triangles don't start at scene-wide index 0. Returns the indices of the shapes with lights
+// that get moved later on.
+std::vector<size_t> setup_scene(Scene &scene) {
+    auto emissive = Scene::add_material(scene, {1, {1.f, 0.93f, 0.85f}, 0.f, 1.f, 15.f});
+    auto led = Scene::add_material(scene, {1, {0.3f, 0.5f, 1.f}, 0.f, 1.f, 5.f});
+    auto dim = Scene::add_material(scene, {1, {1.f, 0.2f, 0.1f}, 0.f, 1.f, 0.5f});
+    auto diffuse = Scene::add_material(scene, {2, {0.740063, 0.742313, 0.733934}});
+
+    auto wall_left =
+        Shape::make_plane({-0.5f, 0.4f, 0}, {0, 0, -glm::half_pi<float>()}, {1, 1}, diffuse);
+    auto wall_right =
+        Shape::make_plane({0.5f, 0.4f, 0}, {0, 0, glm::half_pi<float>()}, {1, 1}, diffuse);
+    auto wall_bottom = Shape::make_plane({0, -0.1f, 0}, {0, 0, 0}, {1, 1}, diffuse);
+    auto lamp = Shape::make_plane({0, 0.85f, -0.1}, {0, 0, 0}, {0.4, 0.4}, emissive);
+    auto orb = Shape::make_icosphere({0.2f, 0.3f, 0.2f}, {0, 0, 0}, 0.05f, 1, dim);
+
+    Scene::add_shape(scene, wall_left);
+    Scene::add_shape(scene, wall_right);
+    Scene::add_shape(scene, wall_bottom);
+    auto lamp_index = Scene::add_shape(scene, lamp);
+    for (int i = 0; i < 7; i++) {
+        auto strip = Shape::make_plane({-0.35f + i * 0.1f, 0.05f, 0.49f},
+                                       {-glm::half_pi<float>(), 0, 0},
+                                       {0.02f + 0.01f * i, 0.1f}, led);
+        Scene::add_shape(scene, strip);
+    }
+    auto orb_index = Scene::add_shape(scene, orb);
+    Scene::rebuild(scene);
+
+    return {lamp_index, orb_index};
+}
+
+// Samples lights from several points in the room and compares the density of every sample with
+// the one light_pdf() gives for the triangle it's on. Also makes sure that samples lie on the light
+// triangles of the current scene.
+int count_pdf_mismatches(const Scene &scene, const char *name) {
+    std::vector<trac0r::Triangle> triangles;
+    std::vector<uint32_t> ids;
+    Shape::gather_light_triangles(Scene::shapes(scene), Scene::materials(scene), triangles, ids);
+
+    const int num_points = 16;
+    const int num_samples = 2000;
+    int mismatches = 0;
+    for (int i = 0; i < num_points; i++) {
+        glm::vec3 from{trac0r::rand_range(-0.45f, 0.45f), trac0r::rand_range(-0.05f, 0.8f),
+                       trac0r::rand_range(-0.45f, 0.45f)};
+        for (int j = 0; j < num_samples; j++) {
+            LightSample sample;
+            if (!Scene::sample_light(scene, from, sample)) {
+                mismatches++;
+                continue;
+            }
+            float pdf = Scene::light_pdf(scene, from, sample.m_triangle_id, sample.m_material_id);
+            auto found = std::lower_bound(ids.begin(), ids.end(), sample.m_triangle_id);
+            if (glm::abs(pdf - sample.m_pdf) > 1e-4f * sample.m_pdf || found == ids.end() ||
+                *found != sample.m_triangle_id) {
+                mismatches++;
+                continue;
+            }
+
+            const auto &triangle = triangles[found - ids.begin()];
+            if (glm::abs(glm::dot(sample.m_pos - triangle.m_v1, triangle.m_normal)) > 1e-4f)
+                mismatches++;
+        }
+    }
+
+    fmt::print("{:<15} {:>8} mismatches in {} light samples\n", name, mismatches,
+               num_points * num_samples);
+    return mismatches;
+}
+
+// Picking by power has to hit every light triangle about as often as its share of the total power
+// says. Counts the triangles that are off by more than five standard deviations.
+int count_frequency_mismatches(const Scene &scene) {
+    std::vector<trac0r::Triangle> triangles;
+    std::vector<uint32_t> ids;
+    Shape::gather_light_triangles(Scene::shapes(scene), Scene::materials(scene), triangles, ids);
+
+    std::vector<double> powers;
+    double total_power = 0.0;
+    for (const auto &triangle : triangles) {
+        const auto &material = Scene::material(scene, triangle.m_material_id);
+        double exitance =
+            material.m_emittance * (material.m_color.r + material.m_color.g + material.m_color.b) /
+            3.0;
+        powers.push_back(triangle.m_area * exitance);
+        total_power += powers.back();
+    }
+
+    const int num_samples = 2000000;
+    std::vector<int> counts(triangles.size(), 0);
+    for (int i = 0; i < num_samples; i++) {
+        LightSample sample;
+        if (!Scene::sample_light(scene, glm::vec3{0.f}, sample))
+            continue;
+        auto found = std::lower_bound(ids.begin(), ids.end(), sample.m_triangle_id);
+        if (found != ids.end() && *found == sample.m_triangle_id)
+            counts[found - ids.begin()]++;
+    }
+
+    int mismatches = 0;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        double expected = powers[i] / total_power;
+        double frequency = double(counts[i]) / num_samples;
+        double deviation = glm::sqrt(expected * (1.0 - expected) / num_samples);
+        if (glm::abs(frequency - expected) > 5.0 * deviation + 1e-6)
+            mismatches++;
+    }
+
+    fmt::print("{:<15} {:>8} mismatches in {} light triangles\n", "Frequencies", mismatches,
+               triangles.size());
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    Scene scene;
+    auto moving_shapes = setup_scene(scene);
+
+    int failures = 0;
+    failures += count_pdf_mismatches(scene, "Power");
+    failures += count_frequency_mismatches(scene);
+
+    // Switching only takes effect once the lights are set up again
+    Scene::set_light_sampling_type(scene, LightSamplingType::Hierarchy);
+    int early_switches = Scene::light_sampling_type(scene) == LightSamplingType::Power ? 0 : 1;
+    fmt::print("{:<15} {:>8} mismatches in sampling type before rebuild\n", "Switch",
+               early_switches);
+    failures += early_switches;
+    failures += count_pdf_mismatches(scene, "BeforeRebuild");
+
+    Scene::rebuild(scene);
+    failures += count_pdf_mismatches(scene, "Hierarchy");
+
+    // Moving lights only refits the hierarchy
+    for (auto index : moving_shapes) {
+        auto &shape = Scene::edit_shape(scene, index);
+        Shape::set_pos(shape, Shape::pos(shape) + glm::vec3{0.1f, -0.2f, 0.15f});
+        Shape::set_orientation(shape, Shape::orientation(shape) + glm::vec3{0.3f, 0.2f, 0.f});
+    }
+    Scene::rebuild(scene);
+    failures += count_pdf_mismatches(scene, "MovedHierarchy");
+
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+#include "trac0r/task_pool.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using TaskPool = trac0r::TaskPool;
+
+// Counts the indices that weren't visited exactly once if inside of [begin, end) or that were
+// visited at all otherwise
+int count_miscounted(const std::unique_ptr<std::atomic<uint32_t>[]> &visits, uint32_t size,
+                     uint32_t begin, uint32_t end) {
+    int miscounted = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        if (visits[i].load() != (i >= begin && i < end ? 1u : 0u))
+            miscounted++;
+    }
+    return miscounted;
+}
+
+std::unique_ptr<std::atomic<uint32_t>[]> make_visits(uint32_t size) {
+    std::unique_ptr<std::atomic<uint32_t>[]> visits(new std::atomic<uint32_t>[size]);
+    for (uint32_t i = 0; i < size; i++)
+        visits[i] = 0;
+    return visits;
+}
+
+// Runs a flat loop with a grain that doesn't divide the range, on the pool, without any workers
+// and with OpenMP
+int test_every_index(TaskPool &pool) {
+    const uint32_t size = 1000010;
+    const uint32_t begin = 3;
+    const uint32_t end = 1000003;
+    int failures = 0;
+
+    TaskPool inline_pool(1);
+    for (auto *target : {&pool, &inline_pool, static_cast<TaskPool *>(nullptr)}) {
+        auto visits = make_visits(size);
+        trac0r::parallel_for(target, begin, end, 97, [&](uint32_t i) { visits[i]++; });
+
+        int miscounted = count_miscounted(visits, size, begin, end);
+        const char *name = target == &pool ? "Pool" : target ? "Inline" : "OpenMP";
+        fmt::print("{:<15} {:>8} indices not run exactly once out of {}\n", name, miscounted,
+                   end - begin);
+        failures += miscounted;
+    }
+
+    return failures;
+}
+
+// Every outer index runs a parallel_for of its own from whichever thread picked it up
+int test_nested(TaskPool &pool) {
+    const uint32_t outer = 64;
+    const uint32_t inner = 5000;
+    auto visits = make_visits(outer * inner);
+    trac0r::parallel_for(&pool, 0, outer, 1, [&](uint32_t i) {
+        trac0r::parallel_for(&pool, 0, inner, 16, [&](uint32_t j) { visits[i * inner + j]++; });
+    });
+
+    int miscounted = count_miscounted(visits, outer * inner, 0, outer * inner);
+    fmt::print("{:<15} {:>8} indices not run exactly once out of {}\n", "Nested", miscounted,
+               outer * inner);
+    return miscounted;
+}
+
+// One worker queues all chunks of a nested loop on its own deque and then gets stuck in the first
+// of them. The other chunks only get done by someone else if they're stolen.
+int test_stealing(TaskPool &pool) {
+    const uint32_t thread_count = TaskPool::thread_count(pool);
+    const uint32_t size = 256;
+    const auto main_thread = std::this_thread::get_id();
+    auto visits = make_visits(size);
+    std::atomic<uint32_t> arrived{0};
+    std::atomic<bool> claimed{false};
+    std::mutex threads_mutex;
+    std::set<std::thread::id> threads;
+
+    // Holding every thread in an outer chunk until all of them arrived makes sure that each one
+    // gets exactly one, so one of them runs on a worker
+    trac0r::parallel_for(&pool, 0, thread_count, 1, [&](uint32_t) {
+        arrived++;
+        while (arrived.load() < thread_count)
+            std::this_thread::yield();
+
+        if (std::this_thread::get_id() == main_thread || claimed.exchange(true))
+            return;
+
+        trac0r::parallel_for(&pool, 0, size, 1, [&](uint32_t i) {
+            if (i == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            visits[i]++;
+            std::lock_guard<std::mutex> lock(threads_mutex);
+            threads.insert(std::this_thread::get_id());
+        });
+    });
+
+    int miscounted = count_miscounted(visits, size, 0, size);
+    fmt::print("{:<15} {:>8} indices not run exactly once out of {} on {} threads\n", "Stealing",
+               miscounted, size, threads.size());
+    return miscounted + (threads.size() > 1 ? 0 : 1);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    TaskPool pool(std::max(4u, std::thread::hardware_concurrency()));
+
+    int failures = 0;
+    failures += test_every_index(pool);
+    failures += test_nested(pool);
+    failures += test_stealing(pool);
+
+    return failures > 0 ? 1 : 0;
+}
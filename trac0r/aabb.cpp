@@ -36,6 +36,11 @@ glm::vec3 AABB::center(const AABB &aabb) {
         return glm::vec3(0);
 }
 
+float AABB::surface_area(const AABB &aabb) {
+    auto d = diagonal(aabb);
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
 std::array<glm::vec3, 8> AABB::vertices(AABB &aabb) {
     std::array<glm::vec3, 8> result;
     result[0] = {aabb.m_min.x, aabb.m_min.y, aabb.m_min.z}; // lower left front
@@ -49,7 +54,7 @@ std::array<glm::vec3, 8> AABB::vertices(AABB &aabb) {
     return result;
 }
 
-void AABB::extend(AABB &aabb, glm::vec3 &point) {
+void AABB::extend(AABB &aabb, const glm::vec3 &point) {
     if (!is_null(aabb)) {
         aabb.m_min = glm::min(point, aabb.m_min);
         aabb.m_max = glm::max(point, aabb.m_max);
@@ -59,6 +64,19 @@ void AABB::extend(AABB &aabb, glm::vec3 &point) {
     }
 }
 
+void AABB::extend(AABB &aabb, const AABB &other) {
+    if (is_null(other))
+        return;
+
+    if (!is_null(aabb)) {
+        aabb.m_min = glm::min(other.m_min, aabb.m_min);
+        aabb.m_max = glm::max(other.m_max, aabb.m_max);
+    } else {
+        aabb.m_min = other.m_min;
+        aabb.m_max = other.m_max;
+    }
+}
+
 bool AABB::overlaps(const AABB &first, const AABB &second) {
     if (is_null(first) || is_null(second))
         return false;
@@ -14,8 +14,10 @@ class AABB {
     static glm::vec3 max(const AABB &aabb);
     static glm::vec3 diagonal(const AABB &aabb);
     static glm::vec3 center(const AABB &aabb);
+    static float surface_area(const AABB &aabb);
     static std::array<glm::vec3, 8> vertices(AABB &aabb);
-    static void extend(AABB &aabb, glm::vec3 &point);
+    static void extend(AABB &aabb, const glm::vec3 &point);
+    static void extend(AABB &aabb, const AABB &other);
     static bool overlaps(const AABB &first, const AABB &second);
     static void reset(AABB &aabb);
 
@@ -0,0 +1,397 @@
+#include "bidirectional.hpp"
+#include "intersections.hpp"
+#include "random.hpp"
+#include "renderer.hpp"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+
+namespace trac0r {
+
+/**
+ * @brief Densities of a vertex of a complete path for weighting the techniques that could have
+ * found it. fwd is for sampling it from the camera side, rev from the light side.
+ */
+struct MisVertex {
+    float m_fwd;
+    float m_rev;
+    bool m_delta;
+};
+
+static bool is_delta(const Material &material) {
+    return material.m_type == 3 ||
+           (material.m_type == 4 &&
+            glm::cos(material.m_roughness * glm::half_pi<float>()) >= 1.f);
+}
+
+// Solid angle density with which Renderer::scatter() leaves a vertex into dir_out when it arrived
+// along dir_in. Unlike Renderer::scatter_pdf() it includes glossy directions below the surface,
+// which scatter() picks as well, since every connection has to be matched by a sampled direction.
+static float scatter_density(const LightVertex &vertex, const glm::vec3 &dir_in,
+                             const glm::vec3 &dir_out) {
+    const auto &info = vertex.m_info;
+    switch (info.m_material.m_type) {
+    case 2: {
+        // Diffuse surfaces scatter back to the side the path came from
+        float cos_out = glm::dot(info.m_normal, dir_out);
+        if (glm::dot(info.m_normal, dir_in) * cos_out >= 0.f)
+            return 0.f;
+        return glm::abs(cos_out) * glm::one_over_pi<float>();
+    }
+    case 4: {
+        float cos_max = glm::cos(info.m_material.m_roughness * glm::half_pi<float>());
+        if (cos_max >= 1.f)
+            return 0.f;
+        glm::vec3 reflected_dir = dir_in - 2.f * glm::dot(info.m_normal, dir_in) * info.m_normal;
+        float cos_alpha = glm::dot(reflected_dir, dir_out);
+        if (cos_alpha <= 0.f || cos_alpha * cos_alpha < cos_max)
+            return 0.f;
+        return cos_alpha / (glm::pi<float>() * (1.f - cos_max));
+    }
+    default:
+        return 0.f;
+    }
+}
+
+// Reflectance of a vertex for light arriving from -dir_out and leaving along -dir_in, seen the
+// way a camera path arriving along dir_in sees it. scatter() weights every direction with the
+// color, so it's the color times the density over the cosine towards the light.
+static glm::vec3 bsdf(const LightVertex &vertex, const glm::vec3 &dir_in,
+                      const glm::vec3 &dir_out) {
+    float cos_out = glm::abs(glm::dot(vertex.m_info.m_normal, dir_out));
+    if (cos_out <= 0.f)
+        return glm::vec3{0.f};
+    return vertex.m_info.m_material.m_color * scatter_density(vertex, dir_in, dir_out) / cos_out;
+}
+
+// Density of a light emitting into dir, on either side like when a path hits it
+static float emission_density(const LightVertex &light, const glm::vec3 &dir) {
+    return glm::abs(glm::dot(light.m_info.m_normal, dir)) * 0.5f * glm::one_over_pi<float>();
+}
+
+// Converts a solid angle density at from into an area density at to
+static float to_area(float pdf, const glm::vec3 &from, const LightVertex &to) {
+    glm::vec3 offset = to.m_info.m_pos - from;
+    float dist_squared = glm::dot(offset, offset);
+    if (dist_squared <= 0.f)
+        return 0.f;
+    float cos_to = glm::abs(glm::dot(to.m_info.m_normal, offset));
+    return pdf * cos_to / (dist_squared * glm::sqrt(dist_squared));
+}
+
+// Delta vertices store 0 for the densities they can't have, which cancel out of all ratios
+static float remap0(float pdf) {
+    return pdf > 0.f ? pdf : 1.f;
+}
+
+// Power heuristic weight of the technique that found path with t camera vertices, against all
+// other techniques that connect two vertices that aren't delta
+static float mis_weight(const std::vector<MisVertex> &path, uint32_t t) {
+    const uint32_t k = path.size();
+    float sum = 1.f;
+
+    // Fewer camera vertices, down to a single one
+    float ratio = 1.f;
+    for (uint32_t i = t; i >= 2; i--) {
+        ratio *= remap0(path[i - 1].m_rev) / remap0(path[i - 1].m_fwd);
+        if (!path[i - 1].m_delta && !path[i - 2].m_delta)
+            sum += ratio * ratio;
+    }
+
+    // More camera vertices, up to hitting the light
+    ratio = 1.f;
+    for (uint32_t i = t + 1; i <= k; i++) {
+        ratio *= remap0(path[i - 1].m_fwd) / remap0(path[i - 1].m_rev);
+        if (!path[i - 1].m_delta && (i == k || !path[i].m_delta))
+            sum += ratio * ratio;
+    }
+    return 1.f / sum;
+}
+
+// Lays out the first t camera vertices and first s light vertices as one path from the camera
+static void gather_path(const std::vector<LightVertex> &camera, uint32_t t,
+                        const std::vector<LightVertex> &light, uint32_t s,
+                        std::vector<MisVertex> &path) {
+    path.clear();
+    for (uint32_t i = 0; i < t; i++)
+        path.push_back({camera[i].m_pdf_fwd, camera[i].m_pdf_rev, camera[i].m_delta});
+    for (uint32_t i = s; i-- > 0;)
+        path.push_back({light[i].m_pdf_rev, light[i].m_pdf_fwd, light[i].m_delta});
+}
+
+glm::vec4 Bidirectional::trace(const Ray &ray, const unsigned max_depth, const Scene &scene) {
+    static thread_local std::vector<LightVertex> light_vertices;
+    static thread_local std::vector<LightVertex> camera_vertices;
+    static thread_local std::vector<MisVertex> path;
+
+    // Complete paths have at most this many vertices after the camera
+    const uint32_t max_length = max_depth - 1;
+    trace_light_subpath(scene, max_length - 1, light_vertices);
+
+    camera_vertices.clear();
+    LightVertex first;
+    first.m_info = Scene::intersect(scene, ray);
+    if (!first.m_info.m_has_intersected)
+        return glm::vec4(0.f, 0.f, 0.f, 1.f);
+    first.m_luminance = glm::vec3{1.f};
+    camera_vertices.push_back(first);
+
+    glm::vec3 return_color{0.f};
+    for (uint32_t t = 1; t <= max_length; t++) {
+        const LightVertex &vertex = camera_vertices[t - 1];
+        const IntersectionInfo &info = vertex.m_info;
+        const glm::vec3 &dir_in = info.m_incoming_ray.m_dir;
+
+        // The camera subpath hit a light on its own
+        if (info.m_material.m_type == 1) {
+            float weight = 1.f;
+            if (t > 1) {
+                gather_path(camera_vertices, t, light_vertices, 0, path);
+                path[t - 1].m_rev = Scene::emission_pdf(scene, info.m_material_id);
+                path[t - 2].m_rev = to_area(emission_density(vertex, -dir_in), info.m_pos,
+                                            camera_vertices[t - 2]);
+                weight = mis_weight(path, t);
+            }
+            return_color += vertex.m_luminance * info.m_material.m_color *
+                            info.m_material.m_emittance * weight;
+            break;
+        }
+
+        if (!vertex.m_delta && !is_delta(info.m_material) && t < max_length) {
+            // Connect to a new point on a light
+            LightSample sample;
+            if (Scene::sample_light(scene, info.m_pos, sample)) {
+                LightVertex light;
+                light.m_info.m_pos = sample.m_pos;
+                light.m_info.m_normal = sample.m_normal;
+                light.m_info.m_material_id = sample.m_material_id;
+                light.m_info.m_triangle_id = sample.m_triangle_id;
+                light.m_info.m_material = Scene::material(scene, sample.m_material_id);
+
+                glm::vec3 to_light = sample.m_pos - info.m_pos;
+                float dist_squared = glm::dot(to_light, to_light);
+                glm::vec3 dir = to_light / glm::sqrt(dist_squared);
+                glm::vec3 reflectance = bsdf(vertex, dir_in, dir);
+                float cos_light = glm::abs(glm::dot(sample.m_normal, dir));
+                float geometry =
+                    glm::abs(glm::dot(info.m_normal, dir)) * cos_light / dist_squared;
+                if (reflectance != glm::vec3{0.f} && geometry > 0.f &&
+                    visible(scene, info, sample.m_pos)) {
+                    // Weights assume the point came from sample_emission() like the first vertex
+                    // of a light subpath, so that all techniques agree on them
+                    gather_path(camera_vertices, t, light_vertices, 0, path);
+                    path.push_back({to_area(scatter_density(vertex, dir_in, dir), info.m_pos,
+                                            light),
+                                    Scene::emission_pdf(scene, sample.m_material_id), false});
+                    path[t - 1].m_rev = to_area(emission_density(light, -dir), sample.m_pos,
+                                                vertex);
+                    if (t > 1)
+                        path[t - 2].m_rev = to_area(scatter_density(vertex, -dir, -dir_in),
+                                                    info.m_pos, camera_vertices[t - 2]);
+                    const auto &material = light.m_info.m_material;
+                    return_color += vertex.m_luminance * reflectance * geometry *
+                                    material.m_color * material.m_emittance / sample.m_pdf *
+                                    mis_weight(path, t);
+                }
+            }
+
+            // Connect to all vertices of the light subpath past its start
+            const uint32_t max_s = std::min<uint32_t>(light_vertices.size(), max_length - t);
+            for (uint32_t s = 2; s <= max_s; s++) {
+                const LightVertex &light = light_vertices[s - 1];
+                if (light.m_delta || is_delta(light.m_info.m_material))
+                    continue;
+                const glm::vec3 &light_dir_in = light.m_info.m_incoming_ray.m_dir;
+
+                glm::vec3 offset = light.m_info.m_pos - info.m_pos;
+                float dist_squared = glm::dot(offset, offset);
+                if (dist_squared <= 0.f)
+                    continue;
+                glm::vec3 dir = offset / glm::sqrt(dist_squared);
+                glm::vec3 reflectance =
+                    bsdf(vertex, dir_in, dir) * bsdf(light, dir, -light_dir_in);
+                float geometry = glm::abs(glm::dot(info.m_normal, dir)) *
+                                 glm::abs(glm::dot(light.m_info.m_normal, dir)) / dist_squared;
+                if (reflectance == glm::vec3{0.f} || !(geometry > 0.f) ||
+                    !visible(scene, info, light.m_info.m_pos))
+                    continue;
+
+                gather_path(camera_vertices, t, light_vertices, s, path);
+                path[t - 1].m_rev =
+                    to_area(scatter_density(light, light_dir_in, -dir), light.m_info.m_pos, vertex);
+                if (t > 1)
+                    path[t - 2].m_rev = to_area(scatter_density(vertex, -dir, -dir_in),
+                                                info.m_pos, camera_vertices[t - 2]);
+                path[t].m_fwd = to_area(scatter_density(vertex, dir_in, dir), info.m_pos, light);
+                path[t + 1].m_fwd = to_area(scatter_density(light, dir, -light_dir_in),
+                                            light.m_info.m_pos, light_vertices[s - 2]);
+                return_color += vertex.m_luminance * reflectance * geometry * light.m_luminance *
+                                mis_weight(path, t);
+            }
+        }
+
+        if (t == max_length || !extend(scene, camera_vertices, false))
+            break;
+    }
+
+    return glm::vec4(return_color, 1.f);
+}
+
+void Bidirectional::splat_light_path(const Scene &scene, const Camera &camera,
+                                     const unsigned max_depth, Film &film) {
+    static thread_local std::vector<LightVertex> light_vertices;
+    trace_light_subpath(scene, max_depth - 1, light_vertices);
+
+    // Importance of the pinhole camera: seen from the camera, the canvas area of a pixel theta off
+    // the view axis covers pixel_area * cos(theta)^3 / canvas_dist^2 steradians, and a pixel
+    // averages over them
+    const glm::vec3 camera_pos = Camera::pos(camera);
+    const glm::vec3 to_canvas = Camera::canvas_center_pos(camera) - camera_pos;
+    const glm::vec3 view_dir = glm::normalize(to_canvas);
+    const float importance_scale = glm::dot(to_canvas, to_canvas) / Camera::pixel_area(camera);
+    for (uint32_t i = 0; i < light_vertices.size(); i++) {
+        const LightVertex &vertex = light_vertices[i];
+        const IntersectionInfo &info = vertex.m_info;
+        if (i > 0 && info.m_material.m_type != 2)
+            continue;
+
+        glm::i32vec2 pixel;
+        glm::vec3 canvas_pos;
+        if (!Camera::worldpoint_to_pixel(camera, info.m_pos, pixel, canvas_pos))
+            continue;
+
+        glm::vec3 to_camera = camera_pos - info.m_pos;
+        float dist_squared = glm::dot(to_camera, to_camera);
+        glm::vec3 dir = to_camera / glm::sqrt(dist_squared);
+        float cos_camera = -glm::dot(dir, view_dir);
+        float cos_surface = glm::abs(glm::dot(info.m_normal, dir));
+        if (cos_camera <= 0.f || cos_surface <= 0.f)
+            continue;
+
+        // Lights emit the same radiance everywhere, which the first vertex already carries
+        glm::vec3 reflectance =
+            i == 0 ? glm::vec3{1.f} : bsdf(vertex, -dir, -info.m_incoming_ray.m_dir);
+        if (reflectance == glm::vec3{0.f} || !visible(scene, info, canvas_pos))
+            continue;
+
+        float importance = importance_scale / (cos_camera * cos_camera * cos_camera);
+        Film::splat(film, pixel.x, pixel.y,
+                    vertex.m_luminance * reflectance * cos_surface / dist_squared * importance);
+    }
+}
+
+void Bidirectional::trace_light_subpath(const Scene &scene, uint32_t max_vertices,
+                                        std::vector<LightVertex> &vertices) {
+    vertices.clear();
+    LightSample sample;
+    if (max_vertices == 0 || !Scene::sample_emission(scene, sample))
+        return;
+
+    LightVertex start;
+    start.m_info.m_has_intersected = true;
+    start.m_info.m_pos = sample.m_pos;
+    start.m_info.m_normal = sample.m_normal;
+    start.m_info.m_material_id = sample.m_material_id;
+    start.m_info.m_triangle_id = sample.m_triangle_id;
+    start.m_info.m_material = Scene::material(scene, sample.m_material_id);
+    start.m_luminance =
+        start.m_info.m_material.m_color * start.m_info.m_material.m_emittance / sample.m_pdf;
+    start.m_pdf_fwd = sample.m_pdf;
+    vertices.push_back(start);
+
+    // Emit from a random side, cosine weighted
+    glm::vec3 normal = rand_range(0.f, 1.f) < 0.5f ? sample.m_normal : -sample.m_normal;
+    glm::vec3 dir = oriented_cosine_weighted_hemisphere_sample(normal);
+    float pdf = emission_density(start, dir);
+    if (!(pdf > 0.f))
+        return;
+    Ray ray{offset_ray_origin(sample.m_pos, normal, dir), dir};
+
+    LightVertex next;
+    next.m_info = Scene::intersect(scene, ray);
+    if (!next.m_info.m_has_intersected || next.m_info.m_material.m_type == 1)
+        return;
+    next.m_luminance = start.m_luminance * glm::abs(glm::dot(sample.m_normal, dir)) / pdf;
+    next.m_pdf_fwd = to_area(pdf, sample.m_pos, next);
+    vertices.push_back(next);
+
+    // Lights don't scatter, so light subpaths end where they hit one
+    while (vertices.size() < max_vertices && extend(scene, vertices, true)) {
+        if (vertices.back().m_info.m_material.m_type == 1) {
+            vertices.pop_back();
+            break;
+        }
+    }
+}
+
+bool Bidirectional::extend(const Scene &scene, std::vector<LightVertex> &vertices, bool adjoint) {
+    const LightVertex &vertex = vertices.back();
+    const IntersectionInfo &info = vertex.m_info;
+    const glm::vec3 &dir_in = info.m_incoming_ray.m_dir;
+    const auto &material = info.m_material;
+    if (material.m_type < 2 || material.m_type > 4)
+        return false;
+
+    glm::vec3 factor{1.f};
+    Ray next_ray = info.m_incoming_ray;
+    if (!Renderer::scatter(info, factor, next_ray))
+        return false;
+    const glm::vec3 &dir_out = next_ray.m_dir;
+
+    bool delta = is_delta(material);
+    float pdf_fwd = delta ? 0.f : scatter_density(vertex, dir_in, dir_out);
+    float pdf_rev = delta ? 0.f : scatter_density(vertex, -dir_out, -dir_in);
+    if (adjoint) {
+        // Light goes the other way, so it's reflected as a camera path coming from dir_out would
+        // reflect it. Refraction squeezes directions together, which scatter_glass() doesn't
+        // account for because radiance along camera paths stays the same.
+        if (!delta) {
+            if (!(pdf_fwd > 0.f))
+                return false;
+            factor = bsdf(vertex, -dir_out, -dir_in) *
+                     glm::abs(glm::dot(info.m_normal, dir_out)) / pdf_fwd;
+        } else if (material.m_type == 3 &&
+                   glm::dot(info.m_normal, dir_in) * glm::dot(info.m_normal, dir_out) > 0.f) {
+            float n1 = info.m_angle_between > 0.f ? material.m_ior : 1.0003f;
+            float n2 = info.m_angle_between > 0.f ? 1.0003f : material.m_ior;
+            factor *= (n1 / n2) * (n1 / n2);
+        }
+    }
+
+    // Russian Roulette by how much of the throughput the bounce keeps, past the first bounces
+    if (vertices.size() > 2) {
+        float continuation_probability =
+            glm::min(1.f, glm::max(factor.x, glm::max(factor.y, factor.z)));
+        if (rand_range(0.f, 1.f) >= continuation_probability)
+            return false;
+        factor /= continuation_probability;
+    }
+
+    LightVertex next;
+    next.m_info = Scene::intersect(scene, next_ray);
+    if (!next.m_info.m_has_intersected)
+        return false;
+    next.m_luminance = vertex.m_luminance * factor;
+    next.m_pdf_fwd = to_area(pdf_fwd, info.m_pos, next);
+
+    vertices.back().m_delta = delta;
+    if (vertices.size() > 1) {
+        auto &previous = vertices[vertices.size() - 2];
+        previous.m_pdf_rev = to_area(pdf_rev, info.m_pos, previous);
+    }
+    vertices.push_back(next);
+    return true;
+}
+
+bool Bidirectional::visible(const Scene &scene, const IntersectionInfo &from,
+                            const glm::vec3 &to) {
+    glm::vec3 offset = to - from.m_pos;
+    float dist = glm::length(offset);
+    glm::vec3 dir = offset / dist;
+
+    // Stop just short of the other end so that its surface doesn't block it
+    Ray ray{offset_ray_origin(from.m_pos, from.m_normal, dir), dir};
+    return !Scene::occluded(scene, ray, dist * (1.f - 1e-3f));
+}
+}
@@ -0,0 +1,76 @@
+#ifndef BIDIRECTIONAL_HPP
+#define BIDIRECTIONAL_HPP
+
+#include "camera.hpp"
+#include "film.hpp"
+#include "light_vertex.hpp"
+#include "ray.hpp"
+#include "scene.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Bidirectional path tracing as an alternative to Renderer::trace_camera_ray(). For every
+ * camera path a light subpath is traced from a point on an emitter as well. Every vertex of the
+ * camera subpath is then connected to every vertex of the light subpath, to a freshly sampled
+ * point on a light and, if it's an emitter, counted as is. Each of these techniques finds the
+ * same paths with different densities, so they're combined with the power heuristic over all
+ * techniques that could have found a path.
+ *
+ * Light reaching diffuse surfaces through glass (caustics) is practically never found from the
+ * camera side, since glass only scatters into single directions and can't be connected to. Light
+ * subpaths run through glass on their own and land on the diffuse surfaces the camera subpath
+ * connects to.
+ *
+ * Complete paths have at most max_depth - 1 vertices after the camera, the longest paths
+ * trace_camera_ray() lets through, so that all integrators converge to the same image.
+ */
+class Bidirectional {
+  public:
+    /**
+     * @brief Traces the camera subpath starting with ray and a light subpath and connects them.
+     * The light subpath goes into a buffer per thread.
+     */
+    static glm::vec4 trace(const Ray &ray, const unsigned max_depth, const Scene &scene);
+
+    /**
+     * @brief Light tracing: traces a light subpath and adds the light that every vertex of it on
+     * a light or a diffuse surface reflects into the camera to the pixel it lands on. The film then
+     * holds the sum of all paths, which has to be divided by their number.
+     *
+     * Glass and glossy surfaces only reflect light into the camera from a few directions if at
+     * all, so they're left for camera paths: light tracing only finds paths whose first surface as
+     * seen from the camera is diffuse or emits light.
+     */
+    static void splat_light_path(const Scene &scene, const Camera &camera, const unsigned max_depth,
+                                 Film &film);
+
+  private:
+    /**
+     * @brief Traces a light subpath of at most max_vertices vertices, starting on a light picked
+     * by power.
+     */
+    static void trace_light_subpath(const Scene &scene, uint32_t max_vertices,
+                                    std::vector<LightVertex> &vertices);
+
+    /**
+     * @brief Scatters at the last vertex of a subpath and appends the surface it hits next.
+     * adjoint is set for light subpaths, which carry light the other way through the same
+     * surfaces.
+     *
+     * @return Whether there is a new vertex.
+     */
+    static bool extend(const Scene &scene, std::vector<LightVertex> &vertices, bool adjoint);
+
+    /**
+     * @brief Whether nothing blocks the segment between a surface and a point.
+     */
+    static bool visible(const Scene &scene, const IntersectionInfo &from, const glm::vec3 &to);
+};
+}
+
+#endif /* end of include guard: BIDIRECTIONAL_HPP */
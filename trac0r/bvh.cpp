@@ -0,0 +1,1181 @@
+#include "bvh.hpp"
+#include "leaf_kernel.hpp"
+#include "timer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+
+namespace trac0r {
+
+// Relative costs of visiting a node and of testing a primitive as used by the surface area
+// heuristic
+const float traversal_cost = 1.f;
+const float intersection_cost = 1.f;
+
+// Leaves with more primitives than this are always split even if the SAH says otherwise
+const uint32_t max_leaf_size = 8;
+
+// Deepest level the builder will create. Traversal stacks are sized to fit this.
+const uint32_t max_depth = 60;
+
+void BVH::add_shape(BVH &bvh, Shape &shape) {
+    bvh.m_shapes.push_back(shape);
+    bvh.m_needs_rebuild = true;
+}
+
+void BVH::mark_dirty(BVH &bvh, size_t shape_index) {
+    bvh.m_dirty_shapes.push_back(shape_index);
+}
+
+float BVH::spatial_split_budget(const BVH &bvh) {
+    return bvh.m_spatial_split_budget;
+}
+
+void BVH::set_spatial_split_budget(BVH &bvh, float budget) {
+    bvh.m_spatial_split_budget = budget;
+    bvh.m_needs_rebuild = true;
+}
+
+std::vector<Shape> &BVH::shapes(BVH &bvh) {
+    return bvh.m_shapes;
+}
+
+const std::vector<Shape> &BVH::shapes(const BVH &bvh) {
+    return bvh.m_shapes;
+}
+
+const std::vector<TriangleShading> &BVH::shading(const BVH &bvh) {
+    return bvh.m_shading;
+}
+
+const TriangleGeometry &BVH::geometry(const BVH &bvh) {
+    return bvh.m_geometry;
+}
+
+const std::vector<BVHNode> &BVH::nodes(const BVH &bvh) {
+    return bvh.m_nodes;
+}
+
+const BVHBuildStats &BVH::build_stats(const BVH &bvh) {
+    return bvh.m_build_stats;
+}
+
+IntersectionInfo BVH::intersect(const BVH &bvh, const Ray &ray) {
+    return resolve(bvh, ray, closest_hit(bvh, ray));
+}
+
+HitRecord BVH::closest_hit(const BVH &bvh, const Ray &ray) {
+    HitRecord hit;
+    hit.m_triangle = intersect_triangles(bvh.m_nodes, bvh.m_geometry, ray, hit.m_t);
+    return hit;
+}
+
+IntersectionInfo BVH::resolve(const BVH &bvh, const Ray &ray, const HitRecord &hit) {
+    if (!HitRecord::has_hit(hit))
+        return IntersectionInfo{};
+
+    const auto &shading = bvh.m_shading[hit.m_triangle];
+    return HitRecord::resolve(hit, ray, shading.m_normal, shading.m_material_id,
+                              shading.m_triangle_id);
+}
+
+MaterialId BVH::material_id(const BVH &bvh, const HitRecord &hit) {
+    return bvh.m_shading[hit.m_triangle].m_material_id;
+}
+
+uint32_t BVH::intersect_triangles(const std::vector<BVHNode> &nodes,
+                                  const TriangleGeometry &geometry, const Ray &ray,
+                                  float &closest_dist) {
+    uint32_t closest_index = no_triangle;
+    traverse(nodes, ray, closest_dist, [&](const BVHNode &leaf) {
+        auto index = LeafKernel::intersect(ray, geometry, leaf.m_first, leaf.m_count, closest_dist);
+        if (index != no_triangle)
+            closest_index = index;
+        return false;
+    });
+
+    return closest_index;
+}
+
+void BVH::intersect(const BVH &bvh, const RayPacket &packet,
+                    std::vector<IntersectionInfo> &results) {
+    const auto &rays = packet.m_rays;
+    std::vector<float> closest_dists(rays.size(), std::numeric_limits<float>::max());
+    std::vector<uint32_t> closest_indices(rays.size(), no_triangle);
+    intersect_triangles(bvh.m_nodes, bvh.m_geometry, packet, closest_dists, closest_indices);
+
+    results.resize(rays.size());
+    for (size_t i = 0; i < rays.size(); i++) {
+        HitRecord hit;
+        hit.m_triangle = closest_indices[i];
+        hit.m_t = closest_dists[i];
+        results[i] = resolve(bvh, rays[i], hit);
+    }
+}
+
+void BVH::intersect_triangles(const std::vector<BVHNode> &nodes,
+                              const TriangleGeometry &geometry, const RayPacket &packet,
+                              std::vector<float> &closest_dists,
+                              std::vector<uint32_t> &closest_indices) {
+    const auto &rays = packet.m_rays;
+    if (nodes.empty() || rays.empty())
+        return;
+
+    // Each stack entry remembers the first ray that entered its parent. Rays before that one
+    // missed the parent and therefore can't hit any of its children either.
+    struct StackEntry {
+        uint32_t m_node;
+        uint32_t m_first_ray;
+    };
+    std::array<StackEntry, 64> stack;
+    size_t stack_size = 0;
+    stack[stack_size++] = {0, 0};
+
+    // Farthest closest hit of all rays. Nodes beyond it can't improve on any ray.
+    float max_dist = *std::max_element(closest_dists.begin(), closest_dists.end());
+
+    while (stack_size > 0) {
+        auto entry = stack[--stack_size];
+        const auto &node = nodes[entry.m_node];
+        if (!RayPacket::intersect_aabb(packet, node.m_min, node.m_max, max_dist))
+            continue;
+
+        uint32_t first_ray = entry.m_first_ray;
+        float t_entry;
+        while (first_ray < rays.size() &&
+               !intersect_ray_aabb(rays[first_ray], node.m_min, node.m_max,
+                                   closest_dists[first_ray], t_entry))
+            first_ray++;
+        if (first_ray == rays.size())
+            continue;
+
+        if (node.m_count > 0) {
+            bool found_hit = false;
+            for (uint32_t i = first_ray; i < rays.size(); i++) {
+                if (i != first_ray && !intersect_ray_aabb(rays[i], node.m_min, node.m_max,
+                                                          closest_dists[i], t_entry))
+                    continue;
+
+                auto index = LeafKernel::intersect(rays[i], geometry, node.m_first, node.m_count,
+                                                   closest_dists[i]);
+                if (index != no_triangle) {
+                    closest_indices[i] = index;
+                    found_hit = true;
+                }
+            }
+            if (found_hit)
+                max_dist = *std::max_element(closest_dists.begin(), closest_dists.end());
+            continue;
+        }
+
+        // Visit the child first that lies nearer along the direction of the first active ray by
+        // pushing it last. The children are compared along the axis that separates them most.
+        const auto &left = nodes[node.m_first];
+        const auto &right = nodes[node.m_first + 1];
+        glm::vec3 delta = (right.m_min + right.m_max) - (left.m_min + left.m_max);
+        glm::vec3 abs_delta = glm::abs(delta);
+        int axis = abs_delta.x > abs_delta.y ? (abs_delta.x > abs_delta.z ? 0 : 2)
+                                             : (abs_delta.y > abs_delta.z ? 1 : 2);
+        if (rays[first_ray].m_dir[axis] * delta[axis] >= 0.f) {
+            stack[stack_size++] = {node.m_first + 1, first_ray};
+            stack[stack_size++] = {node.m_first, first_ray};
+        } else {
+            stack[stack_size++] = {node.m_first, first_ray};
+            stack[stack_size++] = {node.m_first + 1, first_ray};
+        }
+    }
+}
+
+bool BVH::occluded(const BVH &bvh, const Ray &ray, const float t_max) {
+    return occluded_triangles(bvh.m_nodes, bvh.m_geometry, ray, t_max);
+}
+
+bool BVH::occluded_triangles(const std::vector<BVHNode> &nodes,
+                             const TriangleGeometry &geometry, const Ray &ray,
+                             const float t_max) {
+    bool hit = false;
+    float max_dist = t_max;
+    traverse(nodes, ray, max_dist, [&](const BVHNode &leaf) {
+        hit = LeafKernel::occluded(ray, geometry, leaf.m_first, leaf.m_count, t_max);
+        return hit;
+    });
+
+    return hit;
+}
+
+void BVH::set_shape_triangles(BVH &bvh, size_t shape_index,
+                              std::vector<uint32_t> *dirty_leaves) {
+    auto world_triangles = Shape::world_triangles(bvh.m_shapes[shape_index]);
+    for (size_t i = 0; i < world_triangles.size(); i++) {
+        const auto &triangle = world_triangles[i];
+        uint32_t original = bvh.m_shape_offsets[shape_index] + i;
+        for (auto p = bvh.m_triangle_position_offsets[original];
+             p < bvh.m_triangle_position_offsets[original + 1]; p++) {
+            auto position = bvh.m_triangle_positions[p];
+            TriangleGeometry::set(bvh.m_geometry, position, triangle);
+            bvh.m_shading[position] = {triangle.m_normal, triangle.m_material_id, original};
+            if (dirty_leaves)
+                dirty_leaves->push_back(bvh.m_triangle_leaves[position]);
+        }
+    }
+}
+
+void BVH::set_triangle_test(BVH &bvh, TriangleTest test) {
+    TriangleGeometry::set_test(bvh.m_geometry, test);
+    if (bvh.m_needs_rebuild)
+        return;
+
+    // Records are prepared from the shapes again since the watertight test needs their exact
+    // vertices
+    for (size_t shape_index = 0; shape_index < bvh.m_shapes.size(); shape_index++)
+        set_shape_triangles(bvh, shape_index, nullptr);
+}
+
+bool BVH::rebuild(BVH &bvh) {
+    if (!bvh.m_needs_rebuild && bvh.m_dirty_shapes.empty())
+        return false;
+
+    if (!bvh.m_needs_rebuild) {
+        // Moved shapes only need their triangles replaced and the affected leaves refitted. Leaves
+        // are refitted around whole triangles, so references clipped by spatial splits only make
+        // their boxes looser than a fresh build would.
+        std::vector<uint32_t> dirty_leaves;
+        for (auto shape_index : bvh.m_dirty_shapes)
+            set_shape_triangles(bvh, shape_index, &dirty_leaves);
+        bvh.m_dirty_shapes.clear();
+
+        bvh.m_sah_area_sum +=
+            refit(bvh.m_nodes, bvh.m_parents, dirty_leaves, [&](const BVHNode &leaf) {
+                AABB aabb;
+                AABB::reset(aabb);
+                for (uint32_t i = leaf.m_first; i < leaf.m_first + leaf.m_count; i++) {
+                    for (const auto &vertex : TriangleGeometry::vertices(bvh.m_geometry, i))
+                        AABB::extend(aabb, vertex);
+                }
+                return aabb;
+            });
+
+        // Fall through to a full build once the refitted tree got too slow to traverse
+        if (sah_cost(bvh.m_nodes, bvh.m_sah_area_sum) <=
+            bvh.m_built_sah_cost * bvh_refit_cost_threshold)
+            return false;
+    }
+
+    Timer timer;
+    std::vector<Triangle> triangles;
+    bvh.m_shape_offsets.clear();
+    for (auto &shape : BVH::shapes(bvh)) {
+        bvh.m_shape_offsets.push_back(triangles.size());
+        for (auto &tri : Shape::world_triangles(shape))
+            triangles.push_back(tri);
+    }
+
+    std::vector<uint32_t> prim_indices;
+    if (bvh.m_spatial_split_budget > 0.f) {
+        BVH::build_spatial(triangles, bvh.m_spatial_split_budget, bvh.m_nodes, prim_indices);
+    } else {
+        std::vector<AABB> prim_aabbs(triangles.size());
+        for (size_t i = 0; i < triangles.size(); i++) {
+            AABB::reset(prim_aabbs[i]);
+            AABB::extend(prim_aabbs[i], triangles[i].m_v1);
+            AABB::extend(prim_aabbs[i], triangles[i].m_v2);
+            AABB::extend(prim_aabbs[i], triangles[i].m_v3);
+        }
+        BVH::build(prim_aabbs, bvh.m_nodes, prim_indices);
+    }
+
+    // Triangles referenced by several leaves after spatial splits get copied into each of them
+    TriangleGeometry::resize(bvh.m_geometry, prim_indices.size());
+    bvh.m_shading.resize(prim_indices.size());
+    for (uint32_t position = 0; position < prim_indices.size(); position++) {
+        const auto &triangle = triangles[prim_indices[position]];
+        TriangleGeometry::set(bvh.m_geometry, position, triangle);
+        bvh.m_shading[position] = {triangle.m_normal, triangle.m_material_id,
+                                   prim_indices[position]};
+    }
+
+    // Group the positions of all copies by original triangle
+    bvh.m_triangle_position_offsets.assign(triangles.size() + 1, 0);
+    for (auto prim_index : prim_indices)
+        bvh.m_triangle_position_offsets[prim_index + 1]++;
+    for (size_t i = 0; i < triangles.size(); i++)
+        bvh.m_triangle_position_offsets[i + 1] += bvh.m_triangle_position_offsets[i];
+    std::vector<uint32_t> next_position(bvh.m_triangle_position_offsets.begin(),
+                                        bvh.m_triangle_position_offsets.end() - 1);
+    bvh.m_triangle_positions.resize(prim_indices.size());
+    for (uint32_t position = 0; position < prim_indices.size(); position++)
+        bvh.m_triangle_positions[next_position[prim_indices[position]]++] = position;
+
+    bvh.m_triangle_leaves.resize(prim_indices.size());
+    for (uint32_t node_index = 0; node_index < bvh.m_nodes.size(); node_index++) {
+        const auto &node = bvh.m_nodes[node_index];
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++)
+            bvh.m_triangle_leaves[i] = node_index;
+    }
+
+    compute_parents(bvh.m_nodes, bvh.m_parents);
+    bvh.m_sah_area_sum = sah_area_sum(bvh.m_nodes);
+    bvh.m_built_sah_cost = sah_cost(bvh.m_nodes, bvh.m_sah_area_sum);
+    bvh.m_build_stats.m_build_time = timer.elapsed();
+    bvh.m_build_stats.m_node_count = bvh.m_nodes.size();
+    bvh.m_build_stats.m_node_memory = bvh.m_nodes.size() * sizeof(BVHNode);
+
+    bvh.m_dirty_shapes.clear();
+    bvh.m_needs_rebuild = false;
+    return true;
+}
+
+void BVH::compute_parents(const std::vector<BVHNode> &nodes, std::vector<uint32_t> &parents) {
+    parents.assign(nodes.size(), bvh_no_parent);
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].m_count == 0) {
+            parents[nodes[i].m_first] = i;
+            parents[nodes[i].m_first + 1] = i;
+        }
+    }
+}
+
+float BVH::sah_area_sum(const std::vector<BVHNode> &nodes) {
+    float area_sum = 0.f;
+    for (const auto &node : nodes) {
+        if (node.m_count == 0)
+            area_sum += traversal_cost * node_area(node);
+        else
+            area_sum += intersection_cost * node_area(node) * node.m_count;
+    }
+    return area_sum;
+}
+
+float BVH::sah_cost(const std::vector<BVHNode> &nodes, const float sah_area_sum) {
+    if (nodes.empty())
+        return 0.f;
+
+    float root_area = node_area(nodes[0]);
+    return root_area > 0.f ? sah_area_sum / root_area : 0.f;
+}
+
+// Number of candidate split planes per axis considered by the binned builder
+const uint32_t num_bins = 16;
+
+// Number of candidate planes per axis for spatial splits
+const uint32_t num_spatial_bins = 16;
+
+// Nodes with more primitives than this are binned by all threads at once. Everything below is
+// handed out as independent subtrees.
+const uint32_t parallel_binning_threshold = 1 << 16;
+
+// Size of the chunks the primitive range is split into for parallel binning
+const uint32_t parallel_chunk_size = 1 << 14;
+
+// Subtrees with more primitives than this are built in their own task
+const uint32_t parallel_task_threshold = 1 << 12;
+
+namespace {
+
+struct Bounds {
+    glm::vec3 m_min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 m_max = glm::vec3(std::numeric_limits<float>::lowest());
+};
+
+void grow(Bounds &bounds, const glm::vec3 &min, const glm::vec3 &max) {
+    bounds.m_min = glm::min(bounds.m_min, min);
+    bounds.m_max = glm::max(bounds.m_max, max);
+}
+
+float half_area(const Bounds &bounds) {
+    auto d = bounds.m_max - bounds.m_min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+// Bounds of a range of primitives as well as the bounds of their centroids
+struct RangeBounds {
+    Bounds m_bounds;
+    Bounds m_centroids;
+};
+
+struct Bins {
+    std::array<std::array<Bounds, num_bins>, 3> m_bounds;
+    std::array<std::array<uint32_t, num_bins>, 3> m_counts{};
+};
+
+struct BuildContext {
+    std::vector<glm::vec3> m_prim_min;
+    std::vector<glm::vec3> m_prim_max;
+    std::vector<glm::vec3> m_centroids;
+    std::vector<uint32_t> *m_prim_indices;
+    std::vector<BVHNode> *m_nodes;
+
+    // Nodes are preallocated and handed out in pairs so that subtrees can be built concurrently
+    // while children still always end up behind their parents
+    std::atomic<uint32_t> m_node_count;
+};
+
+struct Subtree {
+    uint32_t m_begin;
+    uint32_t m_end;
+    uint32_t m_node_index;
+    uint32_t m_depth;
+};
+
+void merge(RangeBounds &target, const RangeBounds &source) {
+    grow(target.m_bounds, source.m_bounds.m_min, source.m_bounds.m_max);
+    grow(target.m_centroids, source.m_centroids.m_min, source.m_centroids.m_max);
+}
+
+void merge(Bins &target, const Bins &source) {
+    for (int axis = 0; axis < 3; axis++) {
+        for (uint32_t b = 0; b < num_bins; b++) {
+            grow(target.m_bounds[axis][b], source.m_bounds[axis][b].m_min,
+                 source.m_bounds[axis][b].m_max);
+            target.m_counts[axis][b] += source.m_counts[axis][b];
+        }
+    }
+}
+
+RangeBounds compute_bounds(const BuildContext &ctx, uint32_t begin, uint32_t end) {
+    RangeBounds result;
+    const auto &prim_indices = *ctx.m_prim_indices;
+    for (uint32_t i = begin; i < end; i++) {
+        auto prim = prim_indices[i];
+        grow(result.m_bounds, ctx.m_prim_min[prim], ctx.m_prim_max[prim]);
+        grow(result.m_centroids, ctx.m_centroids[prim], ctx.m_centroids[prim]);
+    }
+    return result;
+}
+
+// Maps a centroid to its bin along an axis. Binning and partitioning must both go through here so
+// that they agree on which side every primitive ends up.
+uint32_t bin_index(const glm::vec3 &centroid, const Bounds &centroid_bounds, const glm::vec3 &scale,
+                   int axis) {
+    auto index = static_cast<uint32_t>((centroid[axis] - centroid_bounds.m_min[axis]) * scale[axis]);
+    return std::min(index, num_bins - 1);
+}
+
+glm::vec3 bin_scale(const Bounds &centroid_bounds) {
+    glm::vec3 scale;
+    auto extent = centroid_bounds.m_max - centroid_bounds.m_min;
+    for (int axis = 0; axis < 3; axis++)
+        scale[axis] = extent[axis] > 0.f ? num_bins / extent[axis] : 0.f;
+    return scale;
+}
+
+// Maps a coordinate to one of the equally sized slabs used for spatial splits
+uint32_t spatial_bin_index(const float coord, const float node_min, const float bin_width) {
+    auto index = static_cast<int>((coord - node_min) / bin_width);
+    return static_cast<uint32_t>(glm::clamp(index, 0, static_cast<int>(num_spatial_bins) - 1));
+}
+
+void fill_bins(const BuildContext &ctx, uint32_t begin, uint32_t end,
+               const Bounds &centroid_bounds, const glm::vec3 &scale, Bins &bins) {
+    const auto &prim_indices = *ctx.m_prim_indices;
+    for (uint32_t i = begin; i < end; i++) {
+        auto prim = prim_indices[i];
+        for (int axis = 0; axis < 3; axis++) {
+            auto b = bin_index(ctx.m_centroids[prim], centroid_bounds, scale, axis);
+            grow(bins.m_bounds[axis][b], ctx.m_prim_min[prim], ctx.m_prim_max[prim]);
+            bins.m_counts[axis][b]++;
+        }
+    }
+}
+
+// Splits a range into chunks which are processed by all threads and merged afterwards
+template <typename Result, typename ChunkFunc>
+Result reduce_chunks(uint32_t begin, uint32_t end, ChunkFunc chunk_func) {
+    auto num_chunks = (end - begin + parallel_chunk_size - 1) / parallel_chunk_size;
+    std::vector<Result> results(num_chunks);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (uint32_t chunk = 0; chunk < num_chunks; chunk++) {
+        auto chunk_begin = begin + chunk * parallel_chunk_size;
+        auto chunk_end = std::min(chunk_begin + parallel_chunk_size, end);
+        chunk_func(chunk_begin, chunk_end, results[chunk]);
+    }
+
+    for (uint32_t chunk = 1; chunk < num_chunks; chunk++)
+        merge(results[0], results[chunk]);
+    return results[0];
+}
+
+// Turns a node into a leaf or splits its range along the cheapest bin boundary and allocates its
+// two children. Returns the index of the first primitive of the right child or 0 for leaves.
+uint32_t split_node(BuildContext &ctx, uint32_t begin, uint32_t end, uint32_t node_index,
+                    uint32_t depth, bool parallel) {
+    auto count = end - begin;
+    RangeBounds range_bounds;
+    if (parallel)
+        range_bounds = reduce_chunks<RangeBounds>(
+            begin, end, [&](uint32_t chunk_begin, uint32_t chunk_end, RangeBounds &result) {
+                result = compute_bounds(ctx, chunk_begin, chunk_end);
+            });
+    else
+        range_bounds = compute_bounds(ctx, begin, end);
+
+    auto &node = (*ctx.m_nodes)[node_index];
+    node.m_min = range_bounds.m_bounds.m_min;
+    node.m_max = range_bounds.m_bounds.m_max;
+    node.m_first = begin;
+    node.m_count = count;
+
+    if (count == 1 || depth >= max_depth)
+        return 0;
+
+    const auto &centroid_bounds = range_bounds.m_centroids;
+    auto scale = bin_scale(centroid_bounds);
+    Bins bins;
+    if (parallel)
+        bins = reduce_chunks<Bins>(begin, end,
+                                   [&](uint32_t chunk_begin, uint32_t chunk_end, Bins &result) {
+                                       fill_bins(ctx, chunk_begin, chunk_end, centroid_bounds,
+                                                 scale, result);
+                                   });
+    else
+        fill_bins(ctx, begin, end, centroid_bounds, scale, bins);
+
+    // Sweep over the bins of every axis. right_areas[b] is the area of all bins from b to the end.
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    uint32_t best_bin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0.f)
+            continue;
+
+        std::array<float, num_bins> right_areas;
+        Bounds right;
+        for (uint32_t b = num_bins; b-- > 1;) {
+            grow(right, bins.m_bounds[axis][b].m_min, bins.m_bounds[axis][b].m_max);
+            right_areas[b] = half_area(right);
+        }
+
+        Bounds left;
+        uint32_t left_count = 0;
+        for (uint32_t b = 1; b < num_bins; b++) {
+            grow(left, bins.m_bounds[axis][b - 1].m_min, bins.m_bounds[axis][b - 1].m_max);
+            left_count += bins.m_counts[axis][b - 1];
+            auto right_count = count - left_count;
+            if (left_count == 0 || right_count == 0)
+                continue;
+
+            float cost = half_area(left) * left_count + right_areas[b] * right_count;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    // Degenerate nodes without any area can't be judged by the SAH so they only get split when
+    // they're too large for a leaf
+    float node_area = half_area(range_bounds.m_bounds);
+    float split_cost = traversal_cost + intersection_cost * best_cost / node_area;
+    float leaf_cost = intersection_cost * count;
+    bool sah_prefers_leaf = best_axis == -1 || node_area <= 0.f || split_cost >= leaf_cost;
+    if (count <= max_leaf_size && sah_prefers_leaf)
+        return 0;
+
+    auto &prim_indices = *ctx.m_prim_indices;
+    uint32_t mid;
+    if (best_axis != -1) {
+        auto it = std::partition(
+            prim_indices.begin() + begin, prim_indices.begin() + end, [&](uint32_t prim) {
+                return bin_index(ctx.m_centroids[prim], centroid_bounds, scale, best_axis) <
+                       best_bin;
+            });
+        mid = it - prim_indices.begin();
+    } else {
+        // All centroids coincide so any split is as good as any other
+        mid = begin + count / 2;
+    }
+
+    auto left_index = ctx.m_node_count.fetch_add(2);
+    node.m_first = left_index;
+    node.m_count = 0;
+    return mid;
+}
+
+void build_subtree(BuildContext *ctx, Subtree subtree) {
+    auto mid = split_node(*ctx, subtree.m_begin, subtree.m_end, subtree.m_node_index,
+                          subtree.m_depth, false);
+    if (mid == 0)
+        return;
+
+    auto left_index = (*ctx->m_nodes)[subtree.m_node_index].m_first;
+    Subtree left{subtree.m_begin, mid, left_index, subtree.m_depth + 1};
+    Subtree right{mid, subtree.m_end, left_index + 1, subtree.m_depth + 1};
+    if (mid - subtree.m_begin > parallel_task_threshold) {
+#pragma omp task
+        build_subtree(ctx, left);
+    } else {
+        build_subtree(ctx, left);
+    }
+    build_subtree(ctx, right);
+}
+
+// The top levels see too few nodes to keep all threads busy so every one of them is binned in
+// parallel instead. Ranges that got small enough are collected to be built as independent tasks.
+void build_top_levels(BuildContext &ctx, Subtree subtree, std::vector<Subtree> &subtrees) {
+    if (subtree.m_end - subtree.m_begin < parallel_binning_threshold) {
+        subtrees.push_back(subtree);
+        return;
+    }
+
+    auto mid = split_node(ctx, subtree.m_begin, subtree.m_end, subtree.m_node_index,
+                          subtree.m_depth, true);
+    if (mid == 0)
+        return;
+
+    auto left_index = (*ctx.m_nodes)[subtree.m_node_index].m_first;
+    build_top_levels(ctx, {subtree.m_begin, mid, left_index, subtree.m_depth + 1}, subtrees);
+    build_top_levels(ctx, {mid, subtree.m_end, left_index + 1, subtree.m_depth + 1}, subtrees);
+}
+}
+
+void BVH::build(const std::vector<AABB> &prim_aabbs, std::vector<BVHNode> &nodes,
+                std::vector<uint32_t> &prim_indices) {
+    nodes.clear();
+    prim_indices.resize(prim_aabbs.size());
+    for (uint32_t i = 0; i < prim_indices.size(); i++)
+        prim_indices[i] = i;
+
+    if (prim_aabbs.empty())
+        return;
+
+    uint32_t num_prims = prim_aabbs.size();
+    BuildContext ctx;
+    ctx.m_prim_min.resize(num_prims);
+    ctx.m_prim_max.resize(num_prims);
+    ctx.m_centroids.resize(num_prims);
+    ctx.m_prim_indices = &prim_indices;
+    ctx.m_nodes = &nodes;
+    ctx.m_node_count = 1;
+
+#pragma omp parallel for
+    for (uint32_t i = 0; i < num_prims; i++) {
+        ctx.m_prim_min[i] = AABB::min(prim_aabbs[i]);
+        ctx.m_prim_max[i] = AABB::max(prim_aabbs[i]);
+        ctx.m_centroids[i] = (ctx.m_prim_min[i] + ctx.m_prim_max[i]) * 0.5f;
+    }
+
+    // A binary tree over n primitives never has more than 2n - 1 nodes
+    nodes.resize(2 * num_prims - 1);
+
+    std::vector<Subtree> subtrees;
+    build_top_levels(ctx, {0, num_prims, 0, 0}, subtrees);
+
+#pragma omp parallel
+#pragma omp single
+    for (const auto &subtree : subtrees) {
+#pragma omp task
+        build_subtree(&ctx, subtree);
+    }
+
+    nodes.resize(ctx.m_node_count);
+}
+
+// Spatial splits are only tried when the children of the best object split overlap by more than
+// this fraction of the root's surface area
+const float spatial_split_alpha = 1e-5f;
+
+namespace {
+
+// A triangle as seen by one node. Spatial splits shrink the bounds to the part of the triangle
+// that lies on each side of the split plane.
+struct Reference {
+    Bounds m_bounds;
+    uint32_t m_prim;
+};
+
+struct SpatialBuildContext {
+    const std::vector<Triangle> *m_triangles;
+    std::vector<BVHNode> *m_nodes;
+
+    // References of all nodes in a single array that every node partitions its own range of in
+    // place. Duplicates created by spatial splits go into free slots behind the range.
+    std::vector<Reference> m_refs;
+    float m_root_area;
+
+    // Nodes are preallocated and handed out in pairs just like for the binned builder
+    std::atomic<uint32_t> m_node_count;
+};
+
+// The references of a node are m_refs[m_begin, m_end). The free slots up to m_capacity_end belong
+// to the node as well and are all the duplicates its whole subtree may create.
+struct SpatialSubtree {
+    uint32_t m_begin;
+    uint32_t m_end;
+    uint32_t m_capacity_end;
+    uint32_t m_node_index;
+    uint32_t m_depth;
+};
+
+struct SplitCandidate {
+    float m_cost = std::numeric_limits<float>::max();
+    int m_axis = -1;
+    uint32_t m_bin = 0;
+    Bounds m_left;
+    Bounds m_right;
+};
+
+// Clipped bounds of references per slab along every axis and how many references enter and exit
+// each slab
+struct SpatialBins {
+    std::array<std::array<Bounds, num_spatial_bins>, 3> m_bounds;
+    std::array<std::array<uint32_t, num_spatial_bins>, 3> m_entries{};
+    std::array<std::array<uint32_t, num_spatial_bins>, 3> m_exits{};
+};
+
+void merge(SpatialBins &target, const SpatialBins &source) {
+    for (int axis = 0; axis < 3; axis++) {
+        for (uint32_t b = 0; b < num_spatial_bins; b++) {
+            grow(target.m_bounds[axis][b], source.m_bounds[axis][b].m_min,
+                 source.m_bounds[axis][b].m_max);
+            target.m_entries[axis][b] += source.m_entries[axis][b];
+            target.m_exits[axis][b] += source.m_exits[axis][b];
+        }
+    }
+}
+
+bool is_valid(const Bounds &bounds) {
+    return bounds.m_min.x <= bounds.m_max.x && bounds.m_min.y <= bounds.m_max.y &&
+           bounds.m_min.z <= bounds.m_max.z;
+}
+
+Bounds intersection(const Bounds &a, const Bounds &b) {
+    Bounds result;
+    result.m_min = glm::max(a.m_min, b.m_min);
+    result.m_max = glm::min(a.m_max, b.m_max);
+    return result;
+}
+
+glm::vec3 centroid(const Reference &ref) {
+    return (ref.m_bounds.m_min + ref.m_bounds.m_max) * 0.5f;
+}
+
+// Bounds of the part of a triangle that lies between two planes along an axis. Everything outside
+// of the reference's current bounds is cut off as well.
+Bounds clip_reference(const Triangle &tri, const Reference &ref, int axis, float lo, float hi) {
+    std::array<glm::vec3, 3> vertices = {{tri.m_v1, tri.m_v2, tri.m_v3}};
+    Bounds result;
+    for (int e = 0; e < 3; e++) {
+        const auto &a = vertices[e];
+        const auto &b = vertices[(e + 1) % 3];
+        if (a[axis] >= lo && a[axis] <= hi)
+            grow(result, a, a);
+
+        for (float plane : {lo, hi}) {
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                auto t = (plane - a[axis]) / (b[axis] - a[axis]);
+                auto p = a + (b - a) * t;
+                p[axis] = plane;
+                grow(result, p, p);
+            }
+        }
+    }
+    return intersection(result, ref.m_bounds);
+}
+
+RangeBounds compute_reference_bounds(const SpatialBuildContext &ctx, uint32_t begin,
+                                     uint32_t end) {
+    RangeBounds result;
+    for (uint32_t i = begin; i < end; i++) {
+        const auto &ref = ctx.m_refs[i];
+        auto ref_centroid = centroid(ref);
+        grow(result.m_bounds, ref.m_bounds.m_min, ref.m_bounds.m_max);
+        grow(result.m_centroids, ref_centroid, ref_centroid);
+    }
+    return result;
+}
+
+// Object split bins over the reference centroids just like the regular binned builder
+void fill_object_bins(const SpatialBuildContext &ctx, uint32_t begin, uint32_t end,
+                      const Bounds &centroid_bounds, const glm::vec3 &scale, Bins &bins) {
+    for (uint32_t i = begin; i < end; i++) {
+        const auto &ref = ctx.m_refs[i];
+        for (int axis = 0; axis < 3; axis++) {
+            auto b = bin_index(centroid(ref), centroid_bounds, scale, axis);
+            grow(bins.m_bounds[axis][b], ref.m_bounds.m_min, ref.m_bounds.m_max);
+            bins.m_counts[axis][b]++;
+        }
+    }
+}
+
+SplitCandidate find_object_split(const Bins &bins, uint32_t count, const glm::vec3 &scale) {
+    SplitCandidate best;
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0.f)
+            continue;
+
+        std::array<Bounds, num_bins> right_bounds;
+        Bounds right;
+        for (uint32_t b = num_bins; b-- > 1;) {
+            grow(right, bins.m_bounds[axis][b].m_min, bins.m_bounds[axis][b].m_max);
+            right_bounds[b] = right;
+        }
+
+        Bounds left;
+        uint32_t left_count = 0;
+        for (uint32_t b = 1; b < num_bins; b++) {
+            grow(left, bins.m_bounds[axis][b - 1].m_min, bins.m_bounds[axis][b - 1].m_max);
+            left_count += bins.m_counts[axis][b - 1];
+            auto right_count = count - left_count;
+            if (left_count == 0 || right_count == 0)
+                continue;
+
+            float cost = half_area(left) * left_count + half_area(right_bounds[b]) * right_count;
+            if (cost < best.m_cost) {
+                best.m_cost = cost;
+                best.m_axis = axis;
+                best.m_bin = b;
+                best.m_left = left;
+                best.m_right = right_bounds[b];
+            }
+        }
+    }
+    return best;
+}
+
+// Chops the node into equally sized slabs along every axis and clips each reference into all
+// slabs it touches. References are counted where they enter and where they exit.
+void fill_spatial_bins(const SpatialBuildContext &ctx, uint32_t begin, uint32_t end,
+                       const Bounds &node_bounds, SpatialBins &bins) {
+    for (int axis = 0; axis < 3; axis++) {
+        auto node_min = node_bounds.m_min[axis];
+        auto bin_width = (node_bounds.m_max[axis] - node_min) / num_spatial_bins;
+        if (!(bin_width > 0.f))
+            continue;
+
+        for (uint32_t i = begin; i < end; i++) {
+            const auto &ref = ctx.m_refs[i];
+            auto first = spatial_bin_index(ref.m_bounds.m_min[axis], node_min, bin_width);
+            auto last = spatial_bin_index(ref.m_bounds.m_max[axis], node_min, bin_width);
+            bins.m_entries[axis][first]++;
+            bins.m_exits[axis][last]++;
+            if (first == last) {
+                grow(bins.m_bounds[axis][first], ref.m_bounds.m_min, ref.m_bounds.m_max);
+                continue;
+            }
+
+            const auto &tri = (*ctx.m_triangles)[ref.m_prim];
+            for (auto b = first; b <= last; b++) {
+                auto clipped = clip_reference(tri, ref, axis, node_min + b * bin_width,
+                                              node_min + (b + 1) * bin_width);
+                if (is_valid(clipped))
+                    grow(bins.m_bounds[axis][b], clipped.m_min, clipped.m_max);
+            }
+        }
+    }
+}
+
+SplitCandidate find_spatial_split(const SpatialBins &bins, const Bounds &node_bounds) {
+    SplitCandidate best;
+    for (int axis = 0; axis < 3; axis++) {
+        if (!(node_bounds.m_max[axis] - node_bounds.m_min[axis] > 0.f))
+            continue;
+
+        const auto &bin_bounds = bins.m_bounds[axis];
+        std::array<Bounds, num_spatial_bins> right_bounds;
+        std::array<uint32_t, num_spatial_bins> right_counts;
+        Bounds right;
+        uint32_t right_count = 0;
+        for (uint32_t b = num_spatial_bins; b-- > 1;) {
+            grow(right, bin_bounds[b].m_min, bin_bounds[b].m_max);
+            right_count += bins.m_exits[axis][b];
+            right_bounds[b] = right;
+            right_counts[b] = right_count;
+        }
+
+        Bounds left;
+        uint32_t left_count = 0;
+        for (uint32_t b = 1; b < num_spatial_bins; b++) {
+            grow(left, bin_bounds[b - 1].m_min, bin_bounds[b - 1].m_max);
+            left_count += bins.m_entries[axis][b - 1];
+            if (left_count == 0 || right_counts[b] == 0)
+                continue;
+
+            float cost =
+                half_area(left) * left_count + half_area(right_bounds[b]) * right_counts[b];
+            if (cost < best.m_cost) {
+                best.m_cost = cost;
+                best.m_axis = axis;
+                best.m_bin = b;
+                best.m_left = left;
+                best.m_right = right_bounds[b];
+            }
+        }
+    }
+    return best;
+}
+
+// Distributes references onto both sides of a spatial split. Straddling references are either
+// split in two or, if that's cheaper or there are no free slots left, moved to one side as a whole.
+// Afterwards the left side is [m_begin, mid) and the right side [mid, end) where end grew by one
+// for every right half of a split reference.
+void perform_spatial_split(SpatialBuildContext &ctx, const SpatialSubtree &subtree,
+                           const SplitCandidate &split, const Bounds &node_bounds, uint32_t &mid,
+                           uint32_t &end) {
+    auto &refs = ctx.m_refs;
+    auto axis = split.m_axis;
+    auto node_min = node_bounds.m_min[axis];
+    auto bin_width = (node_bounds.m_max[axis] - node_min) / num_spatial_bins;
+    auto plane = node_min + split.m_bin * bin_width;
+
+    // Order references as [left | straddling | right]
+    auto first = refs.begin() + subtree.m_begin;
+    auto last = refs.begin() + subtree.m_end;
+    auto straddling_begin = std::partition(first, last, [&](const Reference &ref) {
+        return spatial_bin_index(ref.m_bounds.m_max[axis], node_min, bin_width) < split.m_bin;
+    });
+    auto straddling_end = std::partition(straddling_begin, last, [&](const Reference &ref) {
+        return spatial_bin_index(ref.m_bounds.m_min[axis], node_min, bin_width) < split.m_bin;
+    });
+    mid = straddling_begin - refs.begin();
+    end = subtree.m_end;
+
+    // The bounds of the split already contain both halves of every straddling reference. Every
+    // straddling reference that ends up on the left is swapped to mid which then moves on.
+    auto left_bounds = split.m_left;
+    auto right_bounds = split.m_right;
+    uint32_t left_count = straddling_end - first;
+    uint32_t right_count = last - straddling_begin;
+    uint32_t straddling_last = straddling_end - refs.begin();
+    for (uint32_t i = mid; i < straddling_last; i++) {
+        auto ref = refs[i];
+        const auto &tri = (*ctx.m_triangles)[ref.m_prim];
+        auto left_part = clip_reference(tri, ref, axis, std::numeric_limits<float>::lowest(),
+                                        plane);
+        auto right_part = clip_reference(tri, ref, axis, plane,
+                                         std::numeric_limits<float>::max());
+
+        // Cost of splitting the reference versus keeping it whole on either side
+        Bounds left_with_ref = left_bounds;
+        grow(left_with_ref, ref.m_bounds.m_min, ref.m_bounds.m_max);
+        Bounds right_with_ref = right_bounds;
+        grow(right_with_ref, ref.m_bounds.m_min, ref.m_bounds.m_max);
+        float split_cost = half_area(left_bounds) * left_count +
+                           half_area(right_bounds) * right_count;
+        float left_cost =
+            half_area(left_with_ref) * left_count + half_area(right_bounds) * (right_count - 1);
+        float right_cost =
+            half_area(left_bounds) * (left_count - 1) + half_area(right_with_ref) * right_count;
+
+        bool can_split = end < subtree.m_capacity_end && is_valid(left_part) &&
+                         is_valid(right_part);
+        if (!can_split || left_cost < split_cost || right_cost < split_cost) {
+            if (left_cost <= right_cost) {
+                left_bounds = left_with_ref;
+                right_count--;
+                std::swap(refs[i], refs[mid++]);
+            } else {
+                right_bounds = right_with_ref;
+                left_count--;
+            }
+            continue;
+        }
+
+        refs[i].m_bounds = left_part;
+        std::swap(refs[i], refs[mid++]);
+        refs[end++] = {right_part, ref.m_prim};
+    }
+}
+
+// Turns a node into a leaf or splits its references and allocates its two children. Returns false
+// for leaves.
+bool split_spatial_node(SpatialBuildContext &ctx, const SpatialSubtree &subtree, bool parallel,
+                        SpatialSubtree &left, SpatialSubtree &right) {
+    auto begin = subtree.m_begin;
+    auto count = subtree.m_end - begin;
+    RangeBounds range_bounds;
+    if (parallel)
+        range_bounds = reduce_chunks<RangeBounds>(
+            begin, subtree.m_end,
+            [&](uint32_t chunk_begin, uint32_t chunk_end, RangeBounds &result) {
+                result = compute_reference_bounds(ctx, chunk_begin, chunk_end);
+            });
+    else
+        range_bounds = compute_reference_bounds(ctx, begin, subtree.m_end);
+
+    const auto &node_bounds = range_bounds.m_bounds;
+    auto &node = (*ctx.m_nodes)[subtree.m_node_index];
+    node.m_min = node_bounds.m_min;
+    node.m_max = node_bounds.m_max;
+    node.m_first = begin;
+    node.m_count = count;
+
+    if (count == 1 || subtree.m_depth >= max_depth)
+        return false;
+
+    const auto &centroid_bounds = range_bounds.m_centroids;
+    auto scale = bin_scale(centroid_bounds);
+    Bins bins;
+    if (parallel)
+        bins = reduce_chunks<Bins>(begin, subtree.m_end,
+                                   [&](uint32_t chunk_begin, uint32_t chunk_end, Bins &result) {
+                                       fill_object_bins(ctx, chunk_begin, chunk_end,
+                                                        centroid_bounds, scale, result);
+                                   });
+    else
+        fill_object_bins(ctx, begin, subtree.m_end, centroid_bounds, scale, bins);
+    auto object_split = find_object_split(bins, count, scale);
+    auto best = object_split;
+    bool spatial = false;
+
+    // Only bother with spatial splits where the object split leaves a lot of overlap
+    if (best.m_axis != -1 && subtree.m_end < subtree.m_capacity_end) {
+        auto overlap = intersection(best.m_left, best.m_right);
+        if (is_valid(overlap) && half_area(overlap) > spatial_split_alpha * ctx.m_root_area) {
+            SpatialBins spatial_bins;
+            if (parallel)
+                spatial_bins = reduce_chunks<SpatialBins>(
+                    begin, subtree.m_end,
+                    [&](uint32_t chunk_begin, uint32_t chunk_end, SpatialBins &result) {
+                        fill_spatial_bins(ctx, chunk_begin, chunk_end, node_bounds, result);
+                    });
+            else
+                fill_spatial_bins(ctx, begin, subtree.m_end, node_bounds, spatial_bins);
+
+            auto spatial_split = find_spatial_split(spatial_bins, node_bounds);
+            if (spatial_split.m_cost < best.m_cost) {
+                best = spatial_split;
+                spatial = true;
+            }
+        }
+    }
+
+    float node_area = half_area(node_bounds);
+    float split_cost = traversal_cost + intersection_cost * best.m_cost / node_area;
+    float leaf_cost = intersection_cost * count;
+    bool sah_prefers_leaf = best.m_axis == -1 || node_area <= 0.f || split_cost >= leaf_cost;
+    if (count <= max_leaf_size && sah_prefers_leaf)
+        return false;
+
+    uint32_t mid = 0;
+    uint32_t end = subtree.m_end;
+    if (spatial)
+        perform_spatial_split(ctx, subtree, best, node_bounds, mid, end);
+
+    // Fall back to an object split if unsplitting moved everything to one side. No reference got
+    // split in that case so they're all still there, just in a different order.
+    if (!spatial || mid == begin || mid == end) {
+        auto &refs = ctx.m_refs;
+        if (object_split.m_axis != -1) {
+            auto it = std::partition(refs.begin() + begin, refs.begin() + end,
+                                     [&](const Reference &ref) {
+                                         return bin_index(centroid(ref), centroid_bounds, scale,
+                                                          object_split.m_axis) < object_split.m_bin;
+                                     });
+            mid = it - refs.begin();
+        } else {
+            // All centroids coincide so any split is as good as any other
+            mid = begin + count / 2;
+        }
+    }
+
+    // The free slots are shared in proportion to the references on each side. The right side
+    // moves up to make room for the share of the left one.
+    auto left_count = mid - begin;
+    auto right_count = end - mid;
+    auto free_slots = subtree.m_capacity_end - end;
+    auto left_free = static_cast<uint32_t>(static_cast<uint64_t>(free_slots) * left_count /
+                                           (left_count + right_count));
+    if (left_free > 0)
+        std::move_backward(ctx.m_refs.begin() + mid, ctx.m_refs.begin() + end,
+                           ctx.m_refs.begin() + end + left_free);
+
+    auto left_index = ctx.m_node_count.fetch_add(2);
+    node.m_first = left_index;
+    node.m_count = 0;
+    left = {begin, mid, mid + left_free, left_index, subtree.m_depth + 1};
+    right = {mid + left_free, end + left_free, subtree.m_capacity_end, left_index + 1,
+             subtree.m_depth + 1};
+    return true;
+}
+
+void build_spatial_subtree(SpatialBuildContext *ctx, SpatialSubtree subtree) {
+    SpatialSubtree left;
+    SpatialSubtree right;
+    if (!split_spatial_node(*ctx, subtree, false, left, right))
+        return;
+
+    if (left.m_end - left.m_begin > parallel_task_threshold) {
+#pragma omp task
+        build_spatial_subtree(ctx, left);
+    } else {
+        build_spatial_subtree(ctx, left);
+    }
+    build_spatial_subtree(ctx, right);
+}
+
+// Same as build_top_levels() for the binned builder
+void build_spatial_top_levels(SpatialBuildContext &ctx, SpatialSubtree subtree,
+                              std::vector<SpatialSubtree> &subtrees) {
+    if (subtree.m_end - subtree.m_begin < parallel_binning_threshold) {
+        subtrees.push_back(subtree);
+        return;
+    }
+
+    SpatialSubtree left;
+    SpatialSubtree right;
+    if (!split_spatial_node(ctx, subtree, true, left, right))
+        return;
+
+    build_spatial_top_levels(ctx, left, subtrees);
+    build_spatial_top_levels(ctx, right, subtrees);
+}
+}
+
+void BVH::build_spatial(const std::vector<Triangle> &triangles, const float duplicate_budget,
+                        std::vector<BVHNode> &nodes, std::vector<uint32_t> &prim_indices) {
+    nodes.clear();
+    prim_indices.clear();
+    if (triangles.empty())
+        return;
+
+    uint32_t num_prims = triangles.size();
+    uint32_t capacity = num_prims + static_cast<uint32_t>(num_prims * duplicate_budget);
+    SpatialBuildContext ctx;
+    ctx.m_triangles = &triangles;
+    ctx.m_nodes = &nodes;
+    ctx.m_refs.resize(capacity);
+    ctx.m_node_count = 1;
+
+#pragma omp parallel for
+    for (uint32_t i = 0; i < num_prims; i++) {
+        auto &ref = ctx.m_refs[i];
+        grow(ref.m_bounds, triangles[i].m_v1, triangles[i].m_v1);
+        grow(ref.m_bounds, triangles[i].m_v2, triangles[i].m_v2);
+        grow(ref.m_bounds, triangles[i].m_v3, triangles[i].m_v3);
+        ref.m_prim = i;
+    }
+
+    Bounds root_bounds = compute_reference_bounds(ctx, 0, num_prims).m_bounds;
+    ctx.m_root_area = half_area(root_bounds);
+
+    // Every leaf holds at least one of at most capacity references
+    nodes.resize(2 * capacity - 1);
+
+    std::vector<SpatialSubtree> subtrees;
+    build_spatial_top_levels(ctx, {0, num_prims, capacity, 0, 0}, subtrees);
+
+#pragma omp parallel
+#pragma omp single
+    for (const auto &subtree : subtrees) {
+#pragma omp task
+        build_spatial_subtree(&ctx, subtree);
+    }
+    nodes.resize(ctx.m_node_count);
+
+    // Leaves still point into the reference array which has gaps wherever a subtree didn't use up
+    // its free slots
+    prim_indices.reserve(capacity);
+    for (auto &node : nodes) {
+        if (node.m_count == 0)
+            continue;
+
+        uint32_t first = prim_indices.size();
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++)
+            prim_indices.push_back(ctx.m_refs[i].m_prim);
+        node.m_first = first;
+    }
+}
+}
@@ -0,0 +1,358 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include "triangle.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "intersection_info.hpp"
+#include "hit_record.hpp"
+#include "shape.hpp"
+#include "aabb.hpp"
+#include "intersections.hpp"
+#include "triangle_geometry.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Refitting lets the tree quality degrade over time. Once the SAH cost of a refitted tree
+ * exceeds its cost right after the last full build by this factor, we build from scratch instead.
+ */
+const float bvh_refit_cost_threshold = 1.5f;
+
+/**
+ * @brief Parent index of the root node.
+ */
+const uint32_t bvh_no_parent = std::numeric_limits<uint32_t>::max();
+
+struct BVHNode {
+    glm::vec3 m_min;
+
+    /**
+     * @brief Index of the left child for inner nodes (the right child directly follows it) or
+     * index of the first primitive for leaves.
+     */
+    uint32_t m_first = 0;
+
+    glm::vec3 m_max;
+
+    /**
+     * @brief Number of primitives in this node. Inner nodes always have a count of 0.
+     */
+    uint32_t m_count = 0;
+};
+
+/**
+ * @brief Statistics of the last full build of a hierarchy.
+ */
+struct BVHBuildStats {
+    /**
+     * @brief Wall time of the build in milliseconds.
+     */
+    double m_build_time = 0.0;
+    size_t m_node_count = 0;
+
+    /**
+     * @brief Size of all nodes in bytes. Wide hierarchies also count the binary nodes they keep
+     * for refitting.
+     */
+    size_t m_node_memory = 0;
+};
+
+class BVH {
+  public:
+    static void add_shape(BVH &bvh, Shape &shape);
+    static void mark_dirty(BVH &bvh, size_t shape_index);
+    static std::vector<Shape> &shapes(BVH &bvh);
+    static const std::vector<Shape> &shapes(const BVH &bvh);
+    static const std::vector<TriangleShading> &shading(const BVH &bvh);
+    static const TriangleGeometry &geometry(const BVH &bvh);
+    static const std::vector<BVHNode> &nodes(const BVH &bvh);
+    static const BVHBuildStats &build_stats(const BVH &bvh);
+    static IntersectionInfo intersect(const BVH &bvh, const Ray &ray);
+
+    /**
+     * @brief Finds the closest hit without looking up any shading data.
+     */
+    static HitRecord closest_hit(const BVH &bvh, const Ray &ray);
+
+    /**
+     * @brief Shading data of a hit found by closest_hit() for the same ray.
+     */
+    static IntersectionInfo resolve(const BVH &bvh, const Ray &ray, const HitRecord &hit);
+    static MaterialId material_id(const BVH &bvh, const HitRecord &hit);
+
+    /**
+     * @brief Finds the closest hit of every ray in a packet by walking the hierarchy once for the
+     * whole packet. results[i] belongs to packet.m_rays[i].
+     */
+    static void intersect(const BVH &bvh, const RayPacket &packet,
+                          std::vector<IntersectionInfo> &results);
+    static bool occluded(const BVH &bvh, const Ray &ray, const float t_max);
+
+    /**
+     * @brief Prepares the triangle records for a different ray-triangle test. Nodes aren't touched.
+     */
+    static void set_triangle_test(BVH &bvh, TriangleTest test);
+
+    /**
+     * @brief Builds the tree from scratch or, if only shapes moved, refits it.
+     *
+     * @return Whether the nodes were built from scratch. Otherwise at most their bounds changed.
+     */
+    static bool rebuild(BVH &bvh);
+
+    static float spatial_split_budget(const BVH &bvh);
+
+    /**
+     * @brief Enables spatial splits for the following builds. They help a lot with long thin
+     * triangles like those of walls whose boxes would otherwise overlap badly.
+     *
+     * @param budget How many references to the same triangle may additionally be created, as a
+     * fraction of the triangle count. 0.3 allows for 30% more references. 0 disables spatial
+     * splits. Moved triangles are refitted as a whole, which loosens leaves that only held a
+     * clipped part of them, so heavily split shapes fall back to full builds sooner.
+     */
+    static void set_spatial_split_budget(BVH &bvh, float budget);
+
+    /**
+     * @brief Builds a binary hierarchy over arbitrary primitives using the binned surface area
+     * heuristic. The top levels are binned by all threads together while lower levels are built as
+     * independent OpenMP tasks.
+     *
+     * @param prim_aabbs Bounding box of every primitive
+     * @param nodes Receives the nodes with the root at index 0
+     * @param prim_indices Receives the primitive order that leaves refer to
+     */
+    static void build(const std::vector<AABB> &prim_aabbs, std::vector<BVHNode> &nodes,
+                      std::vector<uint32_t> &prim_indices);
+
+    /**
+     * @brief Builds a binary hierarchy over triangles that considers spatial splits as well as
+     * object splits (SBVH). Triangles that straddle a spatial split are referenced by both
+     * children with their bounds clipped to each side.
+     *
+     * @param duplicate_budget Fraction of additional references that may be created
+     * @param prim_indices Receives the triangle order that leaves refer to. Triangles may appear
+     * more than once.
+     */
+    static void build_spatial(const std::vector<Triangle> &triangles, const float duplicate_budget,
+                              std::vector<BVHNode> &nodes, std::vector<uint32_t> &prim_indices);
+
+    /**
+     * @brief Calculates the parent of every node. The root gets bvh_no_parent.
+     */
+    static void compute_parents(const std::vector<BVHNode> &nodes, std::vector<uint32_t> &parents);
+
+    static float node_area(const BVHNode &node);
+
+    /**
+     * @brief Sum of the surface areas of all nodes where leaves are weighted by their primitive
+     * count. Dividing it by the surface area of the root gives the SAH cost of the whole tree.
+     */
+    static float sah_area_sum(const std::vector<BVHNode> &nodes);
+    static float sah_cost(const std::vector<BVHNode> &nodes, const float sah_area_sum);
+
+    /**
+     * @brief Refits a tree bottom-up after primitives moved. Only the given leaves and their
+     * ancestors are touched.
+     *
+     * @param leaves Indices of leaves whose primitives changed
+     * @param leaf_aabb Called as leaf_aabb(const BVHNode &leaf) and returns the new bounds
+     *
+     * @return How much the SAH area sum changed
+     */
+    template <typename LeafAABBFunc>
+    static float refit(std::vector<BVHNode> &nodes, const std::vector<uint32_t> &parents,
+                       std::vector<uint32_t> leaves, LeafAABBFunc leaf_aabb);
+
+    /**
+     * @brief Walks a hierarchy front to back and calls leaf_func for every leaf the ray enters
+     * before closest_dist.
+     *
+     * @param closest_dist Distance of the closest hit so far. leaf_func is expected to lower it
+     * whenever it finds a closer hit so that traversal can skip everything behind it.
+     * @param leaf_func Called as leaf_func(const BVHNode &leaf). Returning true stops traversal
+     * right away.
+     */
+    template <typename LeafFunc>
+    static void traverse(const std::vector<BVHNode> &nodes, const Ray &ray, float &closest_dist,
+                         LeafFunc leaf_func);
+
+    /**
+     * @brief Finds the closest triangle in a hierarchy whose leaves directly reference ranges of
+     * triangles. Only the geometry stream is touched.
+     *
+     * @return Index of the hit triangle or no_triangle if nothing closer than closest_dist was hit
+     */
+    static uint32_t intersect_triangles(const std::vector<BVHNode> &nodes,
+                                        const TriangleGeometry &geometry, const Ray &ray,
+                                        float &closest_dist);
+
+    /**
+     * @brief Packet version of intersect_triangles(). Nodes are culled for the whole packet at
+     * once and inside a node only rays from the first one that enters it onward are tested. That
+     * skips every ray that already missed an ancestor.
+     *
+     * @param closest_dists One distance per ray, lowered wherever a closer hit is found
+     * @param closest_indices One triangle index per ray, set wherever a closer hit is found
+     */
+    static void intersect_triangles(const std::vector<BVHNode> &nodes,
+                                    const TriangleGeometry &geometry, const RayPacket &packet,
+                                    std::vector<float> &closest_dists,
+                                    std::vector<uint32_t> &closest_indices);
+
+    /**
+     * @brief Checks whether any triangle in a hierarchy whose leaves directly reference ranges of
+     * triangles is hit before t_max. Traversal stops at the first hit.
+     */
+    static bool occluded_triangles(const std::vector<BVHNode> &nodes,
+                                   const TriangleGeometry &geometry, const Ray &ray,
+                                   const float t_max);
+
+  private:
+    /**
+     * @brief Writes the current world space triangles of a shape into every position that
+     * references them and collects the leaves of those positions if dirty_leaves isn't null.
+     */
+    static void set_shape_triangles(BVH &bvh, size_t shape_index,
+                                    std::vector<uint32_t> *dirty_leaves);
+
+    std::vector<BVHNode> m_nodes;
+
+    /**
+     * @brief All triangles of all shapes in world space, ordered so that every leaf references a
+     * contiguous range. Traversal only reads m_geometry while m_shading holds what resolving a hit
+     * needs in the same order.
+     */
+    TriangleGeometry m_geometry;
+    std::vector<TriangleShading> m_shading;
+    std::vector<Shape> m_shapes;
+
+    /**
+     * @brief Bookkeeping for refits. Triangles of shape n originally start at
+     * m_shape_offsets[n]. The positions of all copies of such an original triangle
+     * i are m_triangle_positions[m_triangle_position_offsets[i]] up to
+     * m_triangle_positions[m_triangle_position_offsets[i + 1]]; spatial splits may have created
+     * several. m_triangle_leaves maps each position to its leaf.
+     */
+    std::vector<uint32_t> m_parents;
+    std::vector<uint32_t> m_shape_offsets;
+    std::vector<uint32_t> m_triangle_position_offsets;
+    std::vector<uint32_t> m_triangle_positions;
+    std::vector<uint32_t> m_triangle_leaves;
+    std::vector<uint32_t> m_dirty_shapes;
+    float m_sah_area_sum = 0.f;
+    float m_built_sah_cost = 0.f;
+
+    BVHBuildStats m_build_stats;
+    float m_spatial_split_budget = 0.f;
+    bool m_needs_rebuild = false;
+};
+
+inline float BVH::node_area(const BVHNode &node) {
+    auto d = node.m_max - node.m_min;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+template <typename LeafAABBFunc>
+float BVH::refit(std::vector<BVHNode> &nodes, const std::vector<uint32_t> &parents,
+                 std::vector<uint32_t> leaves, LeafAABBFunc leaf_aabb) {
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+    float area_sum_delta = 0.f;
+    std::vector<uint32_t> ancestors;
+    for (auto leaf : leaves) {
+        auto &node = nodes[leaf];
+        float old_area = node_area(node);
+        AABB aabb = leaf_aabb(node);
+        node.m_min = AABB::min(aabb);
+        node.m_max = AABB::max(aabb);
+        area_sum_delta += (node_area(node) - old_area) * node.m_count;
+
+        for (auto parent = parents[leaf]; parent != bvh_no_parent; parent = parents[parent])
+            ancestors.push_back(parent);
+    }
+
+    // Children are always stored behind their parents so going through the ancestors from the
+    // back refits every node after both of its children
+    std::sort(ancestors.begin(), ancestors.end());
+    ancestors.erase(std::unique(ancestors.begin(), ancestors.end()), ancestors.end());
+    for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+        auto &node = nodes[*it];
+        const auto &left = nodes[node.m_first];
+        const auto &right = nodes[node.m_first + 1];
+        float old_area = node_area(node);
+        node.m_min = glm::min(left.m_min, right.m_min);
+        node.m_max = glm::max(left.m_max, right.m_max);
+        area_sum_delta += node_area(node) - old_area;
+    }
+
+    return area_sum_delta;
+}
+
+template <typename LeafFunc>
+void BVH::traverse(const std::vector<BVHNode> &nodes, const Ray &ray, float &closest_dist,
+                   LeafFunc leaf_func) {
+    if (nodes.empty())
+        return;
+
+    // Each stack entry remembers the distance at which its node was entered so that nodes behind
+    // the closest hit found so far can be skipped without touching them again
+    struct StackEntry {
+        uint32_t m_node;
+        float m_t_entry;
+    };
+    std::array<StackEntry, 64> stack;
+    size_t stack_size = 0;
+
+    float root_entry;
+    const auto &root = nodes[0];
+    if (intersect_ray_aabb(ray, root.m_min, root.m_max, closest_dist, root_entry))
+        stack[stack_size++] = {0, root_entry};
+
+    while (stack_size > 0) {
+        auto entry = stack[--stack_size];
+        if (entry.m_t_entry > closest_dist)
+            continue;
+
+        const auto &node = nodes[entry.m_node];
+        if (node.m_count > 0) {
+            if (leaf_func(node))
+                return;
+            continue;
+        }
+
+        // Visit the nearer child first by pushing it last
+        const auto &left = nodes[node.m_first];
+        const auto &right = nodes[node.m_first + 1];
+        float t_left;
+        float t_right;
+        bool hit_left = intersect_ray_aabb(ray, left.m_min, left.m_max, closest_dist, t_left);
+        bool hit_right = intersect_ray_aabb(ray, right.m_min, right.m_max, closest_dist, t_right);
+        if (hit_left && hit_right) {
+            if (t_left < t_right) {
+                stack[stack_size++] = {node.m_first + 1, t_right};
+                stack[stack_size++] = {node.m_first, t_left};
+            } else {
+                stack[stack_size++] = {node.m_first, t_left};
+                stack[stack_size++] = {node.m_first + 1, t_right};
+            }
+        } else if (hit_left) {
+            stack[stack_size++] = {node.m_first, t_left};
+        } else if (hit_right) {
+            stack[stack_size++] = {node.m_first + 1, t_right};
+        }
+    }
+}
+}
+
+#endif /* end of include guard: BVH_HPP */
@@ -212,4 +212,36 @@ Ray Camera::pixel_to_ray(const Camera &camera, unsigned x, unsigned y) {
     return Ray{world_pos, ray_dir};
 }
 
+bool Camera::worldpoint_to_pixel(const Camera &camera, glm::vec3 world_point, glm::i32vec2 &pixel,
+                                 glm::vec3 &canvas_pos) {
+    // The canvas lies as far along the view direction as its center, whatever the length of dir
+    glm::vec3 to_point = world_point - pos(camera);
+    glm::vec3 to_canvas = canvas_center_pos(camera) - pos(camera);
+    float depth = glm::dot(to_point, to_canvas);
+    float canvas_depth = glm::dot(to_canvas, to_canvas);
+    if (depth <= canvas_depth)
+        return false;
+    float scale = canvas_depth / depth;
+    canvas_pos = pos(camera) + to_point * scale;
+
+    // camspace_to_worldspace() goes along the negated canvas directions. They're perpendicular to
+    // the view direction, which leaves the offset from the camera scaled down onto the canvas.
+    // The canvas is tiny and far from the origin, so going through canvas_pos would lose most of
+    // the precision.
+    glm::vec2 rel_pos = {-scale * glm::dot(to_point, canvas_dir_x(camera)) /
+                             glm::dot(canvas_dir_x(camera), canvas_dir_x(camera)),
+                         -scale * glm::dot(to_point, canvas_dir_y(camera)) /
+                             glm::dot(canvas_dir_y(camera), canvas_dir_y(camera))};
+    pixel = {static_cast<int>(glm::floor(rel_pos.x * screen_width(camera) +
+                                         screen_width(camera) / 2.f + 0.5f)),
+             static_cast<int>(glm::floor(rel_pos.y * screen_height(camera) +
+                                         screen_height(camera) / 2.f + 0.5f))};
+    return pixel.x >= 0 && pixel.x < screen_width(camera) && pixel.y >= 0 &&
+           pixel.y < screen_height(camera);
+}
+
+float Camera::pixel_area(const Camera &camera) {
+    return glm::length(canvas_dir_x(camera)) * pixel_size(camera).x *
+           glm::length(canvas_dir_y(camera)) * pixel_size(camera).y;
+}
 }
@@ -117,6 +117,25 @@ class Camera {
      */
     static Ray pixel_to_ray(const Camera &camera, unsigned x, unsigned y);
 
+    /**
+     * @brief Finds the pixel whose rays pass through a world point, the inverse of pixel_to_ray()
+     * without its jitter.
+     *
+     * @param world_point The world point in world space.
+     * @param pixel Set to the pixel coordinates if the point is on screen.
+     * @param canvas_pos Set to where the line from the point to the camera crosses the canvas,
+     * which is where the rays of the pixel start.
+     *
+     * @return Whether the point lies beyond the canvas and within the screen.
+     */
+    static bool worldpoint_to_pixel(const Camera &camera, glm::vec3 world_point,
+                                    glm::i32vec2 &pixel, glm::vec3 &canvas_pos);
+
+    /**
+     * @brief Returns the area a pixel covers on the canvas in world space.
+     */
+    static float pixel_area(const Camera &camera);
+
   private:
     static void rebuild(Camera &camera);
 
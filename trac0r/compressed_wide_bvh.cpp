@@ -0,0 +1,264 @@
+#include "compressed_wide_bvh.hpp"
+#include "intersections.hpp"
+#include "leaf_kernel.hpp"
+#include "timer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace trac0r {
+
+// Leaves store their primitive count in 8 bits
+const uint32_t max_compressed_leaf_size = std::numeric_limits<uint8_t>::max();
+
+// Highest quantized coordinate within a frame
+const float max_quantized = std::numeric_limits<uint8_t>::max();
+
+void CompressedWideBVH::add_shape(CompressedWideBVH &cwbvh, Shape &shape) {
+    BVH::add_shape(cwbvh.m_bvh, shape);
+    cwbvh.m_needs_rebuild = true;
+}
+
+void CompressedWideBVH::mark_dirty(CompressedWideBVH &cwbvh, size_t shape_index) {
+    BVH::mark_dirty(cwbvh.m_bvh, shape_index);
+    cwbvh.m_needs_rebuild = true;
+}
+
+void CompressedWideBVH::set_spatial_split_budget(CompressedWideBVH &cwbvh, float budget) {
+    BVH::set_spatial_split_budget(cwbvh.m_bvh, budget);
+    cwbvh.m_needs_rebuild = true;
+}
+
+void CompressedWideBVH::set_triangle_test(CompressedWideBVH &cwbvh, TriangleTest test) {
+    BVH::set_triangle_test(cwbvh.m_bvh, test);
+}
+
+std::vector<Shape> &CompressedWideBVH::shapes(CompressedWideBVH &cwbvh) {
+    return BVH::shapes(cwbvh.m_bvh);
+}
+
+const std::vector<Shape> &CompressedWideBVH::shapes(const CompressedWideBVH &cwbvh) {
+    return BVH::shapes(cwbvh.m_bvh);
+}
+
+const std::vector<CompressedWideBVHNode> &CompressedWideBVH::nodes(const CompressedWideBVH &cwbvh) {
+    return cwbvh.m_nodes;
+}
+
+const BVHBuildStats &CompressedWideBVH::build_stats(const CompressedWideBVH &cwbvh) {
+    return cwbvh.m_build_stats;
+}
+
+IntersectionInfo CompressedWideBVH::intersect(const CompressedWideBVH &cwbvh, const Ray &ray) {
+    return resolve(cwbvh, ray, closest_hit(cwbvh, ray));
+}
+
+HitRecord CompressedWideBVH::closest_hit(const CompressedWideBVH &cwbvh, const Ray &ray) {
+    const auto &geometry = BVH::geometry(cwbvh.m_bvh);
+    HitRecord hit;
+    WideBVH::traverse(cwbvh.m_nodes, ray, hit.m_t, [&](uint32_t first, uint32_t count) {
+        auto index = LeafKernel::intersect(ray, geometry, first, count, hit.m_t);
+        if (index != no_triangle)
+            hit.m_triangle = index;
+        return false;
+    });
+
+    return hit;
+}
+
+IntersectionInfo CompressedWideBVH::resolve(const CompressedWideBVH &cwbvh, const Ray &ray,
+                                            const HitRecord &hit) {
+    if (!HitRecord::has_hit(hit))
+        return IntersectionInfo{};
+
+    const auto &shading = BVH::shading(cwbvh.m_bvh)[hit.m_triangle];
+    return HitRecord::resolve(hit, ray, shading.m_normal, shading.m_material_id,
+                              shading.m_triangle_id);
+}
+
+MaterialId CompressedWideBVH::material_id(const CompressedWideBVH &cwbvh, const HitRecord &hit) {
+    return BVH::shading(cwbvh.m_bvh)[hit.m_triangle].m_material_id;
+}
+
+bool CompressedWideBVH::occluded(const CompressedWideBVH &cwbvh, const Ray &ray,
+                                 const float t_max) {
+    const auto &geometry = BVH::geometry(cwbvh.m_bvh);
+    bool hit = false;
+    float max_dist = t_max;
+    WideBVH::traverse(cwbvh.m_nodes, ray, max_dist, [&](uint32_t first, uint32_t count) {
+        hit = LeafKernel::occluded(ray, geometry, first, count, t_max);
+        return hit;
+    });
+
+    return hit;
+}
+
+void CompressedWideBVH::rebuild(CompressedWideBVH &cwbvh) {
+    if (!cwbvh.m_needs_rebuild)
+        return;
+
+    Timer timer;
+    if (!BVH::rebuild(cwbvh.m_bvh)) {
+        refit(BVH::nodes(cwbvh.m_bvh), cwbvh.m_sources, cwbvh.m_nodes);
+        cwbvh.m_needs_rebuild = false;
+        return;
+    }
+    std::vector<WideBVHNode> wide_nodes;
+    std::vector<WideBVHSources> wide_sources;
+    WideBVH::collapse(BVH::nodes(cwbvh.m_bvh), wide_nodes, wide_sources);
+    compress(wide_nodes, wide_sources, cwbvh.m_nodes, cwbvh.m_sources);
+
+    cwbvh.m_build_stats.m_build_time = timer.elapsed();
+    cwbvh.m_build_stats.m_node_count = cwbvh.m_nodes.size();
+    cwbvh.m_build_stats.m_node_memory = cwbvh.m_nodes.size() * sizeof(CompressedWideBVHNode) +
+                                        cwbvh.m_sources.size() * sizeof(WideBVHSources) +
+                                        BVH::build_stats(cwbvh.m_bvh).m_node_memory;
+    cwbvh.m_needs_rebuild = false;
+}
+
+// Picks the smallest power of two grid spacing per axis for which 255 steps cover the whole frame
+static void set_frame(CompressedWideBVHNode &node, const glm::vec3 &min, const glm::vec3 &max) {
+    node.m_origin = min;
+    for (int axis = 0; axis < 3; axis++) {
+        int exponent = -126;
+        float extent = max[axis] - min[axis];
+        if (extent > 0.f) {
+            std::frexp(extent / max_quantized, &exponent);
+            exponent = std::max(exponent, -126);
+            while (exponent < 127 &&
+                   min[axis] + max_quantized * std::ldexp(1.f, exponent) < max[axis])
+                exponent++;
+        }
+        node.m_exponent[axis] = exponent;
+    }
+}
+
+// Rounds bounds outwards onto the grid of a node. Decoding has to reproduce exactly the values
+// that are checked here which holds since q * scale is always exact for power of two scales.
+static void quantize_child(CompressedWideBVHNode &node, uint32_t i, const glm::vec3 &min,
+                           const glm::vec3 &max) {
+    std::array<std::array<uint8_t, wide_bvh_width> *, 3> qmin = {
+        {&node.m_qmin_x, &node.m_qmin_y, &node.m_qmin_z}};
+    std::array<std::array<uint8_t, wide_bvh_width> *, 3> qmax = {
+        {&node.m_qmax_x, &node.m_qmax_y, &node.m_qmax_z}};
+    for (int axis = 0; axis < 3; axis++) {
+        auto origin = node.m_origin[axis];
+        auto scale = exponent_to_scale(node.m_exponent[axis]);
+        auto lo = glm::clamp(std::floor((min[axis] - origin) / scale), 0.f, max_quantized);
+        while (lo > 0.f && origin + lo * scale > min[axis])
+            lo -= 1.f;
+
+        auto hi = glm::clamp(std::ceil((max[axis] - origin) / scale), 0.f, max_quantized);
+        while (hi < max_quantized && origin + hi * scale < max[axis])
+            hi += 1.f;
+
+        (*qmin[axis])[i] = static_cast<uint8_t>(lo);
+        (*qmax[axis])[i] = static_cast<uint8_t>(hi);
+    }
+}
+
+static uint32_t split_leaf(std::vector<CompressedWideBVHNode> &nodes,
+                           std::vector<WideBVHSources> &sources, uint32_t first, uint32_t count,
+                           const glm::vec3 &min, const glm::vec3 &max, uint32_t source);
+
+static void set_child(std::vector<CompressedWideBVHNode> &nodes,
+                      std::vector<WideBVHSources> &sources, uint32_t node_index, uint32_t i,
+                      const glm::vec3 &min, const glm::vec3 &max, uint32_t child, uint32_t count,
+                      uint32_t source) {
+    if (count > max_compressed_leaf_size) {
+        child = split_leaf(nodes, sources, child, count, min, max, source);
+        count = 0;
+    }
+
+    auto &node = nodes[node_index];
+    quantize_child(node, i, min, max);
+    node.m_child[i] = child;
+    node.m_count[i] = count;
+    sources[node_index][i] = source;
+}
+
+// Turns a leaf whose count doesn't fit into 8 bits into a node of smaller leaves with the same
+// bounds. This only happens for leaves the builder couldn't split any further. All parts come from
+// the same binary leaf.
+static uint32_t split_leaf(std::vector<CompressedWideBVHNode> &nodes,
+                           std::vector<WideBVHSources> &sources, uint32_t first, uint32_t count,
+                           const glm::vec3 &min, const glm::vec3 &max, uint32_t source) {
+    uint32_t node_index = nodes.size();
+    nodes.emplace_back();
+    sources.emplace_back();
+    set_frame(nodes[node_index], min, max);
+
+    auto part_size = (count + wide_bvh_width - 1) / wide_bvh_width;
+    uint32_t num_children = 0;
+    for (uint32_t begin = first; begin < first + count; begin += part_size) {
+        auto part_count = std::min(part_size, first + count - begin);
+        set_child(nodes, sources, node_index, num_children++, min, max, begin, part_count,
+                  source);
+    }
+    nodes[node_index].m_num_children = num_children;
+    return node_index;
+}
+
+void CompressedWideBVH::compress(const std::vector<WideBVHNode> &wide_nodes,
+                                 const std::vector<WideBVHSources> &wide_sources,
+                                 std::vector<CompressedWideBVHNode> &nodes,
+                                 std::vector<WideBVHSources> &sources) {
+    nodes.clear();
+    nodes.resize(wide_nodes.size());
+    sources = wide_sources;
+    for (uint32_t n = 0; n < wide_nodes.size(); n++) {
+        const auto &wide_node = wide_nodes[n];
+        const auto &bounds = wide_node.m_bounds;
+
+        glm::vec3 frame_min(std::numeric_limits<float>::max());
+        glm::vec3 frame_max(std::numeric_limits<float>::lowest());
+        for (uint32_t i = 0; i < wide_node.m_num_children; i++) {
+            glm::vec3 min{bounds.m_min_x[i], bounds.m_min_y[i], bounds.m_min_z[i]};
+            glm::vec3 max{bounds.m_max_x[i], bounds.m_max_y[i], bounds.m_max_z[i]};
+            frame_min = glm::min(frame_min, min);
+            frame_max = glm::max(frame_max, max);
+        }
+        set_frame(nodes[n], frame_min, frame_max);
+        nodes[n].m_num_children = wide_node.m_num_children;
+
+        for (uint32_t i = 0; i < wide_bvh_width; i++) {
+            if (i >= wide_node.m_num_children) {
+                quantize_child(nodes[n], i, frame_min, frame_min);
+                nodes[n].m_child[i] = 0;
+                nodes[n].m_count[i] = 0;
+                continue;
+            }
+
+            glm::vec3 min{bounds.m_min_x[i], bounds.m_min_y[i], bounds.m_min_z[i]};
+            glm::vec3 max{bounds.m_max_x[i], bounds.m_max_y[i], bounds.m_max_z[i]};
+            set_child(nodes, sources, n, i, min, max, wide_node.m_child[i], wide_node.m_count[i],
+                      wide_sources[n][i]);
+        }
+    }
+}
+
+void CompressedWideBVH::refit(const std::vector<BVHNode> &bvh_nodes,
+                              const std::vector<WideBVHSources> &sources,
+                              std::vector<CompressedWideBVHNode> &nodes) {
+    for (uint32_t n = 0; n < nodes.size(); n++) {
+        auto &node = nodes[n];
+        glm::vec3 frame_min(std::numeric_limits<float>::max());
+        glm::vec3 frame_max(std::numeric_limits<float>::lowest());
+        for (uint32_t i = 0; i < node.m_num_children; i++) {
+            frame_min = glm::min(frame_min, bvh_nodes[sources[n][i]].m_min);
+            frame_max = glm::max(frame_max, bvh_nodes[sources[n][i]].m_max);
+        }
+
+        // Children and their counts stay, only the frame and the quantized bounds change
+        set_frame(node, frame_min, frame_max);
+        for (uint32_t i = 0; i < wide_bvh_width; i++) {
+            if (i < node.m_num_children)
+                quantize_child(node, i, bvh_nodes[sources[n][i]].m_min,
+                               bvh_nodes[sources[n][i]].m_max);
+            else
+                quantize_child(node, i, frame_min, frame_min);
+        }
+    }
+}
+}
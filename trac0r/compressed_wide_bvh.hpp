@@ -0,0 +1,150 @@
+#ifndef COMPRESSED_WIDE_BVH_HPP
+#define COMPRESSED_WIDE_BVH_HPP
+
+#include "bvh.hpp"
+#include "wide_bvh.hpp"
+#include "triangle.hpp"
+#include "ray.hpp"
+#include "intersection_info.hpp"
+#include "hit_record.hpp"
+#include "shape.hpp"
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Wide node whose child bounds are quantized to 8 bits relative to a local frame. The frame
+ * starts at m_origin and uses a power of two grid spacing per axis so that decoding is exact.
+ * Quantized bounds are always rounded outwards so they never miss anything the original bounds
+ * would have hit.
+ */
+struct CompressedWideBVHNode {
+    glm::vec3 m_origin;
+    std::array<int8_t, 3> m_exponent;
+    uint8_t m_num_children = 0;
+
+    std::array<uint8_t, wide_bvh_width> m_qmin_x;
+    std::array<uint8_t, wide_bvh_width> m_qmin_y;
+    std::array<uint8_t, wide_bvh_width> m_qmin_z;
+    std::array<uint8_t, wide_bvh_width> m_qmax_x;
+    std::array<uint8_t, wide_bvh_width> m_qmax_y;
+    std::array<uint8_t, wide_bvh_width> m_qmax_z;
+
+    /**
+     * @brief Index of the child node for inner children or index of the first primitive for
+     * leaves.
+     */
+    std::array<uint32_t, wide_bvh_width> m_child;
+
+    /**
+     * @brief Number of primitives of leaf children. Inner children have a count of 0.
+     */
+    std::array<uint8_t, wide_bvh_width> m_count;
+};
+
+/**
+ * @brief Grid spacing for an exponent. Builds the float directly as that's a lot cheaper than
+ * std::ldexp() and exponents are always kept in the range of normal floats.
+ */
+inline float exponent_to_scale(const int8_t exponent) {
+    uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+inline WideBVHBounds decode_bounds(const CompressedWideBVHNode &node) {
+    auto scale_x = exponent_to_scale(node.m_exponent[0]);
+    auto scale_y = exponent_to_scale(node.m_exponent[1]);
+    auto scale_z = exponent_to_scale(node.m_exponent[2]);
+
+    WideBVHBounds bounds;
+    for (uint32_t i = 0; i < wide_bvh_width; i++) {
+        bounds.m_min_x[i] = node.m_origin.x + node.m_qmin_x[i] * scale_x;
+        bounds.m_min_y[i] = node.m_origin.y + node.m_qmin_y[i] * scale_y;
+        bounds.m_min_z[i] = node.m_origin.z + node.m_qmin_z[i] * scale_z;
+        bounds.m_max_x[i] = node.m_origin.x + node.m_qmax_x[i] * scale_x;
+        bounds.m_max_y[i] = node.m_origin.y + node.m_qmax_y[i] * scale_y;
+        bounds.m_max_z[i] = node.m_origin.z + node.m_qmax_z[i] * scale_z;
+    }
+    return bounds;
+}
+
+/**
+ * @brief Wide BVH with quantized nodes. Nodes take less than half the memory of WideBVH nodes at
+ * the cost of somewhat looser bounds and decoding them during traversal. When the binary BVH was
+ * only refitted the nodes keep their children and just quantize the new bounds.
+ *
+ * Traversal only reads the quantized nodes but the binary nodes stay in memory as well since
+ * refitting works on them, so build_stats() counts them too.
+ */
+class CompressedWideBVH {
+  public:
+    static void add_shape(CompressedWideBVH &cwbvh, Shape &shape);
+    static void mark_dirty(CompressedWideBVH &cwbvh, size_t shape_index);
+    static std::vector<Shape> &shapes(CompressedWideBVH &cwbvh);
+    static const std::vector<Shape> &shapes(const CompressedWideBVH &cwbvh);
+    static const std::vector<CompressedWideBVHNode> &nodes(const CompressedWideBVH &cwbvh);
+    static const BVHBuildStats &build_stats(const CompressedWideBVH &cwbvh);
+    static IntersectionInfo intersect(const CompressedWideBVH &cwbvh, const Ray &ray);
+
+    /**
+     * @brief Finds the closest hit without looking up any shading data.
+     */
+    static HitRecord closest_hit(const CompressedWideBVH &cwbvh, const Ray &ray);
+
+    /**
+     * @brief Shading data of a hit found by closest_hit() for the same ray.
+     */
+    static IntersectionInfo resolve(const CompressedWideBVH &cwbvh, const Ray &ray,
+                                    const HitRecord &hit);
+    static MaterialId material_id(const CompressedWideBVH &cwbvh, const HitRecord &hit);
+    static bool occluded(const CompressedWideBVH &cwbvh, const Ray &ray, const float t_max);
+    static void rebuild(CompressedWideBVH &cwbvh);
+
+    /**
+     * @brief See BVH::set_spatial_split_budget().
+     */
+    static void set_spatial_split_budget(CompressedWideBVH &cwbvh, float budget);
+
+    /**
+     * @brief See BVH::set_triangle_test().
+     */
+    static void set_triangle_test(CompressedWideBVH &cwbvh, TriangleTest test);
+
+    /**
+     * @brief Quantizes wide nodes. Node indices stay the same except for leaves that have too
+     * many primitives for an 8-bit count which get split into extra nodes at the end.
+     *
+     * @param wide_sources The binary nodes behind the wide nodes as found by WideBVH::collapse()
+     * @param sources Receives the binary node behind every child of every compressed node
+     */
+    static void compress(const std::vector<WideBVHNode> &wide_nodes,
+                         const std::vector<WideBVHSources> &wide_sources,
+                         std::vector<CompressedWideBVHNode> &nodes,
+                         std::vector<WideBVHSources> &sources);
+
+    /**
+     * @brief Quantizes the bounds of refitted binary nodes into the compressed nodes made from
+     * them. The binary hierarchy must not have been built again since compress().
+     */
+    static void refit(const std::vector<BVHNode> &bvh_nodes,
+                      const std::vector<WideBVHSources> &sources,
+                      std::vector<CompressedWideBVHNode> &nodes);
+
+  private:
+    BVH m_bvh;
+    std::vector<CompressedWideBVHNode> m_nodes;
+    std::vector<WideBVHSources> m_sources;
+    BVHBuildStats m_build_stats;
+    bool m_needs_rebuild = false;
+};
+}
+
+#endif /* end of include guard: COMPRESSED_WIDE_BVH_HPP */
@@ -0,0 +1,57 @@
+#include "film.hpp"
+
+namespace trac0r {
+
+Film::Film(uint32_t width, uint32_t height)
+    : m_width(width), m_height(height), m_channels(new std::atomic<float>[width * height * 3]) {
+    clear(*this);
+}
+
+uint32_t Film::width(const Film &film) {
+    return film.m_width;
+}
+
+uint32_t Film::height(const Film &film) {
+    return film.m_height;
+}
+
+void Film::clear(Film &film) {
+    const uint32_t channel_count = film.m_width * film.m_height * 3;
+    for (uint32_t i = 0; i < channel_count; i++)
+        film.m_channels[i].store(0.f, std::memory_order_relaxed);
+}
+
+// There's no atomic add for floats before C++20, so retry until no other thread got in between
+static void atomic_add(std::atomic<float> &channel, float value) {
+    float current = channel.load(std::memory_order_relaxed);
+    while (!channel.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        ;
+}
+
+void Film::splat(Film &film, uint32_t x, uint32_t y, const glm::vec3 &color) {
+    auto *channels = &film.m_channels[(y * film.m_width + x) * 3];
+    atomic_add(channels[0], color.r);
+    atomic_add(channels[1], color.g);
+    atomic_add(channels[2], color.b);
+}
+
+glm::vec3 Film::pixel(const Film &film, uint32_t x, uint32_t y) {
+    const auto *channels = &film.m_channels[(y * film.m_width + x) * 3];
+    return {channels[0].load(std::memory_order_relaxed),
+            channels[1].load(std::memory_order_relaxed),
+            channels[2].load(std::memory_order_relaxed)};
+}
+
+void Film::resolve(const Film &film, float scale, uint32_t samples_per_pixel, bool overwrite,
+                   std::vector<glm::vec4> &luminance) {
+    for (uint32_t y = 0; y < film.m_height; y++) {
+        for (uint32_t x = 0; x < film.m_width; x++) {
+            glm::vec4 color{pixel(film, x, y) * scale, static_cast<float>(samples_per_pixel)};
+            if (overwrite)
+                luminance[y * film.m_width + x] = color;
+            else
+                luminance[y * film.m_width + x] += color;
+        }
+    }
+}
+}
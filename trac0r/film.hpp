@@ -0,0 +1,61 @@
+#ifndef FILM_HPP
+#define FILM_HPP
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief An image that any number of threads can add light to at once, at any pixel. Techniques
+ * that connect light paths to the camera don't know which pixel they land on until they got
+ * there, so unlike with the tiles of camera paths no thread owns any part of the image.
+ *
+ * Every color channel is a float that splat() adds to atomically with compare and exchange. That
+ * never blocks, and splats of different threads rarely go to the same pixel at the same time.
+ */
+class Film {
+  public:
+    Film(uint32_t width, uint32_t height);
+    Film(const Film &) = delete;
+    Film &operator=(const Film &) = delete;
+
+    static uint32_t width(const Film &film);
+    static uint32_t height(const Film &film);
+
+    /**
+     * @brief Sets all pixels back to black. Must not run at the same time as splat().
+     */
+    static void clear(Film &film);
+
+    /**
+     * @brief Adds color to a pixel. Safe to call from many threads at once.
+     */
+    static void splat(Film &film, uint32_t x, uint32_t y, const glm::vec3 &color);
+    static glm::vec3 pixel(const Film &film, uint32_t x, uint32_t y);
+
+    /**
+     * @brief Writes all pixels times scale into an image of the same size, with samples_per_pixel
+     * as alpha like the camera paths of the renderer count their samples.
+     *
+     * @param overwrite Whether colors replace what's in luminance or are added to it.
+     */
+    static void resolve(const Film &film, float scale, uint32_t samples_per_pixel, bool overwrite,
+                        std::vector<glm::vec4> &luminance);
+
+  private:
+    uint32_t m_width;
+    uint32_t m_height;
+
+    /**
+     * @brief Red, green and blue of every pixel, row by row.
+     */
+    std::unique_ptr<std::atomic<float>[]> m_channels;
+};
+}
+
+#endif /* end of include guard: FILM_HPP */
@@ -1,6 +1,7 @@
 #ifndef FILTERING_HPP
 #define FILTERING_HPP
 
+#include <trac0r/task_pool.hpp>
 #include <trac0r/utils.hpp>
 
 #include <cstdint>
@@ -20,8 +21,12 @@ namespace trac0r {
 
 // inline void gaussian_filter(const std::vector<uint32_t> &input, std::vector<uint32_t> &output,
 
+/**
+ * @brief Runs on the given task pool or with OpenMP if it's nullptr.
+ */
 inline void box_filter(const std::vector<uint32_t> &input, const uint32_t width,
-                       const uint32_t height, std::vector<uint32_t> &output) {
+                       const uint32_t height, std::vector<uint32_t> &output,
+                       TaskPool *pool = nullptr) {
     // clang-format off
     std::vector<float> kernel = {1.f, 1.f, 1.f,
                                  1.f, 2.f, 1.f,
@@ -32,9 +37,8 @@ inline void box_filter(const std::vector<uint32_t> &input, const uint32_t width,
     int offset = kernel_width / 2;
     float weightsum = std::accumulate(kernel.cbegin(), kernel.cend(), 0.f);
 
-#pragma omp parallel for collapse(2) schedule(dynamic, 1024)
-    for (uint32_t x = 1; x < width - 1; x++) {
-        for (uint32_t y = 1; y < height - 1; y++) {
+    parallel_for(pool, 1, height - 1, 4, [&](uint32_t y) {
+        for (uint32_t x = 1; x < width - 1; x++) {
             glm::vec4 new_color;
             for (int i = 0; i < kernel_width; i++) {
                 for (int j = 0; j < kernel_width; j++) {
@@ -47,7 +51,7 @@ inline void box_filter(const std::vector<uint32_t> &input, const uint32_t width,
             new_color.a = 1.f;
             output[x + y * width] = pack_color_argb(new_color);
         }
-    }
+    });
 }
 }
 
@@ -4,8 +4,10 @@
 #include "triangle.hpp"
 #include "ray.hpp"
 #include "intersection_info.hpp"
+#include "hit_record.hpp"
 #include "shape.hpp"
 #include "camera.hpp"
+#include "triangle_geometry.hpp"
 
 #include <glm/glm.hpp>
 
@@ -14,16 +16,39 @@ namespace trac0r {
 class FlatStructure {
   public:
     static void add_shape(FlatStructure &flatstruct, Shape &shape);
+    static void mark_dirty(FlatStructure &flatstruct, size_t shape_index);
     static std::vector<Shape> &shapes(FlatStructure &flatstruct);
     static const std::vector<Shape> &shapes(const FlatStructure &flatstruct);
-    static std::vector<Triangle> &light_triangles(FlatStructure &flatstruct);
-    static const std::vector<Triangle> &light_triangles(const FlatStructure &flatstruct);
     static IntersectionInfo intersect(const FlatStructure &flatstruct, const Ray &ray);
+
+    /**
+     * @brief Finds the closest hit without looking up any shading data.
+     */
+    static HitRecord closest_hit(const FlatStructure &flatstruct, const Ray &ray);
+
+    /**
+     * @brief Shading data of a hit found by closest_hit() for the same ray.
+     */
+    static IntersectionInfo resolve(const FlatStructure &flatstruct, const Ray &ray,
+                                    const HitRecord &hit);
+    static MaterialId material_id(const FlatStructure &flatstruct, const HitRecord &hit);
+    static bool occluded(const FlatStructure &flatstruct, const Ray &ray, const float t_max);
+    static void set_triangle_test(FlatStructure &flatstruct, TriangleTest test);
     static void rebuild(FlatStructure &flatstruct);
 
   private:
-    std::vector<Triangle> m_light_triangles;
     std::vector<Shape> m_shapes;
+
+    /**
+     * @brief World space triangles of all shapes. Shape n owns the range starting at
+     * m_shape_offsets[n] up to m_shape_offsets[n + 1]. The scan only reads m_geometry which holds
+     * the same triangles in the same order.
+     */
+    std::vector<Triangle> m_triangles;
+    TriangleGeometry m_geometry;
+    std::vector<uint32_t> m_shape_offsets;
+    std::vector<uint32_t> m_dirty_shapes;
+    bool m_needs_rebuild = false;
 };
 }
 
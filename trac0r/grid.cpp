@@ -0,0 +1,308 @@
+#include "grid.hpp"
+#include "intersections.hpp"
+#include "timer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+namespace trac0r {
+
+// Number of triangles each thread handles at once while computing the bounds of the scene
+const uint32_t grid_chunk_size = 1 << 14;
+
+void Grid::add_shape(Grid &grid, Shape &shape) {
+    grid.m_shapes.push_back(shape);
+    grid.m_needs_rebuild = true;
+}
+
+void Grid::mark_dirty(Grid &grid, size_t shape_index) {
+    grid.m_dirty_shapes.push_back(shape_index);
+}
+
+std::vector<Shape> &Grid::shapes(Grid &grid) {
+    return grid.m_shapes;
+}
+
+const std::vector<Shape> &Grid::shapes(const Grid &grid) {
+    return grid.m_shapes;
+}
+
+glm::ivec3 Grid::resolution(const Grid &grid) {
+    return grid.m_resolution;
+}
+
+const BVHBuildStats &Grid::build_stats(const Grid &grid) {
+    return grid.m_build_stats;
+}
+
+static glm::ivec3 cell_of(const glm::vec3 &min, const glm::vec3 &inv_cell_size,
+                          const glm::ivec3 &resolution, const glm::vec3 &point) {
+    glm::ivec3 cell = glm::ivec3((point - min) * inv_cell_size);
+    return glm::clamp(cell, glm::ivec3(0), resolution - 1);
+}
+
+template <typename CellFunc>
+void Grid::traverse(const Grid &grid, const Ray &ray, float &closest_dist, CellFunc cell_func) {
+    if (grid.m_cell_starts.empty())
+        return;
+
+    float t_entry;
+    if (!intersect_ray_aabb(ray, grid.m_min, grid.m_max, closest_dist, t_entry))
+        return;
+
+    // Set up the DDA in the cell where the ray enters the grid. t_next holds the distance at which
+    // the ray crosses into the next cell along each axis.
+    const auto &res = grid.m_resolution;
+    auto cell =
+        cell_of(grid.m_min, grid.m_inv_cell_size, res, ray.m_origin + ray.m_dir * t_entry);
+    glm::ivec3 step;
+    glm::vec3 t_next;
+    glm::vec3 t_delta;
+    for (int axis = 0; axis < 3; axis++) {
+        auto cell_min = grid.m_min[axis] + cell[axis] * grid.m_cell_size[axis];
+        if (ray.m_dir[axis] > 0.f) {
+            step[axis] = 1;
+            t_next[axis] =
+                (cell_min + grid.m_cell_size[axis] - ray.m_origin[axis]) * ray.m_invdir[axis];
+            t_delta[axis] = grid.m_cell_size[axis] * ray.m_invdir[axis];
+        } else if (ray.m_dir[axis] < 0.f) {
+            step[axis] = -1;
+            t_next[axis] = (cell_min - ray.m_origin[axis]) * ray.m_invdir[axis];
+            t_delta[axis] = -grid.m_cell_size[axis] * ray.m_invdir[axis];
+        } else {
+            step[axis] = 0;
+            t_next[axis] = std::numeric_limits<float>::max();
+            t_delta[axis] = std::numeric_limits<float>::max();
+        }
+    }
+
+    while (true) {
+        auto index = cell.x + res.x * (cell.y + static_cast<size_t>(res.y) * cell.z);
+        auto first = grid.m_cell_starts[index];
+        auto count = grid.m_cell_starts[index + 1] - first;
+        if (count > 0 && cell_func(first, count))
+            return;
+
+        // A triangle can span several cells so a hit only ends the walk once it lies before the
+        // point where the ray leaves the current cell
+        int axis = t_next.x < t_next.y ? (t_next.x < t_next.z ? 0 : 2)
+                                       : (t_next.y < t_next.z ? 1 : 2);
+        if (closest_dist <= t_next[axis])
+            return;
+
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= res[axis])
+            return;
+        t_next[axis] += t_delta[axis];
+    }
+}
+
+// Rays only pay for the watertight setup if the grid's records are prepared for that test
+static WatertightRay watertight_setup(const TriangleGeometry &geometry, const Ray &ray) {
+    if (geometry.m_test == TriangleTest::Watertight)
+        return WatertightRay(ray);
+    return WatertightRay();
+}
+
+IntersectionInfo Grid::intersect(const Grid &grid, const Ray &ray) {
+    return resolve(grid, ray, closest_hit(grid, ray));
+}
+
+HitRecord Grid::closest_hit(const Grid &grid, const Ray &ray) {
+    HitRecord hit;
+    auto watertight_ray = watertight_setup(grid.m_geometry, ray);
+    traverse(grid, ray, hit.m_t, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            float dist_to_intersect;
+            auto index = grid.m_cell_triangles[i];
+            if (intersect_ray_triangle(ray, watertight_ray, grid.m_geometry, index,
+                                       dist_to_intersect) &&
+                dist_to_intersect < hit.m_t) {
+                hit.m_t = dist_to_intersect;
+                hit.m_triangle = index;
+            }
+        }
+        return false;
+    });
+
+    return hit;
+}
+
+IntersectionInfo Grid::resolve(const Grid &grid, const Ray &ray, const HitRecord &hit) {
+    if (!HitRecord::has_hit(hit))
+        return IntersectionInfo{};
+
+    const auto &triangle = grid.m_triangles[hit.m_triangle];
+    return HitRecord::resolve(hit, ray, triangle.m_normal, triangle.m_material_id,
+                              hit.m_triangle);
+}
+
+MaterialId Grid::material_id(const Grid &grid, const HitRecord &hit) {
+    return grid.m_triangles[hit.m_triangle].m_material_id;
+}
+
+bool Grid::occluded(const Grid &grid, const Ray &ray, const float t_max) {
+    bool hit = false;
+    float max_dist = t_max;
+    auto watertight_ray = watertight_setup(grid.m_geometry, ray);
+    traverse(grid, ray, max_dist, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            float dist_to_intersect;
+            if (intersect_ray_triangle(ray, watertight_ray, grid.m_geometry,
+                                       grid.m_cell_triangles[i], dist_to_intersect) &&
+                dist_to_intersect < t_max) {
+                hit = true;
+                return true;
+            }
+        }
+        return false;
+    });
+
+    return hit;
+}
+
+void Grid::set_triangle_test(Grid &grid, TriangleTest test) {
+    TriangleGeometry::set_test(grid.m_geometry, test);
+    TriangleGeometry::assign(grid.m_geometry, grid.m_triangles);
+}
+
+void Grid::rebuild(Grid &grid) {
+    if (!grid.m_needs_rebuild && grid.m_dirty_shapes.empty())
+        return;
+
+    Timer timer;
+    if (grid.m_needs_rebuild) {
+        grid.m_triangles.clear();
+        grid.m_shape_offsets.clear();
+        for (auto &shape : Grid::shapes(grid)) {
+            grid.m_shape_offsets.push_back(grid.m_triangles.size());
+            for (auto &tri : Shape::world_triangles(shape))
+                grid.m_triangles.push_back(tri);
+        }
+        grid.m_shape_offsets.push_back(grid.m_triangles.size());
+        TriangleGeometry::assign(grid.m_geometry, grid.m_triangles);
+    } else {
+        // Only shapes that changed get transformed again but the cells are always built anew
+        auto &dirty_shapes = grid.m_dirty_shapes;
+        std::sort(dirty_shapes.begin(), dirty_shapes.end());
+        dirty_shapes.erase(std::unique(dirty_shapes.begin(), dirty_shapes.end()),
+                           dirty_shapes.end());
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for (uint32_t i = 0; i < dirty_shapes.size(); i++) {
+            auto shape_index = dirty_shapes[i];
+            auto world_triangles = Shape::world_triangles(grid.m_shapes[shape_index]);
+            auto offset = grid.m_shape_offsets[shape_index];
+            std::copy(world_triangles.begin(), world_triangles.end(),
+                      grid.m_triangles.begin() + offset);
+            for (size_t j = 0; j < world_triangles.size(); j++)
+                TriangleGeometry::set(grid.m_geometry, offset + j, world_triangles[j]);
+        }
+    }
+
+    build_cells(grid);
+
+    grid.m_build_stats.m_build_time = timer.elapsed();
+    grid.m_build_stats.m_node_count =
+        grid.m_cell_starts.empty() ? 0 : grid.m_cell_starts.size() - 1;
+    grid.m_build_stats.m_node_memory = grid.m_cell_starts.size() * sizeof(uint32_t) +
+                                       grid.m_cell_triangles.size() * sizeof(uint32_t);
+
+    grid.m_dirty_shapes.clear();
+    grid.m_needs_rebuild = false;
+}
+
+// Cells are filled with a counting sort: count the references per cell, turn the counts into
+// offsets and then scatter the references. Both passes over the triangles run on all threads.
+void Grid::build_cells(Grid &grid) {
+    const auto &triangles = grid.m_triangles;
+    uint32_t num_triangles = triangles.size();
+    grid.m_cell_starts.clear();
+    grid.m_cell_triangles.clear();
+    grid.m_resolution = {0, 0, 0};
+    if (num_triangles == 0)
+        return;
+
+    auto num_chunks = (num_triangles + grid_chunk_size - 1) / grid_chunk_size;
+    std::vector<glm::vec3> chunk_min(num_chunks, glm::vec3(std::numeric_limits<float>::max()));
+    std::vector<glm::vec3> chunk_max(num_chunks, glm::vec3(std::numeric_limits<float>::lowest()));
+#pragma omp parallel for schedule(dynamic, 1)
+    for (uint32_t chunk = 0; chunk < num_chunks; chunk++) {
+        auto end = std::min((chunk + 1) * grid_chunk_size, num_triangles);
+        for (uint32_t i = chunk * grid_chunk_size; i < end; i++) {
+            const auto &tri = triangles[i];
+            chunk_min[chunk] = glm::min(chunk_min[chunk], glm::min(tri.m_v1, tri.m_v2));
+            chunk_min[chunk] = glm::min(chunk_min[chunk], tri.m_v3);
+            chunk_max[chunk] = glm::max(chunk_max[chunk], glm::max(tri.m_v1, tri.m_v2));
+            chunk_max[chunk] = glm::max(chunk_max[chunk], tri.m_v3);
+        }
+    }
+
+    glm::vec3 min = chunk_min[0];
+    glm::vec3 max = chunk_max[0];
+    for (uint32_t chunk = 1; chunk < num_chunks; chunk++) {
+        min = glm::min(min, chunk_min[chunk]);
+        max = glm::max(max, chunk_max[chunk]);
+    }
+
+    // Pad the bounds a little so that flat scenes still get a grid with some volume and triangles
+    // lying exactly on the boundary are inside
+    auto extent = max - min;
+    auto padding = 1e-4f * (1.f + glm::max(extent.x, glm::max(extent.y, extent.z)));
+    min -= padding;
+    max += padding;
+    extent = max - min;
+
+    // Pick the resolution so that there are about grid_density cells per triangle
+    auto volume = extent.x * extent.y * extent.z;
+    auto cells_per_unit = std::cbrt(grid_density * num_triangles / volume);
+    glm::ivec3 res;
+    for (int axis = 0; axis < 3; axis++)
+        res[axis] = glm::clamp(static_cast<int>(extent[axis] * cells_per_unit), 1,
+                               grid_max_resolution);
+
+    grid.m_min = min;
+    grid.m_max = max;
+    grid.m_resolution = res;
+    grid.m_cell_size = extent / glm::vec3(res);
+    grid.m_inv_cell_size = 1.f / grid.m_cell_size;
+
+    // Calls func(cell_index) for every cell the bounding box of a triangle overlaps
+    auto for_each_cell = [&](const Triangle &tri, auto func) {
+        auto lo = cell_of(min, grid.m_inv_cell_size, res,
+                          glm::min(tri.m_v1, glm::min(tri.m_v2, tri.m_v3)));
+        auto hi = cell_of(min, grid.m_inv_cell_size, res,
+                          glm::max(tri.m_v1, glm::max(tri.m_v2, tri.m_v3)));
+        for (int z = lo.z; z <= hi.z; z++)
+            for (int y = lo.y; y <= hi.y; y++)
+                for (int x = lo.x; x <= hi.x; x++)
+                    func(x + res.x * (y + static_cast<size_t>(res.y) * z));
+    };
+
+    size_t num_cells = static_cast<size_t>(res.x) * res.y * res.z;
+    std::vector<std::atomic<uint32_t>> cursors(num_cells);
+#pragma omp parallel for
+    for (uint32_t i = 0; i < num_triangles; i++)
+        for_each_cell(triangles[i], [&](size_t cell) {
+            cursors[cell].fetch_add(1, std::memory_order_relaxed);
+        });
+
+    grid.m_cell_starts.resize(num_cells + 1);
+    grid.m_cell_starts[0] = 0;
+    for (size_t cell = 0; cell < num_cells; cell++) {
+        grid.m_cell_starts[cell + 1] = grid.m_cell_starts[cell] + cursors[cell].load();
+        cursors[cell].store(grid.m_cell_starts[cell]);
+    }
+
+    // References within a cell end up in arbitrary order which doesn't matter since intersect()
+    // looks for the closest hit among all of them anyway
+    grid.m_cell_triangles.resize(grid.m_cell_starts[num_cells]);
+#pragma omp parallel for
+    for (uint32_t i = 0; i < num_triangles; i++)
+        for_each_cell(triangles[i], [&](size_t cell) {
+            grid.m_cell_triangles[cursors[cell].fetch_add(1, std::memory_order_relaxed)] = i;
+        });
+}
+}
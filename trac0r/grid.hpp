@@ -0,0 +1,111 @@
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include "bvh.hpp"
+#include "triangle.hpp"
+#include "ray.hpp"
+#include "intersection_info.hpp"
+#include "hit_record.hpp"
+#include "shape.hpp"
+#include "triangle_geometry.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Average number of cells per triangle. The resolution along each axis is chosen so that
+ * the grid has about this many cells in total while keeping them roughly cubic.
+ */
+const float grid_density = 3.f;
+
+/**
+ * @brief Upper limit for the resolution along a single axis.
+ */
+const int grid_max_resolution = 256;
+
+/**
+ * @brief Uniform grid over all world space triangles. It is built from scratch on every rebuild in
+ * O(n) by all threads, which makes it the structure of choice for scenes where most shapes move
+ * every frame and a refit would have to touch the whole hierarchy anyway. Rays walk the cells
+ * front to back using a 3D-DDA.
+ */
+class Grid {
+  public:
+    static void add_shape(Grid &grid, Shape &shape);
+    static void mark_dirty(Grid &grid, size_t shape_index);
+    static std::vector<Shape> &shapes(Grid &grid);
+    static const std::vector<Shape> &shapes(const Grid &grid);
+    static glm::ivec3 resolution(const Grid &grid);
+
+    /**
+     * @brief Node count is the number of cells and node memory covers the cells as well as the
+     * triangle references they hold.
+     */
+    static const BVHBuildStats &build_stats(const Grid &grid);
+    static IntersectionInfo intersect(const Grid &grid, const Ray &ray);
+
+    /**
+     * @brief Finds the closest hit without looking up any shading data.
+     */
+    static HitRecord closest_hit(const Grid &grid, const Ray &ray);
+
+    /**
+     * @brief Shading data of a hit found by closest_hit() for the same ray.
+     */
+    static IntersectionInfo resolve(const Grid &grid, const Ray &ray, const HitRecord &hit);
+    static MaterialId material_id(const Grid &grid, const HitRecord &hit);
+    static bool occluded(const Grid &grid, const Ray &ray, const float t_max);
+    static void set_triangle_test(Grid &grid, TriangleTest test);
+    static void rebuild(Grid &grid);
+
+  private:
+    static void build_cells(Grid &grid);
+
+    /**
+     * @brief Walks the cells a ray passes through front to back and calls cell_func for each of
+     * them.
+     *
+     * @param closest_dist Distance of the closest hit so far. The walk ends at the first cell
+     * that the ray leaves behind this distance.
+     * @param cell_func Called as cell_func(uint32_t first, uint32_t count) with the range of
+     * m_cell_triangles referenced by the cell. Returning true stops the walk right away.
+     */
+    template <typename CellFunc>
+    static void traverse(const Grid &grid, const Ray &ray, float &closest_dist,
+                         CellFunc cell_func);
+
+    std::vector<Shape> m_shapes;
+
+    /**
+     * @brief World space triangles of all shapes. Shape n owns the range starting at
+     * m_shape_offsets[n] up to m_shape_offsets[n + 1]. Cells are walked over m_geometry which holds
+     * the same triangles in the same order.
+     */
+    std::vector<Triangle> m_triangles;
+    TriangleGeometry m_geometry;
+    std::vector<uint32_t> m_shape_offsets;
+
+    glm::vec3 m_min;
+    glm::vec3 m_max;
+    glm::vec3 m_cell_size;
+    glm::vec3 m_inv_cell_size;
+    glm::ivec3 m_resolution = {0, 0, 0};
+
+    /**
+     * @brief Cell n references the triangles m_cell_triangles[m_cell_starts[n]] up to
+     * m_cell_triangles[m_cell_starts[n + 1]]. Cells are stored x first, then y, then z.
+     */
+    std::vector<uint32_t> m_cell_starts;
+    std::vector<uint32_t> m_cell_triangles;
+    std::vector<uint32_t> m_dirty_shapes;
+
+    BVHBuildStats m_build_stats;
+    bool m_needs_rebuild = false;
+};
+}
+
+#endif /* end of include guard: GRID_HPP */
@@ -0,0 +1,64 @@
+#ifndef HIT_RECORD_HPP
+#define HIT_RECORD_HPP
+
+#include "intersection_info.hpp"
+#include "material.hpp"
+#include "ray.hpp"
+#include "triangle_geometry.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <limits>
+
+namespace trac0r {
+
+/**
+ * @brief All that traversal keeps of the closest hit: which triangle it is and how far along the
+ * ray. Position, normal and material are only looked up by the resolve() function of the structure
+ * that found the hit, once the final hit is known. At 12 bytes it's also cheap to keep hits of
+ * whole batches of rays around until they're shaded.
+ */
+struct HitRecord {
+    /**
+     * @brief Index into the triangles of the structure that found the hit or no_triangle if the
+     * ray missed everything.
+     */
+    uint32_t m_triangle = no_triangle;
+
+    /**
+     * @brief Index of the instance the triangle belongs to. Only used by structures made of
+     * instances.
+     */
+    uint32_t m_instance = 0;
+
+    /**
+     * @brief Distance of the hit along the ray.
+     */
+    float m_t = std::numeric_limits<float>::max();
+
+    static bool has_hit(const HitRecord &hit) {
+        return hit.m_triangle != no_triangle;
+    }
+
+    /**
+     * @brief Builds the shading data of a hit on a surface with the given world space normal and
+     * material id. The material itself is left for the Scene to look up. triangle_id is the
+     * scene-wide index of the hit triangle, see IntersectionInfo::m_triangle_id.
+     */
+    static IntersectionInfo resolve(const HitRecord &hit, const Ray &ray, const glm::vec3 &normal,
+                                    const MaterialId material_id, const uint32_t triangle_id) {
+        IntersectionInfo intersect_info;
+        intersect_info.m_has_intersected = true;
+        intersect_info.m_pos = ray.m_origin + ray.m_dir * hit.m_t;
+        intersect_info.m_incoming_ray = ray;
+        intersect_info.m_angle_between = glm::dot(normal, ray.m_dir);
+        intersect_info.m_normal = normal;
+        intersect_info.m_material_id = material_id;
+        intersect_info.m_triangle_id = triangle_id;
+        return intersect_info;
+    }
+};
+}
+
+#endif /* end of include guard: HIT_RECORD_HPP */
@@ -35,7 +35,20 @@ struct IntersectionInfo {
     Ray m_incoming_ray = Ray(glm::vec3(0), glm::vec3(0));
 
     /**
-     * @brief Material at the point of intersection.
+     * @brief Id of the material at the point of intersection.
+     */
+    MaterialId m_material_id = 0;
+
+    /**
+     * @brief Index of the hit triangle among the triangles of all shapes of the scene, counted
+     * shape by shape in the order they were added. It stays the same whichever structure found
+     * the hit.
+     */
+    uint32_t m_triangle_id = 0;
+
+    /**
+     * @brief Copy of the material looked up in the scene's material table. Acceleration structures
+     * don't know the table and only fill in m_material_id, the Scene fills in the rest.
      */
     Material m_material;
 };
@@ -4,10 +4,12 @@
 #include "aabb.hpp"
 #include "ray.hpp"
 #include "triangle.hpp"
+#include "triangle_geometry.hpp"
 
 #include <glm/glm.hpp>
 
 #include <memory>
+#include <utility>
 
 namespace trac0r {
 // From
@@ -102,13 +104,28 @@ inline bool intersect_ray_aabb(const Ray &ray, const AABB &aabb) {
     return true;
 }
 
+// Branchless slab test against raw bounds for use in hierarchy traversal. Boxes that are entered
+// behind the ray origin or beyond t_max are rejected so that traversal can cull everything that
+// lies farther away than the closest hit found so far.
+inline bool intersect_ray_aabb(const Ray &ray, const glm::vec3 &min, const glm::vec3 &max,
+                               const float t_max, float &t_entry) {
+    glm::vec3 t1 = (min - ray.m_origin) * ray.m_invdir;
+    glm::vec3 t2 = (max - ray.m_origin) * ray.m_invdir;
+    glm::vec3 t_near = glm::min(t1, t2);
+    glm::vec3 t_far = glm::max(t1, t2);
+
+    float entry = glm::max(glm::max(t_near.x, t_near.y), glm::max(t_near.z, 0.f));
+    float exit = glm::min(glm::min(t_far.x, t_far.y), glm::min(t_far.z, t_max));
+
+    t_entry = entry;
+    return entry <= exit;
+}
+
 // Möller-Trumbore intersection algorithm
 // (see https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm)
-inline bool intersect_ray_triangle(const Ray &ray, const Triangle &triangle, float &dist) {
-    // Calculate edges of triangle from v0.
-    auto e0 = triangle.m_v2 - triangle.m_v1;
-    auto e1 = triangle.m_v3 - triangle.m_v1;
-
+// The triangle is given by its first vertex and the edges from there to the other two.
+inline bool intersect_ray_triangle(const Ray &ray, const glm::vec3 &v1, const glm::vec3 &e0,
+                                   const glm::vec3 &e1, float &dist) {
     // Calculate determinant to check whether the ray is in the newly calculated plane made up from
     // e0 and e1.
     auto pvec = glm::cross(ray.m_dir, e1);
@@ -124,7 +141,7 @@ inline bool intersect_ray_triangle(const Ray &ray, const Triangle &triangle, flo
     auto inv_det = 1.f / det;
 
     // Calculate distance from v1 to ray origin
-    auto tvec = ray.m_origin - triangle.m_v1;
+    auto tvec = ray.m_origin - v1;
 
     // Calculate u parameter and test bound
     auto u = glm::dot(tvec, pvec) * inv_det;
@@ -153,6 +170,132 @@ inline bool intersect_ray_triangle(const Ray &ray, const Triangle &triangle, flo
     // If we end up here, there was no hit
     return false;
 }
+
+inline bool intersect_ray_triangle(const Ray &ray, const Triangle &triangle, float &dist) {
+    return intersect_ray_triangle(ray, triangle.m_v1, triangle.m_v2 - triangle.m_v1,
+                                  triangle.m_v3 - triangle.m_v1, dist);
+}
+
+/**
+ * @brief Axis permutation and shear that transform a ray into unit z direction for the watertight
+ * triangle test. Only code running that test sets one up so other rays don't pay for it.
+ */
+struct WatertightRay {
+    WatertightRay() {
+    }
+
+    explicit WatertightRay(const Ray &ray) : m_origin(ray.m_origin) {
+        // Swapping x and y keeps the winding of triangles intact when the dominant axis of the
+        // direction points backwards
+        const auto &direction = ray.m_dir;
+        auto abs_dir = glm::abs(direction);
+        m_kz = abs_dir.x > abs_dir.y ? (abs_dir.x > abs_dir.z ? 0 : 2)
+                                     : (abs_dir.y > abs_dir.z ? 1 : 2);
+        m_kx = (m_kz + 1) % 3;
+        m_ky = (m_kx + 1) % 3;
+        if (direction[m_kz] < 0.f)
+            std::swap(m_kx, m_ky);
+
+        m_shear = {direction[m_kx] / direction[m_kz], direction[m_ky] / direction[m_kz],
+                   1.f / direction[m_kz]};
+    }
+
+    glm::vec3 m_origin;
+    int m_kx = 0;
+    int m_ky = 1;
+    int m_kz = 2;
+    glm::vec3 m_shear;
+};
+
+// Watertight ray-triangle intersection by Woop, Benthin and Wald
+// (see http://jcgt.org/published/0002/01/05/)
+// Vertices are transformed into a space where the ray starts at the origin and points along +z
+// so that the test boils down to 2D edge functions. Edges shared by two triangles get exactly the
+// same edge function values with opposite signs in both of them so no ray can slip through.
+inline bool intersect_ray_triangle_watertight(const WatertightRay &ray, const glm::vec3 &v1,
+                                              const glm::vec3 &v2, const glm::vec3 &v3,
+                                              float &dist) {
+    const auto kx = ray.m_kx;
+    const auto ky = ray.m_ky;
+    const auto kz = ray.m_kz;
+    const auto &shear = ray.m_shear;
+
+    auto a = v1 - ray.m_origin;
+    auto b = v2 - ray.m_origin;
+    auto c = v3 - ray.m_origin;
+
+    float ax = a[kx] - shear.x * a[kz];
+    float ay = a[ky] - shear.y * a[kz];
+    float bx = b[kx] - shear.x * b[kz];
+    float by = b[ky] - shear.y * b[kz];
+    float cx = c[kx] - shear.x * c[kz];
+    float cy = c[ky] - shear.y * c[kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+
+    // Rays hitting an edge exactly need more precision to decide which side they're on
+    if (u == 0.f || v == 0.f || w == 0.f) {
+        u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+        v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+        w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+    }
+
+    // Hits need all edge functions to have the same sign. Both signs are allowed since we don't do
+    // backface culling.
+    if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+        return false;
+
+    float det = u + v + w;
+    if (det == 0.f)
+        return false;
+
+    float t = (u * shear.z * a[kz] + v * shear.z * b[kz] + w * shear.z * c[kz]) / det;
+    if (t <= 0.f)
+        return false;
+
+    dist = t;
+    return true;
+}
+
+// Reads the triangle from a geometry stream so that none of its shading data gets loaded. The
+// records were prepared for the test that the stream was set up for. watertight_ray only has to be
+// set up from ray if that is the watertight test.
+inline bool intersect_ray_triangle(const Ray &ray, const WatertightRay &watertight_ray,
+                                   const TriangleGeometry &geometry, const uint32_t index,
+                                   float &dist) {
+    auto a = TriangleGeometry::a(geometry, index);
+    auto b = TriangleGeometry::b(geometry, index);
+    auto c = TriangleGeometry::c(geometry, index);
+    if (geometry.m_test == TriangleTest::Watertight)
+        return intersect_ray_triangle_watertight(watertight_ray, a, b, c, dist);
+    return intersect_ray_triangle(ray, a, b, c, dist);
+}
+
+// Moves a point that was found on a surface away from it along the normal by a few ulps so that a
+// ray leaving from there doesn't hit the same surface again. The offset scales with the magnitude
+// of the coordinates which a fixed epsilon can't do. The normal gets flipped towards dir.
+// From "A Fast and Robust Method for Avoiding Self-Intersection" by Wächter and Binder in Ray
+// Tracing Gems (2019)
+inline glm::vec3 offset_ray_origin(const glm::vec3 &pos, glm::vec3 normal, const glm::vec3 &dir) {
+    const float origin = 1.f / 32.f;
+    const float float_scale = 1.f / 65536.f;
+    const float int_scale = 256.f;
+
+    if (glm::dot(normal, dir) < 0.f)
+        normal = -normal;
+
+    glm::vec3 result;
+    for (int axis = 0; axis < 3; axis++) {
+        auto offset = static_cast<int>(int_scale * normal[axis]);
+        auto bits = glm::floatBitsToInt(pos[axis]);
+        auto moved = glm::intBitsToFloat(bits + (pos[axis] < 0.f ? -offset : offset));
+        result[axis] =
+            glm::abs(pos[axis]) < origin ? pos[axis] + float_scale * normal[axis] : moved;
+    }
+    return result;
+}
 }
 
 #endif /* end of include guard: INTERSECTIONS_HPP */
@@ -0,0 +1,388 @@
+#include "leaf_kernel.hpp"
+#include "intersections.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRAC0R_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace trac0r {
+
+namespace {
+
+SIMDLevel detect_level() {
+#ifdef TRAC0R_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMDLevel::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMDLevel::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMDLevel::SSE;
+#endif
+    return SIMDLevel::Scalar;
+}
+
+SIMDLevel &current_level() {
+    static SIMDLevel level = LeafKernel::supported_level();
+    return level;
+}
+
+uint32_t intersect_scalar(const Ray &ray, const TriangleGeometry &geometry, uint32_t first,
+                          uint32_t count, float &closest_dist) {
+    uint32_t closest_index = no_triangle;
+    for (uint32_t i = first; i < first + count; i++) {
+        float dist_to_intersect;
+        if (intersect_ray_triangle(ray, TriangleGeometry::a(geometry, i),
+                                   TriangleGeometry::b(geometry, i),
+                                   TriangleGeometry::c(geometry, i), dist_to_intersect) &&
+            dist_to_intersect < closest_dist) {
+            closest_dist = dist_to_intersect;
+            closest_index = i;
+        }
+    }
+    return closest_index;
+}
+
+// The shear is set up once per run rather than for every ray since most rays never see this test
+uint32_t intersect_watertight(const Ray &ray, const TriangleGeometry &geometry, uint32_t first,
+                              uint32_t count, float &closest_dist) {
+    WatertightRay watertight_ray(ray);
+    uint32_t closest_index = no_triangle;
+    for (uint32_t i = first; i < first + count; i++) {
+        float dist_to_intersect;
+        if (intersect_ray_triangle_watertight(watertight_ray, TriangleGeometry::a(geometry, i),
+                                              TriangleGeometry::b(geometry, i),
+                                              TriangleGeometry::c(geometry, i),
+                                              dist_to_intersect) &&
+            dist_to_intersect < closest_dist) {
+            closest_dist = dist_to_intersect;
+            closest_index = i;
+        }
+    }
+    return closest_index;
+}
+
+#ifdef TRAC0R_X86_KERNELS
+// All kernels below are a lane-wise copy of the scalar Möller-Trumbore test in intersections.hpp
+// including its epsilon handling so that every level finds exactly the same hits. Lanes that miss
+// get an infinite distance and the closest remaining lane wins. Ties go to the lowest index just
+// like in the scalar loop.
+
+__attribute__((target("sse2"))) uint32_t intersect_sse(const Ray &ray,
+                                                        const TriangleGeometry &geometry,
+                                                        uint32_t first, uint32_t count,
+                                                        float &closest_dist) {
+    const auto epsilon = std::numeric_limits<float>::epsilon();
+    const __m128 eps = _mm_set1_ps(epsilon);
+    const __m128 neg_eps = _mm_set1_ps(-epsilon);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 ox = _mm_set1_ps(ray.m_origin.x);
+    const __m128 oy = _mm_set1_ps(ray.m_origin.y);
+    const __m128 oz = _mm_set1_ps(ray.m_origin.z);
+    const __m128 dx = _mm_set1_ps(ray.m_dir.x);
+    const __m128 dy = _mm_set1_ps(ray.m_dir.y);
+    const __m128 dz = _mm_set1_ps(ray.m_dir.z);
+
+    uint32_t closest_index = no_triangle;
+    const uint32_t end = first + count;
+    uint32_t base = first;
+    for (; base + 4 <= end; base += 4) {
+        __m128 v1x = _mm_loadu_ps(&geometry.m_a_x[base]);
+        __m128 v1y = _mm_loadu_ps(&geometry.m_a_y[base]);
+        __m128 v1z = _mm_loadu_ps(&geometry.m_a_z[base]);
+        __m128 e0x = _mm_loadu_ps(&geometry.m_b_x[base]);
+        __m128 e0y = _mm_loadu_ps(&geometry.m_b_y[base]);
+        __m128 e0z = _mm_loadu_ps(&geometry.m_b_z[base]);
+        __m128 e1x = _mm_loadu_ps(&geometry.m_c_x[base]);
+        __m128 e1y = _mm_loadu_ps(&geometry.m_c_y[base]);
+        __m128 e1z = _mm_loadu_ps(&geometry.m_c_z[base]);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(e1y, dz));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(e1z, dx));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(e1x, dy));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, px), _mm_mul_ps(e0y, py)),
+                                _mm_mul_ps(e0z, pz));
+        __m128 inv_det = _mm_div_ps(one, det);
+
+        __m128 tx = _mm_sub_ps(ox, v1x);
+        __m128 ty = _mm_sub_ps(oy, v1y);
+        __m128 tz = _mm_sub_ps(oz, v1z);
+        __m128 u = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)),
+            inv_det);
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e0z), _mm_mul_ps(e0y, tz));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e0x), _mm_mul_ps(e0z, tx));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e0y), _mm_mul_ps(e0x, ty));
+        __m128 v = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)),
+            inv_det);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qx), _mm_mul_ps(e1y, qy)),
+                                         _mm_mul_ps(e1z, qz)),
+                              inv_det);
+        __m128 dist = _mm_sub_ps(t, eps);
+
+        __m128 mask = _mm_or_ps(_mm_cmple_ps(det, neg_eps), _mm_cmpge_ps(det, eps));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(u, one));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, eps));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(dist, _mm_set1_ps(closest_dist)));
+        if (_mm_movemask_ps(mask) == 0)
+            continue;
+
+        dist = _mm_or_ps(_mm_and_ps(mask, dist), _mm_andnot_ps(mask, inf));
+        __m128 min = _mm_min_ps(dist, _mm_shuffle_ps(dist, dist, _MM_SHUFFLE(1, 0, 3, 2)));
+        min = _mm_min_ps(min, _mm_shuffle_ps(min, min, _MM_SHUFFLE(2, 3, 0, 1)));
+        int lanes = _mm_movemask_ps(_mm_and_ps(mask, _mm_cmpeq_ps(dist, min)));
+        closest_dist = _mm_cvtss_f32(min);
+        closest_index = base + __builtin_ctz(lanes);
+    }
+
+    // SSE can't load partial vectors safely so the last few triangles are tested one by one
+    auto tail_index = intersect_scalar(ray, geometry, base, end - base, closest_dist);
+    return tail_index != no_triangle ? tail_index : closest_index;
+}
+
+__attribute__((target("avx2"))) uint32_t intersect_avx2(const Ray &ray,
+                                                        const TriangleGeometry &geometry,
+                                                        uint32_t first, uint32_t count,
+                                                        float &closest_dist) {
+    const auto epsilon = std::numeric_limits<float>::epsilon();
+    const __m256 eps = _mm256_set1_ps(epsilon);
+    const __m256 neg_eps = _mm256_set1_ps(-epsilon);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256 ox = _mm256_set1_ps(ray.m_origin.x);
+    const __m256 oy = _mm256_set1_ps(ray.m_origin.y);
+    const __m256 oz = _mm256_set1_ps(ray.m_origin.z);
+    const __m256 dx = _mm256_set1_ps(ray.m_dir.x);
+    const __m256 dy = _mm256_set1_ps(ray.m_dir.y);
+    const __m256 dz = _mm256_set1_ps(ray.m_dir.z);
+    const __m256i lane_ids = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    uint32_t closest_index = no_triangle;
+    const uint32_t end = first + count;
+    for (uint32_t base = first; base < end; base += 8) {
+        // Lanes past the end of the range are neither loaded nor reported
+        __m256i valid =
+            _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(end - base)), lane_ids);
+        __m256 v1x = _mm256_maskload_ps(&geometry.m_a_x[base], valid);
+        __m256 v1y = _mm256_maskload_ps(&geometry.m_a_y[base], valid);
+        __m256 v1z = _mm256_maskload_ps(&geometry.m_a_z[base], valid);
+        __m256 e0x = _mm256_maskload_ps(&geometry.m_b_x[base], valid);
+        __m256 e0y = _mm256_maskload_ps(&geometry.m_b_y[base], valid);
+        __m256 e0z = _mm256_maskload_ps(&geometry.m_b_z[base], valid);
+        __m256 e1x = _mm256_maskload_ps(&geometry.m_c_x[base], valid);
+        __m256 e1y = _mm256_maskload_ps(&geometry.m_c_y[base], valid);
+        __m256 e1z = _mm256_maskload_ps(&geometry.m_c_z[base], valid);
+
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e1z), _mm256_mul_ps(e1y, dz));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e1x), _mm256_mul_ps(e1z, dx));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e1y), _mm256_mul_ps(e1x, dy));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0x, px), _mm256_mul_ps(e0y, py)),
+                                   _mm256_mul_ps(e0z, pz));
+        __m256 inv_det = _mm256_div_ps(one, det);
+
+        __m256 tx = _mm256_sub_ps(ox, v1x);
+        __m256 ty = _mm256_sub_ps(oy, v1y);
+        __m256 tz = _mm256_sub_ps(oz, v1z);
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px),
+                                                             _mm256_mul_ps(ty, py)),
+                                               _mm256_mul_ps(tz, pz)),
+                                 inv_det);
+
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e0z), _mm256_mul_ps(e0y, tz));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e0x), _mm256_mul_ps(e0z, tx));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e0y), _mm256_mul_ps(e0x, ty));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx),
+                                                             _mm256_mul_ps(dy, qy)),
+                                               _mm256_mul_ps(dz, qz)),
+                                 inv_det);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, qx),
+                                                             _mm256_mul_ps(e1y, qy)),
+                                               _mm256_mul_ps(e1z, qz)),
+                                 inv_det);
+        __m256 dist = _mm256_sub_ps(t, eps);
+
+        __m256 mask = _mm256_or_ps(_mm256_cmp_ps(det, neg_eps, _CMP_LE_OQ),
+                                   _mm256_cmp_ps(det, eps, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_castsi256_ps(valid));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, eps, _CMP_GT_OQ));
+        mask = _mm256_and_ps(mask,
+                             _mm256_cmp_ps(dist, _mm256_set1_ps(closest_dist), _CMP_LT_OQ));
+        if (_mm256_movemask_ps(mask) == 0)
+            continue;
+
+        dist = _mm256_blendv_ps(inf, dist, mask);
+        __m256 min = _mm256_min_ps(dist, _mm256_permute2f128_ps(dist, dist, 1));
+        min = _mm256_min_ps(min, _mm256_shuffle_ps(min, min, _MM_SHUFFLE(1, 0, 3, 2)));
+        min = _mm256_min_ps(min, _mm256_shuffle_ps(min, min, _MM_SHUFFLE(2, 3, 0, 1)));
+        int lanes = _mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(dist, min, _CMP_EQ_OQ)));
+        closest_dist = _mm256_cvtss_f32(min);
+        closest_index = base + __builtin_ctz(lanes);
+    }
+
+    return closest_index;
+}
+
+__attribute__((target("avx512f"))) uint32_t intersect_avx512(const Ray &ray,
+                                                             const TriangleGeometry &geometry,
+                                                             uint32_t first, uint32_t count,
+                                                             float &closest_dist) {
+    const auto epsilon = std::numeric_limits<float>::epsilon();
+    const __m512 eps = _mm512_set1_ps(epsilon);
+    const __m512 neg_eps = _mm512_set1_ps(-epsilon);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.f);
+    const __m512 ox = _mm512_set1_ps(ray.m_origin.x);
+    const __m512 oy = _mm512_set1_ps(ray.m_origin.y);
+    const __m512 oz = _mm512_set1_ps(ray.m_origin.z);
+    const __m512 dx = _mm512_set1_ps(ray.m_dir.x);
+    const __m512 dy = _mm512_set1_ps(ray.m_dir.y);
+    const __m512 dz = _mm512_set1_ps(ray.m_dir.z);
+
+    uint32_t closest_index = no_triangle;
+    const uint32_t end = first + count;
+    for (uint32_t base = first; base < end; base += 16) {
+        // Lanes past the end of the range are neither loaded nor reported
+        __mmask16 valid = static_cast<__mmask16>(end - base >= 16 ? 0xffff
+                                                                  : (1u << (end - base)) - 1);
+        __m512 v1x = _mm512_maskz_loadu_ps(valid, &geometry.m_a_x[base]);
+        __m512 v1y = _mm512_maskz_loadu_ps(valid, &geometry.m_a_y[base]);
+        __m512 v1z = _mm512_maskz_loadu_ps(valid, &geometry.m_a_z[base]);
+        __m512 e0x = _mm512_maskz_loadu_ps(valid, &geometry.m_b_x[base]);
+        __m512 e0y = _mm512_maskz_loadu_ps(valid, &geometry.m_b_y[base]);
+        __m512 e0z = _mm512_maskz_loadu_ps(valid, &geometry.m_b_z[base]);
+        __m512 e1x = _mm512_maskz_loadu_ps(valid, &geometry.m_c_x[base]);
+        __m512 e1y = _mm512_maskz_loadu_ps(valid, &geometry.m_c_y[base]);
+        __m512 e1z = _mm512_maskz_loadu_ps(valid, &geometry.m_c_z[base]);
+
+        __m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e1z), _mm512_mul_ps(e1y, dz));
+        __m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e1x), _mm512_mul_ps(e1z, dx));
+        __m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e1y), _mm512_mul_ps(e1x, dy));
+        __m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e0x, px), _mm512_mul_ps(e0y, py)),
+                                   _mm512_mul_ps(e0z, pz));
+        __m512 inv_det = _mm512_div_ps(one, det);
+
+        __m512 tx = _mm512_sub_ps(ox, v1x);
+        __m512 ty = _mm512_sub_ps(oy, v1y);
+        __m512 tz = _mm512_sub_ps(oz, v1z);
+        __m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px),
+                                                             _mm512_mul_ps(ty, py)),
+                                               _mm512_mul_ps(tz, pz)),
+                                 inv_det);
+
+        __m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e0z), _mm512_mul_ps(e0y, tz));
+        __m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e0x), _mm512_mul_ps(e0z, tx));
+        __m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e0y), _mm512_mul_ps(e0x, ty));
+        __m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx),
+                                                             _mm512_mul_ps(dy, qy)),
+                                               _mm512_mul_ps(dz, qz)),
+                                 inv_det);
+        __m512 t = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, qx),
+                                                             _mm512_mul_ps(e1y, qy)),
+                                               _mm512_mul_ps(e1z, qz)),
+                                 inv_det);
+        __m512 dist = _mm512_sub_ps(t, eps);
+
+        __mmask16 mask = _mm512_cmp_ps_mask(det, neg_eps, _CMP_LE_OQ) |
+                         _mm512_cmp_ps_mask(det, eps, _CMP_GE_OQ);
+        mask &= valid;
+        mask = _mm512_mask_cmp_ps_mask(mask, u, zero, _CMP_GE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, u, one, _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, v, zero, _CMP_GE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_add_ps(u, v), one, _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, t, eps, _CMP_GT_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, dist, _mm512_set1_ps(closest_dist), _CMP_LT_OQ);
+        if (mask == 0)
+            continue;
+
+        // Rarely more than one or two lanes hit so they're simply walked in order
+        alignas(64) float dists[16];
+        _mm512_store_ps(dists, dist);
+        uint32_t lanes = mask;
+        uint32_t closest_lane = __builtin_ctz(lanes);
+        for (lanes &= lanes - 1; lanes != 0; lanes &= lanes - 1) {
+            uint32_t lane = __builtin_ctz(lanes);
+            if (dists[lane] < dists[closest_lane])
+                closest_lane = lane;
+        }
+        closest_dist = dists[closest_lane];
+        closest_index = base + closest_lane;
+    }
+
+    return closest_index;
+}
+#endif
+}
+
+SIMDLevel LeafKernel::supported_level() {
+    static SIMDLevel level = detect_level();
+    return level;
+}
+
+SIMDLevel LeafKernel::level() {
+    return current_level();
+}
+
+void LeafKernel::set_level(SIMDLevel level) {
+    current_level() = std::min(level, supported_level());
+}
+
+const char *LeafKernel::name(SIMDLevel level) {
+    switch (level) {
+    case SIMDLevel::Scalar:
+        return "scalar";
+    case SIMDLevel::SSE:
+        return "SSE";
+    case SIMDLevel::AVX2:
+        return "AVX2";
+    case SIMDLevel::AVX512:
+        return "AVX-512";
+    }
+    return "unknown";
+}
+
+uint32_t LeafKernel::intersect(const Ray &ray, const TriangleGeometry &geometry, uint32_t first,
+                               uint32_t count, float &closest_dist) {
+    if (geometry.m_test == TriangleTest::Watertight)
+        return intersect_watertight(ray, geometry, first, count, closest_dist);
+
+    switch (current_level()) {
+    case SIMDLevel::Scalar:
+        return intersect_scalar(ray, geometry, first, count, closest_dist);
+#ifdef TRAC0R_X86_KERNELS
+    case SIMDLevel::SSE:
+        return intersect_sse(ray, geometry, first, count, closest_dist);
+    case SIMDLevel::AVX2:
+        return intersect_avx2(ray, geometry, first, count, closest_dist);
+    case SIMDLevel::AVX512:
+        return intersect_avx512(ray, geometry, first, count, closest_dist);
+#else
+    default:
+        return intersect_scalar(ray, geometry, first, count, closest_dist);
+#endif
+    }
+    return no_triangle;
+}
+
+bool LeafKernel::occluded(const Ray &ray, const TriangleGeometry &geometry, uint32_t first,
+                          uint32_t count, const float t_max) {
+    // Runs are short so looking for the closest hit costs hardly more than stopping at the first
+    float max_dist = t_max;
+    return intersect(ray, geometry, first, count, max_dist) != no_triangle;
+}
+}
@@ -0,0 +1,59 @@
+#ifndef LEAF_KERNEL_HPP
+#define LEAF_KERNEL_HPP
+
+#include "ray.hpp"
+#include "triangle_geometry.hpp"
+
+#include <cstdint>
+
+namespace trac0r {
+
+/**
+ * @brief Instruction sets that leaf kernels exist for, ordered by width. SSE tests 4 triangles at
+ * once, AVX2 8 and AVX-512 16.
+ */
+enum class SIMDLevel { Scalar, SSE, AVX2, AVX512 };
+
+/**
+ * @brief Tests one ray against a run of consecutive triangles of a geometry stream. Leaves of all
+ * hierarchies reference such runs so their triangles already sit side by side in the SoA arrays
+ * and can be loaded straight into SIMD lanes.
+ *
+ * All kernels are compiled into every binary and the widest one the CPU supports is picked at
+ * runtime. That way binaries don't need -march=native and still use AVX-512 where it exists.
+ * Records prepared for the watertight test always go through the scalar path.
+ */
+class LeafKernel {
+  public:
+    /**
+     * @brief Widest instruction set supported by the CPU we're running on.
+     */
+    static SIMDLevel supported_level();
+
+    static SIMDLevel level();
+
+    /**
+     * @brief Restricts kernels to an instruction set, e.g. for comparing them. Levels beyond what
+     * the CPU supports are clamped. Not thread-safe, set it before rendering starts.
+     */
+    static void set_level(SIMDLevel level);
+    static const char *name(SIMDLevel level);
+
+    /**
+     * @brief Finds the closest triangle in the range [first, first + count) that is hit closer
+     * than closest_dist.
+     *
+     * @return The index of that triangle or no_triangle. closest_dist is updated on a hit.
+     */
+    static uint32_t intersect(const Ray &ray, const TriangleGeometry &geometry, uint32_t first,
+                              uint32_t count, float &closest_dist);
+
+    /**
+     * @brief Whether any triangle in the range [first, first + count) is hit closer than t_max.
+     */
+    static bool occluded(const Ray &ray, const TriangleGeometry &geometry, uint32_t first,
+                         uint32_t count, const float t_max);
+};
+}
+
+#endif /* end of include guard: LEAF_KERNEL_HPP */
@@ -0,0 +1,298 @@
+#include "light_sampler.hpp"
+#include "random.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace trac0r {
+
+void LightSampler::build(LightSampler &sampler, std::vector<Triangle> triangles,
+                         std::vector<uint32_t> triangle_ids,
+                         const std::vector<Material> &materials) {
+    sampler.m_type = sampler.m_next_type;
+    sampler.m_triangles = std::move(triangles);
+    sampler.m_triangle_ids = std::move(triangle_ids);
+    sampler.m_nodes.clear();
+    sampler.m_parents.clear();
+    sampler.m_leaves.clear();
+
+    if (sampler.m_type == LightSamplingType::Hierarchy && !sampler.m_triangles.empty()) {
+        std::vector<uint32_t> indices(sampler.m_triangles.size());
+        for (uint32_t i = 0; i < indices.size(); i++)
+            indices[i] = i;
+        sampler.m_nodes.reserve(2 * indices.size() - 1);
+        build_node(sampler, indices, 0, indices.size());
+
+        sampler.m_parents.resize(sampler.m_nodes.size());
+        sampler.m_leaves.resize(sampler.m_triangles.size());
+        for (uint32_t i = 0; i < sampler.m_nodes.size(); i++) {
+            const auto &node = sampler.m_nodes[i];
+            if (node.m_leaf) {
+                sampler.m_leaves[node.m_index] = i;
+            } else {
+                sampler.m_parents[i + 1] = i;
+                sampler.m_parents[node.m_index] = i;
+            }
+        }
+    }
+
+    update_power(sampler, materials);
+}
+
+void LightSampler::update_power(LightSampler &sampler, const std::vector<Material> &materials) {
+    sampler.m_powers.resize(sampler.m_triangles.size());
+    sampler.m_total_power = 0.f;
+    for (size_t i = 0; i < sampler.m_triangles.size(); i++) {
+        const auto &triangle = sampler.m_triangles[i];
+        sampler.m_powers[i] =
+            triangle.m_area * radiant_exitance(materials[triangle.m_material_id]);
+        sampler.m_total_power += sampler.m_powers[i];
+    }
+    build_alias_table(sampler);
+
+    // Children always come after their parents
+    for (size_t i = sampler.m_nodes.size(); i-- > 0;) {
+        auto &node = sampler.m_nodes[i];
+        if (node.m_leaf)
+            node.m_power = sampler.m_powers[node.m_index];
+        else
+            node.m_power = sampler.m_nodes[i + 1].m_power + sampler.m_nodes[node.m_index].m_power;
+    }
+}
+
+void LightSampler::refit(LightSampler &sampler, std::vector<Triangle> triangles,
+                         const std::vector<Material> &materials) {
+    sampler.m_triangles = std::move(triangles);
+
+    // Children always come after their parents
+    for (size_t i = sampler.m_nodes.size(); i-- > 0;) {
+        auto &node = sampler.m_nodes[i];
+        if (node.m_leaf) {
+            const auto &triangle = sampler.m_triangles[node.m_index];
+            node.m_min = glm::min(triangle.m_v1, glm::min(triangle.m_v2, triangle.m_v3));
+            node.m_max = glm::max(triangle.m_v1, glm::max(triangle.m_v2, triangle.m_v3));
+        } else {
+            const auto &left = sampler.m_nodes[i + 1];
+            const auto &right = sampler.m_nodes[node.m_index];
+            node.m_min = glm::min(left.m_min, right.m_min);
+            node.m_max = glm::max(left.m_max, right.m_max);
+        }
+    }
+
+    update_power(sampler, materials);
+}
+
+const std::vector<Triangle> &LightSampler::triangles(const LightSampler &sampler) {
+    return sampler.m_triangles;
+}
+
+LightSamplingType LightSampler::type(const LightSampler &sampler) {
+    return sampler.m_type;
+}
+
+void LightSampler::set_type(LightSampler &sampler, LightSamplingType type) {
+    sampler.m_next_type = type;
+}
+
+bool LightSampler::sample(const LightSampler &sampler, const glm::vec3 &from,
+                          LightSample &sample) {
+    if (!(sampler.m_total_power > 0.f))
+        return false;
+
+    uint32_t index;
+    float probability;
+    if (sampler.m_type == LightSamplingType::Hierarchy) {
+        uint32_t node = 0;
+        probability = 1.f;
+        while (!sampler.m_nodes[node].m_leaf) {
+            glm::vec2 probabilities = child_probabilities(sampler, node, from);
+            if (rand_range(0.f, 1.f) < probabilities.x) {
+                probability *= probabilities.x;
+                node = node + 1;
+            } else {
+                probability *= probabilities.y;
+                node = sampler.m_nodes[node].m_index;
+            }
+        }
+        index = sampler.m_nodes[node].m_index;
+    } else {
+        index = pick_by_power(sampler);
+        probability = sampler.m_powers[index] / sampler.m_total_power;
+    }
+    return sample_triangle(sampler, index, probability, sample);
+}
+
+float LightSampler::pdf(const LightSampler &sampler, const glm::vec3 &from, uint32_t triangle_id,
+                        const Material &material) {
+    if (!(sampler.m_total_power > 0.f))
+        return 0.f;
+
+    // Picking a triangle in proportion to its power and a point uniformly on it comes down to
+    // the power per area of its material
+    if (sampler.m_type == LightSamplingType::Power)
+        return radiant_exitance(material) / sampler.m_total_power;
+
+    // Otherwise the probability is that of all branches sample() takes on the way down to the
+    // triangle's leaf
+    const auto &ids = sampler.m_triangle_ids;
+    auto found = std::lower_bound(ids.begin(), ids.end(), triangle_id);
+    if (found == ids.end() || *found != triangle_id)
+        return 0.f;
+    uint32_t index = found - ids.begin();
+    const auto &triangle = sampler.m_triangles[index];
+    if (!(triangle.m_area > 0.f))
+        return 0.f;
+
+    float probability = 1.f;
+    for (uint32_t node = sampler.m_leaves[index]; node != 0;) {
+        uint32_t parent = sampler.m_parents[node];
+        glm::vec2 probabilities = child_probabilities(sampler, parent, from);
+        probability *= node == parent + 1 ? probabilities.x : probabilities.y;
+        node = parent;
+    }
+    return probability / triangle.m_area;
+}
+
+bool LightSampler::sample_emission(const LightSampler &sampler, LightSample &sample) {
+    if (!(sampler.m_total_power > 0.f))
+        return false;
+
+    uint32_t index = pick_by_power(sampler);
+    return sample_triangle(sampler, index, sampler.m_powers[index] / sampler.m_total_power,
+                           sample);
+}
+
+float LightSampler::emission_pdf(const LightSampler &sampler, const Material &material) {
+    if (!(sampler.m_total_power > 0.f))
+        return 0.f;
+    return radiant_exitance(material) / sampler.m_total_power;
+}
+
+float LightSampler::radiant_exitance(const Material &material) {
+    return material.m_emittance * (material.m_color.r + material.m_color.g + material.m_color.b) /
+           3.f;
+}
+
+void LightSampler::build_alias_table(LightSampler &sampler) {
+    // Vose's method: slots of lights with less than average power are filled up with the excess
+    // of lights with more than average power
+    const uint32_t count = sampler.m_powers.size();
+    auto &table = sampler.m_alias_table;
+    table.resize(count);
+    if (count == 0 || !(sampler.m_total_power > 0.f))
+        return;
+
+    std::vector<float> scaled(count);
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+    for (uint32_t i = 0; i < count; i++) {
+        scaled[i] = sampler.m_powers[i] / sampler.m_total_power * count;
+        if (scaled[i] < 1.f)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+
+    while (!small.empty() && !large.empty()) {
+        uint32_t less = small.back();
+        small.pop_back();
+        uint32_t more = large.back();
+        table[less] = {scaled[less], more};
+        scaled[more] -= 1.f - scaled[less];
+        if (scaled[more] < 1.f) {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+
+    // Whatever is left is only off by rounding errors
+    for (auto i : small)
+        table[i] = {1.f, i};
+    for (auto i : large)
+        table[i] = {1.f, i};
+}
+
+uint32_t LightSampler::pick_by_power(const LightSampler &sampler) {
+    const uint32_t count = sampler.m_alias_table.size();
+    float slot = rand_range(0.f, 1.f) * count;
+    uint32_t slot_index = std::min(static_cast<uint32_t>(slot), count - 1);
+    const auto &entry = sampler.m_alias_table[slot_index];
+    return slot - slot_index < entry.m_threshold ? slot_index : entry.m_alias;
+}
+
+bool LightSampler::sample_triangle(const LightSampler &sampler, uint32_t index, float probability,
+                                   LightSample &sample) {
+    const auto &triangle = sampler.m_triangles[index];
+    if (!(probability > 0.f) || !(triangle.m_area > 0.f))
+        return false;
+    sample.m_pos = Triangle::random_point(triangle);
+    sample.m_normal = triangle.m_normal;
+    sample.m_material_id = triangle.m_material_id;
+    sample.m_triangle_id = sampler.m_triangle_ids[index];
+    sample.m_pdf = probability / triangle.m_area;
+    return true;
+}
+
+uint32_t LightSampler::build_node(LightSampler &sampler, std::vector<uint32_t> &indices,
+                                  uint32_t first, uint32_t last) {
+    const uint32_t node_index = sampler.m_nodes.size();
+    sampler.m_nodes.emplace_back();
+
+    glm::vec3 min{std::numeric_limits<float>::max()};
+    glm::vec3 max{-std::numeric_limits<float>::max()};
+    glm::vec3 centroid_min{std::numeric_limits<float>::max()};
+    glm::vec3 centroid_max{-std::numeric_limits<float>::max()};
+    for (uint32_t i = first; i < last; i++) {
+        const auto &triangle = sampler.m_triangles[indices[i]];
+        min = glm::min(min, glm::min(triangle.m_v1, glm::min(triangle.m_v2, triangle.m_v3)));
+        max = glm::max(max, glm::max(triangle.m_v1, glm::max(triangle.m_v2, triangle.m_v3)));
+        centroid_min = glm::min(centroid_min, triangle.m_centroid);
+        centroid_max = glm::max(centroid_max, triangle.m_centroid);
+    }
+
+    uint32_t right = 0;
+    if (last - first > 1) {
+        // Median split along the axis the centroids spread the most
+        glm::vec3 extent = centroid_max - centroid_min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                       : (extent.y > extent.z ? 1 : 2);
+        uint32_t middle = first + (last - first) / 2;
+        std::nth_element(indices.begin() + first, indices.begin() + middle,
+                         indices.begin() + last, [&](uint32_t a, uint32_t b) {
+                             return sampler.m_triangles[a].m_centroid[axis] <
+                                    sampler.m_triangles[b].m_centroid[axis];
+                         });
+        build_node(sampler, indices, first, middle);
+        right = build_node(sampler, indices, middle, last);
+    }
+
+    auto &node = sampler.m_nodes[node_index];
+    node.m_min = min;
+    node.m_max = max;
+    node.m_power = 0.f;
+    node.m_leaf = last - first == 1;
+    node.m_index = node.m_leaf ? indices[first] : right;
+    return node_index;
+}
+
+glm::vec2 LightSampler::child_probabilities(const LightSampler &sampler, uint32_t node,
+                                            const glm::vec3 &from) {
+    // A child's light falls off with the squared distance to its center, but never by more than
+    // for a point at the edge of its box so that close and overlapping boxes stay finite
+    auto importance = [&](const LightNode &child) {
+        glm::vec3 center = (child.m_min + child.m_max) * 0.5f;
+        glm::vec3 half_diagonal = (child.m_max - child.m_min) * 0.5f;
+        glm::vec3 offset = from - center;
+        float dist_squared =
+            glm::max(glm::dot(offset, offset), glm::dot(half_diagonal, half_diagonal));
+        return child.m_power / glm::max(dist_squared, std::numeric_limits<float>::min());
+    };
+
+    float left = importance(sampler.m_nodes[node + 1]);
+    float right = importance(sampler.m_nodes[sampler.m_nodes[node].m_index]);
+    if (!(left + right > 0.f))
+        return {0.5f, 0.5f};
+    return {left / (left + right), right / (left + right)};
+}
+}
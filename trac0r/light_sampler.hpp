@@ -0,0 +1,187 @@
+#ifndef LIGHT_SAMPLER_HPP
+#define LIGHT_SAMPLER_HPP
+
+#include "material.hpp"
+#include "triangle.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief How LightSampler picks a light triangle.
+ *
+ * Power: With a probability proportional to its emitted power, from an alias table in constant
+ * time. Best when all lights are about equally far away.
+ *
+ * Hierarchy: By walking down a BVH over the lights and picking either child by how much light it
+ * may send to the point being lit, estimated from its power and distance. Costs a walk down the
+ * tree but keeps far away lights from taking shadow rays away from close ones.
+ */
+enum class LightSamplingType { Power, Hierarchy };
+
+/**
+ * @brief A point picked on one of the light triangles.
+ */
+struct LightSample {
+    glm::vec3 m_pos;
+    glm::vec3 m_normal;
+    MaterialId m_material_id;
+
+    /**
+     * @brief Scene-wide index of the light triangle, see IntersectionInfo::m_triangle_id.
+     */
+    uint32_t m_triangle_id;
+
+    /**
+     * @brief Probability density of picking m_pos with respect to surface area.
+     */
+    float m_pdf;
+};
+
+/**
+ * @brief Entry of the alias table. A slot is picked uniformly, then it's either its own triangle
+ * with probability m_threshold or the triangle m_alias otherwise.
+ */
+struct LightAlias {
+    float m_threshold;
+    uint32_t m_alias;
+};
+
+struct LightNode {
+    glm::vec3 m_min;
+    glm::vec3 m_max;
+
+    /**
+     * @brief Power emitted by all triangles below this node.
+     */
+    float m_power;
+
+    /**
+     * @brief Index of the right child for inner nodes (the left child directly follows the node)
+     * or index of the triangle for leaves.
+     */
+    uint32_t m_index;
+    bool m_leaf;
+};
+
+/**
+ * @brief Picks points on the light triangles of a scene for next-event estimation. Triangles are
+ * picked with one of the strategies of LightSamplingType and points uniformly on them.
+ */
+class LightSampler {
+  public:
+    /**
+     * @brief Builds everything from scratch over the given light triangles.
+     *
+     * @param triangle_ids Scene-wide index of each triangle in ascending order, as in
+     * IntersectionInfo::m_triangle_id
+     */
+    static void build(LightSampler &sampler, std::vector<Triangle> triangles,
+                      std::vector<uint32_t> triangle_ids, const std::vector<Material> &materials);
+
+    /**
+     * @brief Recomputes the power of all lights after their materials changed. The triangles and
+     * the shape of the hierarchy stay the same, only the alias table is rebuilt and the hierarchy
+     * refitted.
+     */
+    static void update_power(LightSampler &sampler, const std::vector<Material> &materials);
+
+    /**
+     * @brief Takes the same light triangles in new positions, e.g. after their shapes moved. The
+     * shape of the hierarchy stays the same, only its bounds are refitted and the powers updated
+     * like in update_power().
+     */
+    static void refit(LightSampler &sampler, std::vector<Triangle> triangles,
+                      const std::vector<Material> &materials);
+
+    static const std::vector<Triangle> &triangles(const LightSampler &sampler);
+
+    /**
+     * @brief The strategy that sample() uses, which is the one set when build() last ran.
+     */
+    static LightSamplingType type(const LightSampler &sampler);
+
+    /**
+     * @brief Switches the strategy. Takes effect with the next build(), until then sampling goes
+     * on with the one it was built for.
+     */
+    static void set_type(LightSampler &sampler, LightSamplingType type);
+
+    /**
+     * @brief Picks a point on a light to light the point from with.
+     *
+     * @return Whether there was any light with power to pick.
+     */
+    static bool sample(const LightSampler &sampler, const glm::vec3 &from, LightSample &sample);
+
+    /**
+     * @brief Density with respect to area with which sample() picks a point on the triangle with
+     * the given scene-wide index when lighting from. material is the one of that triangle.
+     */
+    static float pdf(const LightSampler &sampler, const glm::vec3 &from, uint32_t triangle_id,
+                     const Material &material);
+
+    /**
+     * @brief Picks a point on a light to start a light subpath from. There's no point being lit
+     * yet, so triangles are always picked by power from the alias table, whatever the strategy.
+     *
+     * @return Whether there was any light with power to pick.
+     */
+    static bool sample_emission(const LightSampler &sampler, LightSample &sample);
+
+    /**
+     * @brief Density with respect to area with which sample_emission() picks a point on a light
+     * of the given material.
+     */
+    static float emission_pdf(const LightSampler &sampler, const Material &material);
+
+  private:
+    /**
+     * @brief Power emitted per area by a material.
+     */
+    static float radiant_exitance(const Material &material);
+    static void build_alias_table(LightSampler &sampler);
+
+    /**
+     * @brief Picks a triangle from the alias table, in proportion to its power.
+     */
+    static uint32_t pick_by_power(const LightSampler &sampler);
+
+    /**
+     * @brief Picks a point uniformly on the given triangle, which was picked with probability.
+     */
+    static bool sample_triangle(const LightSampler &sampler, uint32_t index, float probability,
+                                LightSample &sample);
+    static uint32_t build_node(LightSampler &sampler, std::vector<uint32_t> &indices,
+                               uint32_t first, uint32_t last);
+
+    /**
+     * @brief Probabilities with which sample() goes on to the left and right child of an inner
+     * node when lighting from.
+     */
+    static glm::vec2 child_probabilities(const LightSampler &sampler, uint32_t node,
+                                         const glm::vec3 &from);
+
+    LightSamplingType m_type = LightSamplingType::Power;
+    LightSamplingType m_next_type = LightSamplingType::Power;
+    std::vector<Triangle> m_triangles;
+    std::vector<uint32_t> m_triangle_ids;
+    std::vector<float> m_powers;
+    float m_total_power = 0.f;
+    std::vector<LightAlias> m_alias_table;
+    std::vector<LightNode> m_nodes;
+
+    /**
+     * @brief Parent of every node and leaf of every triangle, so that pdf() can walk from a
+     * triangle up to the root instead of searching for it.
+     */
+    std::vector<uint32_t> m_parents;
+    std::vector<uint32_t> m_leaves;
+};
+}
+
+#endif /* end of include guard: LIGHT_SAMPLER_HPP */
@@ -1,11 +1,47 @@
 #ifndef LIGHT_VERTEX_HPP
 #define LIGHT_VERTEX_HPP
 
+#include "intersection_info.hpp"
+
 #include <glm/glm.hpp>
 
+namespace trac0r {
+
+/**
+ * @brief A vertex of a subpath for bidirectional path tracing. Light subpaths start on an emitter
+ * and camera subpaths at the camera, both are stored the same way.
+ */
 struct LightVertex {
-    glm::vec3 m_pos{0.f};
+    /**
+     * @brief The surface at the vertex. Its incoming ray is the one of its own subpath that led
+     * there. The first vertex of a light subpath only has position, normal and material.
+     */
+    IntersectionInfo m_info;
+
+    /**
+     * @brief Throughput of the subpath up to the vertex, not yet scattered there. For the first
+     * vertex of a light subpath that's the emitted radiance over the density of its position.
+     */
     glm::vec3 m_luminance{0.f};
+
+    /**
+     * @brief Density with respect to area of sampling the vertex from the previous vertex of its
+     * own subpath.
+     */
+    float m_pdf_fwd = 0.f;
+
+    /**
+     * @brief Density with respect to area of sampling the vertex the other way, from the next
+     * vertex of its subpath. Only known once there is a next vertex.
+     */
+    float m_pdf_rev = 0.f;
+
+    /**
+     * @brief Whether the surface scatters into single directions only, like glass. Such vertices
+     * can't be connected to.
+     */
+    bool m_delta = false;
 };
+}
 
 #endif /* end of include guard: LIGHT_VERTEX_HPP */
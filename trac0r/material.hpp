@@ -3,8 +3,19 @@
 
 #include <glm/glm.hpp>
 
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
 namespace trac0r {
 
+/**
+ * @brief Index of a material in the material table of a Scene. Triangles only store this id so that
+ * all triangles sharing a material also share its single copy in the table.
+ */
+using MaterialId = uint16_t;
+const size_t max_materials = size_t(std::numeric_limits<MaterialId>::max()) + 1;
+
 struct Material {
     /**
      * @brief Used to determine the material type used. Refer to the table below:
@@ -38,6 +49,10 @@ struct Material {
      * than 1.0.
      */
     float m_emittance = 0.f;
+
+    static bool is_emissive(const Material &material) {
+        return material.m_type == 1;
+    }
 };
 }
 
@@ -0,0 +1,84 @@
+#include "mesh.hpp"
+
+#include <glm/gtx/normal.hpp>
+
+#include <algorithm>
+
+namespace trac0r {
+
+std::vector<glm::vec3> &Mesh::vertices(Mesh &mesh) {
+    return mesh.m_vertices;
+}
+
+const std::vector<glm::vec3> &Mesh::vertices(const Mesh &mesh) {
+    return mesh.m_vertices;
+}
+
+std::vector<MeshTriangle> &Mesh::triangles(Mesh &mesh) {
+    return mesh.m_triangles;
+}
+
+const std::vector<MeshTriangle> &Mesh::triangles(const Mesh &mesh) {
+    return mesh.m_triangles;
+}
+
+Triangle Mesh::triangle(const Mesh &mesh, const std::vector<glm::vec3> &vertices,
+                        uint32_t index) {
+    const auto &tri = mesh.m_triangles[index];
+    return Triangle{vertices[tri.m_v1], vertices[tri.m_v2], vertices[tri.m_v3],
+                    tri.m_material_id};
+}
+
+glm::vec3 Mesh::normal(const Mesh &mesh, uint32_t index) {
+    const auto &tri = mesh.m_triangles[index];
+    return glm::triangleNormal(mesh.m_vertices[tri.m_v1], mesh.m_vertices[tri.m_v2],
+                               mesh.m_vertices[tri.m_v3]);
+}
+
+const AABB &Mesh::aabb(const Mesh &mesh) {
+    return mesh.m_aabb;
+}
+
+const std::vector<MaterialId> &Mesh::material_ids(const Mesh &mesh) {
+    return mesh.m_material_ids;
+}
+
+static void add_material_id(std::vector<MaterialId> &material_ids, MaterialId material_id) {
+    auto pos = std::lower_bound(material_ids.begin(), material_ids.end(), material_id);
+    if (pos == material_ids.end() || *pos != material_id)
+        material_ids.insert(pos, material_id);
+}
+
+uint32_t Mesh::add_vertex(Mesh &mesh, const glm::vec3 vertex) {
+    if (mesh.m_vertices.empty())
+        AABB::reset(mesh.m_aabb);
+
+    AABB::extend(mesh.m_aabb, vertex);
+    mesh.m_vertices.push_back(vertex);
+    return mesh.m_vertices.size() - 1;
+}
+
+void Mesh::add_triangle(Mesh &mesh, const MeshTriangle triangle) {
+    add_material_id(mesh.m_material_ids, triangle.m_material_id);
+    mesh.m_triangles.push_back(triangle);
+}
+
+void Mesh::add_triangle(Mesh &mesh, const Triangle triangle) {
+    MeshTriangle tri;
+    tri.m_v1 = add_vertex(mesh, triangle.m_v1);
+    tri.m_v2 = add_vertex(mesh, triangle.m_v2);
+    tri.m_v3 = add_vertex(mesh, triangle.m_v3);
+    tri.m_material_id = triangle.m_material_id;
+    add_triangle(mesh, tri);
+}
+
+void Mesh::rebuild(Mesh &mesh) {
+    AABB::reset(mesh.m_aabb);
+    for (const auto &vertex : mesh.m_vertices)
+        AABB::extend(mesh.m_aabb, vertex);
+
+    mesh.m_material_ids.clear();
+    for (const auto &tri : mesh.m_triangles)
+        add_material_id(mesh.m_material_ids, tri.m_material_id);
+}
+}
@@ -0,0 +1,81 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include "aabb.hpp"
+#include "material.hpp"
+#include "triangle.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief A triangle of a Mesh. Its corners are indices into the vertices of the mesh so that
+ * vertices shared by neighboring triangles are only stored once.
+ */
+struct MeshTriangle {
+    uint32_t m_v1;
+    uint32_t m_v2;
+    uint32_t m_v3;
+    MaterialId m_material_id = 0;
+};
+
+/**
+ * @brief Indexed triangles of a shape in object space. Meshes are shared between all instances of
+ * a shape and must not change anymore once a shape using them was added to a scene.
+ */
+class Mesh {
+  public:
+    static std::vector<glm::vec3> &vertices(Mesh &mesh);
+    static const std::vector<glm::vec3> &vertices(const Mesh &mesh);
+    static std::vector<MeshTriangle> &triangles(Mesh &mesh);
+    static const std::vector<MeshTriangle> &triangles(const Mesh &mesh);
+
+    /**
+     * @brief Assembles a full triangle with cached normal, centroid and area from the given
+     * vertices which are either the mesh's own or a transformed copy of them.
+     */
+    static Triangle triangle(const Mesh &mesh, const std::vector<glm::vec3> &vertices,
+                             uint32_t index);
+
+    /**
+     * @brief Normal of a triangle in object space without assembling the whole triangle.
+     */
+    static glm::vec3 normal(const Mesh &mesh, uint32_t index);
+    static const AABB &aabb(const Mesh &mesh);
+
+    /**
+     * @brief Sorted list of the distinct materials used by the triangles. Whether a mesh has
+     * emitters can be told from this without looking at its triangles.
+     */
+    static const std::vector<MaterialId> &material_ids(const Mesh &mesh);
+
+    /**
+     * @brief Appends a vertex and returns the index that triangles refer to it by.
+     */
+    static uint32_t add_vertex(Mesh &mesh, const glm::vec3 vertex);
+    static void add_triangle(Mesh &mesh, const MeshTriangle triangle);
+
+    /**
+     * @brief Appends a triangle that shares no vertices with the rest of the mesh.
+     */
+    static void add_triangle(Mesh &mesh, const Triangle triangle);
+
+    /**
+     * @brief Recalculates the bounding box and material list after vertices or triangles were
+     * changed directly.
+     */
+    static void rebuild(Mesh &mesh);
+
+  private:
+    std::vector<glm::vec3> m_vertices;
+    std::vector<MeshTriangle> m_triangles;
+    AABB m_aabb;
+    std::vector<MaterialId> m_material_ids;
+};
+}
+
+#endif /* end of include guard: MESH_HPP */
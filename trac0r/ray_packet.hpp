@@ -0,0 +1,88 @@
+#ifndef RAY_PACKET_HPP
+#define RAY_PACKET_HPP
+
+#include "ray.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Camera rays are traced in packets covering square tiles of this many pixels per side.
+ */
+const uint32_t ray_packet_width = 8;
+const uint32_t ray_packet_size = ray_packet_width * ray_packet_width;
+
+/**
+ * @brief A bundle of coherent rays such as the camera rays of a tile of pixels. Besides the rays
+ * themselves it keeps the ranges that their origins and inverse directions span. With those a whole
+ * packet can be culled against a box at once using interval arithmetic.
+ */
+struct RayPacket {
+    static void clear(RayPacket &packet) {
+        packet.m_rays.clear();
+        packet.m_origin_min = glm::vec3{std::numeric_limits<float>::max()};
+        packet.m_origin_max = glm::vec3{-std::numeric_limits<float>::max()};
+        packet.m_invdir_min = glm::vec3{std::numeric_limits<float>::max()};
+        packet.m_invdir_max = glm::vec3{-std::numeric_limits<float>::max()};
+    }
+
+    static void add_ray(RayPacket &packet, const Ray &ray) {
+        packet.m_rays.push_back(ray);
+        packet.m_origin_min = glm::min(packet.m_origin_min, ray.m_origin);
+        packet.m_origin_max = glm::max(packet.m_origin_max, ray.m_origin);
+        packet.m_invdir_min = glm::min(packet.m_invdir_min, ray.m_invdir);
+        packet.m_invdir_max = glm::max(packet.m_invdir_max, ray.m_invdir);
+    }
+
+    /**
+     * @brief Conservative test whether any ray of the packet may enter a box before t_max. If this
+     * returns false, every single ray misses the box.
+     *
+     * Per axis the smallest distance at which any ray enters the slab and the largest at which any
+     * ray leaves it are bounded by multiplying the intervals of plane offsets and inverse
+     * directions. Axes along which rays point in different directions can't be bounded this way
+     * and are skipped.
+     */
+    static bool intersect_aabb(const RayPacket &packet, const glm::vec3 &min, const glm::vec3 &max,
+                               const float t_max) {
+        float entry = 0.f;
+        float exit = t_max;
+        for (int axis = 0; axis < 3; axis++) {
+            float inv_lo = packet.m_invdir_min[axis];
+            float inv_hi = packet.m_invdir_max[axis];
+            if (!(inv_lo * inv_hi > 0.f) || !std::isfinite(inv_lo) || !std::isfinite(inv_hi))
+                continue;
+
+            float near_plane = inv_lo > 0.f ? min[axis] : max[axis];
+            float far_plane = inv_lo > 0.f ? max[axis] : min[axis];
+            float near_lo = near_plane - packet.m_origin_max[axis];
+            float near_hi = near_plane - packet.m_origin_min[axis];
+            float far_lo = far_plane - packet.m_origin_max[axis];
+            float far_hi = far_plane - packet.m_origin_min[axis];
+
+            float t_near = glm::min(glm::min(near_lo * inv_lo, near_lo * inv_hi),
+                                    glm::min(near_hi * inv_lo, near_hi * inv_hi));
+            float t_far = glm::max(glm::max(far_lo * inv_lo, far_lo * inv_hi),
+                                   glm::max(far_hi * inv_lo, far_hi * inv_hi));
+            entry = glm::max(entry, t_near);
+            exit = glm::min(exit, t_far);
+        }
+
+        return entry <= exit;
+    }
+
+    std::vector<Ray> m_rays;
+    glm::vec3 m_origin_min{std::numeric_limits<float>::max()};
+    glm::vec3 m_origin_max{-std::numeric_limits<float>::max()};
+    glm::vec3 m_invdir_min{std::numeric_limits<float>::max()};
+    glm::vec3 m_invdir_max{-std::numeric_limits<float>::max()};
+};
+}
+
+#endif /* end of include guard: RAY_PACKET_HPP */
@@ -1,4 +1,5 @@
 #include "renderer.hpp"
+#include "leaf_kernel.hpp"
 #include "ray.hpp"
 #include "random.hpp"
 #include "utils.hpp"
@@ -9,6 +10,7 @@
 
 #include "fmt/format.h"
 
+#include <algorithm>
 #include <fstream>
 #include <thread>
 
@@ -18,6 +20,9 @@ Renderer::Renderer(const int width, const int height, const Camera &camera, cons
                    bool print_perf)
     : m_width(width), m_height(height), m_camera(camera), m_scene(scene), m_print_perf(print_perf) {
     m_luminance.resize(width * height, glm::vec4{0});
+#ifdef TASKPOOL
+    set_task_pool(std::make_shared<TaskPool>());
+#endif
 
 #ifdef OPENCL
     cl::Platform::get(&m_compute_platforms);
@@ -54,7 +59,8 @@ Renderer::Renderer(const int width, const int height, const Camera &camera, cons
 #endif
 }
 
-std::vector<glm::vec4> &Renderer::render(bool scene_changed, int stride_x, int stride_y) {
+std::vector<glm::vec4> &Renderer::render(bool scene_changed, int stride_x, int stride_y,
+                                         uint32_t samples_per_pixel) {
 #ifdef OPENCL
     struct DevicePRNG {
         cl_ulong m_seed[16];
@@ -73,10 +79,10 @@ std::vector<glm::vec4> &Renderer::render(bool scene_changed, int stride_x, int s
         cl_float3 m_v1;
         cl_float3 m_v2;
         cl_float3 m_v3;
-        DeviceMaterial m_material;
         cl_float3 m_normal;
         cl_float3 m_centroid;
         cl_float m_area;
+        cl_ushort m_material_id;
     };
 
     struct DeviceAABB {
@@ -163,12 +169,29 @@ std::vector<glm::vec4> &Renderer::render(bool scene_changed, int stride_x, int s
     m_compute_queues[0].enqueueWriteBuffer(dev_camera_buf, CL_TRUE, 0, sizeof(dev_camera),
                                            &dev_camera);
 
+    // Init dev_materials, triangles only carry an index into these
+    std::vector<DeviceMaterial> dev_materials;
+    for (auto &material : Scene::materials(m_scene)) {
+        DeviceMaterial dev_mat;
+        dev_mat.m_type = material.m_type;
+        dev_mat.m_color = {{material.m_color.r, material.m_color.g, material.m_color.b}};
+        dev_mat.m_roughness = material.m_roughness;
+        dev_mat.m_ior = material.m_ior;
+        dev_mat.m_emittance = material.m_emittance;
+        dev_materials.push_back(dev_mat);
+    }
+
+    cl::Buffer dev_materials_buf(m_compute_context, CL_MEM_READ_ONLY,
+                                 sizeof(DeviceMaterial) * dev_materials.size());
+    m_compute_queues[0].enqueueWriteBuffer(dev_materials_buf, CL_TRUE, 0,
+                                           sizeof(DeviceMaterial) * dev_materials.size(),
+                                           &dev_materials[0]);
+
     // Init dev_flatstruct
     // DeviceFlatStructure dev_flatstruct;
     std::vector<DeviceTriangle> dev_triangles;
     std::vector<DeviceShape> dev_shapes;
-    auto &accel_struct = Scene::accel_struct(m_scene);
-    for (auto &shape : FlatStructure::shapes(accel_struct)) {
+    for (auto &shape : Scene::shapes(m_scene)) {
         DeviceAABB dev_aabb;
         dev_aabb.m_min = {{AABB::min(Shape::aabb(shape)).x, AABB::min(Shape::aabb(shape)).y,
                            AABB::min(Shape::aabb(shape)).z}};
@@ -178,22 +201,15 @@ std::vector<glm::vec4> &Renderer::render(bool scene_changed, int stride_x, int s
         dev_shape.m_aabb = dev_aabb;
         dev_shape.m_triangle_index_start = dev_triangles.size();
 
-        for (auto &tri : Shape::triangles(shape)) {
-            DeviceMaterial dev_mat;
-            dev_mat.m_type = tri.m_material.m_type;
-            dev_mat.m_color = {
-                {tri.m_material.m_color.r, tri.m_material.m_color.g, tri.m_material.m_color.b}};
-            dev_mat.m_roughness = tri.m_material.m_roughness;
-            dev_mat.m_ior = tri.m_material.m_ior;
-            dev_mat.m_emittance = tri.m_material.m_emittance;
+        for (auto &tri : Shape::world_triangles(shape)) {
             DeviceTriangle dev_tri;
             dev_tri.m_v1 = {{tri.m_v1.x, tri.m_v1.y, tri.m_v1.z}};
             dev_tri.m_v2 = {{tri.m_v2.x, tri.m_v2.y, tri.m_v2.z}};
             dev_tri.m_v3 = {{tri.m_v3.x, tri.m_v3.y, tri.m_v3.z}};
-            dev_tri.m_material = dev_mat;
             dev_tri.m_normal = {{tri.m_normal.x, tri.m_normal.y, tri.m_normal.z}};
             dev_tri.m_centroid = {{tri.m_centroid.x, tri.m_centroid.y, tri.m_centroid.z}};
             dev_tri.m_area = tri.m_area;
+            dev_tri.m_material_id = tri.m_material_id;
             dev_triangles.push_back(dev_tri);
         }
 
@@ -224,6 +240,7 @@ std::vector<glm::vec4> &Renderer::render(bool scene_changed, int stride_x, int s
     m_kernel.setArg(6, static_cast<uint32_t>(dev_triangles.size()));
     m_kernel.setArg(7, dev_shapes_buf);
     m_kernel.setArg(8, static_cast<uint32_t>(dev_shapes.size()));
+    m_kernel.setArg(9, dev_materials_buf);
     cl::Event event;
 
     cl::Device device = m_compute_queues[0].getInfo<CL_QUEUE_DEVICE>();
@@ -253,76 +270,279 @@ std::vector<glm::vec4> &Renderer::render(bool scene_changed, int stride_x, int s
                    max_work_group_size, local_mem_size / 1024, private_mem_size / 1024);
     }
 
-    cl_int result = m_compute_queues[0].enqueueNDRangeKernel(
-        m_kernel, cl::NDRange(0, 0), cl::NDRange(m_width, m_height),
-        cl::NDRange(local_work_size_x, local_work_size_y), nullptr, &event);
-
-    if (result != CL_SUCCESS) {
-        fmt::print("{}\n", opencl_error_string(result));
-        exit(1);
-    }
-
-    // Wait for kernel to finish computing
-    event.wait();
+    // The kernel takes one sample per pixel and the device keeps the state of its PRNG, so it's
+    // simply run again for every further sample. The scene is only uploaded once.
+    m_last_frame_kernel_run_time = 0;
+    m_last_frame_buffer_read_time = 0;
+    for (uint32_t sample = 0; sample < samples_per_pixel; sample++) {
+        cl_int result = m_compute_queues[0].enqueueNDRangeKernel(
+            m_kernel, cl::NDRange(0, 0), cl::NDRange(m_width, m_height),
+            cl::NDRange(local_work_size_x, local_work_size_y), nullptr, &event);
+
+        if (result != CL_SUCCESS) {
+            fmt::print("{}\n", opencl_error_string(result));
+            exit(1);
+        }
 
-    if (m_print_perf)
-        m_last_frame_kernel_run_time = timer.elapsed();
-
-    // Transfer data from GPU back to CPU (TODO In later versions, just expose it to the OpenGL
-    // buffer
-    // and render it directly in order to get rid of this transfer)
-    m_compute_queues[0].enqueueReadBuffer(dev_output_buf, CL_TRUE, 0,
-                                          image_size * sizeof(cl_float4), &host_output[0]);
-
-    // Accumulate energy
-    // TODO Do this in opencl
-    for (uint32_t x = 0; x < m_width; x += stride_x) {
-        for (uint32_t y = 0; y < m_height; y += stride_y) {
-            auto lol = reinterpret_cast<glm::vec4 *>(&host_output[y * m_width + x]);
-            if (scene_changed)
-                m_luminance[y * m_width + x] = *lol;
-            else
-                m_luminance[y * m_width + x] += *lol;
+        // Wait for kernel to finish computing
+        event.wait();
+
+        if (m_print_perf)
+            m_last_frame_kernel_run_time += timer.elapsed();
+
+        // Transfer data from GPU back to CPU (TODO In later versions, just expose it to the
+        // OpenGL buffer and render it directly in order to get rid of this transfer)
+        m_compute_queues[0].enqueueReadBuffer(dev_output_buf, CL_TRUE, 0,
+                                              image_size * sizeof(cl_float4), &host_output[0]);
+
+        // Accumulate energy
+        // TODO Do this in opencl
+        for (uint32_t x = 0; x < m_width; x += stride_x) {
+            for (uint32_t y = 0; y < m_height; y += stride_y) {
+                auto lol = reinterpret_cast<glm::vec4 *>(&host_output[y * m_width + x]);
+                if (scene_changed && sample == 0)
+                    m_luminance[y * m_width + x] = *lol;
+                else
+                    m_luminance[y * m_width + x] += *lol;
+            }
         }
-    }
 
-    if (m_print_perf)
-        m_last_frame_buffer_read_time = timer.elapsed();
+        if (m_print_perf)
+            m_last_frame_buffer_read_time += timer.elapsed();
+    }
 #else
     Timer timer;
 
-// TODO Make OpenMP simd option work
-#pragma omp parallel for collapse(2) schedule(dynamic, 1024)
-    // Reverse path tracing part: Trace a ray through every camera pixel
-    for (uint32_t x = 0; x < m_width; x += stride_x) {
-        for (uint32_t y = 0; y < m_height; y += stride_y) {
-            Ray ray = Camera::pixel_to_ray(m_camera, x, y);
-            glm::vec4 new_color = trace_camera_ray(ray, m_max_camera_subpath_depth, m_scene);
-            if (scene_changed)
-                m_luminance[y * m_width + x] = new_color;
-            else
-                m_luminance[y * m_width + x] += new_color;
-        }
+    if (m_light_tracing) {
+        // Light paths splat onto the film from all threads at once. Camera paths for what they
+        // miss are added tile by tile afterwards, for all pixels like the light paths.
+        const uint32_t pixel_count = m_width * m_height;
+        Film::clear(*m_film);
+        parallel_for(m_task_pool.get(), 0, pixel_count * samples_per_pixel, 64, [&](uint32_t) {
+            Bidirectional::splat_light_path(m_scene, m_camera, m_max_camera_subpath_depth,
+                                            *m_film);
+        });
+        Film::resolve(*m_film, 1.f / pixel_count, samples_per_pixel, scene_changed, m_luminance);
+
+        const auto &tiles = TileScheduler::plan(m_tile_scheduler, m_width, m_height, 1, 1);
+        parallel_for(m_task_pool.get(), 0, tiles.size(), 1, [&](uint32_t i) {
+            static thread_local std::vector<glm::vec4> tile_luminance;
+            trace_tile(tiles[i], 1, 1, samples_per_pixel, tile_luminance);
+            TileScheduler::write_back(m_tile_scheduler, tiles[i], tile_luminance, false,
+                                      m_luminance);
+        });
+    } else if (m_use_wavefront && !m_bidirectional) {
+        Wavefront::render(m_wavefront, m_scene, m_camera, m_max_camera_subpath_depth, stride_x,
+                          stride_y, samples_per_pixel, scene_changed, m_luminance);
+    } else {
+        // Every thread renders whole tiles into a buffer of its own and writes them back at once.
+        // Tiles come in Morton order so threads work on neighboring parts of the image.
+        const auto &tiles =
+            TileScheduler::plan(m_tile_scheduler, m_width, m_height, stride_x, stride_y);
+        parallel_for(m_task_pool.get(), 0, tiles.size(), 1, [&](uint32_t i) {
+            static thread_local std::vector<glm::vec4> tile_luminance;
+            trace_tile(tiles[i], stride_x, stride_y, samples_per_pixel, tile_luminance);
+            TileScheduler::write_back(m_tile_scheduler, tiles[i], tile_luminance, scene_changed,
+                                      m_luminance);
+        });
     }
 
-    if (m_print_perf)
+    if (m_print_perf) {
         fmt::print("    {:<15} {:>10.3f} ms\n", "Path tracing", timer.elapsed());
+        if (m_use_wavefront && !m_bidirectional && !m_light_tracing)
+            Wavefront::print_last_frame_timings(m_wavefront);
+    }
 #endif
 
     return m_luminance;
 }
 
+void Renderer::trace_tile(const Tile &tile, int stride_x, int stride_y, uint32_t samples_per_pixel,
+                          std::vector<glm::vec4> &tile_luminance) const {
+    tile_luminance.resize(Tile::pixel_count(tile));
+    if (m_light_tracing) {
+        // Only paths that start with glass or a glossy surface, light tracing finds all others.
+        // They don't count as a sample of their own.
+        for (uint32_t row = 0; row < tile.m_rows; row++) {
+            for (uint32_t column = 0; column < tile.m_columns; column++) {
+                glm::vec3 color{0.f};
+                for (uint32_t sample = 0; sample < samples_per_pixel; sample++) {
+                    Ray ray = Camera::pixel_to_ray(m_camera, tile.m_x + column * stride_x,
+                                                   tile.m_y + row * stride_y);
+                    auto first_hit = Scene::intersect(m_scene, ray);
+                    auto type = first_hit.m_material.m_type;
+                    if (first_hit.m_has_intersected && (type == 3 || type == 4))
+                        color += glm::vec3(trace_camera_ray(ray, first_hit,
+                                                            m_max_camera_subpath_depth, m_scene,
+                                                            m_next_event_estimation));
+                }
+                tile_luminance[row * tile.m_columns + column] = glm::vec4(color, 0.f);
+            }
+        }
+        return;
+    }
+
+    if (m_bidirectional) {
+        for (uint32_t row = 0; row < tile.m_rows; row++) {
+            for (uint32_t column = 0; column < tile.m_columns; column++) {
+                glm::vec4 color{0.f};
+                for (uint32_t sample = 0; sample < samples_per_pixel; sample++) {
+                    Ray ray = Camera::pixel_to_ray(m_camera, tile.m_x + column * stride_x,
+                                                   tile.m_y + row * stride_y);
+                    color += Bidirectional::trace(ray, m_max_camera_subpath_depth, m_scene);
+                }
+                tile_luminance[row * tile.m_columns + column] = color;
+            }
+        }
+        return;
+    }
+
+    if (!m_ray_packets) {
+        for (uint32_t row = 0; row < tile.m_rows; row++) {
+            for (uint32_t column = 0; column < tile.m_columns; column++) {
+                glm::vec4 color{0.f};
+                for (uint32_t sample = 0; sample < samples_per_pixel; sample++) {
+                    Ray ray = Camera::pixel_to_ray(m_camera, tile.m_x + column * stride_x,
+                                                   tile.m_y + row * stride_y);
+                    color += trace_camera_ray(ray, m_max_camera_subpath_depth, m_scene,
+                                              m_next_event_estimation);
+                }
+                tile_luminance[row * tile.m_columns + column] = color;
+            }
+        }
+        return;
+    }
+
+    // Camera rays of neighboring pixels are nearly identical so they're traced to their first hit
+    // in packets covering ray_packet_width x ray_packet_width pixels of the tile each. Every
+    // sample gets a packet of its own, their colors add up in the tile.
+    std::fill(tile_luminance.begin(), tile_luminance.end(), glm::vec4{0.f});
+    RayPacket packet;
+    std::vector<uint32_t> pixels;
+    std::vector<IntersectionInfo> first_hits;
+    for (uint32_t first_row = 0; first_row < tile.m_rows; first_row += ray_packet_width) {
+        for (uint32_t first_column = 0; first_column < tile.m_columns;
+             first_column += ray_packet_width) {
+            for (uint32_t sample = 0; sample < samples_per_pixel; sample++) {
+                RayPacket::clear(packet);
+                pixels.clear();
+                for (uint32_t row = first_row;
+                     row < std::min(tile.m_rows, first_row + ray_packet_width); row++) {
+                    for (uint32_t column = first_column;
+                         column < std::min(tile.m_columns, first_column + ray_packet_width);
+                         column++) {
+                        RayPacket::add_ray(
+                            packet, Camera::pixel_to_ray(m_camera, tile.m_x + column * stride_x,
+                                                         tile.m_y + row * stride_y));
+                        pixels.push_back(row * tile.m_columns + column);
+                    }
+                }
+
+                Scene::intersect(m_scene, packet, first_hits);
+                for (size_t i = 0; i < pixels.size(); i++)
+                    tile_luminance[pixels[i]] += trace_camera_ray(
+                        packet.m_rays[i], first_hits[i], m_max_camera_subpath_depth, m_scene,
+                        m_next_event_estimation);
+            }
+        }
+    }
+}
+
+void Renderer::set_ray_packets(bool enabled) {
+    m_ray_packets = enabled;
+}
+
+void Renderer::set_tile_size(uint32_t tile_size) {
+    TileScheduler::set_tile_size(m_tile_scheduler, tile_size);
+}
+
+void Renderer::set_wavefront(bool enabled, bool sort_rays) {
+    m_use_wavefront = enabled;
+    Wavefront::set_ray_sorting(m_wavefront, sort_rays);
+}
+
+void Renderer::set_next_event_estimation(bool enabled) {
+    m_next_event_estimation = enabled;
+    Wavefront::set_next_event_estimation(m_wavefront, enabled);
+}
+
+void Renderer::set_bidirectional(bool enabled) {
+    m_bidirectional = enabled;
+}
+
+void Renderer::set_light_tracing(bool enabled) {
+    m_light_tracing = enabled;
+    if (enabled && !m_film)
+        m_film = std::make_unique<Film>(m_width, m_height);
+}
+
+void Renderer::set_task_pool(std::shared_ptr<TaskPool> pool) {
+    m_task_pool = pool;
+    Wavefront::set_task_pool(m_wavefront, m_task_pool.get());
+}
+
+const std::shared_ptr<TaskPool> &Renderer::task_pool() const {
+    return m_task_pool;
+}
+
 void Renderer::print_sysinfo() const {
     auto count_shapes = 0;
     auto count_triangles = 0;
-    for (const auto shape : FlatStructure::shapes(Scene::accel_struct(m_scene))) {
+    for (const auto &shape : Scene::shapes(m_scene)) {
         count_shapes++;
-        for (const auto triangle : Shape::triangles(shape)) {
-            (void)triangle;
-            count_triangles++;
-        }
+        count_triangles += Shape::triangles(shape).size();
     }
     fmt::print("Scene has {} triangles and {} Shapes\n", count_triangles, count_shapes);
+    switch (Scene::accel_struct_type(m_scene)) {
+    case AccelStructType::Flat:
+        fmt::print("Using flat acceleration structure\n");
+        break;
+    case AccelStructType::BVH:
+        fmt::print("Using BVH acceleration structure\n");
+        break;
+    case AccelStructType::TwoLevelBVH:
+        fmt::print("Using two-level BVH acceleration structure\n");
+        break;
+    case AccelStructType::WideBVH:
+        fmt::print("Using {}-wide BVH acceleration structure\n", wide_bvh_width);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        fmt::print("Using compressed {}-wide BVH acceleration structure\n", wide_bvh_width);
+        break;
+    case AccelStructType::Grid:
+        fmt::print("Using uniform grid acceleration structure\n");
+        break;
+    }
+    fmt::print("Testing leaf triangles with {} kernel\n", LeafKernel::name(LeafKernel::level()));
+    if (m_light_tracing)
+        fmt::print("Tracing light paths onto a shared film\n");
+    else if (m_bidirectional)
+        fmt::print("Tracing light and camera subpaths bidirectionally\n");
+    else if (m_use_wavefront)
+        fmt::print("Tracing paths breadth-first in queues of {} ({})\n", wavefront_queue_size,
+                   Wavefront::ray_sorting(m_wavefront) ? "sorted" : "unsorted");
+    else
+        fmt::print("Rendering tiles of {0}x{0} pixels in Morton order\n",
+                   TileScheduler::tile_size(m_tile_scheduler));
+    if (!m_use_wavefront && !m_bidirectional && !m_light_tracing && m_ray_packets)
+        fmt::print("Tracing camera rays in packets of {}x{}\n", ray_packet_width,
+                   ray_packet_width);
+    if (m_next_event_estimation || m_bidirectional)
+        fmt::print("Sampling {} light triangles directly by {} with multiple importance "
+                   "sampling\n",
+                   Scene::light_triangles(m_scene).size(),
+                   Scene::light_sampling_type(m_scene) == LightSamplingType::Power
+                       ? "power"
+                       : "light hierarchy");
+    if (m_task_pool)
+        fmt::print("Running on a work-stealing task pool of {} threads ({})\n",
+                   TaskPool::thread_count(*m_task_pool),
+                   TaskPool::pinned(*m_task_pool) ? "pinned" : "not pinned");
+    if (Scene::accel_struct_type(m_scene) != AccelStructType::Flat) {
+        auto build_stats = Scene::build_stats(m_scene);
+        fmt::print("    {} nodes ({:.2f} MB) built in {:.3f} ms\n", build_stats.m_node_count,
+                   build_stats.m_node_memory / (1024.0 * 1024.0), build_stats.m_build_time);
+    }
 #ifdef OPENCL
     fmt::print("Rendering on OpenCL\n");
     std::vector<cl::Platform> platforms;
@@ -381,9 +601,11 @@ void Renderer::print_sysinfo() const {
         }
     }
 #else
-    fmt::print("Rendering on OpenMP\n");
-    auto threads = std::thread::hardware_concurrency();
-    fmt::print("    OpenMP ({} threads)\n", threads);
+    if (!m_task_pool) {
+        fmt::print("Rendering on OpenMP\n");
+        auto threads = std::thread::hardware_concurrency();
+        fmt::print("    OpenMP ({} threads)\n", threads);
+    }
 #endif
 }
 
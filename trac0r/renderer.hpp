@@ -1,9 +1,13 @@
 #ifndef RENDERER_HPP
 #define RENDERER_HPP
 
+#include "bidirectional.hpp"
 #include "camera.hpp"
+#include "film.hpp"
 #include "scene.hpp"
-#include "light_vertex.hpp"
+#include "task_pool.hpp"
+#include "tile_scheduler.hpp"
+#include "wavefront.hpp"
 
 #ifdef OPENCL
 #include <CL/cl.hpp>
@@ -18,12 +22,137 @@ class Renderer {
   public:
     Renderer(const int width, const int height, const Camera &camera, const Scene &scene,
              bool print_perf);
-    static glm::vec4 trace_camera_ray(const Ray &ray, const unsigned max_depth, const Scene &scene);
-    std::vector<glm::vec4> &render(bool screen_changed, int stride_x, int stride_y);
+    /**
+     * @brief Traces a path from the camera until Russian Roulette ends it.
+     *
+     * @param next_event_estimation Whether light is also sampled directly at every diffuse and
+     * glossy bounce. Otherwise paths only pick up light by happening to hit an emitter.
+     */
+    static glm::vec4 trace_camera_ray(const Ray &ray, const unsigned max_depth, const Scene &scene,
+                                      bool next_event_estimation);
+
+    /**
+     * @brief Continues a camera path whose first hit was already found, e.g. by tracing a whole
+     * packet of camera rays at once.
+     */
+    static glm::vec4 trace_camera_ray(const Ray &ray, const IntersectionInfo &first_hit,
+                                      const unsigned max_depth, const Scene &scene,
+                                      bool next_event_estimation);
+
+    /**
+     * @brief Samples how a path goes on from a surface that doesn't emit light. luminance is
+     * attenuated by the surface and next_ray is replaced by the ray leaving it.
+     *
+     * @return Whether the path continues at all.
+     */
+    static bool scatter(const IntersectionInfo &intersect_info, glm::vec3 &luminance,
+                        Ray &next_ray);
+
+    /**
+     * @brief The materials scatter() picks from. Calling them directly saves the branch when all
+     * hits at hand are known to share a material type.
+     */
+    static void scatter_diffuse(IntersectionInfo intersect_info, glm::vec3 &luminance,
+                                Ray &next_ray);
+    static bool scatter_glass(IntersectionInfo intersect_info, glm::vec3 &luminance,
+                              Ray &next_ray);
+    static void scatter_glossy(IntersectionInfo intersect_info, glm::vec3 &luminance,
+                               Ray &next_ray);
+
+    /**
+     * @brief Solid angle density with which scatter() sends a path into dir. It's 0 for all
+     * directions connect_to_light() never connects to, in particular for glass which only ever
+     * scatters into single directions.
+     */
+    static float scatter_pdf(const IntersectionInfo &intersect_info, const glm::vec3 &dir);
+
+    /**
+     * @brief Next-event estimation: connects a surface to a random point on a light. If nothing
+     * blocks shadow_ray before t_max, the surface reflects radiance back along its incoming ray.
+     * radiance is already weighted against finding the same light through scatter() by multiple
+     * importance sampling and still has to be multiplied by the throughput of the path.
+     *
+     * @return Whether there's a light to connect to at all.
+     */
+    static bool connect_to_light(const IntersectionInfo &intersect_info, const Scene &scene,
+                                 Ray &shadow_ray, float &t_max, glm::vec3 &radiance);
+
+    /**
+     * @brief Multiple importance sampling weight of an emitter that a path hit after scatter()
+     * picked its direction with the given density, as opposed to finding it through
+     * connect_to_light() at the previous bounce.
+     */
+    static float emission_weight(const IntersectionInfo &emitter_hit, float scatter_pdf,
+                                 const Scene &scene);
+
+    /**
+     * @brief Traces samples_per_pixel paths for every pixel at the given stride and adds their
+     * sum to the image, or replaces it if screen_changed. Alpha counts the samples, so dividing by
+     * it gives the average. All samples of a pixel are summed up before the image is written,
+     * which saves most of the overhead of one call per sample when many are taken at once.
+     */
+    std::vector<glm::vec4> &render(bool screen_changed, int stride_x, int stride_y,
+                                   uint32_t samples_per_pixel = 1);
+
+    /**
+     * @brief Whether camera rays are traced in packets of ray_packet_width x ray_packet_width
+     * pixels. Only the first hit is found for the whole packet, every path continues on its own
+     * from there.
+     */
+    void set_ray_packets(bool enabled);
+
+    /**
+     * @brief Number of pixels per side of the square tiles that depth-first path tracing hands
+     * out to threads. Multiples of ray_packet_width keep all ray packets full.
+     */
+    void set_tile_size(uint32_t tile_size);
+
+    /**
+     * @brief Whether paths are traced breadth-first in queues by the wavefront integrator instead
+     * of one after another. Ray packets aren't used in that case.
+     */
+    void set_wavefront(bool enabled, bool sort_rays);
+
+    /**
+     * @brief Whether light is sampled directly at every diffuse and glossy bounce and combined
+     * with paths that hit emitters through multiple importance sampling. On by default.
+     */
+    void set_next_event_estimation(bool enabled);
+
+    /**
+     * @brief Whether every pixel is rendered by bidirectional path tracing, which finds light
+     * through glass far sooner. Ray packets and the wavefront integrator aren't used in that case
+     * and lights are always sampled directly. Can be switched between calls to render().
+     */
+    void set_bidirectional(bool enabled);
+
+    /**
+     * @brief Whether the image is rendered by light tracing: every render() traces one light path
+     * per pixel and sample and splats what the camera sees of it onto a shared film, whatever the
+     * stride. Pixels whose camera ray first hits glass or a glossy surface are path traced on top
+     * since light paths can't be connected through them. Takes precedence over all other
+     * integrators.
+     */
+    void set_light_tracing(bool enabled);
+
+    /**
+     * @brief Renders on the given task pool or with OpenMP if it's nullptr. Several renderers may
+     * share one pool. Builds with TASKPOOL defined start out on a pool with one thread per
+     * hardware thread, all others on OpenMP.
+     */
+    void set_task_pool(std::shared_ptr<TaskPool> pool);
+    const std::shared_ptr<TaskPool> &task_pool() const;
     void print_sysinfo() const;
     void print_last_frame_timings() const;
 
   private:
+    /**
+     * @brief Traces samples_per_pixel paths per pixel of a tile and stores the sums of their
+     * colors row by row.
+     */
+    void trace_tile(const Tile &tile, int stride_x, int stride_y, uint32_t samples_per_pixel,
+                    std::vector<glm::vec4> &tile_luminance) const;
+
     const uint32_t m_max_camera_subpath_depth = 10;
 
     /**
@@ -36,6 +165,20 @@ class Renderer {
     const Camera &m_camera;
     const Scene &m_scene;
     bool m_print_perf = false;
+    bool m_ray_packets = true;
+    bool m_use_wavefront = false;
+    bool m_next_event_estimation = true;
+    bool m_bidirectional = false;
+    bool m_light_tracing = false;
+    Wavefront m_wavefront;
+    TileScheduler m_tile_scheduler;
+
+    /**
+     * @brief Light paths land anywhere on the image, so light tracing collects them in here first.
+     * Only allocated once light tracing gets enabled.
+     */
+    std::unique_ptr<Film> m_film;
+    std::shared_ptr<TaskPool> m_task_pool;
 
 #ifdef OPENCL
     double m_last_frame_buffer_write_time;
@@ -48,10 +48,10 @@ typedef struct Triangle {
     float3 m_v1;
     float3 m_v2;
     float3 m_v3;
-    Material m_material;
     float3 m_normal;
     float3 m_centroid;
     float m_area;
+    ushort m_material_id;
 } Triangle;
 
 // typedef struct FlatStructure {
@@ -353,7 +353,8 @@ inline bool intersect_ray_triangle(const Ray *ray, __global const Triangle *tria
 }
 
 inline IntersectionInfo Scene_intersect(__global Triangle *triangles, const uint num_triangles,
-                                        __global Shape *shapes, const uint num_shapes, Ray *ray) {
+                                        __global Shape *shapes, const uint num_shapes,
+                                        __global Material *materials, Ray *ray) {
     IntersectionInfo intersect_info; // TODO use proper constructor
     intersect_info.m_has_intersected = false;
 
@@ -379,7 +380,7 @@ inline IntersectionInfo Scene_intersect(__global Triangle *triangles, const uint
                         intersect_info.m_angle_between =
                             dot(closest_triangle.m_normal, intersect_info.m_incoming_ray.m_dir);
                         intersect_info.m_normal = closest_triangle.m_normal;
-                        intersect_info.m_material = closest_triangle.m_material;
+                        intersect_info.m_material = materials[closest_triangle.m_material_id];
                     }
                 }
             }
@@ -393,7 +394,7 @@ __kernel void renderer_trace_camera_ray(__write_only __global float4 *output, co
                                         const uint max_depth, __global PRNG *prng,
                                         __constant Camera *camera, __global Triangle *triangles,
                                         const uint num_triangles, __global Shape *shapes,
-                                        const uint num_shapes) {
+                                        const uint num_shapes, __global Material *materials) {
     uint x = get_global_id(0);
     uint y = get_global_id(1);
     uint index = y * width + x;
@@ -411,14 +412,15 @@ __kernel void renderer_trace_camera_ray(__write_only __global float4 *output, co
         if (rand_range(prng, 0.f, 1.f) >= continuation_probability) {
             break;
         }
+        luminance /= continuation_probability;
         depth++;
 
-        IntersectionInfo intersect_info = Scene_intersect(triangles, num_triangles, shapes, num_shapes, &next_ray);
+        IntersectionInfo intersect_info = Scene_intersect(triangles, num_triangles, shapes, num_shapes, materials, &next_ray);
         if (intersect_info.m_has_intersected) {
             // Emitter Material
             if (intersect_info.m_material.m_type == 1) {
                 return_color = luminance * intersect_info.m_material.m_color *
-                               intersect_info.m_material.m_emittance / continuation_probability;
+                               intersect_info.m_material.m_emittance;
                 break;
             }
 
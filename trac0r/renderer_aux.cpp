@@ -1,6 +1,7 @@
 #include "renderer.hpp"
 
 #include "random.hpp"
+#include "intersections.hpp"
 
 #include <glm/gtc/constants.hpp>
 #include <glm/gtx/rotate_vector.hpp>
@@ -10,151 +11,271 @@
 
 namespace trac0r {
 // #pragma omp declare simd // TODO make this work
-glm::vec4 Renderer::trace_camera_ray(const Ray &ray, const unsigned max_depth, const Scene &scene) {
+glm::vec4 Renderer::trace_camera_ray(const Ray &ray, const unsigned max_depth, const Scene &scene,
+                                     bool next_event_estimation) {
+    return trace_camera_ray(ray, Scene::intersect(scene, ray), max_depth, scene,
+                            next_event_estimation);
+}
+
+glm::vec4 Renderer::trace_camera_ray(const Ray &ray, const IntersectionInfo &first_hit,
+                                     const unsigned max_depth, const Scene &scene,
+                                     bool next_event_estimation) {
     Ray next_ray = ray;
     glm::vec3 return_color{0.f};
     glm::vec3 luminance{1.f};
     size_t depth = 0;
 
+    // Density with which the last bounce picked next_ray, 0 as long as no light was sampled there
+    float last_scatter_pdf = 0.f;
+
     // We'll run until terminated by Russian Roulette
     while (true) {
-        // Russian Roulette
+        // Russian Roulette. Surviving paths carry 1 / p of every roulette they got through, so
+        // that all light they find afterwards is divided by the probability of getting there.
         float continuation_probability = 1.f - (1.f / (max_depth - depth));
         // float continuation_probability = (luminance.x + luminance.y + luminance.z) / 3.f;
         if (rand_range(0.f, 1.0f) >= continuation_probability) {
             break;
         }
+        luminance /= continuation_probability;
         depth++;
 
-        // TODO Refactor out all of the material BRDFs into the material class so we don't duplicate
-        // them
-        auto intersect_info = Scene::intersect(scene, next_ray);
-        if (intersect_info.m_has_intersected) {
-            // Emitter Material
-            if (intersect_info.m_material.m_type == 1) {
-                return_color = luminance * intersect_info.m_material.m_color *
-                               intersect_info.m_material.m_emittance / continuation_probability;
-                break;
-            }
-
-            // Diffuse Material
-            else if (intersect_info.m_material.m_type == 2) {
-                // Find normal in correct direction
-                intersect_info.m_normal =
-                    intersect_info.m_normal * -glm::sign(intersect_info.m_angle_between);
-                intersect_info.m_angle_between =
-                    intersect_info.m_angle_between * -glm::sign(intersect_info.m_angle_between);
-
-                // Find new random direction for diffuse reflection
-
-                // We're using importance sampling for this since it converges much faster than
-                // uniform sampling
-                // See http://blog.hvidtfeldts.net/index.php/2015/01/path-tracing-3d-fractals/ and
-                // http://www.rorydriscoll.com/2009/01/07/better-sampling/ and
-                // https://pathtracing.wordpress.com/2011/03/03/cosine-weighted-hemisphere/
-                glm::vec3 new_ray_dir =
-                    oriented_cosine_weighted_hemisphere_sample(intersect_info.m_normal);
-                luminance *= intersect_info.m_material.m_color;
-
-                // For completeness, this is what it looks like with uniform sampling:
-                // glm::vec3 new_ray_dir =
-                // oriented_uniform_hemisphere_sample(intersect_info.m_normal);
-                // float cos_theta = glm::dot(new_ray_dir, intersect_info.m_normal);
-                // luminance *= 2.f * intersect_info.m_material.m_color * cos_theta;
-
-                // Make a new ray
-                next_ray = Ray{intersect_info.m_pos, new_ray_dir};
-            }
-
-            // Glass Material
-            else if (intersect_info.m_material.m_type == 3) {
-                // This code is mostly taken from TomCrypto's Lambda
-                float n1, n2;
-
-                if (intersect_info.m_angle_between > 0) {
-                    // Ray in inside the object
-                    n1 = intersect_info.m_material.m_ior;
-                    n2 = 1.0003f;
-
-                    intersect_info.m_normal = -intersect_info.m_normal;
-                } else {
-                    // Ray is outside the object
-                    n1 = 1.0003f;
-                    n2 = intersect_info.m_material.m_ior;
-
-                    intersect_info.m_angle_between = -intersect_info.m_angle_between;
-                }
-
-                float n = n1 / n2;
-
-                float cos_t =
-                    1.f - glm::pow(n, 2) * (1.f - glm::pow(intersect_info.m_angle_between, 2));
-
-                glm::vec3 new_ray_dir;
-                // Handle total internal reflection
-                if (cos_t < 0.f) {
-                    new_ray_dir = intersect_info.m_incoming_ray.m_dir -
-                                  (2.f * intersect_info.m_angle_between * intersect_info.m_normal);
-                    next_ray = Ray{intersect_info.m_pos, new_ray_dir};
-                    break;
-                }
-
-                cos_t = glm::sqrt(cos_t);
-
-                // Fresnel coefficients
-                float r1 = n1 * intersect_info.m_angle_between - n2 * cos_t;
-                float r2 = n1 * intersect_info.m_angle_between + n2 * cos_t;
-                float r3 = n2 * intersect_info.m_angle_between - n1 * cos_t;
-                float r4 = n2 * intersect_info.m_angle_between + n1 * cos_t;
-                float r = glm::pow(r1 / r2, 2) + glm::pow(r3 / r4, 2) * 0.5f;
-
-                if (rand_range(0.f, 1.f) < r) {
-                    // Reflection
-                    new_ray_dir = intersect_info.m_incoming_ray.m_dir -
-                                  (2.f * intersect_info.m_angle_between * intersect_info.m_normal);
-                    luminance *= intersect_info.m_material.m_color;
-                } else {
-                    // Refraction
-                    new_ray_dir = intersect_info.m_incoming_ray.m_dir * (n1 / n2) +
-                                  intersect_info.m_normal *
-                                      ((n1 / n2) * intersect_info.m_angle_between - cos_t);
-                    luminance *= 1.f;
-                }
-
-                // Make a new ray
-                next_ray = Ray{intersect_info.m_pos, new_ray_dir};
-            }
-
-            // Glossy Material
-            else if (intersect_info.m_material.m_type == 4) {
-                // Find normal in correct direction
-                intersect_info.m_normal =
-                    intersect_info.m_normal * -glm::sign(intersect_info.m_angle_between);
-                intersect_info.m_angle_between =
-                    intersect_info.m_angle_between * -glm::sign(intersect_info.m_angle_between);
-
-                float real_roughness =
-                    intersect_info.m_material.m_roughness * glm::half_pi<float>();
-
-                // Find new direction for reflection
-                glm::vec3 reflected_dir =
-                    intersect_info.m_incoming_ray.m_dir -
-                    (2.f * intersect_info.m_angle_between * intersect_info.m_normal);
-
-                // Find new random direction on cone for glossy reflection
-                glm::vec3 new_ray_dir =
-                    oriented_cosine_weighted_cone_sample(reflected_dir, real_roughness);
-
-                luminance *= intersect_info.m_material.m_color;
-
-                // Make a new ray
-                next_ray = Ray{intersect_info.m_pos, new_ray_dir};
-            }
-        } else {
+        auto intersect_info = depth == 1 ? first_hit : Scene::intersect(scene, next_ray);
+        if (!intersect_info.m_has_intersected)
             break;
+
+        // Emitter Material
+        if (intersect_info.m_material.m_type == 1) {
+            return_color += luminance * intersect_info.m_material.m_color *
+                            intersect_info.m_material.m_emittance *
+                            emission_weight(intersect_info, last_scatter_pdf, scene);
+            break;
+        }
+
+        // Roulette never lets a path past max_depth - 1 so there's no point in sampling lights on
+        // the last bounce
+        bool sample_lights = next_event_estimation && max_depth - depth > 1;
+        if (sample_lights) {
+            Ray shadow_ray = next_ray;
+            float t_max;
+            glm::vec3 radiance;
+            if (connect_to_light(intersect_info, scene, shadow_ray, t_max, radiance) &&
+                !Scene::occluded(scene, shadow_ray, t_max))
+                return_color += luminance * radiance;
         }
+
+        if (!scatter(intersect_info, luminance, next_ray))
+            break;
+        last_scatter_pdf = sample_lights ? scatter_pdf(intersect_info, next_ray.m_dir) : 0.f;
     }
 
     return glm::vec4(return_color, 1.f);
 }
+
+// Power heuristic with an exponent of 2 for combining two sampling techniques
+static float power_heuristic(float pdf, float other_pdf) {
+    float pdf_squared = pdf * pdf;
+    return pdf_squared / (pdf_squared + other_pdf * other_pdf);
+}
+
+float Renderer::scatter_pdf(const IntersectionInfo &intersect_info, const glm::vec3 &dir) {
+    // Normal on the side the path came from, like in scatter_diffuse() and scatter_glossy()
+    glm::vec3 normal = intersect_info.m_normal * -glm::sign(intersect_info.m_angle_between);
+    float cos_theta = glm::dot(normal, dir);
+    if (cos_theta <= 0.f)
+        return 0.f;
+
+    switch (intersect_info.m_material.m_type) {
+    case 2:
+        return cos_theta * glm::one_over_pi<float>();
+    case 4: {
+        // sample_hemisphere() draws the squared cosine to the reflected direction uniformly from
+        // [cos_max, 1]. A cone of width 0 is a mirror.
+        float cos_max = glm::cos(intersect_info.m_material.m_roughness * glm::half_pi<float>());
+        if (cos_max >= 1.f)
+            return 0.f;
+        const auto &incoming_dir = intersect_info.m_incoming_ray.m_dir;
+        glm::vec3 reflected_dir = incoming_dir - 2.f * glm::dot(normal, incoming_dir) * normal;
+        float cos_alpha = glm::dot(reflected_dir, dir);
+        if (cos_alpha <= 0.f || cos_alpha * cos_alpha < cos_max)
+            return 0.f;
+        return cos_alpha / (glm::pi<float>() * (1.f - cos_max));
+    }
+    default:
+        return 0.f;
+    }
+}
+
+bool Renderer::connect_to_light(const IntersectionInfo &intersect_info, const Scene &scene,
+                                Ray &shadow_ray, float &t_max, glm::vec3 &radiance) {
+    LightSample light;
+    if (!Scene::sample_light(scene, intersect_info.m_pos, light))
+        return false;
+
+    glm::vec3 to_light = light.m_pos - intersect_info.m_pos;
+    float dist_squared = glm::dot(to_light, to_light);
+    if (dist_squared <= 0.f)
+        return false;
+    float dist = glm::sqrt(dist_squared);
+    glm::vec3 dir = to_light / dist;
+
+    // Lights emit on both sides just like when a path hits them
+    float cos_light = glm::abs(glm::dot(light.m_normal, dir));
+    float bsdf_pdf = scatter_pdf(intersect_info, dir);
+    if (cos_light <= 0.f || bsdf_pdf <= 0.f)
+        return false;
+
+    // scatter() multiplies the throughput by the surface color for every direction it picks, so
+    // light arriving from dir is reflected with the color times the density of picking dir
+    float light_pdf = light.m_pdf * dist_squared / cos_light;
+    const auto &light_material = Scene::material(scene, light.m_material_id);
+    radiance = intersect_info.m_material.m_color * light_material.m_color *
+               light_material.m_emittance * (bsdf_pdf / light_pdf) *
+               power_heuristic(light_pdf, bsdf_pdf);
+
+    // Stop just short of the light so that it doesn't block itself
+    shadow_ray = Ray{offset_ray_origin(intersect_info.m_pos, intersect_info.m_normal, dir), dir};
+    t_max = dist * (1.f - 1e-3f);
+    return true;
+}
+
+float Renderer::emission_weight(const IntersectionInfo &emitter_hit, float scatter_pdf,
+                                const Scene &scene) {
+    if (scatter_pdf <= 0.f)
+        return 1.f;
+
+    const auto &from = emitter_hit.m_incoming_ray.m_origin;
+    glm::vec3 offset = emitter_hit.m_pos - from;
+    float cos_light = glm::abs(emitter_hit.m_angle_between);
+    if (cos_light <= 0.f)
+        return 1.f;
+    float light_pdf =
+        Scene::light_pdf(scene, from, emitter_hit.m_triangle_id, emitter_hit.m_material_id) *
+        glm::dot(offset, offset) / cos_light;
+    return power_heuristic(scatter_pdf, light_pdf);
+}
+
+// TODO Refactor out all of the material BRDFs into the material class so we don't duplicate them
+bool Renderer::scatter(const IntersectionInfo &intersect_info, glm::vec3 &luminance,
+                       Ray &next_ray) {
+    switch (intersect_info.m_material.m_type) {
+    case 2:
+        scatter_diffuse(intersect_info, luminance, next_ray);
+        return true;
+    case 3:
+        return scatter_glass(intersect_info, luminance, next_ray);
+    case 4:
+        scatter_glossy(intersect_info, luminance, next_ray);
+        return true;
+    default:
+        return true;
+    }
+}
+
+void Renderer::scatter_diffuse(IntersectionInfo intersect_info, glm::vec3 &luminance,
+                               Ray &next_ray) {
+    // Find normal in correct direction
+    intersect_info.m_normal = intersect_info.m_normal * -glm::sign(intersect_info.m_angle_between);
+    intersect_info.m_angle_between =
+        intersect_info.m_angle_between * -glm::sign(intersect_info.m_angle_between);
+
+    // Find new random direction for diffuse reflection
+
+    // We're using importance sampling for this since it converges much faster than uniform
+    // sampling
+    // See http://blog.hvidtfeldts.net/index.php/2015/01/path-tracing-3d-fractals/ and
+    // http://www.rorydriscoll.com/2009/01/07/better-sampling/ and
+    // https://pathtracing.wordpress.com/2011/03/03/cosine-weighted-hemisphere/
+    glm::vec3 new_ray_dir = oriented_cosine_weighted_hemisphere_sample(intersect_info.m_normal);
+    luminance *= intersect_info.m_material.m_color;
+
+    // For completeness, this is what it looks like with uniform sampling:
+    // glm::vec3 new_ray_dir = oriented_uniform_hemisphere_sample(intersect_info.m_normal);
+    // float cos_theta = glm::dot(new_ray_dir, intersect_info.m_normal);
+    // luminance *= 2.f * intersect_info.m_material.m_color * cos_theta;
+
+    // Make a new ray
+    next_ray = Ray{offset_ray_origin(intersect_info.m_pos, intersect_info.m_normal, new_ray_dir),
+                   new_ray_dir};
+}
+
+bool Renderer::scatter_glass(IntersectionInfo intersect_info, glm::vec3 &luminance,
+                             Ray &next_ray) {
+    // This code is mostly taken from TomCrypto's Lambda
+    float n1, n2;
+
+    if (intersect_info.m_angle_between > 0) {
+        // Ray in inside the object
+        n1 = intersect_info.m_material.m_ior;
+        n2 = 1.0003f;
+
+        intersect_info.m_normal = -intersect_info.m_normal;
+    } else {
+        // Ray is outside the object
+        n1 = 1.0003f;
+        n2 = intersect_info.m_material.m_ior;
+
+        intersect_info.m_angle_between = -intersect_info.m_angle_between;
+    }
+
+    float n = n1 / n2;
+
+    float cos_t = 1.f - glm::pow(n, 2) * (1.f - glm::pow(intersect_info.m_angle_between, 2));
+
+    // Total internal reflection ends the path
+    if (cos_t < 0.f)
+        return false;
+
+    cos_t = glm::sqrt(cos_t);
+
+    // Fresnel coefficients
+    float r1 = n1 * intersect_info.m_angle_between - n2 * cos_t;
+    float r2 = n1 * intersect_info.m_angle_between + n2 * cos_t;
+    float r3 = n2 * intersect_info.m_angle_between - n1 * cos_t;
+    float r4 = n2 * intersect_info.m_angle_between + n1 * cos_t;
+    float r = glm::pow(r1 / r2, 2) + glm::pow(r3 / r4, 2) * 0.5f;
+
+    glm::vec3 new_ray_dir;
+    if (rand_range(0.f, 1.f) < r) {
+        // Reflection
+        new_ray_dir = intersect_info.m_incoming_ray.m_dir -
+                      (2.f * intersect_info.m_angle_between * intersect_info.m_normal);
+        luminance *= intersect_info.m_material.m_color;
+    } else {
+        // Refraction
+        new_ray_dir =
+            intersect_info.m_incoming_ray.m_dir * (n1 / n2) +
+            intersect_info.m_normal * ((n1 / n2) * intersect_info.m_angle_between - cos_t);
+        luminance *= 1.f;
+    }
+
+    // Make a new ray
+    next_ray = Ray{offset_ray_origin(intersect_info.m_pos, intersect_info.m_normal, new_ray_dir),
+                   new_ray_dir};
+
+    return true;
+}
+
+void Renderer::scatter_glossy(IntersectionInfo intersect_info, glm::vec3 &luminance,
+                              Ray &next_ray) {
+    // Find normal in correct direction
+    intersect_info.m_normal = intersect_info.m_normal * -glm::sign(intersect_info.m_angle_between);
+    intersect_info.m_angle_between =
+        intersect_info.m_angle_between * -glm::sign(intersect_info.m_angle_between);
+
+    float real_roughness = intersect_info.m_material.m_roughness * glm::half_pi<float>();
+
+    // Find new direction for reflection
+    glm::vec3 reflected_dir = intersect_info.m_incoming_ray.m_dir -
+                              (2.f * intersect_info.m_angle_between * intersect_info.m_normal);
+
+    // Find new random direction on cone for glossy reflection
+    glm::vec3 new_ray_dir = oriented_cosine_weighted_cone_sample(reflected_dir, real_roughness);
+
+    luminance *= intersect_info.m_material.m_color;
+
+    // Make a new ray
+    next_ray = Ray{offset_ray_origin(intersect_info.m_pos, intersect_info.m_normal, new_ray_dir),
+                   new_ray_dir};
+}
 }
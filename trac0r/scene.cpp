@@ -7,26 +7,444 @@
 #include <glm/gtc/random.hpp>
 
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
 namespace trac0r {
 
-void Scene::add_shape(Scene &scene, Shape &shape) {
-    FlatStructure::add_shape(Scene::accel_struct(scene), shape);
+MaterialId Scene::add_material(Scene &scene, const Material &material) {
+    if (scene.m_materials.size() >= max_materials)
+        throw std::length_error("Scene can't hold more than " + std::to_string(max_materials) +
+                                " materials");
+    scene.m_materials.push_back(material);
+    return static_cast<MaterialId>(scene.m_materials.size() - 1);
+}
+
+const std::vector<Material> &Scene::materials(const Scene &scene) {
+    return scene.m_materials;
+}
+
+const Material &Scene::material(const Scene &scene, MaterialId material_id) {
+    return scene.m_materials[material_id];
+}
+
+void Scene::set_material(Scene &scene, MaterialId material_id, const Material &material) {
+    auto &old_material = scene.m_materials[material_id];
+    if (Material::is_emissive(old_material) != Material::is_emissive(material))
+        scene.m_lights_dirty = true;
+    else if (Material::is_emissive(material) && (old_material.m_color != material.m_color ||
+                                                 old_material.m_emittance != material.m_emittance))
+        scene.m_light_power_dirty = true;
+    old_material = material;
+}
+
+// Structures only know which material a hit has, the material itself is in the scene's table
+static IntersectionInfo look_up_material(const Scene &scene, IntersectionInfo intersect_info) {
+    if (intersect_info.m_has_intersected)
+        intersect_info.m_material = Scene::material(scene, intersect_info.m_material_id);
+    return intersect_info;
+}
+
+size_t Scene::add_shape(Scene &scene, Shape &shape) {
+    scene.m_lights_dirty |= Shape::has_emitters(shape, scene.m_materials);
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        FlatStructure::add_shape(scene.m_flat_structure, shape);
+        break;
+    case AccelStructType::BVH:
+        BVH::add_shape(scene.m_bvh, shape);
+        break;
+    case AccelStructType::TwoLevelBVH:
+        TwoLevelBVH::add_shape(scene.m_two_level_bvh, shape);
+        break;
+    case AccelStructType::WideBVH:
+        WideBVH::add_shape(scene.m_wide_bvh, shape);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        CompressedWideBVH::add_shape(scene.m_compressed_wide_bvh, shape);
+        break;
+    case AccelStructType::Grid:
+        Grid::add_shape(scene.m_grid, shape);
+        break;
+    }
+    return Scene::shapes(scene).size() - 1;
+}
+
+const std::vector<Shape> &Scene::shapes(const Scene &scene) {
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        return FlatStructure::shapes(scene.m_flat_structure);
+    case AccelStructType::BVH:
+        return BVH::shapes(scene.m_bvh);
+    case AccelStructType::TwoLevelBVH:
+        return TwoLevelBVH::shapes(scene.m_two_level_bvh);
+    case AccelStructType::WideBVH:
+        return WideBVH::shapes(scene.m_wide_bvh);
+    case AccelStructType::CompressedWideBVH:
+        return CompressedWideBVH::shapes(scene.m_compressed_wide_bvh);
+    case AccelStructType::Grid:
+        return Grid::shapes(scene.m_grid);
+    }
+    return FlatStructure::shapes(scene.m_flat_structure);
+}
+
+Shape &Scene::edit_shape(Scene &scene, size_t index) {
+    // Checked before the shape is moved but moving doesn't change which materials it uses, so the
+    // light triangles stay the same ones and only need to be refitted
+    scene.m_lights_moved |= Shape::has_emitters(Scene::shapes(scene)[index], scene.m_materials);
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        FlatStructure::mark_dirty(scene.m_flat_structure, index);
+        return FlatStructure::shapes(scene.m_flat_structure)[index];
+    case AccelStructType::BVH:
+        BVH::mark_dirty(scene.m_bvh, index);
+        return BVH::shapes(scene.m_bvh)[index];
+    case AccelStructType::TwoLevelBVH:
+        TwoLevelBVH::mark_dirty(scene.m_two_level_bvh, index);
+        return TwoLevelBVH::shapes(scene.m_two_level_bvh)[index];
+    case AccelStructType::WideBVH:
+        WideBVH::mark_dirty(scene.m_wide_bvh, index);
+        return WideBVH::shapes(scene.m_wide_bvh)[index];
+    case AccelStructType::CompressedWideBVH:
+        CompressedWideBVH::mark_dirty(scene.m_compressed_wide_bvh, index);
+        return CompressedWideBVH::shapes(scene.m_compressed_wide_bvh)[index];
+    case AccelStructType::Grid:
+        Grid::mark_dirty(scene.m_grid, index);
+        return Grid::shapes(scene.m_grid)[index];
+    }
+    return FlatStructure::shapes(scene.m_flat_structure)[index];
+}
+
+const std::vector<Triangle> &Scene::light_triangles(const Scene &scene) {
+    return LightSampler::triangles(scene.m_light_sampler);
+}
+
+bool Scene::sample_light(const Scene &scene, const glm::vec3 &from, LightSample &sample) {
+    return LightSampler::sample(scene.m_light_sampler, from, sample);
+}
+
+float Scene::light_pdf(const Scene &scene, const glm::vec3 &from, uint32_t triangle_id,
+                       MaterialId material_id) {
+    return LightSampler::pdf(scene.m_light_sampler, from, triangle_id,
+                             Scene::material(scene, material_id));
+}
+
+bool Scene::sample_emission(const Scene &scene, LightSample &sample) {
+    return LightSampler::sample_emission(scene.m_light_sampler, sample);
+}
+
+float Scene::emission_pdf(const Scene &scene, MaterialId material_id) {
+    return LightSampler::emission_pdf(scene.m_light_sampler, Scene::material(scene, material_id));
+}
+
+LightSamplingType Scene::light_sampling_type(const Scene &scene) {
+    return LightSampler::type(scene.m_light_sampler);
+}
+
+void Scene::set_light_sampling_type(Scene &scene, LightSamplingType type) {
+    LightSampler::set_type(scene.m_light_sampler, type);
+    scene.m_lights_dirty = true;
 }
 
 IntersectionInfo Scene::intersect(const Scene &scene, const Ray &ray) {
-    return FlatStructure::intersect(accel_struct(scene), ray);
+    IntersectionInfo intersect_info;
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        intersect_info = FlatStructure::intersect(scene.m_flat_structure, ray);
+        break;
+    case AccelStructType::BVH:
+        intersect_info = BVH::intersect(scene.m_bvh, ray);
+        break;
+    case AccelStructType::TwoLevelBVH:
+        intersect_info = TwoLevelBVH::intersect(scene.m_two_level_bvh, ray);
+        break;
+    case AccelStructType::WideBVH:
+        intersect_info = WideBVH::intersect(scene.m_wide_bvh, ray);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        intersect_info = CompressedWideBVH::intersect(scene.m_compressed_wide_bvh, ray);
+        break;
+    case AccelStructType::Grid:
+        intersect_info = Grid::intersect(scene.m_grid, ray);
+        break;
+    }
+    return look_up_material(scene, intersect_info);
+}
+
+HitRecord Scene::closest_hit(const Scene &scene, const Ray &ray) {
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        return FlatStructure::closest_hit(scene.m_flat_structure, ray);
+    case AccelStructType::BVH:
+        return BVH::closest_hit(scene.m_bvh, ray);
+    case AccelStructType::TwoLevelBVH:
+        return TwoLevelBVH::closest_hit(scene.m_two_level_bvh, ray);
+    case AccelStructType::WideBVH:
+        return WideBVH::closest_hit(scene.m_wide_bvh, ray);
+    case AccelStructType::CompressedWideBVH:
+        return CompressedWideBVH::closest_hit(scene.m_compressed_wide_bvh, ray);
+    case AccelStructType::Grid:
+        return Grid::closest_hit(scene.m_grid, ray);
+    }
+    return HitRecord();
+}
+
+IntersectionInfo Scene::resolve(const Scene &scene, const Ray &ray, const HitRecord &hit) {
+    IntersectionInfo intersect_info;
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        intersect_info = FlatStructure::resolve(scene.m_flat_structure, ray, hit);
+        break;
+    case AccelStructType::BVH:
+        intersect_info = BVH::resolve(scene.m_bvh, ray, hit);
+        break;
+    case AccelStructType::TwoLevelBVH:
+        intersect_info = TwoLevelBVH::resolve(scene.m_two_level_bvh, ray, hit);
+        break;
+    case AccelStructType::WideBVH:
+        intersect_info = WideBVH::resolve(scene.m_wide_bvh, ray, hit);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        intersect_info = CompressedWideBVH::resolve(scene.m_compressed_wide_bvh, ray, hit);
+        break;
+    case AccelStructType::Grid:
+        intersect_info = Grid::resolve(scene.m_grid, ray, hit);
+        break;
+    }
+    return look_up_material(scene, intersect_info);
+}
+
+const Material &Scene::material(const Scene &scene, const HitRecord &hit) {
+    MaterialId material_id = 0;
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        material_id = FlatStructure::material_id(scene.m_flat_structure, hit);
+        break;
+    case AccelStructType::BVH:
+        material_id = BVH::material_id(scene.m_bvh, hit);
+        break;
+    case AccelStructType::TwoLevelBVH:
+        material_id = TwoLevelBVH::material_id(scene.m_two_level_bvh, hit);
+        break;
+    case AccelStructType::WideBVH:
+        material_id = WideBVH::material_id(scene.m_wide_bvh, hit);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        material_id = CompressedWideBVH::material_id(scene.m_compressed_wide_bvh, hit);
+        break;
+    case AccelStructType::Grid:
+        material_id = Grid::material_id(scene.m_grid, hit);
+        break;
+    }
+    return Scene::material(scene, material_id);
+}
+
+template <typename AccelStruct>
+static void intersect_batch(const AccelStruct &accel_struct, const RayPacket &packet,
+                            std::vector<IntersectionInfo> &results) {
+    results.resize(packet.m_rays.size());
+    for (size_t i = 0; i < packet.m_rays.size(); i++)
+        results[i] = AccelStruct::intersect(accel_struct, packet.m_rays[i]);
+}
+
+void Scene::intersect(const Scene &scene, const RayPacket &packet,
+                      std::vector<IntersectionInfo> &results) {
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        intersect_batch(scene.m_flat_structure, packet, results);
+        break;
+    case AccelStructType::BVH:
+        BVH::intersect(scene.m_bvh, packet, results);
+        break;
+    case AccelStructType::TwoLevelBVH:
+        intersect_batch(scene.m_two_level_bvh, packet, results);
+        break;
+    case AccelStructType::WideBVH:
+        intersect_batch(scene.m_wide_bvh, packet, results);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        intersect_batch(scene.m_compressed_wide_bvh, packet, results);
+        break;
+    case AccelStructType::Grid:
+        intersect_batch(scene.m_grid, packet, results);
+        break;
+    }
+
+    for (auto &intersect_info : results)
+        intersect_info = look_up_material(scene, intersect_info);
+}
+
+bool Scene::occluded(const Scene &scene, const Ray &ray, const float t_max) {
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        return FlatStructure::occluded(scene.m_flat_structure, ray, t_max);
+    case AccelStructType::BVH:
+        return BVH::occluded(scene.m_bvh, ray, t_max);
+    case AccelStructType::TwoLevelBVH:
+        return TwoLevelBVH::occluded(scene.m_two_level_bvh, ray, t_max);
+    case AccelStructType::WideBVH:
+        return WideBVH::occluded(scene.m_wide_bvh, ray, t_max);
+    case AccelStructType::CompressedWideBVH:
+        return CompressedWideBVH::occluded(scene.m_compressed_wide_bvh, ray, t_max);
+    case AccelStructType::Grid:
+        return Grid::occluded(scene.m_grid, ray, t_max);
+    }
+    return false;
+}
+
+// Dispatches once for the whole batch instead of once per ray
+template <typename AccelStruct>
+static void occluded_batch(const AccelStruct &accel_struct, const std::vector<Ray> &rays,
+                           const std::vector<float> &t_maxs, std::vector<bool> &results) {
+    for (size_t i = 0; i < rays.size(); i++)
+        results[i] = AccelStruct::occluded(accel_struct, rays[i], t_maxs[i]);
+}
+
+void Scene::occluded(const Scene &scene, const std::vector<Ray> &rays,
+                     const std::vector<float> &t_maxs, std::vector<bool> &results) {
+    results.resize(rays.size());
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        occluded_batch(scene.m_flat_structure, rays, t_maxs, results);
+        break;
+    case AccelStructType::BVH:
+        occluded_batch(scene.m_bvh, rays, t_maxs, results);
+        break;
+    case AccelStructType::TwoLevelBVH:
+        occluded_batch(scene.m_two_level_bvh, rays, t_maxs, results);
+        break;
+    case AccelStructType::WideBVH:
+        occluded_batch(scene.m_wide_bvh, rays, t_maxs, results);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        occluded_batch(scene.m_compressed_wide_bvh, rays, t_maxs, results);
+        break;
+    case AccelStructType::Grid:
+        occluded_batch(scene.m_grid, rays, t_maxs, results);
+        break;
+    }
 }
 
 void Scene::rebuild(Scene &scene) {
-    FlatStructure::rebuild(Scene::accel_struct(scene));
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        FlatStructure::rebuild(scene.m_flat_structure);
+        break;
+    case AccelStructType::BVH:
+        BVH::rebuild(scene.m_bvh);
+        break;
+    case AccelStructType::TwoLevelBVH:
+        TwoLevelBVH::rebuild(scene.m_two_level_bvh);
+        break;
+    case AccelStructType::WideBVH:
+        WideBVH::rebuild(scene.m_wide_bvh);
+        break;
+    case AccelStructType::CompressedWideBVH:
+        CompressedWideBVH::rebuild(scene.m_compressed_wide_bvh);
+        break;
+    case AccelStructType::Grid:
+        Grid::rebuild(scene.m_grid);
+        break;
+    }
+
+    // Put lights into a list for easy access. Moved lights only need their positions updated and
+    // changed materials of lights only change how often they're picked.
+    if (scene.m_lights_dirty || scene.m_lights_moved) {
+        std::vector<Triangle> light_triangles;
+        std::vector<uint32_t> light_triangle_ids;
+        Shape::gather_light_triangles(Scene::shapes(scene), scene.m_materials, light_triangles,
+                                      light_triangle_ids);
+        if (scene.m_lights_dirty)
+            LightSampler::build(scene.m_light_sampler, std::move(light_triangles),
+                                std::move(light_triangle_ids), scene.m_materials);
+        else
+            LightSampler::refit(scene.m_light_sampler, std::move(light_triangles),
+                                scene.m_materials);
+    } else if (scene.m_light_power_dirty) {
+        LightSampler::update_power(scene.m_light_sampler, scene.m_materials);
+    }
+    scene.m_lights_dirty = false;
+    scene.m_lights_moved = false;
+    scene.m_light_power_dirty = false;
+}
+
+AccelStructType Scene::accel_struct_type(const Scene &scene) {
+    return scene.m_accel_struct_type;
 }
 
-FlatStructure &Scene::accel_struct(Scene &scene) {
-    return scene.m_accel_struct;
+BVHBuildStats Scene::build_stats(const Scene &scene) {
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        return BVHBuildStats();
+    case AccelStructType::BVH:
+        return BVH::build_stats(scene.m_bvh);
+    case AccelStructType::TwoLevelBVH:
+        return TwoLevelBVH::build_stats(scene.m_two_level_bvh);
+    case AccelStructType::WideBVH:
+        return WideBVH::build_stats(scene.m_wide_bvh);
+    case AccelStructType::CompressedWideBVH:
+        return CompressedWideBVH::build_stats(scene.m_compressed_wide_bvh);
+    case AccelStructType::Grid:
+        return Grid::build_stats(scene.m_grid);
+    }
+    return BVHBuildStats();
 }
 
-const FlatStructure &Scene::accel_struct(const Scene &scene) {
-    return scene.m_accel_struct;
+void Scene::set_spatial_split_budget(Scene &scene, float budget) {
+    scene.m_spatial_split_budget = budget;
+    BVH::set_spatial_split_budget(scene.m_bvh, budget);
+    WideBVH::set_spatial_split_budget(scene.m_wide_bvh, budget);
+    CompressedWideBVH::set_spatial_split_budget(scene.m_compressed_wide_bvh, budget);
+}
+
+void Scene::set_triangle_test(Scene &scene, TriangleTest test) {
+    scene.m_triangle_test = test;
+    FlatStructure::set_triangle_test(scene.m_flat_structure, test);
+    BVH::set_triangle_test(scene.m_bvh, test);
+    TwoLevelBVH::set_triangle_test(scene.m_two_level_bvh, test);
+    WideBVH::set_triangle_test(scene.m_wide_bvh, test);
+    CompressedWideBVH::set_triangle_test(scene.m_compressed_wide_bvh, test);
+    Grid::set_triangle_test(scene.m_grid, test);
+}
+
+void Scene::set_accel_struct_type(Scene &scene, AccelStructType type) {
+    if (type == scene.m_accel_struct_type)
+        return;
+
+    // Clearing the old structure also resets its settings, they're handed to it again below
+    std::vector<Shape> shapes;
+    switch (scene.m_accel_struct_type) {
+    case AccelStructType::Flat:
+        shapes.swap(FlatStructure::shapes(scene.m_flat_structure));
+        scene.m_flat_structure = FlatStructure();
+        break;
+    case AccelStructType::BVH:
+        shapes.swap(BVH::shapes(scene.m_bvh));
+        scene.m_bvh = BVH();
+        break;
+    case AccelStructType::TwoLevelBVH:
+        shapes.swap(TwoLevelBVH::shapes(scene.m_two_level_bvh));
+        scene.m_two_level_bvh = TwoLevelBVH();
+        break;
+    case AccelStructType::WideBVH:
+        shapes.swap(WideBVH::shapes(scene.m_wide_bvh));
+        scene.m_wide_bvh = WideBVH();
+        break;
+    case AccelStructType::CompressedWideBVH:
+        shapes.swap(CompressedWideBVH::shapes(scene.m_compressed_wide_bvh));
+        scene.m_compressed_wide_bvh = CompressedWideBVH();
+        break;
+    case AccelStructType::Grid:
+        shapes.swap(Grid::shapes(scene.m_grid));
+        scene.m_grid = Grid();
+        break;
+    }
+    set_spatial_split_budget(scene, scene.m_spatial_split_budget);
+    set_triangle_test(scene, scene.m_triangle_test);
+
+    scene.m_accel_struct_type = type;
+    for (auto &shape : shapes)
+        Scene::add_shape(scene, shape);
 }
 }
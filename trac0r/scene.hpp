@@ -2,10 +2,18 @@
 #define SCENE_HPP
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 #include "shape.hpp"
 #include "camera.hpp"
 #include "intersection_info.hpp"
+#include "hit_record.hpp"
 #include "flat_structure.hpp"
+#include "bvh.hpp"
+#include "two_level_bvh.hpp"
+#include "wide_bvh.hpp"
+#include "compressed_wide_bvh.hpp"
+#include "grid.hpp"
+#include "light_sampler.hpp"
 
 #include <glm/glm.hpp>
 
@@ -14,16 +22,167 @@
 
 namespace trac0r {
 
+/**
+ * @brief Available acceleration structures. All of them share the same interface so the Scene
+ * just dispatches to whichever one is active.
+ */
+enum class AccelStructType { Flat, BVH, TwoLevelBVH, WideBVH, CompressedWideBVH, Grid };
+
 class Scene {
   public:
-    static void add_shape(Scene &scene, Shape &shape);
+    /**
+     * @brief Adds a material to the scene's material table. Triangles refer to it by the returned
+     * id which is then passed to the Shape factories. Throws std::length_error once all
+     * max_materials ids are taken.
+     */
+    static MaterialId add_material(Scene &scene, const Material &material);
+    static const std::vector<Material> &materials(const Scene &scene);
+    static const Material &material(const Scene &scene, MaterialId material_id);
+
+    /**
+     * @brief Replaces a material. All triangles using it pick up the change right away since they
+     * only store its id, so this never touches any geometry. Only a material that becomes or stops
+     * being emissive makes the next rebuild() gather the light triangles again. If a light just
+     * changes its color or emittance, only the power of the lights is updated.
+     */
+    static void set_material(Scene &scene, MaterialId material_id, const Material &material);
+
+    /**
+     * @brief Adds a copy of a shape to the scene.
+     *
+     * @return Index of the new shape which can later be passed to edit_shape()
+     */
+    static size_t add_shape(Scene &scene, Shape &shape);
+    static const std::vector<Shape> &shapes(const Scene &scene);
+
+    /**
+     * @brief Gives access to a shape in order to move, rotate or scale it. The shape is marked
+     * dirty so that the next rebuild() refits the active structure instead of building it from
+     * scratch. Meshes of shapes in a scene must not be changed. Moving a shape with emitters
+     * refits the light hierarchy the same way.
+     */
+    static Shape &edit_shape(Scene &scene, size_t index);
+
+    /**
+     * @brief Emissive triangles of all shapes in world space as of the last rebuild().
+     */
+    static const std::vector<Triangle> &light_triangles(const Scene &scene);
+
+    /**
+     * @brief Picks a random point on the light triangles for lighting the point from with
+     * next-event estimation. See LightSamplingType for how lights are picked.
+     *
+     * @return Whether there are any lights to pick from.
+     */
+    static bool sample_light(const Scene &scene, const glm::vec3 &from, LightSample &sample);
+
+    /**
+     * @brief Density with respect to area with which sample_light() picks a point on the given
+     * light triangle of the given material when lighting from, or 0 if it never does. See
+     * IntersectionInfo::m_triangle_id for what identifies a triangle.
+     */
+    static float light_pdf(const Scene &scene, const glm::vec3 &from, uint32_t triangle_id,
+                           MaterialId material_id);
+
+    /**
+     * @brief Picks a random point on the light triangles to start a light subpath from, by power
+     * alone. emission_pdf() gives its density.
+     */
+    static bool sample_emission(const Scene &scene, LightSample &sample);
+    static float emission_pdf(const Scene &scene, MaterialId material_id);
+    static LightSamplingType light_sampling_type(const Scene &scene);
+
+    /**
+     * @brief Switches how lights are picked, starting with the next rebuild() which sets up the
+     * lights again.
+     */
+    static void set_light_sampling_type(Scene &scene, LightSamplingType type);
     static IntersectionInfo intersect(const Scene &scene, const Ray &ray);
+
+    /**
+     * @brief intersect() split in two. closest_hit() only finds the hit and resolve() looks up its
+     * shading data afterwards, which lets batches of rays keep just the small HitRecord around in
+     * between. Records refer to the active structure and are invalidated by rebuild().
+     */
+    static HitRecord closest_hit(const Scene &scene, const Ray &ray);
+    static IntersectionInfo resolve(const Scene &scene, const Ray &ray, const HitRecord &hit);
+
+    /**
+     * @brief Material of the surface hit, without resolving anything else.
+     */
+    static const Material &material(const Scene &scene, const HitRecord &hit);
+
+    /**
+     * @brief Finds the closest hit of every ray in a packet. The BVH walks its nodes once for the
+     * whole packet while all other structures trace the rays one by one. results[i] belongs to
+     * packet.m_rays[i].
+     */
+    static void intersect(const Scene &scene, const RayPacket &packet,
+                          std::vector<IntersectionInfo> &results);
+
+    /**
+     * @brief Checks whether anything is hit closer than t_max along the ray. The search stops at
+     * the first hit it comes across and no shading data is gathered, so this is a lot cheaper than
+     * intersect() for shadow rays.
+     */
+    static bool occluded(const Scene &scene, const Ray &ray, const float t_max);
+
+    /**
+     * @brief Batched version of occluded(). results[i] tells whether rays[i] hits anything closer
+     * than t_maxs[i].
+     */
+    static void occluded(const Scene &scene, const std::vector<Ray> &rays,
+                         const std::vector<float> &t_maxs, std::vector<bool> &results);
     static void rebuild(Scene &scene);
-    static const FlatStructure &accel_struct(const Scene &scene);
-    static FlatStructure &accel_struct(Scene &scene);
+
+    static AccelStructType accel_struct_type(const Scene &scene);
+
+    /**
+     * @brief Statistics of the last full build of the active structure. The flat structure has no
+     * hierarchy so it always reports zero nodes.
+     */
+    static BVHBuildStats build_stats(const Scene &scene);
+
+    /**
+     * @brief Switches the acceleration structure used for all following intersections. All shapes
+     * are moved over to the new structure which is then rebuilt on the next call to rebuild().
+     * The old structure is cleared so that only one set of nodes is kept around.
+     */
+    static void set_accel_struct_type(Scene &scene, AccelStructType type);
+
+    /**
+     * @brief Lets all structures that are built over world space triangles use spatial splits.
+     * See BVH::set_spatial_split_budget() for the meaning of the budget.
+     */
+    static void set_spatial_split_budget(Scene &scene, float budget);
+
+    /**
+     * @brief Selects the ray-triangle test of all structures. See TriangleTest.
+     */
+    static void set_triangle_test(Scene &scene, TriangleTest test);
 
   private:
-    FlatStructure m_accel_struct;
+    /**
+     * @brief Shared by all triangles of all shapes, see add_material().
+     */
+    std::vector<Material> m_materials;
+    LightSampler m_light_sampler;
+    bool m_lights_dirty = false;
+    bool m_lights_moved = false;
+    bool m_light_power_dirty = false;
+    AccelStructType m_accel_struct_type = AccelStructType::BVH;
+
+    /**
+     * @brief Settings of all structures, for handing them to structures that got cleared.
+     */
+    float m_spatial_split_budget = 0.f;
+    TriangleTest m_triangle_test = TriangleTest::MollerTrumbore;
+    FlatStructure m_flat_structure;
+    BVH m_bvh;
+    TwoLevelBVH m_two_level_bvh;
+    WideBVH m_wide_bvh;
+    CompressedWideBVH m_compressed_wide_bvh;
+    Grid m_grid;
 };
 }
 
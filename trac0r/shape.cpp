@@ -4,6 +4,9 @@
 
 #include "utils.hpp"
 
+#include <algorithm>
+#include <unordered_map>
+
 namespace trac0r {
 
 const glm::vec3 Shape::pos(const Shape &shape) {
@@ -12,6 +15,7 @@ const glm::vec3 Shape::pos(const Shape &shape) {
 
 void Shape::set_pos(Shape &shape, glm::vec3 new_pos) {
     shape.m_pos = new_pos;
+    rebuild(shape);
 }
 
 const glm::vec3 Shape::orientation(const Shape &shape) {
@@ -20,6 +24,7 @@ const glm::vec3 Shape::orientation(const Shape &shape) {
 
 void Shape::set_orientation(Shape &shape, glm::vec3 new_orientation) {
     shape.m_orientation = new_orientation;
+    rebuild(shape);
 }
 
 const glm::vec3 Shape::scale(const Shape &shape) {
@@ -28,79 +33,136 @@ const glm::vec3 Shape::scale(const Shape &shape) {
 
 void Shape::set_scale(Shape &shape, glm::vec3 new_scale) {
     shape.m_scale = new_scale;
+    rebuild(shape);
 }
 
-AABB &Shape::aabb(Shape &shape) {
-    return shape.m_aabb;
+const glm::mat4 &Shape::model(const Shape &shape) {
+    return shape.m_model;
 }
 
 const AABB &Shape::aabb(const Shape &shape) {
     return shape.m_aabb;
 }
 
-std::vector<Triangle> &Shape::triangles(Shape &shape) {
-    return shape.m_triangles;
+std::shared_ptr<const Mesh> Shape::mesh(const Shape &shape) {
+    return shape.m_mesh;
+}
+
+const std::vector<MeshTriangle> &Shape::triangles(const Shape &shape) {
+    return Mesh::triangles(*shape.m_mesh);
+}
+
+std::vector<glm::vec3> Shape::world_vertices(const Shape &shape) {
+    const auto &vertices = Mesh::vertices(*shape.m_mesh);
+    std::vector<glm::vec3> result;
+    result.reserve(vertices.size());
+    for (const auto &vertex : vertices)
+        result.push_back(glm::vec3(shape.m_model * glm::vec4(vertex, 1)));
+    return result;
+}
+
+std::vector<Triangle> Shape::world_triangles(const Shape &shape) {
+    auto vertices = Shape::world_vertices(shape);
+    std::vector<Triangle> result;
+    result.reserve(Shape::triangles(shape).size());
+    for (uint32_t i = 0; i < Shape::triangles(shape).size(); i++)
+        result.push_back(Mesh::triangle(*shape.m_mesh, vertices, i));
+    return result;
+}
+
+bool Shape::has_emitters(const Shape &shape, const std::vector<Material> &materials) {
+    for (auto material_id : Mesh::material_ids(*shape.m_mesh)) {
+        if (Material::is_emissive(materials[material_id]))
+            return true;
+    }
+    return false;
+}
+
+void Shape::gather_light_triangles(const std::vector<Shape> &shapes,
+                                   const std::vector<Material> &materials,
+                                   std::vector<Triangle> &light_triangles,
+                                   std::vector<uint32_t> &light_triangle_ids) {
+    light_triangles.clear();
+    light_triangle_ids.clear();
+    uint32_t first_triangle = 0;
+    for (const auto &shape : shapes) {
+        uint32_t triangle_count = Shape::triangles(shape).size();
+        if (Shape::has_emitters(shape, materials)) {
+            auto world_triangles = Shape::world_triangles(shape);
+            for (uint32_t i = 0; i < triangle_count; i++) {
+                if (Material::is_emissive(materials[world_triangles[i].m_material_id])) {
+                    light_triangles.push_back(world_triangles[i]);
+                    light_triangle_ids.push_back(first_triangle + i);
+                }
+            }
+        }
+        first_triangle += triangle_count;
+    }
+}
+
+uint32_t Shape::add_vertex(Shape &shape, const glm::vec3 vertex) {
+    return Mesh::add_vertex(*shape.m_mesh, vertex);
 }
 
-const std::vector<Triangle> &Shape::triangles(const Shape &shape) {
-    return shape.m_triangles;
+void Shape::add_triangle(Shape &shape, const MeshTriangle triangle) {
+    Mesh::add_triangle(*shape.m_mesh, triangle);
 }
 
 void Shape::add_triangle(Shape &shape, const Triangle triangle) {
-    shape.m_triangles.push_back(triangle);
+    Mesh::add_triangle(*shape.m_mesh, triangle);
 }
 
-Shape Shape::make_box(glm::vec3 pos, glm::vec3 orientation, glm::vec3 size, Material material) {
+Shape Shape::make_instance(const Shape &shape, glm::vec3 pos, glm::vec3 orientation,
+                           glm::vec3 scale) {
+    Shape new_shape = shape;
+    new_shape.m_pos = pos;
+    new_shape.m_orientation = orientation;
+    new_shape.m_scale = scale;
+
+    rebuild(new_shape);
+
+    return new_shape;
+}
+
+Shape Shape::make_box(glm::vec3 pos, glm::vec3 orientation, glm::vec3 size,
+                      MaterialId material_id) {
     Shape new_shape;
-    Shape::set_pos(new_shape, pos);
-    Shape::set_orientation(new_shape, orientation);
-    Shape::set_scale(new_shape, size);
-
-    auto p1 = glm::vec3{-0.5f, 0.5f, -0.5f};
-    auto p2 = glm::vec3{-0.5f, -0.5f, -0.5f};
-    auto p3 = glm::vec3{0.5f, -0.5f, -0.5f};
-    auto p4 = glm::vec3{0.5f, 0.5f, -0.5f};
-    auto p5 = glm::vec3{-0.5f, 0.5f, 0.5f};
-    auto p6 = glm::vec3{-0.5f, -0.5f, 0.5f};
-    auto p7 = glm::vec3{0.5f, -0.5f, 0.5f};
-    auto p8 = glm::vec3{0.5f, 0.5f, 0.5f};
+    new_shape.m_pos = pos;
+    new_shape.m_orientation = orientation;
+    new_shape.m_scale = size;
+
+    auto p1 = Shape::add_vertex(new_shape, {-0.5f, 0.5f, -0.5f});
+    auto p2 = Shape::add_vertex(new_shape, {-0.5f, -0.5f, -0.5f});
+    auto p3 = Shape::add_vertex(new_shape, {0.5f, -0.5f, -0.5f});
+    auto p4 = Shape::add_vertex(new_shape, {0.5f, 0.5f, -0.5f});
+    auto p5 = Shape::add_vertex(new_shape, {-0.5f, 0.5f, 0.5f});
+    auto p6 = Shape::add_vertex(new_shape, {-0.5f, -0.5f, 0.5f});
+    auto p7 = Shape::add_vertex(new_shape, {0.5f, -0.5f, 0.5f});
+    auto p8 = Shape::add_vertex(new_shape, {0.5f, 0.5f, 0.5f});
 
     // front face
-    auto t1 = Triangle(p2, p1, p3, material);
-    auto t2 = Triangle(p1, p4, p3, material);
+    Shape::add_triangle(new_shape, MeshTriangle{p2, p1, p3, material_id});
+    Shape::add_triangle(new_shape, MeshTriangle{p1, p4, p3, material_id});
 
     // right face
-    auto t3 = Triangle(p4, p3, p8, material);
-    auto t4 = Triangle(p3, p7, p8, material);
+    Shape::add_triangle(new_shape, MeshTriangle{p4, p3, p8, material_id});
+    Shape::add_triangle(new_shape, MeshTriangle{p3, p7, p8, material_id});
 
     // left face
-    auto t5 = Triangle(p1, p2, p6, material);
-    auto t6 = Triangle(p5, p1, p6, material);
+    Shape::add_triangle(new_shape, MeshTriangle{p1, p2, p6, material_id});
+    Shape::add_triangle(new_shape, MeshTriangle{p5, p1, p6, material_id});
 
     // back face
-    auto t7 = Triangle(p5, p6, p8, material);
-    auto t8 = Triangle(p6, p7, p8, material);
+    Shape::add_triangle(new_shape, MeshTriangle{p5, p6, p8, material_id});
+    Shape::add_triangle(new_shape, MeshTriangle{p6, p7, p8, material_id});
 
     // top face
-    auto t9 = Triangle(p5, p1, p4, material);
-    auto t10 = Triangle(p8, p4, p5, material);
+    Shape::add_triangle(new_shape, MeshTriangle{p5, p1, p4, material_id});
+    Shape::add_triangle(new_shape, MeshTriangle{p8, p4, p5, material_id});
 
     // bottom face
-    auto t11 = Triangle(p2, p3, p6, material);
-    auto t12 = Triangle(p3, p7, p6, material);
-
-    Shape::add_triangle(new_shape, t1);
-    Shape::add_triangle(new_shape, t2);
-    Shape::add_triangle(new_shape, t3);
-    Shape::add_triangle(new_shape, t4);
-    Shape::add_triangle(new_shape, t5);
-    Shape::add_triangle(new_shape, t6);
-    Shape::add_triangle(new_shape, t7);
-    Shape::add_triangle(new_shape, t8);
-    Shape::add_triangle(new_shape, t9);
-    Shape::add_triangle(new_shape, t10);
-    Shape::add_triangle(new_shape, t11);
-    Shape::add_triangle(new_shape, t12);
+    Shape::add_triangle(new_shape, MeshTriangle{p2, p3, p6, material_id});
+    Shape::add_triangle(new_shape, MeshTriangle{p3, p7, p6, material_id});
 
     rebuild(new_shape);
 
@@ -108,75 +170,84 @@ Shape Shape::make_box(glm::vec3 pos, glm::vec3 orientation, glm::vec3 size, Mate
 }
 
 Shape Shape::make_icosphere(glm::vec3 pos, glm::vec3 orientation, float radius, size_t iterations,
-                            Material material) {
+                            MaterialId material_id) {
     Shape new_shape;
-    Shape::set_pos(new_shape, pos);
-    Shape::set_orientation(new_shape, orientation);
-    Shape::set_scale(new_shape, glm::vec3(radius, radius, radius));
+    new_shape.m_pos = pos;
+    new_shape.m_orientation = orientation;
+    new_shape.m_scale = glm::vec3(radius, radius, radius);
 
     float t = 0.5 + glm::sqrt(5) / 2.f;
 
-    triangles(new_shape).push_back(Triangle{{-1, t, 0}, {-t, 0, 1}, {0, 1, t}, material});
-    triangles(new_shape).push_back(Triangle{{-1, t, 0}, {0, 1, t}, {1, t, 0}, material});
-    triangles(new_shape).push_back(Triangle{{-1, t, 0}, {1, t, 0}, {0, 1, -t}, material});
-    triangles(new_shape).push_back(Triangle{{-1, t, 0}, {0, 1, -t}, {-t, 0, -1}, material});
-    triangles(new_shape).push_back(Triangle{{-1, t, 0}, {-t, 0, -1}, {-t, 0, 1}, material});
-
-    triangles(new_shape).push_back(Triangle{{1, t, 0}, {0, 1, t}, {t, 0, 1}, material});
-    triangles(new_shape).push_back(Triangle{{0, 1, t}, {-t, 0, 1}, {0, -1, t}, material});
-    triangles(new_shape).push_back(Triangle{{-t, 0, 1}, {-t, 0, -1}, {-1, -t, 0}, material});
-    triangles(new_shape).push_back(Triangle{{-t, 0, -1}, {0, 1, -t}, {0, -1, -t}, material});
-    triangles(new_shape).push_back(Triangle{{0, 1, -t}, {1, t, 0}, {t, 0, -1}, material});
-
-    triangles(new_shape).push_back(Triangle{{1, -t, 0}, {t, 0, 1}, {0, -1, t}, material});
-    triangles(new_shape).push_back(Triangle{{1, -t, 0}, {0, -1, t}, {-1, -t, 0}, material});
-    triangles(new_shape).push_back(Triangle{{1, -t, 0}, {-1, -t, 0}, {0, -1, -t}, material});
-    triangles(new_shape).push_back(Triangle{{1, -t, 0}, {0, -1, -t}, {t, 0, -1}, material});
-    triangles(new_shape).push_back(Triangle{{1, -t, 0}, {t, 0, -1}, {t, 0, 1}, material});
-
-    triangles(new_shape).push_back(Triangle{{0, -1, t}, {t, 0, 1}, {0, 1, t}, material});
-    triangles(new_shape).push_back(Triangle{{-1, -t, 0}, {0, -1, t}, {-t, 0, 1}, material});
-    triangles(new_shape).push_back(Triangle{{0, -1, -t}, {-1, -t, 0}, {-t, 0, -1}, material});
-    triangles(new_shape).push_back(Triangle{{t, 0, -1}, {0, -1, -t}, {0, 1, -t}, material});
-    triangles(new_shape).push_back(Triangle{{t, 0, 1}, {t, 0, -1}, {1, t, 0}, material});
+    // The 12 vertices and 20 faces of an icosahedron
+    auto &vertices = Mesh::vertices(*new_shape.m_mesh);
+    vertices = {{-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0}, {0, -1, t}, {0, 1, t},
+                {0, -1, -t}, {0, 1, -t}, {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1}};
+
+    const uint32_t faces[20][3] = {{0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11},
+                                   {1, 5, 9}, {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+                                   {3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8}, {3, 8, 9},
+                                   {4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1}};
+    auto &triangles = Mesh::triangles(*new_shape.m_mesh);
+    for (const auto &face : faces)
+        triangles.push_back(MeshTriangle{face[0], face[1], face[2], material_id});
 
     for (size_t i = 0; i < iterations; i++) {
-        std::vector<Triangle> new_triangles;
-        for (const auto &tri : triangles(new_shape)) {
-            glm::vec3 a = glm::normalize(get_middle_point(tri.m_v1, tri.m_v2));
-            glm::vec3 b = glm::normalize(get_middle_point(tri.m_v2, tri.m_v3));
-            glm::vec3 c = glm::normalize(get_middle_point(tri.m_v3, tri.m_v1));
-
-            new_triangles.push_back(Triangle{glm::normalize(tri.m_v1), a, c, material});
-            new_triangles.push_back(Triangle{glm::normalize(tri.m_v2), b, a, material});
-            new_triangles.push_back(Triangle{glm::normalize(tri.m_v3), c, b, material});
-            new_triangles.push_back(Triangle{a, b, c, material});
+        for (auto &vertex : vertices)
+            vertex = glm::normalize(vertex);
+
+        // Every edge is split once and its middle point is shared by the triangles on both sides
+        std::unordered_map<uint64_t, uint32_t> middle_points;
+        auto middle_point = [&](uint32_t v1, uint32_t v2) {
+            uint64_t key = (uint64_t(std::min(v1, v2)) << 32) | std::max(v1, v2);
+            auto it = middle_points.find(key);
+            if (it != middle_points.end())
+                return it->second;
+            auto middle = glm::normalize(get_middle_point(vertices[v1], vertices[v2]));
+            uint32_t index = vertices.size();
+            vertices.push_back(middle);
+            middle_points.emplace(key, index);
+            return index;
+        };
+
+        std::vector<MeshTriangle> new_triangles;
+        new_triangles.reserve(triangles.size() * 4);
+        for (const auto &tri : triangles) {
+            auto a = middle_point(tri.m_v1, tri.m_v2);
+            auto b = middle_point(tri.m_v2, tri.m_v3);
+            auto c = middle_point(tri.m_v3, tri.m_v1);
+
+            new_triangles.push_back(MeshTriangle{tri.m_v1, a, c, material_id});
+            new_triangles.push_back(MeshTriangle{tri.m_v2, b, a, material_id});
+            new_triangles.push_back(MeshTriangle{tri.m_v3, c, b, material_id});
+            new_triangles.push_back(MeshTriangle{a, b, c, material_id});
         }
 
-        new_shape.m_triangles = new_triangles;
+        triangles = new_triangles;
     }
 
+    Mesh::rebuild(*new_shape.m_mesh);
     rebuild(new_shape);
 
     return new_shape;
 }
 
-Shape Shape::make_plane(glm::vec3 pos, glm::vec3 orientation, glm::vec2 size, Material material) {
+Shape Shape::make_plane(glm::vec3 pos, glm::vec3 orientation, glm::vec2 size,
+                        MaterialId material_id) {
     Shape new_shape;
-    Shape::set_pos(new_shape, pos);
-    Shape::set_orientation(new_shape, orientation);
-    Shape::set_scale(new_shape, glm::vec3(size.x, 0, size.y));
+    new_shape.m_pos = pos;
+    new_shape.m_orientation = orientation;
 
-    auto p1 = glm::vec3{-0.5f, 0, 0.5f};
-    auto p2 = glm::vec3{-0.5f, 0, -0.5f};
-    auto p3 = glm::vec3{0.5f, 0, -0.5f};
-    auto p4 = glm::vec3{0.5f, 0, 0.5f};
+    // The plane has no thickness anyway so we keep the y scale at 1 to keep the model matrix
+    // invertible
+    new_shape.m_scale = glm::vec3(size.x, 1, size.y);
 
-    auto triangle_left = Triangle(p2, p1, p3, material);
-    auto triangle_right = Triangle(p1, p4, p3, material);
+    auto p1 = Shape::add_vertex(new_shape, {-0.5f, 0, 0.5f});
+    auto p2 = Shape::add_vertex(new_shape, {-0.5f, 0, -0.5f});
+    auto p3 = Shape::add_vertex(new_shape, {0.5f, 0, -0.5f});
+    auto p4 = Shape::add_vertex(new_shape, {0.5f, 0, 0.5f});
 
-    Shape::add_triangle(new_shape, triangle_left);
-    Shape::add_triangle(new_shape, triangle_right);
+    Shape::add_triangle(new_shape, MeshTriangle{p2, p1, p3, material_id});
+    Shape::add_triangle(new_shape, MeshTriangle{p1, p4, p3, material_id});
 
     rebuild(new_shape);
 
@@ -189,21 +260,18 @@ void Shape::rebuild(Shape &shape) {
     glm::mat4 rotation_y = glm::rotate(Shape::orientation(shape).y, glm::vec3{0, 1, 0});
     glm::mat4 rotation_z = glm::rotate(Shape::orientation(shape).z, glm::vec3{0, 0, 1});
     glm::mat4 scale = glm::scale(Shape::scale(shape));
-    glm::mat4 model = translation * rotation_x * rotation_y * rotation_z * scale;
-
-    for (auto &tri : triangles(shape)) {
-        tri.m_v1 = glm::vec3(model * glm::vec4(tri.m_v1, 1));
-        tri.m_v2 = glm::vec3(model * glm::vec4(tri.m_v2, 1));
-        tri.m_v3 = glm::vec3(model * glm::vec4(tri.m_v3, 1));
-        tri.rebuild();
-    }
+    shape.m_model = translation * rotation_x * rotation_y * rotation_z * scale;
 
-    auto &aabb = Shape::aabb(shape);
+    // Transforming the corners of the mesh's bounding box is a bit looser than transforming every
+    // vertex but it keeps moving a shape independent of its triangle count
+    auto mesh_aabb = Mesh::aabb(*shape.m_mesh);
+    auto &aabb = shape.m_aabb;
     AABB::reset(aabb);
-    for (auto &tri : Shape::triangles(shape)) {
-        AABB::extend(aabb, tri.m_v1);
-        AABB::extend(aabb, tri.m_v2);
-        AABB::extend(aabb, tri.m_v3);
+    if (Mesh::triangles(*shape.m_mesh).empty())
+        return;
+    for (auto &vertex : AABB::vertices(mesh_aabb)) {
+        glm::vec3 world_vertex = glm::vec3(shape.m_model * glm::vec4(vertex, 1));
+        AABB::extend(aabb, world_vertex);
     }
 }
 }
@@ -2,9 +2,12 @@
 #define SHAPE_HPP
 
 #include "aabb.hpp"
+#include "mesh.hpp"
 #include "triangle.hpp"
 #include "material.hpp"
 
+#include <glm/glm.hpp>
+
 #include <memory>
 #include <vector>
 
@@ -21,28 +24,92 @@ class Shape {
     static const glm::vec3 scale(const Shape &shape);
     static void set_scale(Shape &shape, glm::vec3 new_scale);
 
-    static AABB &aabb(Shape &shape);
+    /**
+     * @brief Transformation from object space into world space built from position, orientation
+     * and scale.
+     */
+    static const glm::mat4 &model(const Shape &shape);
+
+    /**
+     * @brief Bounding box in world space.
+     */
     static const AABB &aabb(const Shape &shape);
 
-    static std::vector<Triangle> &triangles(Shape &shape);
-    static const std::vector<Triangle> &triangles(const Shape &shape);
+    /**
+     * @brief The mesh in object space. It is shared by all instances of this shape.
+     */
+    static std::shared_ptr<const Mesh> mesh(const Shape &shape);
+
+    /**
+     * @brief Indexed triangles in object space.
+     */
+    static const std::vector<MeshTriangle> &triangles(const Shape &shape);
+
+    /**
+     * @brief Vertices of the mesh transformed into world space, each of them exactly once.
+     */
+    static std::vector<glm::vec3> world_vertices(const Shape &shape);
+
+    /**
+     * @brief Triangles assembled from world_vertices(). This creates a copy of the whole mesh so
+     * it's only meant for structures that need to flatten the scene.
+     */
+    static std::vector<Triangle> world_triangles(const Shape &shape);
 
+    /**
+     * @brief Whether any triangle of the shape uses a material that is emissive in the given
+     * material table.
+     */
+    static bool has_emitters(const Shape &shape, const std::vector<Material> &materials);
+
+    /**
+     * @brief Collects the emissive triangles of all shapes in world space. Only shapes whose mesh
+     * has emitters at all are transformed.
+     *
+     * @param light_triangle_ids Scene-wide index of each light triangle (see
+     * IntersectionInfo::m_triangle_id), in ascending order
+     */
+    static void gather_light_triangles(const std::vector<Shape> &shapes,
+                                       const std::vector<Material> &materials,
+                                       std::vector<Triangle> &light_triangles,
+                                       std::vector<uint32_t> &light_triangle_ids);
+
+    static uint32_t add_vertex(Shape &shape, const glm::vec3 vertex);
+    static void add_triangle(Shape &shape, const MeshTriangle triangle);
+
+    /**
+     * @brief Adds a triangle with vertices of its own. Prefer add_vertex() and indexed triangles
+     * for closed meshes.
+     */
     static void add_triangle(Shape &shape, const Triangle triangle);
 
-    static Shape make_box(glm::vec3 pos, glm::vec3 orientation, glm::vec3 size, Material material);
+    /**
+     * @brief Creates a new shape that shares the mesh of an existing one but has its own
+     * transformation. Neither triangles nor any per-mesh acceleration data get copied.
+     */
+    static Shape make_instance(const Shape &shape, glm::vec3 pos, glm::vec3 orientation,
+                               glm::vec3 scale);
+
+    /**
+     * @brief The primitives below give all their triangles the same material. Its id has to come
+     * from Scene::add_material() of the scene the shape is going to be added to.
+     */
+    static Shape make_box(glm::vec3 pos, glm::vec3 orientation, glm::vec3 size,
+                          MaterialId material_id);
 
     static Shape make_icosphere(glm::vec3 pos, glm::vec3 orientation, float radius,
-                                size_t iterations, Material material);
+                                size_t iterations, MaterialId material_id);
 
     static Shape make_plane(glm::vec3 pos, glm::vec3 orientation, glm::vec2 size,
-                            Material material);
+                            MaterialId material_id);
 
   protected:
     glm::vec3 m_pos;
     glm::vec3 m_orientation;
-    glm::vec3 m_scale;
+    glm::vec3 m_scale = {1.f, 1.f, 1.f};
+    glm::mat4 m_model = glm::mat4(1.f);
     AABB m_aabb;
-    std::vector<Triangle> m_triangles;
+    std::shared_ptr<Mesh> m_mesh = std::make_shared<Mesh>();
 
   private:
     static void rebuild(Shape &shape);
@@ -0,0 +1,147 @@
+#include "task_pool.hpp"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace trac0r {
+
+/**
+ * @brief The pool the current thread works for and its index there, if it's a worker at all.
+ */
+static thread_local const TaskPool *current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+TaskPool::TaskPool(uint32_t thread_count, int first_core) {
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    // The thread calling parallel_for() is one of them
+    const uint32_t worker_count = thread_count - 1;
+    for (uint32_t i = 0; i < worker_count; i++)
+        m_workers.emplace_back(new Worker);
+
+#ifdef __linux__
+    m_pinned = first_core >= 0;
+#endif
+    for (uint32_t i = 0; i < worker_count; i++) {
+        m_threads.emplace_back([this, i] { work(*this, i); });
+#ifdef __linux__
+        if (m_pinned) {
+            cpu_set_t cores;
+            CPU_ZERO(&cores);
+            CPU_SET(first_core + i, &cores);
+            pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(cores), &cores);
+        }
+#endif
+    }
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto &thread : m_threads)
+        thread.join();
+}
+
+uint32_t TaskPool::thread_count(const TaskPool &pool) {
+    return pool.m_workers.size() + 1;
+}
+
+bool TaskPool::pinned(const TaskPool &pool) {
+    return pool.m_pinned;
+}
+
+void TaskPool::parallel_for(TaskPool &pool, uint32_t begin, uint32_t end, uint32_t grain,
+                            const std::function<void(uint32_t, uint32_t)> &func) {
+    if (begin >= end)
+        return;
+    grain = std::max(grain, 1u);
+    const uint32_t chunk_count = (end - begin + grain - 1) / grain;
+    if (pool.m_workers.empty() || chunk_count == 1) {
+        func(begin, end);
+        return;
+    }
+
+    int worker = current_pool == &pool ? current_worker : -1;
+    std::atomic<uint32_t> remaining{chunk_count};
+    for (uint32_t chunk = 0; chunk < chunk_count; chunk++) {
+        // A worker keeps the chunks to itself until someone steals them, chunks from outside of
+        // the pool are dealt out to all workers. Chunks go in back to front so that the owner
+        // starts with the first one and thieves take the last ones.
+        uint32_t first = begin + (chunk_count - 1 - chunk) * grain;
+        uint32_t last = std::min(first + grain, end);
+        uint32_t target = worker >= 0 ? worker : chunk % pool.m_workers.size();
+        push(pool, target, [&func, &remaining, first, last] {
+            func(first, last);
+            remaining.fetch_sub(1, std::memory_order_release);
+        });
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool.m_sleep_mutex);
+    }
+    pool.m_wake.notify_all();
+
+    // Help out instead of blocking. All tasks that reference func are done once remaining is zero.
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (!run_one(pool, worker))
+            std::this_thread::yield();
+    }
+}
+
+void TaskPool::push(TaskPool &pool, uint32_t worker, Task task) {
+    auto &target = *pool.m_workers[worker];
+    std::lock_guard<std::mutex> lock(target.m_mutex);
+    target.m_tasks.push_back(std::move(task));
+    pool.m_queued++;
+}
+
+bool TaskPool::run_one(TaskPool &pool, int worker) {
+    Task task;
+    if (worker >= 0) {
+        auto &own = *pool.m_workers[worker];
+        std::lock_guard<std::mutex> lock(own.m_mutex);
+        if (!own.m_tasks.empty()) {
+            task = std::move(own.m_tasks.back());
+            own.m_tasks.pop_back();
+        }
+    }
+
+    const uint32_t worker_count = pool.m_workers.size();
+    const uint32_t first_victim = worker >= 0 ? worker + 1 : 0;
+    for (uint32_t i = 0; !task && i < worker_count; i++) {
+        auto &victim = *pool.m_workers[(first_victim + i) % worker_count];
+        std::lock_guard<std::mutex> lock(victim.m_mutex);
+        if (!victim.m_tasks.empty()) {
+            task = std::move(victim.m_tasks.front());
+            victim.m_tasks.pop_front();
+        }
+    }
+
+    if (!task)
+        return false;
+    pool.m_queued--;
+    task();
+    return true;
+}
+
+void TaskPool::work(TaskPool &pool, uint32_t worker) {
+    current_pool = &pool;
+    current_worker = worker;
+    while (true) {
+        if (run_one(pool, worker))
+            continue;
+
+        std::unique_lock<std::mutex> lock(pool.m_sleep_mutex);
+        pool.m_wake.wait(lock, [&pool] { return pool.m_stop || pool.m_queued > 0; });
+        if (pool.m_stop)
+            return;
+    }
+}
+}
@@ -0,0 +1,102 @@
+#ifndef TASK_POOL_HPP
+#define TASK_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief A fixed set of worker threads that share work by stealing. Every worker has a deque of
+ * its own: it takes tasks from the back, where the ones it pushed itself sit while they're still
+ * warm in cache, and idle workers steal from the front of the others. A thread that waits for a
+ * parallel_for() to finish works on tasks in the meantime, which makes nested calls (like building
+ * a BVH from inside a render job) safe and keeps the pool from being oversubscribed by them.
+ *
+ * Unlike OpenMP the number of threads is fixed per pool and can be bound to a range of cores, so
+ * several render jobs on one machine can each get a pool of their own without competing for cores.
+ */
+class TaskPool {
+  public:
+    /**
+     * @param thread_count Threads that work on a parallel_for(), counting the one that calls it.
+     * Zero uses one per hardware thread.
+     * @param first_core If not negative, worker n only runs on core first_core + n. Only supported
+     * on Linux, elsewhere threads are never pinned.
+     */
+    TaskPool(uint32_t thread_count = 0, int first_core = -1);
+    ~TaskPool();
+    TaskPool(const TaskPool &) = delete;
+    TaskPool &operator=(const TaskPool &) = delete;
+
+    static uint32_t thread_count(const TaskPool &pool);
+    static bool pinned(const TaskPool &pool);
+
+    /**
+     * @brief Calls func(first, last) for consecutive ranges of at most grain indices that together
+     * cover [begin, end) and returns once all of them are done.
+     */
+    static void parallel_for(TaskPool &pool, uint32_t begin, uint32_t end, uint32_t grain,
+                             const std::function<void(uint32_t, uint32_t)> &func);
+
+  private:
+    using Task = std::function<void()>;
+
+    struct Worker {
+        std::mutex m_mutex;
+        std::deque<Task> m_tasks;
+    };
+
+    static void push(TaskPool &pool, uint32_t worker, Task task);
+
+    /**
+     * @brief Runs one task, taken from the back of the given worker's own deque if it has one or
+     * stolen from the front of another deque otherwise.
+     *
+     * @param worker Index of the calling worker or -1 for threads outside of the pool.
+     * @return Whether there was any task to run.
+     */
+    static bool run_one(TaskPool &pool, int worker);
+    static void work(TaskPool &pool, uint32_t worker);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+
+    /**
+     * @brief Tasks pushed but not yet taken by any thread. Workers go to sleep when it's zero.
+     */
+    std::atomic<uint32_t> m_queued{0};
+    std::atomic<bool> m_stop{false};
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_wake;
+    bool m_pinned = false;
+};
+
+/**
+ * @brief Calls func(i) for every i in [begin, end), on the task pool if one is given and with
+ * OpenMP otherwise. Indices are handed out in runs of grain.
+ */
+template <typename Func>
+void parallel_for(TaskPool *pool, uint32_t begin, uint32_t end, uint32_t grain, Func func) {
+    if (pool) {
+        TaskPool::parallel_for(*pool, begin, end, grain, [&func](uint32_t first, uint32_t last) {
+            for (uint32_t i = first; i < last; i++)
+                func(i);
+        });
+        return;
+    }
+
+#pragma omp parallel for schedule(dynamic, grain)
+    for (uint32_t i = begin; i < end; i++)
+        func(i);
+}
+}
+
+#endif /* end of include guard: TASK_POOL_HPP */
@@ -0,0 +1,84 @@
+#include "tile_scheduler.hpp"
+
+#include <algorithm>
+
+namespace trac0r {
+
+// Spreads the lower 16 bits of v out to every other bit
+static uint32_t expand_bits(uint32_t v) {
+    v &= 0x0000FFFFu;
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+uint32_t TileScheduler::tile_size(const TileScheduler &scheduler) {
+    return scheduler.m_tile_size;
+}
+
+void TileScheduler::set_tile_size(TileScheduler &scheduler, uint32_t tile_size) {
+    scheduler.m_tile_size = std::max(tile_size, 1u);
+    scheduler.m_tiles.clear();
+}
+
+const std::vector<Tile> &TileScheduler::plan(TileScheduler &scheduler, uint32_t width,
+                                             uint32_t height, uint32_t stride_x,
+                                             uint32_t stride_y) {
+    if (!scheduler.m_tiles.empty() && scheduler.m_width == width &&
+        scheduler.m_height == height && scheduler.m_stride_x == stride_x &&
+        scheduler.m_stride_y == stride_y)
+        return scheduler.m_tiles;
+
+    scheduler.m_width = width;
+    scheduler.m_height = height;
+    scheduler.m_stride_x = stride_x;
+    scheduler.m_stride_y = stride_y;
+
+    // Pixels that actually get rendered at this stride
+    const uint32_t columns = (width + stride_x - 1) / stride_x;
+    const uint32_t rows = (height + stride_y - 1) / stride_y;
+    const uint32_t size = scheduler.m_tile_size;
+    const uint32_t tiles_x = (columns + size - 1) / size;
+    const uint32_t tiles_y = (rows + size - 1) / size;
+
+    std::vector<std::pair<uint32_t, Tile>> keyed_tiles;
+    keyed_tiles.reserve(tiles_x * tiles_y);
+    for (uint32_t tile_y = 0; tile_y < tiles_y; tile_y++) {
+        for (uint32_t tile_x = 0; tile_x < tiles_x; tile_x++) {
+            Tile tile;
+            tile.m_x = tile_x * size * stride_x;
+            tile.m_y = tile_y * size * stride_y;
+            tile.m_columns = std::min(size, columns - tile_x * size);
+            tile.m_rows = std::min(size, rows - tile_y * size);
+            keyed_tiles.emplace_back(expand_bits(tile_x) | expand_bits(tile_y) << 1, tile);
+        }
+    }
+    std::sort(keyed_tiles.begin(), keyed_tiles.end(),
+              [](const std::pair<uint32_t, Tile> &a, const std::pair<uint32_t, Tile> &b) {
+                  return a.first < b.first;
+              });
+
+    scheduler.m_tiles.clear();
+    for (const auto &keyed_tile : keyed_tiles)
+        scheduler.m_tiles.push_back(keyed_tile.second);
+    return scheduler.m_tiles;
+}
+
+void TileScheduler::write_back(const TileScheduler &scheduler, const Tile &tile,
+                               const std::vector<glm::vec4> &tile_luminance, bool overwrite,
+                               std::vector<glm::vec4> &luminance) {
+    for (uint32_t row = 0; row < tile.m_rows; row++) {
+        auto pixel = (tile.m_y + row * scheduler.m_stride_y) * scheduler.m_width + tile.m_x;
+        for (uint32_t column = 0; column < tile.m_columns; column++) {
+            const auto &color = tile_luminance[row * tile.m_columns + column];
+            if (overwrite)
+                luminance[pixel] = color;
+            else
+                luminance[pixel] += color;
+            pixel += scheduler.m_stride_x;
+        }
+    }
+}
+}
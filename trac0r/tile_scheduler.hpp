@@ -0,0 +1,67 @@
+#ifndef TILE_SCHEDULER_HPP
+#define TILE_SCHEDULER_HPP
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Default number of (strided) pixels per tile side.
+ */
+const uint32_t default_tile_size = 16;
+
+/**
+ * @brief A rectangle of pixels that one thread renders in one go. It covers m_columns x m_rows
+ * pixels of the strided image starting at pixel (m_x, m_y).
+ */
+struct Tile {
+    uint32_t m_x;
+    uint32_t m_y;
+    uint32_t m_columns;
+    uint32_t m_rows;
+
+    static uint32_t pixel_count(const Tile &tile) {
+        return tile.m_columns * tile.m_rows;
+    }
+};
+
+/**
+ * @brief Splits the image into square tiles and orders them along a Morton curve. Threads that
+ * pick up consecutive tiles then work on neighboring parts of the image, so the rays they trace at
+ * the same time hit mostly the same geometry and share it in cache. Tiles are only planned again
+ * when the image size, stride or tile size changes.
+ */
+class TileScheduler {
+  public:
+    static uint32_t tile_size(const TileScheduler &scheduler);
+    static void set_tile_size(TileScheduler &scheduler, uint32_t tile_size);
+
+    /**
+     * @brief Tiles covering every stride_x-th column and stride_y-th row of the image.
+     */
+    static const std::vector<Tile> &plan(TileScheduler &scheduler, uint32_t width, uint32_t height,
+                                         uint32_t stride_x, uint32_t stride_y);
+
+    /**
+     * @brief Copies the colors of a tile, stored row by row, into the image.
+     *
+     * @param overwrite Whether colors replace what's in luminance or are added to it.
+     */
+    static void write_back(const TileScheduler &scheduler, const Tile &tile,
+                           const std::vector<glm::vec4> &tile_luminance, bool overwrite,
+                           std::vector<glm::vec4> &luminance);
+
+  private:
+    uint32_t m_tile_size = default_tile_size;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    uint32_t m_stride_x = 0;
+    uint32_t m_stride_y = 0;
+    std::vector<Tile> m_tiles;
+};
+}
+
+#endif /* end of include guard: TILE_SCHEDULER_HPP */
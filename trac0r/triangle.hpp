@@ -13,8 +13,8 @@ struct Triangle {
     Triangle() {
     }
 
-    Triangle(glm::vec3 v1, glm::vec3 v2, glm::vec3 v3, Material material)
-        : m_v1(v1), m_v2(v2), m_v3(v3), m_material(material) {
+    Triangle(glm::vec3 v1, glm::vec3 v2, glm::vec3 v3, MaterialId material_id)
+        : m_v1(v1), m_v2(v2), m_v3(v3), m_material_id(material_id) {
         rebuild();
     }
 
@@ -35,18 +35,29 @@ struct Triangle {
         m_area = glm::sqrt(s * (s - a) * (s - b) * (s - c));
     }
 
+    /**
+     * @brief Picks a point on the triangle with uniform distribution, so its density with respect
+     * to area is 1 / m_area.
+     */
     static inline glm::vec3 random_point(const Triangle &triangle) {
-        return triangle.m_v1 + rand_range(0.f, 1.f) * (triangle.m_v2 - triangle.m_v1) +
-               rand_range(0.f, 1.f) * (triangle.m_v3 - triangle.m_v1);
+        // Taking the square root keeps points from bunching up at m_v1
+        float r1 = glm::sqrt(rand_range(0.f, 1.f));
+        float r2 = rand_range(0.f, 1.f);
+        return (1.f - r1) * triangle.m_v1 + r1 * (1.f - r2) * triangle.m_v2 +
+               r1 * r2 * triangle.m_v3;
     }
 
     glm::vec3 m_v1;
     glm::vec3 m_v2;
     glm::vec3 m_v3;
-    Material m_material;
     glm::vec3 m_normal;
     glm::vec3 m_centroid;
     float m_area;
+
+    /**
+     * @brief Index into the material table of the scene the triangle's shape gets added to.
+     */
+    MaterialId m_material_id = 0;
 };
 }
 
@@ -0,0 +1,137 @@
+#ifndef TRIANGLE_GEOMETRY_HPP
+#define TRIANGLE_GEOMETRY_HPP
+
+#include "triangle.hpp"
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Index that stands for no triangle at all, e.g. when a ray missed everything.
+ */
+const uint32_t no_triangle = std::numeric_limits<uint32_t>::max();
+
+/**
+ * @brief Available ray-triangle tests.
+ *
+ * MollerTrumbore is the fastest but rejects hits closer than a fixed epsilon and can let rays slip
+ * through edges shared by neighboring triangles. Watertight (Woop et al., "Watertight Ray/Triangle
+ * Intersection", JCGT 2013) never misses a shared edge and reports hits right down to distance 0.
+ */
+enum class TriangleTest { MollerTrumbore, Watertight };
+
+/**
+ * @brief The part of many triangles that ray intersection needs, stored component-wise. What the
+ * three points a, b and c of a record hold is prepared at build time for the chosen test: For
+ * Möller-Trumbore a is the first vertex and b and c are the edges from there to the other two
+ * vertices. The watertight test needs the vertices themselves since edges can't be reconstructed
+ * exactly. Materials and normals stay in a separate array with the same indices, either of whole
+ * Triangles or of TriangleShading, so that they're only touched once for the final hit.
+ */
+struct TriangleGeometry {
+    static size_t size(const TriangleGeometry &geometry) {
+        return geometry.m_a_x.size();
+    }
+
+    static void resize(TriangleGeometry &geometry, size_t size) {
+        for (auto component : components(geometry))
+            component->resize(size);
+    }
+
+    /**
+     * @brief Changes the test that records are prepared for. All triangles have to be set again
+     * afterwards.
+     */
+    static void set_test(TriangleGeometry &geometry, TriangleTest test) {
+        geometry.m_test = test;
+    }
+
+    static void set(TriangleGeometry &geometry, size_t index, const Triangle &triangle) {
+        auto a = triangle.m_v1;
+        auto b = triangle.m_v2;
+        auto c = triangle.m_v3;
+        if (geometry.m_test == TriangleTest::MollerTrumbore) {
+            b = triangle.m_v2 - triangle.m_v1;
+            c = triangle.m_v3 - triangle.m_v1;
+        }
+        geometry.m_a_x[index] = a.x;
+        geometry.m_a_y[index] = a.y;
+        geometry.m_a_z[index] = a.z;
+        geometry.m_b_x[index] = b.x;
+        geometry.m_b_y[index] = b.y;
+        geometry.m_b_z[index] = b.z;
+        geometry.m_c_x[index] = c.x;
+        geometry.m_c_y[index] = c.y;
+        geometry.m_c_z[index] = c.z;
+    }
+
+    static void assign(TriangleGeometry &geometry, const std::vector<Triangle> &triangles) {
+        resize(geometry, triangles.size());
+        for (size_t i = 0; i < triangles.size(); i++)
+            set(geometry, i, triangles[i]);
+    }
+
+    /**
+     * @brief Recovers the vertices of a record. For Möller-Trumbore they are off by the rounding of
+     * adding the edges back, which is as close as the edges themselves get to the real triangle.
+     */
+    static std::array<glm::vec3, 3> vertices(const TriangleGeometry &geometry, size_t index) {
+        auto v1 = a(geometry, index);
+        if (geometry.m_test == TriangleTest::MollerTrumbore)
+            return {{v1, v1 + b(geometry, index), v1 + c(geometry, index)}};
+        return {{v1, b(geometry, index), c(geometry, index)}};
+    }
+
+    static glm::vec3 a(const TriangleGeometry &geometry, size_t index) {
+        return {geometry.m_a_x[index], geometry.m_a_y[index], geometry.m_a_z[index]};
+    }
+
+    static glm::vec3 b(const TriangleGeometry &geometry, size_t index) {
+        return {geometry.m_b_x[index], geometry.m_b_y[index], geometry.m_b_z[index]};
+    }
+
+    static glm::vec3 c(const TriangleGeometry &geometry, size_t index) {
+        return {geometry.m_c_x[index], geometry.m_c_y[index], geometry.m_c_z[index]};
+    }
+
+    TriangleTest m_test = TriangleTest::MollerTrumbore;
+    std::vector<float> m_a_x;
+    std::vector<float> m_a_y;
+    std::vector<float> m_a_z;
+    std::vector<float> m_b_x;
+    std::vector<float> m_b_y;
+    std::vector<float> m_b_z;
+    std::vector<float> m_c_x;
+    std::vector<float> m_c_y;
+    std::vector<float> m_c_z;
+
+  private:
+    static std::array<std::vector<float> *, 9> components(TriangleGeometry &geometry) {
+        return {{&geometry.m_a_x, &geometry.m_a_y, &geometry.m_a_z, &geometry.m_b_x,
+                 &geometry.m_b_y, &geometry.m_b_z, &geometry.m_c_x, &geometry.m_c_y,
+                 &geometry.m_c_z}};
+    }
+};
+
+/**
+ * @brief The part of a triangle that resolving a hit needs. Structures that keep no other copy of
+ * their triangles store these next to their TriangleGeometry.
+ */
+struct TriangleShading {
+    glm::vec3 m_normal;
+    MaterialId m_material_id;
+
+    /**
+     * @brief Scene-wide index of the triangle, see IntersectionInfo::m_triangle_id.
+     */
+    uint32_t m_triangle_id;
+};
+}
+
+#endif /* end of include guard: TRIANGLE_GEOMETRY_HPP */
@@ -0,0 +1,247 @@
+#include "two_level_bvh.hpp"
+#include "timer.hpp"
+
+#include <limits>
+
+namespace trac0r {
+
+void TwoLevelBVH::add_shape(TwoLevelBVH &tlbvh, Shape &shape) {
+    tlbvh.m_shapes.push_back(shape);
+    tlbvh.m_needs_rebuild = true;
+}
+
+void TwoLevelBVH::mark_dirty(TwoLevelBVH &tlbvh, size_t shape_index) {
+    tlbvh.m_dirty_shapes.push_back(shape_index);
+}
+
+std::vector<Shape> &TwoLevelBVH::shapes(TwoLevelBVH &tlbvh) {
+    return tlbvh.m_shapes;
+}
+
+const std::vector<Shape> &TwoLevelBVH::shapes(const TwoLevelBVH &tlbvh) {
+    return tlbvh.m_shapes;
+}
+
+const BVHBuildStats &TwoLevelBVH::build_stats(const TwoLevelBVH &tlbvh) {
+    return tlbvh.m_build_stats;
+}
+
+IntersectionInfo TwoLevelBVH::intersect(const TwoLevelBVH &tlbvh, const Ray &ray) {
+    return resolve(tlbvh, ray, closest_hit(tlbvh, ray));
+}
+
+HitRecord TwoLevelBVH::closest_hit(const TwoLevelBVH &tlbvh, const Ray &ray) {
+    HitRecord hit;
+    BVH::traverse(tlbvh.m_nodes, ray, hit.m_t, [&](const BVHNode &leaf) {
+        for (uint32_t i = leaf.m_first; i < leaf.m_first + leaf.m_count; i++) {
+            const auto &instance = tlbvh.m_instances[i];
+            const auto &hierarchy = tlbvh.m_mesh_hierarchies[instance.m_mesh_hierarchy];
+
+            // The direction is deliberately not normalized so that distances along the object
+            // space ray are the same as along the world space ray
+            Ray object_ray{glm::vec3(instance.m_world_to_object * glm::vec4(ray.m_origin, 1)),
+                           glm::vec3(instance.m_world_to_object * glm::vec4(ray.m_dir, 0))};
+            auto index = BVH::intersect_triangles(hierarchy.m_nodes, hierarchy.m_geometry,
+                                                  object_ray, hit.m_t);
+            if (index != no_triangle) {
+                hit.m_triangle = index;
+                hit.m_instance = i;
+            }
+        }
+        return false;
+    });
+
+    return hit;
+}
+
+IntersectionInfo TwoLevelBVH::resolve(const TwoLevelBVH &tlbvh, const Ray &ray,
+                                      const HitRecord &hit) {
+    if (!HitRecord::has_hit(hit))
+        return IntersectionInfo{};
+
+    const auto &instance = tlbvh.m_instances[hit.m_instance];
+    const auto &hierarchy = tlbvh.m_mesh_hierarchies[instance.m_mesh_hierarchy];
+    const auto &mesh = *hierarchy.m_mesh;
+    auto index = hierarchy.m_triangle_indices[hit.m_triangle];
+    auto normal = glm::normalize(instance.m_normal_to_world * Mesh::normal(mesh, index));
+    return HitRecord::resolve(hit, ray, normal, Mesh::triangles(mesh)[index].m_material_id,
+                              tlbvh.m_shape_offsets[instance.m_shape] + index);
+}
+
+MaterialId TwoLevelBVH::material_id(const TwoLevelBVH &tlbvh, const HitRecord &hit) {
+    const auto &instance = tlbvh.m_instances[hit.m_instance];
+    const auto &hierarchy = tlbvh.m_mesh_hierarchies[instance.m_mesh_hierarchy];
+    auto index = hierarchy.m_triangle_indices[hit.m_triangle];
+    return Mesh::triangles(*hierarchy.m_mesh)[index].m_material_id;
+}
+
+bool TwoLevelBVH::occluded(const TwoLevelBVH &tlbvh, const Ray &ray, const float t_max) {
+    bool hit = false;
+    float max_dist = t_max;
+    BVH::traverse(tlbvh.m_nodes, ray, max_dist, [&](const BVHNode &leaf) {
+        for (uint32_t i = leaf.m_first; i < leaf.m_first + leaf.m_count; i++) {
+            const auto &instance = tlbvh.m_instances[i];
+            const auto &hierarchy = tlbvh.m_mesh_hierarchies[instance.m_mesh_hierarchy];
+            Ray object_ray{glm::vec3(instance.m_world_to_object * glm::vec4(ray.m_origin, 1)),
+                           glm::vec3(instance.m_world_to_object * glm::vec4(ray.m_dir, 0))};
+            if (BVH::occluded_triangles(hierarchy.m_nodes, hierarchy.m_geometry, object_ray,
+                                        t_max)) {
+                hit = true;
+                return true;
+            }
+        }
+        return false;
+    });
+
+    return hit;
+}
+
+void TwoLevelBVH::set_triangle_test(TwoLevelBVH &tlbvh, TriangleTest test) {
+    tlbvh.m_triangle_test = test;
+    for (auto &hierarchy : tlbvh.m_mesh_hierarchies)
+        assign_geometry(hierarchy, test);
+}
+
+void TwoLevelBVH::assign_geometry(MeshHierarchy &hierarchy, TriangleTest test) {
+    const auto &mesh = *hierarchy.m_mesh;
+    TriangleGeometry::set_test(hierarchy.m_geometry, test);
+    TriangleGeometry::resize(hierarchy.m_geometry, hierarchy.m_triangle_indices.size());
+    for (size_t i = 0; i < hierarchy.m_triangle_indices.size(); i++) {
+        auto triangle = Mesh::triangle(mesh, Mesh::vertices(mesh), hierarchy.m_triangle_indices[i]);
+        TriangleGeometry::set(hierarchy.m_geometry, i, triangle);
+    }
+}
+
+uint32_t TwoLevelBVH::mesh_hierarchy_index(TwoLevelBVH &tlbvh,
+                                           const std::shared_ptr<const Mesh> &mesh) {
+    auto found = tlbvh.m_mesh_hierarchy_indices.find(mesh.get());
+    if (found != tlbvh.m_mesh_hierarchy_indices.end())
+        return found->second;
+
+    // First time we see this mesh so build its bottom-level hierarchy
+    MeshHierarchy hierarchy;
+    hierarchy.m_mesh = mesh;
+
+    const auto &vertices = Mesh::vertices(*mesh);
+    const auto &triangles = Mesh::triangles(*mesh);
+    std::vector<AABB> prim_aabbs(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        AABB::reset(prim_aabbs[i]);
+        AABB::extend(prim_aabbs[i], vertices[triangles[i].m_v1]);
+        AABB::extend(prim_aabbs[i], vertices[triangles[i].m_v2]);
+        AABB::extend(prim_aabbs[i], vertices[triangles[i].m_v3]);
+    }
+
+    BVH::build(prim_aabbs, hierarchy.m_nodes, hierarchy.m_triangle_indices);
+    assign_geometry(hierarchy, tlbvh.m_triangle_test);
+
+    uint32_t index = tlbvh.m_mesh_hierarchies.size();
+    tlbvh.m_mesh_hierarchies.push_back(std::move(hierarchy));
+    tlbvh.m_mesh_hierarchy_indices[mesh.get()] = index;
+    return index;
+}
+
+TwoLevelBVH::Instance TwoLevelBVH::make_instance(TwoLevelBVH &tlbvh, uint32_t shape_index) {
+    const auto &shape = tlbvh.m_shapes[shape_index];
+    Instance instance;
+    instance.m_world_to_object = glm::inverse(Shape::model(shape));
+    instance.m_normal_to_world = glm::transpose(glm::mat3(instance.m_world_to_object));
+    instance.m_mesh_hierarchy = mesh_hierarchy_index(tlbvh, Shape::mesh(shape));
+    instance.m_shape = shape_index;
+    return instance;
+}
+
+void TwoLevelBVH::rebuild(TwoLevelBVH &tlbvh) {
+    if (!tlbvh.m_needs_rebuild && tlbvh.m_dirty_shapes.empty())
+        return;
+
+    if (!tlbvh.m_needs_rebuild) {
+        // Moving a shape never touches its mesh so only the top level needs to be refitted
+        std::vector<uint32_t> dirty_leaves;
+        for (auto shape_index : tlbvh.m_dirty_shapes) {
+            auto position = tlbvh.m_instance_positions[shape_index];
+            tlbvh.m_instances[position] = make_instance(tlbvh, shape_index);
+            dirty_leaves.push_back(tlbvh.m_instance_leaves[position]);
+        }
+        tlbvh.m_dirty_shapes.clear();
+
+        tlbvh.m_sah_area_sum +=
+            BVH::refit(tlbvh.m_nodes, tlbvh.m_parents, dirty_leaves, [&](const BVHNode &leaf) {
+                AABB aabb;
+                AABB::reset(aabb);
+                for (uint32_t i = leaf.m_first; i < leaf.m_first + leaf.m_count; i++)
+                    AABB::extend(aabb, Shape::aabb(tlbvh.m_shapes[tlbvh.m_instances[i].m_shape]));
+                return aabb;
+            });
+
+        // Fall through to a full build once the refitted tree got too slow to traverse
+        if (BVH::sah_cost(tlbvh.m_nodes, tlbvh.m_sah_area_sum) <=
+            tlbvh.m_built_sah_cost * bvh_refit_cost_threshold)
+            return;
+    }
+
+    Timer timer;
+
+    // Drop hierarchies of meshes that no shape uses anymore
+    std::vector<bool> used(tlbvh.m_mesh_hierarchies.size(), false);
+    for (const auto &shape : tlbvh.m_shapes) {
+        auto found = tlbvh.m_mesh_hierarchy_indices.find(Shape::mesh(shape).get());
+        if (found != tlbvh.m_mesh_hierarchy_indices.end())
+            used[found->second] = true;
+    }
+
+    uint32_t used_count = 0;
+    for (uint32_t i = 0; i < tlbvh.m_mesh_hierarchies.size(); i++) {
+        const Mesh *mesh = tlbvh.m_mesh_hierarchies[i].m_mesh.get();
+        if (!used[i]) {
+            tlbvh.m_mesh_hierarchy_indices.erase(mesh);
+            continue;
+        }
+        if (used_count != i)
+            tlbvh.m_mesh_hierarchies[used_count] = std::move(tlbvh.m_mesh_hierarchies[i]);
+        tlbvh.m_mesh_hierarchy_indices[mesh] = used_count++;
+    }
+    tlbvh.m_mesh_hierarchies.resize(used_count);
+
+    std::vector<Instance> instances;
+    std::vector<AABB> prim_aabbs;
+    tlbvh.m_shape_offsets.clear();
+    uint32_t triangle_count = 0;
+    for (uint32_t i = 0; i < tlbvh.m_shapes.size(); i++) {
+        instances.push_back(make_instance(tlbvh, i));
+        prim_aabbs.push_back(Shape::aabb(tlbvh.m_shapes[i]));
+        tlbvh.m_shape_offsets.push_back(triangle_count);
+        triangle_count += Shape::triangles(tlbvh.m_shapes[i]).size();
+    }
+
+    std::vector<uint32_t> prim_indices;
+    BVH::build(prim_aabbs, tlbvh.m_nodes, prim_indices);
+    tlbvh.m_instances.clear();
+    tlbvh.m_instances.reserve(prim_indices.size());
+    tlbvh.m_instance_positions.resize(prim_indices.size());
+    for (uint32_t position = 0; position < prim_indices.size(); position++) {
+        tlbvh.m_instances.push_back(instances[prim_indices[position]]);
+        tlbvh.m_instance_positions[prim_indices[position]] = position;
+    }
+
+    tlbvh.m_instance_leaves.resize(tlbvh.m_instances.size());
+    for (uint32_t node_index = 0; node_index < tlbvh.m_nodes.size(); node_index++) {
+        const auto &node = tlbvh.m_nodes[node_index];
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++)
+            tlbvh.m_instance_leaves[i] = node_index;
+    }
+
+    BVH::compute_parents(tlbvh.m_nodes, tlbvh.m_parents);
+    tlbvh.m_sah_area_sum = BVH::sah_area_sum(tlbvh.m_nodes);
+    tlbvh.m_built_sah_cost = BVH::sah_cost(tlbvh.m_nodes, tlbvh.m_sah_area_sum);
+
+    tlbvh.m_build_stats.m_build_time = timer.elapsed();
+    tlbvh.m_build_stats.m_node_count = tlbvh.m_nodes.size();
+    for (const auto &hierarchy : tlbvh.m_mesh_hierarchies)
+        tlbvh.m_build_stats.m_node_count += hierarchy.m_nodes.size();
+    tlbvh.m_build_stats.m_node_memory = tlbvh.m_build_stats.m_node_count * sizeof(BVHNode);
+
+    tlbvh.m_dirty_shapes.clear();
+    tlbvh.m_needs_rebuild = false;
+}
+}
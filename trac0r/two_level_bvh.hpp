@@ -0,0 +1,130 @@
+#ifndef TWO_LEVEL_BVH_HPP
+#define TWO_LEVEL_BVH_HPP
+
+#include "bvh.hpp"
+#include "mesh.hpp"
+#include "triangle.hpp"
+#include "ray.hpp"
+#include "intersection_info.hpp"
+#include "hit_record.hpp"
+#include "shape.hpp"
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Two-level hierarchy: One bottom-level BVH per unique mesh in object space and one
+ * top-level BVH over all shapes which only stores their transformations. Rays are transformed into
+ * object space whenever traversal reaches a shape so meshes shared by many shapes are stored
+ * exactly once.
+ */
+class TwoLevelBVH {
+  public:
+    static void add_shape(TwoLevelBVH &tlbvh, Shape &shape);
+    static void mark_dirty(TwoLevelBVH &tlbvh, size_t shape_index);
+    static std::vector<Shape> &shapes(TwoLevelBVH &tlbvh);
+    static const std::vector<Shape> &shapes(const TwoLevelBVH &tlbvh);
+    static IntersectionInfo intersect(const TwoLevelBVH &tlbvh, const Ray &ray);
+
+    /**
+     * @brief Finds the closest hit without looking up any shading data.
+     */
+    static HitRecord closest_hit(const TwoLevelBVH &tlbvh, const Ray &ray);
+
+    /**
+     * @brief Shading data of a hit found by closest_hit() for the same ray.
+     */
+    static IntersectionInfo resolve(const TwoLevelBVH &tlbvh, const Ray &ray, const HitRecord &hit);
+    static MaterialId material_id(const TwoLevelBVH &tlbvh, const HitRecord &hit);
+    static bool occluded(const TwoLevelBVH &tlbvh, const Ray &ray, const float t_max);
+
+    /**
+     * @brief Prepares the triangle records of all bottom-level hierarchies for a different
+     * ray-triangle test.
+     */
+    static void set_triangle_test(TwoLevelBVH &tlbvh, TriangleTest test);
+
+    /**
+     * @brief Node count includes the top level as well as all bottom-level hierarchies. The build
+     * time only covers hierarchies that actually had to be built during the last rebuild.
+     */
+    static const BVHBuildStats &build_stats(const TwoLevelBVH &tlbvh);
+    static void rebuild(TwoLevelBVH &tlbvh);
+
+  private:
+    struct MeshHierarchy {
+        /**
+         * @brief Keeps the mesh alive so that its address can't be reused by another mesh while
+         * we still cache a hierarchy for it.
+         */
+        std::shared_ptr<const Mesh> m_mesh;
+        std::vector<BVHNode> m_nodes;
+
+        /**
+         * @brief Index into the mesh's triangles of each record in m_geometry. The triangles
+         * aren't copied, resolving a hit reads the indexed mesh itself.
+         */
+        std::vector<uint32_t> m_triangle_indices;
+        TriangleGeometry m_geometry;
+    };
+
+    /**
+     * @brief Fills the traversal records of a hierarchy from its mesh.
+     */
+    static void assign_geometry(MeshHierarchy &hierarchy, TriangleTest test);
+
+    struct Instance {
+        glm::mat4 m_world_to_object;
+        glm::mat3 m_normal_to_world;
+        uint32_t m_mesh_hierarchy;
+        uint32_t m_shape;
+    };
+
+    static Instance make_instance(TwoLevelBVH &tlbvh, uint32_t shape_index);
+
+    static uint32_t mesh_hierarchy_index(TwoLevelBVH &tlbvh,
+                                         const std::shared_ptr<const Mesh> &mesh);
+
+    std::vector<MeshHierarchy> m_mesh_hierarchies;
+
+    /**
+     * @brief Index into m_mesh_hierarchies of every mesh that has a hierarchy.
+     */
+    std::unordered_map<const Mesh *, uint32_t> m_mesh_hierarchy_indices;
+
+    /**
+     * @brief Instances ordered so that every top-level leaf references a contiguous range.
+     */
+    std::vector<Instance> m_instances;
+    std::vector<BVHNode> m_nodes;
+    std::vector<Shape> m_shapes;
+
+    /**
+     * @brief Scene-wide index of the first triangle of each shape, for telling which triangle of
+     * the scene a hit is on.
+     */
+    std::vector<uint32_t> m_shape_offsets;
+
+    /**
+     * @brief Bookkeeping for refits. Shape n is stored at m_instances[m_instance_positions[n]]
+     * which in turn lies in the top-level leaf m_instance_leaves[m_instance_positions[n]].
+     */
+    std::vector<uint32_t> m_parents;
+    std::vector<uint32_t> m_instance_positions;
+    std::vector<uint32_t> m_instance_leaves;
+    std::vector<uint32_t> m_dirty_shapes;
+    float m_sah_area_sum = 0.f;
+    float m_built_sah_cost = 0.f;
+
+    BVHBuildStats m_build_stats;
+    TriangleTest m_triangle_test = TriangleTest::MollerTrumbore;
+    bool m_needs_rebuild = false;
+};
+}
+
+#endif /* end of include guard: TWO_LEVEL_BVH_HPP */
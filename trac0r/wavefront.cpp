@@ -0,0 +1,379 @@
+#include "wavefront.hpp"
+#include "renderer.hpp"
+#include "random.hpp"
+#include "task_pool.hpp"
+#include "timer.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <limits>
+
+namespace trac0r {
+
+// Generating and reordering paths costs about the same for every path, so those stages hand out
+// large runs of paths to keep the scheduling overhead down
+static const uint32_t stage_grain = 4096;
+
+// Russian Roulette exactly like in Renderer::trace_camera_ray(), drawn before each extension
+static bool survive_roulette(WavefrontPath &path, const unsigned max_depth) {
+    float continuation_probability = 1.f - (1.f / (max_depth - path.m_depth));
+    if (rand_range(0.f, 1.0f) >= continuation_probability)
+        return false;
+    path.m_throughput /= continuation_probability;
+    path.m_depth++;
+    return true;
+}
+
+// Ends a path with a last bit of light. Its color is only written by write_path() once all of its
+// shadow rays are traced.
+static void finish_path(WavefrontPath &path, const glm::vec3 &color) {
+    path.m_radiance += color;
+    path.m_active = false;
+}
+
+static void write_path(const WavefrontPath &path, uint32_t samples_per_pixel, bool overwrite,
+                       std::vector<glm::vec4> &luminance) {
+    // Every pixel has at most one path in flight so no other thread writes to it
+    glm::vec4 color{path.m_radiance, static_cast<float>(samples_per_pixel)};
+    if (overwrite)
+        luminance[path.m_pixel] = color;
+    else
+        luminance[path.m_pixel] += color;
+}
+
+// Starts the next sample of a path's pixel from the camera. Samples that Russian Roulette ends
+// before their first hit are black and don't need to go through the queue at all.
+//
+// Returns false once the pixel has no samples left.
+static bool start_sample(WavefrontPath &path, const Camera &camera, const unsigned max_depth) {
+    const uint32_t width = Camera::screen_width(camera);
+    while (path.m_samples_left > 0) {
+        path.m_samples_left--;
+        path.m_ray = Camera::pixel_to_ray(camera, path.m_pixel % width, path.m_pixel / width);
+        path.m_throughput = glm::vec3{1.f};
+        path.m_scatter_pdf = 0.f;
+        path.m_depth = 0;
+        path.m_active = true;
+        if (survive_roulette(path, max_depth))
+            return true;
+    }
+    path.m_active = false;
+    return false;
+}
+
+// Spreads the lower 10 bits of v out so that there are two zero bits between each of them
+static uint32_t expand_bits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Sorts by the bits [32, 32 + key_bits) with an LSD radix sort in passes of radix_bits each
+static void radix_sort(std::vector<uint64_t> &keys, std::vector<uint64_t> &scratch,
+                       const int key_bits) {
+    const int radix_bits = 10;
+    const uint32_t radix_mask = (1u << radix_bits) - 1;
+    scratch.resize(keys.size());
+    for (int shift = 32; shift < 32 + key_bits; shift += radix_bits) {
+        std::array<uint32_t, 1 << radix_bits> offsets{};
+        for (auto key : keys)
+            offsets[(key >> shift) & radix_mask]++;
+        uint32_t sum = 0;
+        for (auto &offset : offsets) {
+            auto count = offset;
+            offset = sum;
+            sum += count;
+        }
+        for (auto key : keys)
+            scratch[offsets[(key >> shift) & radix_mask]++] = key;
+        std::swap(keys, scratch);
+    }
+}
+
+void Wavefront::render(Wavefront &wavefront, const Scene &scene, const Camera &camera,
+                       const unsigned max_depth, int stride_x, int stride_y,
+                       uint32_t samples_per_pixel, bool overwrite,
+                       std::vector<glm::vec4> &luminance) {
+    const uint32_t columns = (Camera::screen_width(camera) + stride_x - 1) / stride_x;
+    const uint32_t rows = (Camera::screen_height(camera) + stride_y - 1) / stride_y;
+    wavefront.m_pixel_count = columns * rows;
+    wavefront.m_next_pixel = 0;
+    wavefront.m_samples_per_pixel = samples_per_pixel;
+    wavefront.m_paths.clear();
+    wavefront.m_generate_time = 0;
+    wavefront.m_sort_time = 0;
+    wavefront.m_extend_time = 0;
+    wavefront.m_shade_time = 0;
+    wavefront.m_connect_time = 0;
+    wavefront.m_iterations = 0;
+    wavefront.m_extended_rays = 0;
+
+    Timer timer;
+    while (true) {
+        generate(wavefront, camera, max_depth, stride_x, stride_y, overwrite, luminance);
+        wavefront.m_generate_time += timer.elapsed();
+
+        sort(wavefront);
+        wavefront.m_sort_time += timer.elapsed();
+        if (wavefront.m_paths.empty())
+            break;
+
+        extend(wavefront, scene);
+        wavefront.m_extend_time += timer.elapsed();
+
+        shade(wavefront, scene, max_depth);
+        wavefront.m_shade_time += timer.elapsed();
+
+        connect(wavefront, scene, camera, max_depth, overwrite, luminance);
+        wavefront.m_connect_time += timer.elapsed();
+
+        wavefront.m_iterations++;
+        wavefront.m_extended_rays += wavefront.m_paths.size();
+    }
+}
+
+bool Wavefront::ray_sorting(const Wavefront &wavefront) {
+    return wavefront.m_ray_sorting;
+}
+
+void Wavefront::set_ray_sorting(Wavefront &wavefront, bool enabled) {
+    wavefront.m_ray_sorting = enabled;
+}
+
+void Wavefront::set_next_event_estimation(Wavefront &wavefront, bool enabled) {
+    wavefront.m_next_event_estimation = enabled;
+}
+
+void Wavefront::set_task_pool(Wavefront &wavefront, TaskPool *pool) {
+    wavefront.m_task_pool = pool;
+}
+
+void Wavefront::print_last_frame_timings(const Wavefront &wavefront) {
+    fmt::print("      {:<13} {:>10.3f} ms\n", "Generate", wavefront.m_generate_time);
+    fmt::print("      {:<13} {:>10.3f} ms\n", "Sort", wavefront.m_sort_time);
+    fmt::print("      {:<13} {:>10.3f} ms\n", "Extend", wavefront.m_extend_time);
+    fmt::print("      {:<13} {:>10.3f} ms\n", "Shade", wavefront.m_shade_time);
+    fmt::print("      {:<13} {:>10.3f} ms\n", "Connect", wavefront.m_connect_time);
+    fmt::print("      {} rays in {} iterations\n", wavefront.m_extended_rays,
+               wavefront.m_iterations);
+}
+
+void Wavefront::generate(Wavefront &wavefront, const Camera &camera, const unsigned max_depth,
+                         int stride_x, int stride_y, bool overwrite,
+                         std::vector<glm::vec4> &luminance) {
+    const uint32_t columns = (Camera::screen_width(camera) + stride_x - 1) / stride_x;
+    const uint32_t width = Camera::screen_width(camera);
+    const uint32_t first = wavefront.m_paths.size();
+    const uint32_t count = std::min(wavefront_queue_size - first,
+                                    wavefront.m_pixel_count - wavefront.m_next_pixel);
+    const uint32_t next_pixel = wavefront.m_next_pixel;
+    wavefront.m_paths.resize(first + count);
+    wavefront.m_next_pixel += count;
+
+    parallel_for(wavefront.m_task_pool, 0, count, stage_grain, [&](uint32_t i) {
+        uint32_t x = (next_pixel + i) % columns * stride_x;
+        uint32_t y = (next_pixel + i) / columns * stride_y;
+        auto &path = wavefront.m_paths[first + i];
+        path.m_pixel = y * width + x;
+        path.m_samples_left = wavefront.m_samples_per_pixel;
+        if (!start_sample(path, camera, max_depth))
+            write_path(path, wavefront.m_samples_per_pixel, overwrite, luminance);
+    });
+}
+
+void Wavefront::sort(Wavefront &wavefront) {
+    auto &paths = wavefront.m_paths;
+    auto &keys = wavefront.m_sort_keys;
+
+    // Origins are quantized relative to the box around all of them
+    glm::vec3 origin_min{std::numeric_limits<float>::max()};
+    glm::vec3 origin_max{-std::numeric_limits<float>::max()};
+    if (wavefront.m_ray_sorting) {
+        for (const auto &path : paths) {
+            if (!path.m_active)
+                continue;
+            origin_min = glm::min(origin_min, path.m_ray.m_origin);
+            origin_max = glm::max(origin_max, path.m_ray.m_origin);
+        }
+    }
+    glm::vec3 scale = 511.f / glm::max(origin_max - origin_min, glm::vec3{1e-6f});
+
+    // The key sits in the upper 32 bits and the path index in the lower ones. Without sorting the
+    // key is always 0 and this only compacts the queue.
+    keys.clear();
+    for (uint32_t i = 0; i < paths.size(); i++) {
+        const auto &path = paths[i];
+        if (!path.m_active)
+            continue;
+        uint64_t key = 0;
+        if (wavefront.m_ray_sorting) {
+            const auto &dir = path.m_ray.m_dir;
+            uint32_t octant = (dir.x < 0.f) | (dir.y < 0.f) << 1 | (dir.z < 0.f) << 2;
+            glm::uvec3 cell{glm::clamp((path.m_ray.m_origin - origin_min) * scale, 0.f, 511.f)};
+            uint32_t morton =
+                expand_bits(cell.x) | expand_bits(cell.y) << 1 | expand_bits(cell.z) << 2;
+            key = octant << 27 | morton;
+        }
+        keys.push_back(key << 32 | i);
+    }
+    if (wavefront.m_ray_sorting)
+        radix_sort(keys, wavefront.m_sort_scratch, 30);
+
+    auto &sorted_paths = wavefront.m_sorted_paths;
+    sorted_paths.resize(keys.size());
+    parallel_for(wavefront.m_task_pool, 0, keys.size(), stage_grain,
+                 [&](uint32_t i) { sorted_paths[i] = paths[keys[i] & 0xFFFFFFFFu]; });
+    std::swap(paths, sorted_paths);
+}
+
+void Wavefront::extend(Wavefront &wavefront, const Scene &scene) {
+    auto &paths = wavefront.m_paths;
+    auto &hits = wavefront.m_hits;
+    hits.resize(paths.size());
+
+    // Chunks keep runs of sorted rays on the same thread
+    parallel_for(wavefront.m_task_pool, 0, paths.size(), 256,
+                 [&](uint32_t i) { hits[i] = Scene::closest_hit(scene, paths[i].m_ray); });
+}
+
+void Wavefront::shade(Wavefront &wavefront, const Scene &scene, const unsigned max_depth) {
+    const auto &hits = wavefront.m_hits;
+    auto &buckets = wavefront.m_shade_buckets;
+    auto &order = wavefront.m_shade_order;
+
+    // Bucket 0 holds the misses and buckets 1 to 4 the hits on the material type of the same
+    // number. Anything else goes into bucket 5.
+    const uint32_t bucket_count = 6;
+    std::array<uint32_t, bucket_count + 1> starts{};
+    buckets.resize(hits.size());
+    for (uint32_t i = 0; i < hits.size(); i++) {
+        uint8_t bucket = 0;
+        if (HitRecord::has_hit(hits[i])) {
+            uint8_t type = Scene::material(scene, hits[i]).m_type;
+            bucket = type >= 1 && type <= 4 ? type : 5;
+        }
+        buckets[i] = bucket;
+        starts[bucket + 1]++;
+    }
+    for (uint32_t bucket = 0; bucket < bucket_count; bucket++)
+        starts[bucket + 1] += starts[bucket];
+
+    // Paths keep their sorted order within each bucket
+    auto offsets = starts;
+    order.resize(hits.size());
+    for (uint32_t i = 0; i < hits.size(); i++)
+        order[offsets[buckets[i]]++] = i;
+
+    auto finish_black = [&](WavefrontPath &path) { finish_path(path, glm::vec3{0.f}); };
+
+    // Leaves a shadow ray towards a light for connect() before a diffuse or glossy hit scatters
+    // the path, just like Renderer::trace_camera_ray() does
+    auto &shadow_rays = wavefront.m_shadow_rays;
+    shadow_rays.resize(hits.size());
+    auto sample_lights = [&](const WavefrontPath &path, const IntersectionInfo &intersect_info,
+                             uint32_t index) {
+        if (!wavefront.m_next_event_estimation || max_depth - path.m_depth <= 1)
+            return false;
+        auto &shadow_ray = shadow_rays[index];
+        shadow_ray.m_pending =
+            Renderer::connect_to_light(intersect_info, scene, shadow_ray.m_ray,
+                                       shadow_ray.m_t_max, shadow_ray.m_radiance);
+        shadow_ray.m_radiance *= path.m_throughput;
+        return true;
+    };
+
+    // Misses
+    shade_bucket(wavefront, starts[0], starts[1],
+                 [&](WavefrontPath &path, const HitRecord &, uint32_t) { finish_black(path); });
+
+    // Emitter Material
+    shade_bucket(wavefront, starts[1], starts[2],
+                 [&](WavefrontPath &path, const HitRecord &hit, uint32_t) {
+                     const auto &material = Scene::material(scene, hit);
+                     float weight = 1.f;
+                     if (path.m_scatter_pdf > 0.f)
+                         weight = Renderer::emission_weight(
+                             Scene::resolve(scene, path.m_ray, hit), path.m_scatter_pdf, scene);
+                     glm::vec3 color =
+                         path.m_throughput * material.m_color * material.m_emittance;
+                     finish_path(path, color * weight);
+                 });
+
+    // Diffuse Material
+    shade_bucket(wavefront, starts[2], starts[3],
+                 [&](WavefrontPath &path, const HitRecord &hit, uint32_t index) {
+                     auto intersect_info = Scene::resolve(scene, path.m_ray, hit);
+                     bool sampled_lights = sample_lights(path, intersect_info, index);
+                     Renderer::scatter_diffuse(intersect_info, path.m_throughput, path.m_ray);
+                     path.m_scatter_pdf =
+                         sampled_lights ? Renderer::scatter_pdf(intersect_info, path.m_ray.m_dir)
+                                        : 0.f;
+                     if (!survive_roulette(path, max_depth))
+                         finish_black(path);
+                 });
+
+    // Glass Material
+    shade_bucket(wavefront, starts[3], starts[4],
+                 [&](WavefrontPath &path, const HitRecord &hit, uint32_t) {
+                     path.m_scatter_pdf = 0.f;
+                     if (!Renderer::scatter_glass(Scene::resolve(scene, path.m_ray, hit),
+                                                  path.m_throughput, path.m_ray) ||
+                         !survive_roulette(path, max_depth))
+                         finish_black(path);
+                 });
+
+    // Glossy Material
+    shade_bucket(wavefront, starts[4], starts[5],
+                 [&](WavefrontPath &path, const HitRecord &hit, uint32_t index) {
+                     auto intersect_info = Scene::resolve(scene, path.m_ray, hit);
+                     bool sampled_lights = sample_lights(path, intersect_info, index);
+                     Renderer::scatter_glossy(intersect_info, path.m_throughput, path.m_ray);
+                     path.m_scatter_pdf =
+                         sampled_lights ? Renderer::scatter_pdf(intersect_info, path.m_ray.m_dir)
+                                        : 0.f;
+                     if (!survive_roulette(path, max_depth))
+                         finish_black(path);
+                 });
+
+    // Unknown materials are left to Renderer::scatter() so they behave like in the depth-first
+    // integrator
+    shade_bucket(wavefront, starts[5], starts[6],
+                 [&](WavefrontPath &path, const HitRecord &hit, uint32_t) {
+                     path.m_scatter_pdf = 0.f;
+                     if (!Renderer::scatter(Scene::resolve(scene, path.m_ray, hit),
+                                            path.m_throughput, path.m_ray) ||
+                         !survive_roulette(path, max_depth))
+                         finish_black(path);
+                 });
+}
+
+void Wavefront::connect(Wavefront &wavefront, const Scene &scene, const Camera &camera,
+                        const unsigned max_depth, bool overwrite,
+                        std::vector<glm::vec4> &luminance) {
+    auto &paths = wavefront.m_paths;
+    auto &shadow_rays = wavefront.m_shadow_rays;
+    parallel_for(wavefront.m_task_pool, 0, paths.size(), 256, [&](uint32_t i) {
+        auto &shadow_ray = shadow_rays[i];
+        if (shadow_ray.m_pending) {
+            if (!Scene::occluded(scene, shadow_ray.m_ray, shadow_ray.m_t_max))
+                paths[i].m_radiance += shadow_ray.m_radiance;
+            shadow_ray.m_pending = false;
+        }
+        if (!paths[i].m_active && !start_sample(paths[i], camera, max_depth))
+            write_path(paths[i], wavefront.m_samples_per_pixel, overwrite, luminance);
+    });
+}
+
+template <typename ShadeFunc>
+void Wavefront::shade_bucket(Wavefront &wavefront, uint32_t first, uint32_t last,
+                             ShadeFunc shade_func) {
+    parallel_for(wavefront.m_task_pool, first, last, 256, [&](uint32_t i) {
+        uint32_t index = wavefront.m_shade_order[i];
+        shade_func(wavefront.m_paths[index], wavefront.m_hits[index], index);
+    });
+}
+}
@@ -0,0 +1,195 @@
+#ifndef WAVEFRONT_HPP
+#define WAVEFRONT_HPP
+
+#include "camera.hpp"
+#include "hit_record.hpp"
+#include "intersection_info.hpp"
+#include "ray.hpp"
+#include "scene.hpp"
+#include "task_pool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Number of paths the wavefront integrator keeps in flight. Enough to keep every thread
+ * busy in each stage and to give sorting plenty of similar rays to group together.
+ */
+const uint32_t wavefront_queue_size = 1 << 16;
+
+/**
+ * @brief State of a path between two bounces.
+ */
+struct WavefrontPath {
+    /**
+     * @brief The ray that extends this path next.
+     */
+    Ray m_ray = Ray(glm::vec3(0), glm::vec3(0));
+
+    /**
+     * @brief Product of all surface colors along the path so far, divided by the probability with
+     * which Russian Roulette let the path reach its current ray.
+     */
+    glm::vec3 m_throughput{1.f};
+
+    /**
+     * @brief Light the path has gathered so far through next-event estimation and emitters.
+     */
+    glm::vec3 m_radiance{0.f};
+
+    /**
+     * @brief Density with which the last bounce picked m_ray, 0 if no light was sampled there. See
+     * Renderer::emission_weight().
+     */
+    float m_scatter_pdf = 0.f;
+    uint32_t m_pixel = 0;
+
+    /**
+     * @brief Samples of the pixel still to start after the current one. A path that ends starts
+     * over as the next sample of its pixel and m_radiance keeps adding up over all of them.
+     */
+    uint32_t m_samples_left = 0;
+    uint32_t m_depth = 0;
+    bool m_active = false;
+};
+
+/**
+ * @brief Shadow ray towards a light that a path wants to add radiance through if it's unblocked.
+ */
+struct WavefrontShadowRay {
+    Ray m_ray = Ray(glm::vec3(0), glm::vec3(0));
+    float m_t_max = 0.f;
+    glm::vec3 m_radiance{0.f};
+    bool m_pending = false;
+};
+
+/**
+ * @brief Breadth-first alternative to Renderer::trace_camera_ray(). Instead of following one path
+ * to its end per thread, a queue of paths is advanced one bounce at a time in stages: camera paths
+ * are generated into free slots, the queue is sorted, all rays are extended to their next hit and
+ * all hits are shaded. Each stage is a plain loop over the whole queue and paths that end are
+ * replaced by new ones right away so the queue stays full until the frame runs out of pixels.
+ *
+ * With next-event estimation on, shading also connects diffuse and glossy hits to lights. The
+ * shadow rays of the whole queue are then traced in a stage of their own before paths that ended
+ * write their colors.
+ *
+ * Secondary rays leave surfaces in random directions, so consecutive paths rarely visit the same
+ * nodes. Sorting the queue by direction octant and origin before extending it puts rays that walk
+ * through the same part of the scene next to each other.
+ */
+class Wavefront {
+  public:
+    /**
+     * @brief Traces samples_per_pixel paths for each pixel at the given stride and stores the sum
+     * of their colors in luminance the same way Renderer::render() does. The samples of a pixel
+     * run one after another in the same queue slot, so every pixel is written only once.
+     *
+     * @param overwrite Whether colors replace what's in luminance or are added to it.
+     */
+    static void render(Wavefront &wavefront, const Scene &scene, const Camera &camera,
+                       const unsigned max_depth, int stride_x, int stride_y,
+                       uint32_t samples_per_pixel, bool overwrite,
+                       std::vector<glm::vec4> &luminance);
+    static bool ray_sorting(const Wavefront &wavefront);
+    static void set_ray_sorting(Wavefront &wavefront, bool enabled);
+    static void set_next_event_estimation(Wavefront &wavefront, bool enabled);
+
+    /**
+     * @brief Runs the stages on the given pool or with OpenMP if it's nullptr. The pool has to
+     * outlive its use here.
+     */
+    static void set_task_pool(Wavefront &wavefront, TaskPool *pool);
+    static void print_last_frame_timings(const Wavefront &wavefront);
+
+  private:
+    /**
+     * @brief Fills free slots of the queue with camera paths for pixels that haven't been started
+     * yet this frame.
+     */
+    static void generate(Wavefront &wavefront, const Camera &camera, const unsigned max_depth,
+                         int stride_x, int stride_y, bool overwrite,
+                         std::vector<glm::vec4> &luminance);
+
+    /**
+     * @brief Drops finished paths from the queue and, if ray sorting is on, orders the remaining
+     * ones by direction octant first and the Morton code of their origin second.
+     */
+    static void sort(Wavefront &wavefront);
+    static void extend(Wavefront &wavefront, const Scene &scene);
+
+    /**
+     * @brief Groups the queue by what happens at each hit and then shades one group after the
+     * other. That way every material's code runs over a contiguous run of m_shade_order without
+     * branching on the material type per hit.
+     */
+    static void shade(Wavefront &wavefront, const Scene &scene, const unsigned max_depth);
+
+    /**
+     * @brief Traces the shadow rays shade() left and adds the radiance of the unblocked ones to
+     * their paths. Paths that ended in this iteration start their next sample or, after their
+     * last one, write the colors of their pixels.
+     */
+    static void connect(Wavefront &wavefront, const Scene &scene, const Camera &camera,
+                        const unsigned max_depth, bool overwrite,
+                        std::vector<glm::vec4> &luminance);
+
+    /**
+     * @brief Calls shade_func(WavefrontPath &path, const HitRecord &hit, uint32_t index) for the
+     * paths listed in m_shade_order[first, last). index is the path's position in the queue.
+     */
+    template <typename ShadeFunc>
+    static void shade_bucket(Wavefront &wavefront, uint32_t first, uint32_t last,
+                             ShadeFunc shade_func);
+
+    std::vector<WavefrontPath> m_paths;
+
+    /**
+     * @brief Closest hits of the queued rays. Only those paths that get scattered resolve the
+     * shading data of their hit.
+     */
+    std::vector<HitRecord> m_hits;
+
+    /**
+     * @brief Shadow ray of each queued path, if it has one pending.
+     */
+    std::vector<WavefrontShadowRay> m_shadow_rays;
+
+    /**
+     * @brief Scratch space for sorting, kept around so it's only allocated once.
+     */
+    std::vector<WavefrontPath> m_sorted_paths;
+    std::vector<uint64_t> m_sort_keys;
+    std::vector<uint64_t> m_sort_scratch;
+
+    /**
+     * @brief Queue indices grouped by shade() and the group each path went into.
+     */
+    std::vector<uint32_t> m_shade_order;
+    std::vector<uint8_t> m_shade_buckets;
+
+    /**
+     * @brief Index of the next strided pixel to start a path for.
+     */
+    uint32_t m_next_pixel = 0;
+    uint32_t m_pixel_count = 0;
+    uint32_t m_samples_per_pixel = 1;
+    bool m_ray_sorting = true;
+    bool m_next_event_estimation = true;
+    TaskPool *m_task_pool = nullptr;
+
+    double m_generate_time = 0;
+    double m_sort_time = 0;
+    double m_extend_time = 0;
+    double m_shade_time = 0;
+    double m_connect_time = 0;
+    uint32_t m_iterations = 0;
+    uint64_t m_extended_rays = 0;
+};
+}
+
+#endif /* end of include guard: WAVEFRONT_HPP */
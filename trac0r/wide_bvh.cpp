@@ -0,0 +1,199 @@
+#include "wide_bvh.hpp"
+#include "intersections.hpp"
+#include "leaf_kernel.hpp"
+#include "timer.hpp"
+
+#include <limits>
+
+namespace trac0r {
+
+void WideBVH::add_shape(WideBVH &wbvh, Shape &shape) {
+    BVH::add_shape(wbvh.m_bvh, shape);
+    wbvh.m_needs_rebuild = true;
+}
+
+void WideBVH::mark_dirty(WideBVH &wbvh, size_t shape_index) {
+    BVH::mark_dirty(wbvh.m_bvh, shape_index);
+    wbvh.m_needs_rebuild = true;
+}
+
+void WideBVH::set_spatial_split_budget(WideBVH &wbvh, float budget) {
+    BVH::set_spatial_split_budget(wbvh.m_bvh, budget);
+    wbvh.m_needs_rebuild = true;
+}
+
+void WideBVH::set_triangle_test(WideBVH &wbvh, TriangleTest test) {
+    BVH::set_triangle_test(wbvh.m_bvh, test);
+}
+
+std::vector<Shape> &WideBVH::shapes(WideBVH &wbvh) {
+    return BVH::shapes(wbvh.m_bvh);
+}
+
+const std::vector<Shape> &WideBVH::shapes(const WideBVH &wbvh) {
+    return BVH::shapes(wbvh.m_bvh);
+}
+
+const std::vector<WideBVHNode> &WideBVH::nodes(const WideBVH &wbvh) {
+    return wbvh.m_nodes;
+}
+
+const BVHBuildStats &WideBVH::build_stats(const WideBVH &wbvh) {
+    return wbvh.m_build_stats;
+}
+
+IntersectionInfo WideBVH::intersect(const WideBVH &wbvh, const Ray &ray) {
+    return resolve(wbvh, ray, closest_hit(wbvh, ray));
+}
+
+HitRecord WideBVH::closest_hit(const WideBVH &wbvh, const Ray &ray) {
+    const auto &geometry = BVH::geometry(wbvh.m_bvh);
+    HitRecord hit;
+    traverse(wbvh.m_nodes, ray, hit.m_t, [&](uint32_t first, uint32_t count) {
+        auto index = LeafKernel::intersect(ray, geometry, first, count, hit.m_t);
+        if (index != no_triangle)
+            hit.m_triangle = index;
+        return false;
+    });
+
+    return hit;
+}
+
+IntersectionInfo WideBVH::resolve(const WideBVH &wbvh, const Ray &ray, const HitRecord &hit) {
+    if (!HitRecord::has_hit(hit))
+        return IntersectionInfo{};
+
+    const auto &shading = BVH::shading(wbvh.m_bvh)[hit.m_triangle];
+    return HitRecord::resolve(hit, ray, shading.m_normal, shading.m_material_id,
+                              shading.m_triangle_id);
+}
+
+MaterialId WideBVH::material_id(const WideBVH &wbvh, const HitRecord &hit) {
+    return BVH::shading(wbvh.m_bvh)[hit.m_triangle].m_material_id;
+}
+
+bool WideBVH::occluded(const WideBVH &wbvh, const Ray &ray, const float t_max) {
+    const auto &geometry = BVH::geometry(wbvh.m_bvh);
+    bool hit = false;
+    float max_dist = t_max;
+    traverse(wbvh.m_nodes, ray, max_dist, [&](uint32_t first, uint32_t count) {
+        hit = LeafKernel::occluded(ray, geometry, first, count, t_max);
+        return hit;
+    });
+
+    return hit;
+}
+
+void WideBVH::rebuild(WideBVH &wbvh) {
+    if (!wbvh.m_needs_rebuild)
+        return;
+
+    Timer timer;
+    if (!BVH::rebuild(wbvh.m_bvh)) {
+        refit(BVH::nodes(wbvh.m_bvh), wbvh.m_sources, wbvh.m_nodes);
+        wbvh.m_needs_rebuild = false;
+        return;
+    }
+    collapse(BVH::nodes(wbvh.m_bvh), wbvh.m_nodes, wbvh.m_sources);
+
+    wbvh.m_build_stats.m_build_time = timer.elapsed();
+    wbvh.m_build_stats.m_node_count = wbvh.m_nodes.size();
+    wbvh.m_build_stats.m_node_memory = wbvh.m_nodes.size() * sizeof(WideBVHNode) +
+                                       wbvh.m_sources.size() * sizeof(WideBVHSources) +
+                                       BVH::build_stats(wbvh.m_bvh).m_node_memory;
+    wbvh.m_needs_rebuild = false;
+}
+
+static void set_bounds(WideBVHBounds &bounds, uint32_t i, const glm::vec3 &min,
+                       const glm::vec3 &max) {
+    bounds.m_min_x[i] = min.x;
+    bounds.m_min_y[i] = min.y;
+    bounds.m_min_z[i] = min.z;
+    bounds.m_max_x[i] = max.x;
+    bounds.m_max_y[i] = max.y;
+    bounds.m_max_z[i] = max.z;
+}
+
+static void collapse_recursive(const std::vector<BVHNode> &bvh_nodes,
+                               std::array<uint32_t, wide_bvh_width> children,
+                               uint32_t num_children, uint32_t node_index,
+                               std::vector<WideBVHNode> &nodes,
+                               std::vector<WideBVHSources> &sources) {
+    // Keep opening the inner child with the largest surface area until the node is full
+    while (num_children < wide_bvh_width) {
+        int largest = -1;
+        float largest_area = -1.f;
+        for (uint32_t i = 0; i < num_children; i++) {
+            const auto &child = bvh_nodes[children[i]];
+            if (child.m_count == 0 && BVH::node_area(child) > largest_area) {
+                largest = i;
+                largest_area = BVH::node_area(child);
+            }
+        }
+
+        if (largest == -1)
+            break;
+
+        auto opened = bvh_nodes[children[largest]].m_first;
+        children[largest] = opened;
+        children[num_children++] = opened + 1;
+    }
+
+    nodes[node_index].m_num_children = num_children;
+    for (uint32_t i = 0; i < wide_bvh_width; i++) {
+        auto &node = nodes[node_index];
+        if (i >= num_children) {
+            set_bounds(node.m_bounds, i, glm::vec3{0.f}, glm::vec3{0.f});
+            node.m_child[i] = 0;
+            node.m_count[i] = 0;
+            sources[node_index][i] = 0;
+            continue;
+        }
+
+        const auto &child = bvh_nodes[children[i]];
+        set_bounds(node.m_bounds, i, child.m_min, child.m_max);
+        node.m_count[i] = child.m_count;
+        sources[node_index][i] = children[i];
+        if (child.m_count > 0) {
+            node.m_child[i] = child.m_first;
+            continue;
+        }
+
+        // Growing the vector invalidates the reference to the current node
+        uint32_t child_index = nodes.size();
+        node.m_child[i] = child_index;
+        nodes.emplace_back();
+        sources.emplace_back();
+        std::array<uint32_t, wide_bvh_width> grandchildren;
+        grandchildren[0] = child.m_first;
+        grandchildren[1] = child.m_first + 1;
+        collapse_recursive(bvh_nodes, grandchildren, 2, child_index, nodes, sources);
+    }
+}
+
+void WideBVH::collapse(const std::vector<BVHNode> &bvh_nodes, std::vector<WideBVHNode> &nodes,
+                       std::vector<WideBVHSources> &sources) {
+    nodes.clear();
+    sources.clear();
+    if (bvh_nodes.empty())
+        return;
+
+    // The root of the binary tree becomes the only child of the wide root so that a lone leaf is
+    // handled just like everything else
+    nodes.emplace_back();
+    sources.emplace_back();
+    std::array<uint32_t, wide_bvh_width> children;
+    children[0] = 0;
+    collapse_recursive(bvh_nodes, children, 1, 0, nodes, sources);
+}
+
+void WideBVH::refit(const std::vector<BVHNode> &bvh_nodes,
+                    const std::vector<WideBVHSources> &sources, std::vector<WideBVHNode> &nodes) {
+    for (uint32_t n = 0; n < nodes.size(); n++) {
+        for (uint32_t i = 0; i < nodes[n].m_num_children; i++) {
+            const auto &child = bvh_nodes[sources[n][i]];
+            set_bounds(nodes[n].m_bounds, i, child.m_min, child.m_max);
+        }
+    }
+}
+}
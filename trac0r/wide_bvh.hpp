@@ -0,0 +1,279 @@
+#ifndef WIDE_BVH_HPP
+#define WIDE_BVH_HPP
+
+#include "bvh.hpp"
+#include "triangle.hpp"
+#include "ray.hpp"
+#include "intersection_info.hpp"
+#include "hit_record.hpp"
+#include "shape.hpp"
+#include "intersections.hpp"
+
+#include <glm/glm.hpp>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace trac0r {
+
+/**
+ * @brief Number of children per wide node. It matches the number of floats the host's vector
+ * registers can hold so that all children are tested with a single instruction sequence.
+ */
+#if defined(__AVX__)
+const uint32_t wide_bvh_width = 8;
+#else
+const uint32_t wide_bvh_width = 4;
+#endif
+
+/**
+ * @brief Bounds of all children of a wide node stored component-wise so they can be loaded
+ * straight into vector registers.
+ */
+struct WideBVHBounds {
+    std::array<float, wide_bvh_width> m_min_x;
+    std::array<float, wide_bvh_width> m_min_y;
+    std::array<float, wide_bvh_width> m_min_z;
+    std::array<float, wide_bvh_width> m_max_x;
+    std::array<float, wide_bvh_width> m_max_y;
+    std::array<float, wide_bvh_width> m_max_z;
+};
+
+/**
+ * @brief Node with up to wide_bvh_width children.
+ */
+struct WideBVHNode {
+    WideBVHBounds m_bounds;
+
+    /**
+     * @brief Index of the child node for inner children or index of the first primitive for
+     * leaves.
+     */
+    std::array<uint32_t, wide_bvh_width> m_child;
+
+    /**
+     * @brief Number of primitives of leaf children. Inner children have a count of 0.
+     */
+    std::array<uint32_t, wide_bvh_width> m_count;
+
+    uint32_t m_num_children = 0;
+};
+
+/**
+ * @brief The binary node every child slot of a wide node was collapsed from. Unused slots hold 0.
+ */
+using WideBVHSources = std::array<uint32_t, wide_bvh_width>;
+
+inline const WideBVHBounds &decode_bounds(const WideBVHNode &node) {
+    return node.m_bounds;
+}
+
+/**
+ * @brief BVH with wide nodes. It is built by collapsing the binary BVH so it shares its triangle
+ * order, refitting and build statistics. When the binary BVH was only refitted the wide nodes just
+ * copy the new bounds of the binary nodes they were collapsed from.
+ */
+class WideBVH {
+  public:
+    static void add_shape(WideBVH &wbvh, Shape &shape);
+    static void mark_dirty(WideBVH &wbvh, size_t shape_index);
+    static std::vector<Shape> &shapes(WideBVH &wbvh);
+    static const std::vector<Shape> &shapes(const WideBVH &wbvh);
+    static const std::vector<WideBVHNode> &nodes(const WideBVH &wbvh);
+    static const BVHBuildStats &build_stats(const WideBVH &wbvh);
+    static IntersectionInfo intersect(const WideBVH &wbvh, const Ray &ray);
+
+    /**
+     * @brief Finds the closest hit without looking up any shading data.
+     */
+    static HitRecord closest_hit(const WideBVH &wbvh, const Ray &ray);
+
+    /**
+     * @brief Shading data of a hit found by closest_hit() for the same ray.
+     */
+    static IntersectionInfo resolve(const WideBVH &wbvh, const Ray &ray, const HitRecord &hit);
+    static MaterialId material_id(const WideBVH &wbvh, const HitRecord &hit);
+    static bool occluded(const WideBVH &wbvh, const Ray &ray, const float t_max);
+    static void rebuild(WideBVH &wbvh);
+
+    /**
+     * @brief See BVH::set_spatial_split_budget().
+     */
+    static void set_spatial_split_budget(WideBVH &wbvh, float budget);
+
+    /**
+     * @brief See BVH::set_triangle_test().
+     */
+    static void set_triangle_test(WideBVH &wbvh, TriangleTest test);
+
+    /**
+     * @brief Collapses a binary hierarchy into wide nodes. Leaves keep referencing the same
+     * primitive ranges.
+     *
+     * @param sources Receives the binary node behind every child of every wide node
+     */
+    static void collapse(const std::vector<BVHNode> &bvh_nodes, std::vector<WideBVHNode> &nodes,
+                         std::vector<WideBVHSources> &sources);
+
+    /**
+     * @brief Copies the bounds of refitted binary nodes into the wide nodes collapsed from them.
+     * The binary hierarchy must not have been built again since collapse().
+     */
+    static void refit(const std::vector<BVHNode> &bvh_nodes,
+                      const std::vector<WideBVHSources> &sources, std::vector<WideBVHNode> &nodes);
+
+    /**
+     * @brief Slab test of a ray against the first num_children boxes at once.
+     *
+     * @param t_entry Receives the entry distances of all children
+     *
+     * @return Bit mask of the children that were hit before t_max
+     */
+    static uint32_t intersect_children(const WideBVHBounds &bounds, const uint32_t num_children,
+                                       const Ray &ray, const float t_max,
+                                       std::array<float, wide_bvh_width> &t_entry);
+
+    /**
+     * @brief Walks a wide hierarchy front to back and calls leaf_func for every leaf the ray
+     * enters before closest_dist. Works for every node type that has a matching decode_bounds().
+     *
+     * @param leaf_func Called as leaf_func(uint32_t first, uint32_t count) and expected to lower
+     * closest_dist whenever it finds a closer hit. Returning true stops traversal right away.
+     */
+    template <typename Node, typename LeafFunc>
+    static void traverse(const std::vector<Node> &nodes, const Ray &ray, float &closest_dist,
+                         LeafFunc leaf_func);
+
+  private:
+    BVH m_bvh;
+    std::vector<WideBVHNode> m_nodes;
+    std::vector<WideBVHSources> m_sources;
+    BVHBuildStats m_build_stats;
+    bool m_needs_rebuild = false;
+};
+
+inline uint32_t WideBVH::intersect_children(const WideBVHBounds &bounds,
+                                            const uint32_t num_children, const Ray &ray,
+                                            const float t_max,
+                                            std::array<float, wide_bvh_width> &t_entry) {
+#if defined(__AVX__)
+    auto origin_x = _mm256_set1_ps(ray.m_origin.x);
+    auto origin_y = _mm256_set1_ps(ray.m_origin.y);
+    auto origin_z = _mm256_set1_ps(ray.m_origin.z);
+    auto invdir_x = _mm256_set1_ps(ray.m_invdir.x);
+    auto invdir_y = _mm256_set1_ps(ray.m_invdir.y);
+    auto invdir_z = _mm256_set1_ps(ray.m_invdir.z);
+
+    auto t1_x = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(bounds.m_min_x.data()), origin_x), invdir_x);
+    auto t2_x = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(bounds.m_max_x.data()), origin_x), invdir_x);
+    auto t1_y = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(bounds.m_min_y.data()), origin_y), invdir_y);
+    auto t2_y = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(bounds.m_max_y.data()), origin_y), invdir_y);
+    auto t1_z = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(bounds.m_min_z.data()), origin_z), invdir_z);
+    auto t2_z = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(bounds.m_max_z.data()), origin_z), invdir_z);
+
+    auto t_near = _mm256_max_ps(
+        _mm256_max_ps(_mm256_min_ps(t1_x, t2_x), _mm256_min_ps(t1_y, t2_y)),
+        _mm256_max_ps(_mm256_min_ps(t1_z, t2_z), _mm256_setzero_ps()));
+    auto t_far = _mm256_min_ps(
+        _mm256_min_ps(_mm256_max_ps(t1_x, t2_x), _mm256_max_ps(t1_y, t2_y)),
+        _mm256_min_ps(_mm256_max_ps(t1_z, t2_z), _mm256_set1_ps(t_max)));
+
+    _mm256_storeu_ps(t_entry.data(), t_near);
+    uint32_t mask = _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+    auto origin_x = _mm_set1_ps(ray.m_origin.x);
+    auto origin_y = _mm_set1_ps(ray.m_origin.y);
+    auto origin_z = _mm_set1_ps(ray.m_origin.z);
+    auto invdir_x = _mm_set1_ps(ray.m_invdir.x);
+    auto invdir_y = _mm_set1_ps(ray.m_invdir.y);
+    auto invdir_z = _mm_set1_ps(ray.m_invdir.z);
+
+    auto t1_x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds.m_min_x.data()), origin_x), invdir_x);
+    auto t2_x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds.m_max_x.data()), origin_x), invdir_x);
+    auto t1_y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds.m_min_y.data()), origin_y), invdir_y);
+    auto t2_y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds.m_max_y.data()), origin_y), invdir_y);
+    auto t1_z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds.m_min_z.data()), origin_z), invdir_z);
+    auto t2_z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds.m_max_z.data()), origin_z), invdir_z);
+
+    auto t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1_x, t2_x), _mm_min_ps(t1_y, t2_y)),
+                             _mm_max_ps(_mm_min_ps(t1_z, t2_z), _mm_setzero_ps()));
+    auto t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1_x, t2_x), _mm_max_ps(t1_y, t2_y)),
+                            _mm_min_ps(_mm_max_ps(t1_z, t2_z), _mm_set1_ps(t_max)));
+
+    _mm_storeu_ps(t_entry.data(), t_near);
+    uint32_t mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < wide_bvh_width; i++) {
+        glm::vec3 min{bounds.m_min_x[i], bounds.m_min_y[i], bounds.m_min_z[i]};
+        glm::vec3 max{bounds.m_max_x[i], bounds.m_max_y[i], bounds.m_max_z[i]};
+        if (intersect_ray_aabb(ray, min, max, t_max, t_entry[i]))
+            mask |= 1u << i;
+    }
+#endif
+
+    // Unused slots contain garbage bounds
+    return mask & ((1u << num_children) - 1);
+}
+
+template <typename Node, typename LeafFunc>
+void WideBVH::traverse(const std::vector<Node> &nodes, const Ray &ray, float &closest_dist,
+                       LeafFunc leaf_func) {
+    if (nodes.empty())
+        return;
+
+    // Every visited node pushes at most wide_bvh_width - 1 entries more than it pops and wide
+    // trees are never deeper than the binary ones they were collapsed from
+    struct StackEntry {
+        uint32_t m_child;
+        uint32_t m_count;
+        float m_t_entry;
+    };
+    std::array<StackEntry, 64 * wide_bvh_width> stack;
+    size_t stack_size = 0;
+    stack[stack_size++] = {0, 0, 0.f};
+
+    while (stack_size > 0) {
+        auto entry = stack[--stack_size];
+        if (entry.m_t_entry > closest_dist)
+            continue;
+
+        if (entry.m_count > 0) {
+            if (leaf_func(entry.m_child, entry.m_count))
+                return;
+            continue;
+        }
+
+        const auto &node = nodes[entry.m_child];
+        std::array<float, wide_bvh_width> t_entry;
+        auto mask =
+            intersect_children(decode_bounds(node), node.m_num_children, ray, closest_dist, t_entry);
+
+        // Sort hit children far to near so that the nearest one ends up on top of the stack
+        auto first = stack_size;
+        for (uint32_t i = 0; i < wide_bvh_width; i++) {
+            if (!(mask & (1u << i)))
+                continue;
+
+            StackEntry child{node.m_child[i], node.m_count[i], t_entry[i]};
+            auto j = stack_size++;
+            for (; j > first && stack[j - 1].m_t_entry < child.m_t_entry; j--)
+                stack[j] = stack[j - 1];
+            stack[j] = child;
+        }
+    }
+}
+}
+
+#endif /* end of include guard: WIDE_BVH_HPP */
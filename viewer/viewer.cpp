@@ -1,8 +1,8 @@
 #include "viewer.hpp"
 
 #include "trac0r/shape.hpp"
+#include "trac0r/leaf_kernel.hpp"
 #include "trac0r/utils.hpp"
-#include "trac0r/flat_structure.hpp"
 #include "trac0r/filtering.hpp"
 
 #include <SDL_ttf.h>
@@ -25,7 +25,6 @@
 
 using Camera = trac0r::Camera;
 using Scene = trac0r::Scene;
-using FlatStructure = trac0r::FlatStructure;
 using AABB = trac0r::AABB;
 using Shape = trac0r::Shape;
 
@@ -61,6 +60,134 @@ int Viewer::init(int argc, char *argv[]) {
             m_max_frames = 25;
         }
 
+        // Select acceleration structure
+        if (argv_str == "-accel=flat") {
+            Scene::set_accel_struct_type(m_scene, trac0r::AccelStructType::Flat);
+            continue;
+        } else if (argv_str == "-accel=bvh") {
+            Scene::set_accel_struct_type(m_scene, trac0r::AccelStructType::BVH);
+            continue;
+        } else if (argv_str == "-accel=twolevel") {
+            Scene::set_accel_struct_type(m_scene, trac0r::AccelStructType::TwoLevelBVH);
+            continue;
+        } else if (argv_str == "-accel=wide") {
+            Scene::set_accel_struct_type(m_scene, trac0r::AccelStructType::WideBVH);
+            continue;
+        } else if (argv_str == "-accel=compressed") {
+            Scene::set_accel_struct_type(m_scene, trac0r::AccelStructType::CompressedWideBVH);
+            continue;
+        } else if (argv_str == "-accel=grid") {
+            Scene::set_accel_struct_type(m_scene, trac0r::AccelStructType::Grid);
+            continue;
+        }
+
+        // Use the watertight ray-triangle test instead of Möller-Trumbore
+        if (argv_str == "-watertight") {
+            Scene::set_triangle_test(m_scene, trac0r::TriangleTest::Watertight);
+            continue;
+        }
+
+        // Trace camera rays one by one instead of in packets
+        if (argv_str == "-nopackets") {
+            m_ray_packets = false;
+            continue;
+        }
+
+        // Trace paths breadth-first with the wavefront integrator, optionally without sorting rays
+        if (argv_str == "-wavefront") {
+            m_wavefront = true;
+            continue;
+        } else if (argv_str == "-wavefront=unsorted") {
+            m_wavefront = true;
+            m_sort_rays = false;
+            continue;
+        }
+
+        // Trace light subpaths as well and connect them to camera subpaths, e.g. for caustics
+        if (argv_str == "-bdpt") {
+            m_bidirectional = true;
+            continue;
+        }
+
+        // Trace light paths only and splat them onto the image, e.g. for scenes full of caustics
+        if (argv_str == "-lighttracing") {
+            m_light_tracing = true;
+            continue;
+        }
+
+        // Take several samples per pixel in every frame, e.g. for offline renders with -frames
+        if (argv_str.find("-spp=") == 0) {
+            int samples_per_pixel = std::stoi(argv_str.substr(5));
+            if (samples_per_pixel < 1) {
+                std::cerr << "-spp needs at least one sample per pixel, got " << samples_per_pixel
+                          << std::endl;
+                return 1;
+            }
+            m_samples_per_pixel = samples_per_pixel;
+            continue;
+        }
+
+        // Only find light by hitting emitters, e.g. to compare noise with and without light
+        // sampling
+        if (argv_str == "-nee=off") {
+            m_next_event_estimation = false;
+            continue;
+        }
+
+        // Pick lights by their power alone or also by their distance through a light hierarchy
+        if (argv_str == "-lights=power") {
+            Scene::set_light_sampling_type(m_scene, trac0r::LightSamplingType::Power);
+            continue;
+        } else if (argv_str == "-lights=hierarchy") {
+            Scene::set_light_sampling_type(m_scene, trac0r::LightSamplingType::Hierarchy);
+            continue;
+        }
+
+        // Cap the instruction set used for leaf triangles, e.g. to compare kernels
+        if (argv_str == "-simd=scalar") {
+            trac0r::LeafKernel::set_level(trac0r::SIMDLevel::Scalar);
+            continue;
+        } else if (argv_str == "-simd=sse") {
+            trac0r::LeafKernel::set_level(trac0r::SIMDLevel::SSE);
+            continue;
+        } else if (argv_str == "-simd=avx2") {
+            trac0r::LeafKernel::set_level(trac0r::SIMDLevel::AVX2);
+            continue;
+        } else if (argv_str == "-simd=avx512") {
+            trac0r::LeafKernel::set_level(trac0r::SIMDLevel::AVX512);
+            continue;
+        }
+
+        // Size of the tiles handed out to threads, e.g. -tile=32
+        if (argv_str.find("-tile=") == 0) {
+            m_tile_size = std::stoi(argv_str.substr(6));
+            continue;
+        }
+
+        // Run on the work-stealing task pool instead of OpenMP, optionally with a fixed number of
+        // threads (-taskpool=4) and pinned to cores starting at the given one (-pin=8)
+        if (argv_str == "-taskpool") {
+            m_use_task_pool = true;
+            continue;
+        } else if (argv_str.find("-taskpool=") == 0) {
+            m_use_task_pool = true;
+            m_task_pool_threads = std::stoi(argv_str.substr(10));
+            continue;
+        } else if (argv_str.find("-pin=") == 0) {
+            m_use_task_pool = true;
+            m_first_core = std::stoi(argv_str.substr(5));
+            continue;
+        } else if (argv_str == "-openmp") {
+            m_use_openmp = true;
+            continue;
+        }
+
+        // Enable spatial splits with a budget for duplicated references, e.g. -sbvh=0.3
+        if (argv_str.find("-sbvh=") == 0) {
+            Scene::set_spatial_split_budget(m_scene, std::stof(argv_str.substr(6)));
+            continue;
+        }
+
         // Save image after n frames and quit
         auto found = argv_str.find("-f");
         if (found != std::string::npos) {
@@ -108,10 +235,23 @@ int Viewer::init(int argc, char *argv[]) {
         return 1;
     }
 
-    // Setup scene
+    // Setup scene and build its acceleration structure right away so that build statistics are
+    // available
     setup_scene();
+    Scene::rebuild(m_scene);
     m_renderer = std::make_unique<trac0r::Renderer>(m_screen_width, m_screen_height, m_camera,
                                                     m_scene, m_print_perf);
+    m_renderer->set_ray_packets(m_ray_packets);
+    m_renderer->set_wavefront(m_wavefront, m_sort_rays);
+    m_renderer->set_tile_size(m_tile_size);
+    m_renderer->set_next_event_estimation(m_next_event_estimation);
+    m_renderer->set_bidirectional(m_bidirectional);
+    m_renderer->set_light_tracing(m_light_tracing);
+    if (m_use_task_pool)
+        m_renderer->set_task_pool(
+            std::make_shared<trac0r::TaskPool>(m_task_pool_threads, m_first_core));
+    else if (m_use_openmp)
+        m_renderer->set_task_pool(nullptr);
     m_renderer->print_sysinfo();
 
     fmt::print("Finish init\n");
@@ -120,12 +260,12 @@ int Viewer::init(int argc, char *argv[]) {
 }
 
 void Viewer::setup_scene() {
-    trac0r::Material emissive{1, {1.f, 0.93f, 0.85f}, 0.f, 1.f, 15.f};
-    trac0r::Material default_material{2, {0.740063, 0.742313, 0.733934}};
-    trac0r::Material diffuse_red{2, {0.366046, 0.0371827, 0.0416385}};
-    trac0r::Material diffuse_green{2, {0.162928, 0.408903, 0.0833759}};
-    // trac0r::Material glass{3, {0.5f, 0.5f, 0.9f}, 0.0f, 1.51714f};
-    // trac0r::Material glossy{4, {1.f, 1.f, 1.f}, 0.09f};
+    auto emissive = Scene::add_material(m_scene, {1, {1.f, 0.93f, 0.85f}, 0.f, 1.f, 15.f});
+    auto default_material = Scene::add_material(m_scene, {2, {0.740063, 0.742313, 0.733934}});
+    auto diffuse_red = Scene::add_material(m_scene, {2, {0.366046, 0.0371827, 0.0416385}});
+    auto diffuse_green = Scene::add_material(m_scene, {2, {0.162928, 0.408903, 0.0833759}});
+    // auto glass = Scene::add_material(m_scene, {3, {0.5f, 0.5f, 0.9f}, 0.0f, 1.51714f});
+    // auto glossy = Scene::add_material(m_scene, {4, {1.f, 1.f, 1.f}, 0.09f});
     auto wall_left = trac0r::Shape::make_plane({-0.5f, 0.4f, 0}, {0, 0, -glm::half_pi<float>()},
                                                {1, 1}, diffuse_red);
     auto wall_right = trac0r::Shape::make_plane({0.5f, 0.4f, 0}, {0, 0, glm::half_pi<float>()},
@@ -148,8 +288,8 @@ void Viewer::setup_scene() {
     } else {
         auto sphere1 =
             trac0r::Shape::make_icosphere({0.f, 0.1f, -0.3f}, {0, 0, 0}, 0.15f, 1, default_material);
-        auto sphere2 =
-            trac0r::Shape::make_icosphere({0.3f, 0.45f, 0.1f}, {0, 0, 0}, 0.15f, 1, default_material);
+        auto sphere2 = trac0r::Shape::make_instance(sphere1, {0.3f, 0.45f, 0.1f}, {0, 0, 0},
+                                                    {0.15f, 0.15f, 0.15f});
         Scene::add_shape(m_scene, sphere1);
         Scene::add_shape(m_scene, sphere2);
     }
@@ -309,20 +449,22 @@ void Viewer::mainloop() {
     if (m_print_perf)
         fmt::print("    {:<15} {:=10.3f} ms\n", "Scene rebuild", timer.elapsed());
 
-    const auto luminance = m_renderer->render(m_scene_changed, m_stride_x, m_stride_y);
+    const auto luminance =
+        m_renderer->render(m_scene_changed, m_stride_x, m_stride_y, m_samples_per_pixel);
     if (m_print_perf) {
         m_renderer->print_last_frame_timings();
     }
 
-    m_samples_accumulated += 1;
+    m_samples_accumulated += m_samples_per_pixel;
 
     timer.reset();
 
 // This striding is just for speeding up
 // We're basically drawing really big pixels here
-#pragma omp parallel for collapse(2) schedule(dynamic, 1024)
-    for (auto x = 0; x < width; x += m_stride_x) {
-        for (auto y = 0; y < height; y += m_stride_y) {
+    const uint32_t rows = (height + m_stride_y - 1) / m_stride_y;
+    trac0r::parallel_for(m_renderer->task_pool().get(), 0, rows, 4, [&](uint32_t row) {
+        int y = row * m_stride_y;
+        for (auto x = 0; x < width; x += m_stride_x) {
             glm::vec4 color = luminance[y * width + x] / static_cast<float>(m_samples_accumulated);
             for (auto u = 0; u < m_stride_x; u++) {
                 for (auto v = 0; v < m_stride_y; v++) {
@@ -330,7 +472,7 @@ void Viewer::mainloop() {
                 }
             }
         }
-    }
+    });
 
     if (m_print_perf)
         fmt::print("    {:<15} {:>10.3f} ms\n", "Pixel transfer", timer.elapsed());
@@ -408,9 +550,8 @@ void Viewer::mainloop() {
 
         // Let's draw some debug to the display (such as AABBs)
         if (m_debug) {
-            auto &accel_struct = Scene::accel_struct(m_scene);
-            for (auto &shape : FlatStructure::shapes(accel_struct)) {
-                auto &aabb = Shape::aabb(shape);
+            for (auto &shape : Scene::shapes(m_scene)) {
+                auto aabb = Shape::aabb(shape);
                 const auto &verts = AABB::vertices(aabb);
                 std::array<glm::i8vec2, 12> pairs;
                 pairs[0] = {0, 1};
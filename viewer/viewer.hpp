@@ -40,6 +40,18 @@ class Viewer {
     int m_last_frame_time = 0;
     bool m_debug = false;
     bool m_print_perf = false;
+    bool m_ray_packets = true;
+    bool m_wavefront = false;
+    bool m_sort_rays = true;
+    bool m_next_event_estimation = true;
+    bool m_bidirectional = false;
+    bool m_light_tracing = false;
+    uint32_t m_samples_per_pixel = 1;
+    uint32_t m_tile_size = trac0r::default_tile_size;
+    bool m_use_task_pool = false;
+    bool m_use_openmp = false;
+    uint32_t m_task_pool_threads = 0;
+    int m_first_core = -1;
     int m_stride_x = 1;
     int m_stride_y = 1;
     int m_frame = 0;